@@ -18,6 +18,12 @@
  *  - much more
  */
 
+/* 64-bit file offsets, for reading back output past 2GB */
+#ifndef WIN32
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE_SOURCE
+#endif
+
 #include "easylzma/compress.h"
 #include "easylzma/decompress.h"
 #include "util.h"
@@ -25,6 +31,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#ifndef WIN32
+#include <sys/types.h>
+#endif
 
 /* a utility to open a pair of files */
 /* XXX: respect overwrite flag */
@@ -38,7 +47,8 @@ openFiles(const char * ifname, FILE ** inFile, const char * ofname,
         return 1;
     }
     
-    *outFile = fopen(ofname, "wb");
+    /* the output is read back when undoing long range deduplication */
+    *outFile = fopen(ofname, "w+b");
     if (*outFile == NULL) {
         fprintf(stderr, "couldn't open '%s' for writing\n", ofname);
         return 1;
@@ -51,25 +61,36 @@ openFiles(const char * ifname, FILE ** inFile, const char * ofname,
 "Compress files using the LZMA algorithm (in place by default).\n"\
 "\n"\
 "Usage: elzma [options] [file]\n"\
-"  -1 .. -9          compression level, -1 is fast, -9 is best (default 5)\n"\
+"  -1 .. -9          compression level, -1 is fast, -9 is best (default 5),\n"\
+"                    -1 to -3 use greedy parsing for several times the speed\n"\
+"                    and -4 lazy parsing, at about twice the speed\n"\
 "  -f, --force       overwrite output files if they exist\n"\
 "  -h, --help        output this message and exit\n"\
 "  -k, --keep        don't delete input files\n"\
 "  --lzip            compress to lzip disk format (.lz extension)\n"\
 "  --lzma            compress to LZMA-Alone disk format (.lzma extension)\n"\
+"  --xz              compress to xz disk format (.xz extension)\n"\
 "  -v, --verbose     output verbose status information while compressing\n"\
 "  -z, --compress    compress files (default when invoking elzma program)\n"\
 "  -d, --decompress  decompress files (default when invoking unelzma program)\n"\
 "\n"\
 "Advanced Options:\n"\
-"  -s --set-max-dict (advanced) specify maximum dictionary size in bytes\n"
+"  -s --set-max-dict (advanced) specify maximum dictionary size in bytes\n"\
+"  -t --threads      (advanced) compress using the specified number of\n"\
+"                    threads (lzip and xz only)\n"\
+"  --dict <file>     (advanced) compress with a preset dictionary, see\n"\
+"                    elzma --train (lzma and lzip only)\n"\
+"  --long            (advanced) deduplicate repeats beyond the dictionary,\n"\
+"                    for large files (xz only).  decompress with --long\n"
 
 /* parse arguments populating output parameters, return nonzero on failure */
 static int parseCompressArgs(int argc, char ** argv, unsigned char * level,
                              char ** fname, unsigned int * maxDictSize,
                              unsigned int * verbose, unsigned int * keep,
                              unsigned int * overwrite,
-                             elzma_file_format * format)
+                             unsigned int * numThreads,
+                             elzma_file_format * format,
+                             char ** dictFile, unsigned int * longRange)
 {
     int i;
     
@@ -107,6 +128,29 @@ static int parseCompressArgs(int argc, char ** argv, unsigned char * level,
                     *maxDictSize = elzma_get_dict_size(*maxDictSize);
                 }
             }
+            else if (!strcmp(arg, "t") || !strcmp(arg, "threads"))
+            {
+                unsigned int j = 0;
+                val = argv[++i];
+                if (val == NULL) return 1;
+
+                /* validate argument is numeric */
+                for (j = 0; j < strlen(val); j++) {
+                    if (val[j] < '0' || val[j] > '9') return 1;
+                }
+
+                *numThreads = strtoul(val, (char **) NULL, 10);
+                if (*numThreads < 1) return 1;
+            }
+            else if (!strcmp(arg, "dict"))
+            {
+                *dictFile = argv[++i];
+                if (*dictFile == NULL) return 1;
+            }
+            else if (!strcmp(arg, "long"))
+            {
+                *longRange = 1;
+            }
             else if (!strcmp(arg, "v") || !strcmp(arg, "verbose"))
             {
                 *verbose = 1;
@@ -131,6 +175,10 @@ static int parseCompressArgs(int argc, char ** argv, unsigned char * level,
             {
                 *format = ELZMA_lzip;
             }
+            else if (!strcmp(arg, "xz"))
+            {
+                *format = ELZMA_xz;
+            }
             else if (!strcmp(arg, "z") || !strcmp(arg, "d") ||
                      !strcmp(arg, "compress") || !strcmp(arg, "decompress"))
             {
@@ -176,6 +224,38 @@ static int elzmaReadFunc(void *ctx, void *buf, size_t *size)
     return 0;
 }
 
+/* seek to a 64-bit offset from the start, which fseek can't reach
+ * where long is 32 bits */
+static int seekFile(FILE * f, unsigned long long offset)
+{
+#ifdef WIN32
+    if (offset > 0x7FFFFFFFFFFFFFFFULL) return 1;
+    return _fseeki64(f, (__int64) offset, SEEK_SET);
+#else
+    off_t o = (off_t) offset;
+    if (o < 0 || (unsigned long long) o != offset) return 1;
+    return fseeko(f, o, SEEK_SET);
+#endif
+}
+
+static int elzmaReadBackFunc(void *ctx, unsigned long long offset,
+                             void *buf, size_t size)
+{
+    FILE * f = (FILE *) ctx;
+    assert(f != NULL);
+
+    /* seeking flushes what's been written, and back to the end resumes
+     * writing */
+    if (0 != seekFile(f, offset) ||
+        size != fread(buf, 1, size, f) ||
+        0 != fseek(f, 0, SEEK_END))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
 static void printProgressHeader(void)
 {
     printf("|0%%                            50%%                          100%%|\n");
@@ -219,17 +299,35 @@ doCompress(int argc, char ** argv)
     unsigned int uncompressedSize = 0;
     unsigned int keep = 0;
     unsigned int overwrite = 0;
+    unsigned int numThreads = 1;
+    char * dictFile = NULL;
+    unsigned char * presetDict = NULL;
+    size_t presetDictSize = 0;
+    unsigned int longRange = 0;
 
     if (0 != parseCompressArgs(argc, argv, &level, &ifname,
                                &maxDictSize, &verbose, &keep, &overwrite,
-                               &format))
+                               &numThreads, &format, &dictFile, &longRange))
     {
         fprintf(stderr, ELZMA_COMPRESS_USAGE);
         return 1;
     }
 
+    if (longRange && format != ELZMA_xz) {
+        fprintf(stderr, "--long requires --xz\n");
+        return 1;
+    }
+
+    if (dictFile != NULL &&
+        0 != readFile(dictFile, &presetDict, &presetDictSize))
+    {
+        fprintf(stderr, "couldn't read dictionary '%s'\n", dictFile);
+        return 1;
+    }
+
     /* extension switching based on compression type*/
     if (format == ELZMA_lzip) ext = ".lz";
+    else if (format == ELZMA_xz) ext = ".xz";
 
     /* generate output file name */
     {
@@ -256,8 +354,9 @@ doCompress(int argc, char ** argv)
         return 1;
     }
 
-    /* determine a reasonable dictionary size given input size */
-    dictSize = elzma_get_dict_size(uncompressedSize);
+    /* determine a reasonable dictionary size given input size, a preset
+     * dictionary only helps while it's within the window */
+    dictSize = elzma_get_dict_size(uncompressedSize + presetDictSize);
     if (dictSize > maxDictSize) dictSize = maxDictSize;
 
     if (verbose) {
@@ -285,6 +384,49 @@ doCompress(int argc, char ** argv)
         return 1;
     }
 
+    /* the fast levels trade ratio for speed with greedy parsing, level 4
+     * with lazy parsing, the best ones search harder */
+    if (level <= 4 || level >= 7) {
+        elzma_compress_options opts;
+        elzma_compress_options_init(&opts,
+                                    (level <= 3) ? ELZMA_PRESET_FAST :
+                                    (level == 4) ? ELZMA_PRESET_LAZY :
+                                    ELZMA_PRESET_BEST);
+        if (ELZMA_E_OK != elzma_compress_set_options(hand, &opts)) {
+            fprintf(stderr, "couldn't configure compression level %u\n",
+                    (unsigned int) level);
+            deleteFile(ofname);
+            return 1;
+        }
+    }
+
+    if (presetDict != NULL &&
+        ELZMA_E_OK != elzma_compress_set_dictionary(hand, presetDict,
+                                                    presetDictSize))
+    {
+        fprintf(stderr, "couldn't use dictionary '%s'\n", dictFile);
+        deleteFile(ofname);
+        return 1;
+    }
+
+    /* 64k chunks take some 1MB of memory per GB of input */
+    if (longRange &&
+        ELZMA_E_OK != elzma_compress_set_long_range(hand, 1 << 16))
+    {
+        fprintf(stderr, "couldn't configure long range deduplication\n");
+        deleteFile(ofname);
+        return 1;
+    }
+
+    if (numThreads > 1 &&
+        ELZMA_E_OK != elzma_compress_set_threads(hand, numThreads, 0))
+    {
+        fprintf(stderr, "couldn't configure %u compression threads\n",
+                numThreads);
+        deleteFile(ofname);
+        return 1;
+    }
+
     {
         int rv;
         int pCtx = 0;
@@ -304,6 +446,11 @@ doCompress(int argc, char ** argv)
             deleteFile(ofname);
             return 1;
         }
+
+        if (verbose) {
+            printf("%lu bytes of match finder memory in huge pages\n",
+                   (unsigned long) elzma_compress_huge_page_bytes(hand));
+        }
     }
     
     /* clean up */
@@ -311,6 +458,7 @@ doCompress(int argc, char ** argv)
     fclose(inFile);
     fclose(outFile);
     free(ofname);
+    free(presetDict);
 
     if (!keep) deleteFile(ifname);
 
@@ -327,11 +475,14 @@ doCompress(int argc, char ** argv)
 "  -v, --verbose    output verbose status information while decompressing\n"\
 "  -z, --compress   compress files (default when invoking elzma program)\n"\
 "  -d, --decompress decompress files (default when invoking unelzma program)\n"\
+"  --dict <file>    decompress with the preset dictionary used to compress\n"\
+"  --long           decompress a file compressed with --long\n"\
 "\n"
 /* parse arguments populating output parameters, return nonzero on failure */
 static int parseDecompressArgs(int argc, char ** argv, char ** fname,
                                unsigned int * verbose, unsigned int * keep,
-                               unsigned int * overwrite)
+                               unsigned int * overwrite,
+                               char ** dictFile, unsigned int * longRange)
 {
     int i;
     
@@ -359,6 +510,15 @@ static int parseDecompressArgs(int argc, char ** argv, char ** fname,
             {
                 *overwrite = 1;
             }
+            else if (!strcmp(arg, "dict"))
+            {
+                *dictFile = argv[++i];
+                if (*dictFile == NULL) return 1;
+            }
+            else if (!strcmp(arg, "long"))
+            {
+                *longRange = 1;
+            }
             else if (!strcmp(arg, "z") || !strcmp(arg, "d") ||
                      !strcmp(arg, "compress") || !strcmp(arg, "decompress"))
             {
@@ -396,15 +556,28 @@ doDecompress(int argc, char ** argv)
     elzma_file_format format;
     const char * lzmaExt = ".lzma";
     const char * lzipExt = ".lz";
+    const char * xzExt = ".xz";
     const char * ext = ".lz";
+    char * dictFile = NULL;
+    unsigned char * presetDict = NULL;
+    size_t presetDictSize = 0;
+    unsigned int longRange = 0;
+    int rc;
 
     if (0 != parseDecompressArgs(argc, argv, &ifname, &verbose,
-                                 &keep, &overwrite))
+                                 &keep, &overwrite, &dictFile, &longRange))
     {
         fprintf(stderr, ELZMA_DECOMPRESS_USAGE);
         return 1;
     }
 
+    if (dictFile != NULL &&
+        0 != readFile(dictFile, &presetDict, &presetDictSize))
+    {
+        fprintf(stderr, "couldn't read dictionary '%s'\n", dictFile);
+        return 1;
+    }
+
     /* generate output file name */
     if (strlen(ifname) > strlen(lzmaExt) &&
         0 == strcmp(lzmaExt, ifname + strlen(ifname) - strlen(lzmaExt)))
@@ -418,10 +591,16 @@ doDecompress(int argc, char ** argv)
         format = ELZMA_lzip;
         ext = lzipExt;
     }
+    else if (strlen(ifname) > strlen(xzExt) &&
+             0 == strcmp(xzExt, ifname + strlen(ifname) - strlen(xzExt)))
+    {
+        format = ELZMA_xz;
+        ext = xzExt;
+    }
     else
     {
-        fprintf(stderr, "input file extension not recognized (expected either "
-                "%s or %s)", lzmaExt, lzipExt);
+        fprintf(stderr, "input file extension not recognized (expected one "
+                "of %s, %s or %s)", lzmaExt, lzipExt, xzExt);
         return 1;
     }
 
@@ -442,22 +621,271 @@ doDecompress(int argc, char ** argv)
         return 1;
     }
 
-    if (ELZMA_E_OK != elzma_decompress_run(
-            hand, elzmaReadFunc, (void *) inFile,
-            elzmaWriteFunc, (void *) outFile, format))
+    if (presetDict != NULL &&
+        ELZMA_E_OK != elzma_decompress_set_dictionary(hand, presetDict,
+                                                      presetDictSize))
     {
+        fprintf(stderr, "couldn't use dictionary '%s'\n", dictFile);
+        deleteFile(ofname);
+        return 1;
+    }
+
+    if (longRange &&
+        ELZMA_E_OK != elzma_decompress_set_long_range(hand,
+                                                      elzmaReadBackFunc,
+                                                      (void *) outFile))
+    {
+        fprintf(stderr, "couldn't configure long range deduplication\n");
+        deleteFile(ofname);
+        return 1;
+    }
+
+    rc = elzma_decompress_run(hand, elzmaReadFunc, (void *) inFile,
+                              elzmaWriteFunc, (void *) outFile, format);
+    if (rc == ELZMA_E_LONG_RANGE) {
+        fprintf(stderr, "'%s' was compressed with --long, decompress it "
+                "with --long\n", ifname);
+        deleteFile(ofname);
+        return 1;
+    } else if (rc != ELZMA_E_OK) {
         fprintf(stderr, "error decompressing\n");
         deleteFile(ofname);
         return 1;
     }
 
+    if (verbose) {
+        printf("%lu bytes of dictionary in huge pages\n",
+               (unsigned long) elzma_decompress_huge_page_bytes(hand));
+    }
+
     elzma_decompress_free(&hand);    
+    free(presetDict);
 
     if (!keep) deleteFile(ifname);
 
     return 0;
 }
 
+#define ELZMA_TRAIN_USAGE \
+"Build a preset dictionary from a directory of sample messages.\n"\
+"\n"\
+"Usage: elzma --train [options] directory\n"\
+"  -h, --help       output this message and exit\n"\
+"  -o, --output     file to write the dictionary to (default 'dictionary')\n"\
+"  -s, --size       largest dictionary in bytes (default 65536)\n"\
+"\n"\
+"Every tenth sample is held out of training, and the sizes it compresses\n"\
+"to with and without the dictionary are reported.  Use the dictionary\n"\
+"with --dict when compressing and decompressing.\n"
+
+/* parse arguments populating output parameters, return nonzero on failure */
+static int parseTrainArgs(int argc, char ** argv, char ** dir,
+                          char ** ofname, size_t * maxSize)
+{
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            char * arg = &(argv[i][1]);
+            if (arg[0] == '-') arg++;
+
+            if (!strcmp(arg, "h") || !strcmp(arg, "help"))
+            {
+                return 1;
+            }
+            else if (!strcmp(arg, "o") || !strcmp(arg, "output"))
+            {
+                *ofname = argv[++i];
+                if (*ofname == NULL) return 1;
+            }
+            else if (!strcmp(arg, "s") || !strcmp(arg, "size"))
+            {
+                unsigned int j = 0;
+                char * val = argv[++i];
+                if (val == NULL) return 1;
+
+                /* validate argument is numeric */
+                for (j = 0; j < strlen(val); j++) {
+                    if (val[j] < '0' || val[j] > '9') return 1;
+                }
+
+                *maxSize = strtoul(val, (char **) NULL, 10);
+                if (*maxSize < 1) return 1;
+            }
+            else if (!strcmp(arg, "train"))
+            {
+                /* noop */
+            }
+            else
+            {
+                return 1;
+            }
+        }
+        else
+        {
+            *dir = argv[i];
+            break;
+        }
+    }
+
+    /* proper number of arguments? */
+    if (i != argc - 1 || *dir == NULL) return 1;
+
+    return 0;
+}
+
+/* samples read into a single buffer */
+struct sampleSet
+{
+    unsigned char * buf;
+    size_t len;
+    size_t alloc;
+    size_t * sizes;
+    unsigned int num;
+    size_t largest;
+};
+
+static int
+addSample(struct sampleSet * set, const unsigned char * data, size_t size)
+{
+    if (set->len + size > set->alloc) {
+        size_t newAlloc = (set->alloc ? set->alloc : 4096);
+        unsigned char * b;
+        while (newAlloc < set->len + size) newAlloc *= 2;
+        b = (unsigned char *) realloc(set->buf, newAlloc);
+        if (b == NULL) return 1;
+        set->buf = b;
+        set->alloc = newAlloc;
+    }
+    {
+        size_t * s = (size_t *) realloc(set->sizes,
+                                        (set->num + 1) * sizeof(size_t));
+        if (s == NULL) return 1;
+        set->sizes = s;
+    }
+    memcpy((void *) (set->buf + set->len), (const void *) data, size);
+    set->len += size;
+    set->sizes[set->num++] = size;
+    if (size > set->largest) set->largest = size;
+
+    return 0;
+}
+
+static int
+doTrain(int argc, char ** argv)
+{
+    char * dir = NULL;
+    char * ofname = "dictionary";
+    size_t maxSize = 65536;
+    char ** paths = NULL;
+    unsigned int numPaths = 0, i;
+    struct sampleSet train, heldOut;
+    struct sampleSet * evalSet = &heldOut;
+    unsigned char * dict = NULL;
+    size_t dictSize;
+    unsigned long long sizeWithout = 0, sizeWith = 0;
+    elzma_compress_handle hand = NULL;
+    FILE * outFile = NULL;
+    int rv = 1;
+
+    memset((void *) &train, 0, sizeof(train));
+    memset((void *) &heldOut, 0, sizeof(heldOut));
+
+    if (0 != parseTrainArgs(argc, argv, &dir, &ofname, &maxSize))
+    {
+        fprintf(stderr, ELZMA_TRAIN_USAGE);
+        return 1;
+    }
+
+    if (0 != listDirectory(dir, &paths, &numPaths) || numPaths == 0) {
+        fprintf(stderr, "couldn't find sample files in '%s'\n", dir);
+        goto trainDone;
+    }
+
+    for (i = 0; i < numPaths; i++) {
+        unsigned char * data;
+        size_t size;
+        /* with ten or more samples, one in ten is held out */
+        struct sampleSet * set =
+            (numPaths >= 10 && i % 10 == 9) ? &heldOut : &train;
+
+        if (0 != readFile(paths[i], &data, &size)) {
+            fprintf(stderr, "couldn't read sample '%s'\n", paths[i]);
+            goto trainDone;
+        }
+        if (0 != addSample(set, data, size)) {
+            fprintf(stderr, "out of memory reading samples\n");
+            free(data);
+            goto trainDone;
+        }
+        free(data);
+    }
+
+    /* too few samples to hold any out, an optimistic estimate is all we
+     * can give */
+    if (heldOut.num == 0) evalSet = &train;
+
+    dictSize = maxSize;
+    dict = (unsigned char *) malloc(dictSize);
+    if (dict == NULL ||
+        ELZMA_E_OK != elzma_train_dictionary(train.buf, train.sizes,
+                                             train.num, dict, &dictSize))
+    {
+        fprintf(stderr, "couldn't build dictionary\n");
+        goto trainDone;
+    }
+
+    outFile = fopen(ofname, "wb");
+    if (outFile == NULL ||
+        fwrite((const void *) dict, 1, dictSize, outFile) != dictSize)
+    {
+        fprintf(stderr, "couldn't write '%s'\n", ofname);
+        goto trainDone;
+    }
+    fclose(outFile);
+    outFile = NULL;
+
+    printf("trained on %u samples (%lu bytes), wrote a %lu byte "
+           "dictionary to '%s'\n", train.num, (unsigned long) train.len,
+           (unsigned long) dictSize, ofname);
+
+    /* the window must hold the dictionary and a whole sample */
+    hand = elzma_compress_alloc();
+    if (hand == NULL ||
+        ELZMA_E_OK != elzma_compress_config(
+            hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT, ELZMA_PB_DEFAULT, 5,
+            elzma_get_dict_size(dictSize + evalSet->largest), ELZMA_lzma, 0) ||
+        ELZMA_E_OK != elzma_compress_evaluate_dictionary(
+            hand, dict, dictSize, evalSet->buf, evalSet->sizes, evalSet->num,
+            &sizeWithout, &sizeWith))
+    {
+        fprintf(stderr, "couldn't evaluate dictionary\n");
+        goto trainDone;
+    }
+
+    printf("%s %u samples (%lu bytes) compress to %lu bytes without the "
+           "dictionary, %lu with it", (evalSet == &heldOut) ? "held out" :
+           "training", evalSet->num, (unsigned long) evalSet->len,
+           (unsigned long) sizeWithout, (unsigned long) sizeWith);
+    if (sizeWith > 0) {
+        printf(" (ratio gain %.2fx)", (double) sizeWithout / sizeWith);
+    }
+    printf("\n");
+    rv = 0;
+
+  trainDone:
+    if (outFile != NULL) fclose(outFile);
+    elzma_compress_free(&hand);
+    free(dict);
+    free(train.buf);
+    free(train.sizes);
+    free(heldOut.buf);
+    free(heldOut.sizes);
+    if (paths != NULL) freePathList(paths, numPaths);
+
+    return rv;
+}
+
 int
 main(int argc, char ** argv)
 {
@@ -466,11 +894,11 @@ main(int argc, char ** argv)
     const char * elzma = "elzma";    
     const char * elzmaLose = "elzma.exe";    
 
-    enum { RM_NONE, RM_COMPRESS, RM_DECOMPRESS } runmode = RM_NONE;
+    enum { RM_NONE, RM_COMPRESS, RM_DECOMPRESS, RM_TRAIN } runmode = RM_NONE;
     
     /* first we'll determine the mode we're running in, indicated by
      * the binary name (argv[0]) or by the presence of a flag:
-     * one of -z, -d, -compress, --decompress */
+     * one of -z, -d, -compress, --decompress, --train */
     if ((strlen(argv[0]) >= strlen(unelzma) &&
          !strcmp((argv[0] + strlen(argv[0]) - strlen(unelzma)), unelzma)) ||
         (strlen(argv[0]) >= strlen(unelzmaLose) &&
@@ -501,16 +929,22 @@ main(int argc, char ** argv)
                 runmode = RM_COMPRESS;
                 break;
             }
+            else if (!strcmp(argv[i], "--train"))
+            {
+                runmode = RM_TRAIN;
+                break;
+            }
         }
     }
 
-    if (runmode != RM_COMPRESS && runmode != RM_DECOMPRESS)
+    if (runmode == RM_NONE)
     {
         fprintf(stderr, "couldn't determine whether "
                 "you want to compress or decompress\n");
         return 1;
     }
 
+    if (runmode == RM_TRAIN) return doTrain(argc, argv);
     if (runmode == RM_COMPRESS) return doCompress(argc, argv);
     return doDecompress(argc, argv);
 }
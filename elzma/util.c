@@ -1,10 +1,18 @@
 #include "util.h"
 
-#ifdef WIN32
 #include <stdio.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
 #define unlink _unlink
+#define ELZMA_PATH_SEP "\\"
 #else
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#define ELZMA_PATH_SEP "/"
 #endif
 
 int
@@ -12,3 +20,140 @@ deleteFile(const char * path)
 {
     return unlink(path);
 }
+
+int
+readFile(const char * fname, unsigned char ** buf, size_t * size)
+{
+    FILE * f;
+    long len;
+
+    *buf = NULL;
+    *size = 0;
+
+    f = fopen(fname, "rb");
+    if (f == NULL) return 1;
+
+    if (0 != fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0 ||
+        0 != fseek(f, 0, SEEK_SET))
+    {
+        fclose(f);
+        return 1;
+    }
+
+    /* one spare byte so empty files get a buffer too */
+    *buf = (unsigned char *) malloc((size_t) len + 1);
+    if (*buf == NULL ||
+        fread((void *) *buf, 1, (size_t) len, f) != (size_t) len)
+    {
+        free(*buf);
+        *buf = NULL;
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+    *size = (size_t) len;
+
+    return 0;
+}
+
+static int
+comparePaths(const void * a, const void * b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* append dir/name to a growing list */
+static int
+addPath(char *** paths, unsigned int * numPaths, unsigned int * alloc,
+        const char * dir, const char * name)
+{
+    char * path;
+
+    if (*numPaths == *alloc) {
+        unsigned int newAlloc = *alloc ? *alloc * 2 : 64;
+        char ** p = (char **) realloc(*paths, newAlloc * sizeof(char *));
+        if (p == NULL) return 1;
+        *paths = p;
+        *alloc = newAlloc;
+    }
+
+    path = (char *) malloc(strlen(dir) + strlen(ELZMA_PATH_SEP) +
+                           strlen(name) + 1);
+    if (path == NULL) return 1;
+    strcpy(path, dir);
+    strcat(path, ELZMA_PATH_SEP);
+    strcat(path, name);
+    (*paths)[(*numPaths)++] = path;
+
+    return 0;
+}
+
+int
+listDirectory(const char * dir, char *** paths, unsigned int * numPaths)
+{
+    unsigned int alloc = 0;
+    int rv = 0;
+
+    *paths = NULL;
+    *numPaths = 0;
+
+#ifdef WIN32
+    {
+        WIN32_FIND_DATAA fd;
+        HANDLE h;
+        char * pattern = (char *) malloc(strlen(dir) + 3);
+        if (pattern == NULL) return 1;
+        strcpy(pattern, dir);
+        strcat(pattern, "\\*");
+        h = FindFirstFileA(pattern, &fd);
+        free(pattern);
+        if (h == INVALID_HANDLE_VALUE) return 1;
+        do {
+            if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                rv = addPath(paths, numPaths, &alloc, dir, fd.cFileName);
+            }
+        } while (rv == 0 && FindNextFileA(h, &fd));
+        FindClose(h);
+    }
+#else
+    {
+        struct dirent * ent;
+        DIR * d = opendir(dir);
+        if (d == NULL) return 1;
+        while (rv == 0 && (ent = readdir(d)) != NULL) {
+            struct stat st;
+            if (0 != addPath(paths, numPaths, &alloc, dir, ent->d_name)) {
+                rv = 1;
+            } else if (0 != stat((*paths)[*numPaths - 1], &st) ||
+                       !S_ISREG(st.st_mode))
+            {
+                /* not a regular file, drop it */
+                free((*paths)[--(*numPaths)]);
+            }
+        }
+        closedir(d);
+    }
+#endif
+
+    if (rv != 0) {
+        freePathList(*paths, *numPaths);
+        *paths = NULL;
+        *numPaths = 0;
+        return rv;
+    }
+
+    /* readdir order varies, sort so that runs are repeatable */
+    if (*numPaths > 1) {
+        qsort((void *) *paths, *numPaths, sizeof(char *), comparePaths);
+    }
+
+    return 0;
+}
+
+void
+freePathList(char ** paths, unsigned int numPaths)
+{
+    unsigned int i;
+    for (i = 0; i < numPaths; i++) free(paths[i]);
+    free(paths);
+}
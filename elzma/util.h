@@ -1,7 +1,19 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__
 
+#include <stdlib.h>
+
 /* delete a file, nonzero on failure */
 int deleteFile(const char * fname);
 
+/* read a whole file into a malloc'd buffer, nonzero on failure */
+int readFile(const char * fname, unsigned char ** buf, size_t * size);
+
+/* list the paths of the regular files in a directory, sorted by name,
+ * as a malloc'd array of malloc'd strings.  nonzero on failure */
+int listDirectory(const char * dir, char *** paths, unsigned int * numPaths);
+
+/* free a list returned by listDirectory */
+void freePathList(char ** paths, unsigned int numPaths);
+
 #endif
@@ -9,6 +9,13 @@
  */
 
 #include "common_internal.h"
+#include "pavlov/Alloc.h"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
 
 static void *elzmaAlloc(void *p, size_t size) {
     struct elzma_alloc_struct * as = (struct elzma_alloc_struct *) p;
@@ -27,6 +34,25 @@ static void elzmaFree(void *p, void *address) {
     }
 }
 
+static void *elzmaBigAlloc(void *p, size_t size) {
+    struct elzma_alloc_struct * as =
+        ((struct elzma_big_alloc_struct *) p)->owner;
+    if (as->clientMallocFunc) {
+        return as->clientMallocFunc(as->clientMallocContext, size);
+    }
+    return BigAlloc(size);
+}
+
+static void elzmaBigFree(void *p, void *address) {
+    struct elzma_alloc_struct * as =
+        ((struct elzma_big_alloc_struct *) p)->owner;
+    if (as->clientFreeFunc) {
+        as->clientFreeFunc(as->clientMallocContext, address);
+    } else {
+        BigFree(address);
+    }
+}
+
 void
 init_alloc_struct(struct elzma_alloc_struct * as,
                   elzma_malloc clientMallocFunc,
@@ -40,4 +66,24 @@ init_alloc_struct(struct elzma_alloc_struct * as,
     as->clientMallocContext = clientMallocContext;    
     as->clientFreeFunc = clientFreeFunc;
     as->clientFreeContext = clientFreeContext;    
+    as->big.Alloc = elzmaBigAlloc;
+    as->big.Free = elzmaBigFree;
+    as->big.owner = as;
+}
+
+unsigned long long
+elzmaNowMicroseconds(void)
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (unsigned long long) (count.QuadPart / freq.QuadPart) * 1000000 +
+        (unsigned long long) (count.QuadPart % freq.QuadPart) * 1000000 /
+        freq.QuadPart;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
 }
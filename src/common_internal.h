@@ -3,6 +3,19 @@
 
 #include "easylzma/common.h"
 
+struct elzma_alloc_struct;
+
+/** the allocator of an elzma_alloc_struct for the large blocks (windows,
+ *  match finder tables and dictionaries), which Igor's routines take as
+ *  allocBig.  Unless the client gave allocation routines these come from
+ *  BigAlloc, in huge pages where the system has them */
+struct elzma_big_alloc_struct {
+    void *(*Alloc)(void *p, size_t size);
+    void (*Free)(void *p, void *address); /* address can be 0 */
+
+    struct elzma_alloc_struct * owner;
+};
+
 /** a structure which may be cast and passed into Igor's allocate
  *  routines */
 struct elzma_alloc_struct {
@@ -14,6 +27,8 @@ struct elzma_alloc_struct {
 
     elzma_free clientFreeFunc;
     void * clientFreeContext;
+
+    struct elzma_big_alloc_struct big;
 };
 
 /* initialize an allocation structure, may be called safely multiple
@@ -24,6 +39,9 @@ void init_alloc_struct(struct elzma_alloc_struct * allocStruct,
                        elzma_free clientFreeFunc,
                        void * clientFreeContext);
 
+/* a clock for deadlines, in microseconds from an arbitrary start */
+unsigned long long elzmaNowMicroseconds(void);
+
 /** superset representation of a compressed file header */
 struct elzma_file_header {
     unsigned char pb;
@@ -32,16 +50,27 @@ struct elzma_file_header {
     unsigned char isStreamed;    
     long long unsigned int uncompressedSize;
     unsigned int dictSize;
+    /* format version, currently only meaningful for lzip */
+    unsigned char version;
+    /* integrity check type, only meaningful for xz */
+    unsigned char checkType;
 };
 
 /** superset representation of a compressed file footer */
 struct elzma_file_footer {
     unsigned int crc32;
     long long unsigned int uncompressedSize;
+    /* total size of the compressed member including header and footer,
+     * (lzip version 1) */
+    long long unsigned int memberSize;
+    /* size of the index which precedes the footer, and the integrity
+     * check type, which must match the header's (xz) */
+    long long unsigned int indexSize;
+    unsigned char checkType;
 };
 
 /** a structure which encapsulates information about the particular
- *  file header and footer in use (lzip vs lzma vs (eventually) xz.
+ *  file header and footer in use (lzip vs lzma vs xz).
  *  The intention of this structure is to simplify compression and
  *  decompression logic by abstracting the file format details a bit.  */
 struct elzma_format_handler
@@ -11,64 +11,162 @@
 #include "easylzma/compress.h"
 #include "lzma_header.h"
 #include "lzip_header.h"
+#include "lzma2_header.h"
+#include "xz_header.h"
 #include "common_internal.h"
+#include "compress_mt.h"
+#include "compress_batch.h"
+#include "dedup.h"
 
 #include "pavlov/Types.h"
 #include "pavlov/LzmaEnc.h"
+#include "pavlov/Lzma2Enc.h"
 #include "pavlov/7zCrc.h"
 
 #include <string.h>
 
+/* the longest match LZMA codes, and so the most fast bytes */
+#define ELZMA_FB_MAX 273
+
 struct _elzma_compress_handle {
     CLzmaEncProps props;
     CLzmaEncHandle encHand;
+    /* the LZMA2 chunk encoder, which wraps an LZMA encoder of its own */
+    CLzma2EncHandle enc2Hand;
     unsigned long long uncompressedSize;
     elzma_file_format format;
     struct elzma_alloc_struct allocStruct;
     struct elzma_format_handler formatHandler;
+    /* block parallel compression (lzip only) */
+    unsigned int numThreads;
+    unsigned int blockSize;
+    /* push mode compression state, allocated by the first
+     * elzma_compress_stream_begin */
+    struct elzmaPushStream * push;
+    /* a copy of the preset dictionary (lzma and lzip only) */
+    unsigned char * presetDict;
+    size_t presetDictSize;
+    /* polled wherever progress is reported */
+    elzma_abort_callback abortCallback;
+    void * abortContext;
+    /* encoders and threads for elzma_compress_batch, kept between
+     * batches */
+    struct elzmaBatchPool * batch;
+    /* the average chunk size of long range deduplication, zero when
+     * it's off */
+    unsigned int longRangeChunk;
+    /* the throughput target, in KiB per second and milliseconds for the
+     * run, zero when unset */
+    unsigned int targetRate;
+    unsigned int timeBudget;
+    /* times the throughput target and push mode deadlines, NULL for
+     * elzmaNowMicroseconds() */
+    elzma_clock_callback clockCallback;
+    void * clockContext;
+    /* the ringWindow option, which props.ringWindow follows unless the
+     * client allocates */
+    unsigned int ringWindow;
 };
 
-elzma_compress_handle
-elzma_compress_alloc()
+static void freePushStream(elzma_compress_handle hand);
+static void abandonPushStream(elzma_compress_handle hand);
+static int pushStreamOpen(elzma_compress_handle hand);
+
+static void
+freePresetDict(elzma_compress_handle hand)
 {
-    elzma_compress_handle hand = malloc(sizeof(struct _elzma_compress_handle));
-    memset((void *) hand, 0, sizeof(struct _elzma_compress_handle));
+    if (hand->presetDict) {
+        hand->allocStruct.Free(&(hand->allocStruct), hand->presetDict);
+    }
+    hand->presetDict = NULL;
+    hand->presetDictSize = 0;
+}
 
+/* restore the configuration of a freshly allocated handle, leaving the
+ * encoder (and its allocations) alone */
+static void
+setDefaults(elzma_compress_handle hand)
+{
     /* "reasonable" defaults for props */
     LzmaEncProps_Init(&(hand->props));
     hand->props.lc = 3;
     hand->props.lp = 0;    
     hand->props.pb = 2;    
     hand->props.level = 5;
-    hand->props.algo = 1;
-    hand->props.fb = 32;
     hand->props.dictSize = 1 << 24;
-    hand->props.btMode = 1;
-    hand->props.numHashBytes = 4;
-    hand->props.mc = 32;
-    hand->props.numThreads = 1;
     hand->props.writeEndMark = 1;
+    {
+        elzma_compress_options opts;
+        elzma_compress_options_init(&opts, ELZMA_PRESET_DEFAULT);
+        elzma_compress_set_options(hand, &opts);
+    }
 
-    init_alloc_struct(&(hand->allocStruct), NULL, NULL, NULL, NULL);
+    hand->uncompressedSize = 0;
+    hand->numThreads = 1;
+    hand->blockSize = 0;
+    freePresetDict(hand);
+    hand->abortCallback = NULL;
+    hand->abortContext = NULL;
+    hand->longRangeChunk = 0;
+    hand->targetRate = 0;
+    hand->timeBudget = 0;
+    hand->clockCallback = NULL;
+    hand->clockContext = NULL;
 
     /* default format is LZMA-Alone */
+    hand->format = ELZMA_lzma;
     initializeLZMAFormatHandler(&(hand->formatHandler));
+}
+
+elzma_compress_handle
+elzma_compress_alloc()
+{
+    elzma_compress_handle hand = malloc(sizeof(struct _elzma_compress_handle));
+    if (hand == NULL) return NULL;
+    memset((void *) hand, 0, sizeof(struct _elzma_compress_handle));
+
+    init_alloc_struct(&(hand->allocStruct), NULL, NULL, NULL, NULL);
+    setDefaults(hand);
 
     return hand;
 }
 
+/* release the encoder and the buffers it holds between runs */
+static void
+destroyEncoder(elzma_compress_handle hand)
+{
+    if (hand->encHand) {
+        LzmaEnc_Destroy(hand->encHand,
+                        (ISzAlloc *) &(hand->allocStruct),
+                        (ISzAlloc *) &(hand->allocStruct.big));
+        hand->encHand = NULL;
+    }
+    if (hand->enc2Hand) {
+        Lzma2Enc_Destroy(hand->enc2Hand);
+        hand->enc2Hand = NULL;
+    }
+}
+
 void
 elzma_compress_free(elzma_compress_handle * hand)
 {
     if (hand && *hand) {
-        if ((*hand)->encHand) {
-            LzmaEnc_Destroy((*hand)->encHand,
-                            (ISzAlloc *) &((*hand)->allocStruct),
-                            (ISzAlloc *) &((*hand)->allocStruct));
-        }
-        
+        freePushStream(*hand);
+        freePresetDict(*hand);
+        elzmaBatchPoolFree((*hand)->batch);
+        destroyEncoder(*hand);
+        free(*hand);
+        *hand = NULL;
+    }
+}
+
+void
+elzma_compress_reset(elzma_compress_handle hand)
+{
+    if (hand) {
+        abandonPushStream(hand);
+        setDefaults(hand);
     }
-    *hand = NULL;
 }
 
 int
@@ -91,12 +189,221 @@ elzma_compress_config(elzma_compress_handle hand,
     hand->uncompressedSize = uncompressedSize;
     hand->format = format;
 
-    /* default of LZMA-Alone is set at alloc time, and there are only
-     * two possible formats */
+    /* a handle may be reconfigured between runs, so the handler must be
+     * set for either format */
     if (format == ELZMA_lzip) {
         initializeLZIPFormatHandler(&(hand->formatHandler));
+    } else if (format == ELZMA_lzma2) {
+        initializeLZMA2FormatHandler(&(hand->formatHandler));
+    } else if (format == ELZMA_xz) {
+        initializeXZFormatHandler(&(hand->formatHandler));
+    } else {
+        initializeLZMAFormatHandler(&(hand->formatHandler));
+    }
+
+    return ELZMA_E_OK;
+}
+
+int
+elzma_compress_options_init_version(elzma_compress_options * opts,
+                                    elzma_compress_preset preset,
+                                    unsigned int version)
+{
+    if (opts == NULL || version < 1 ||
+        version > ELZMA_COMPRESS_OPTIONS_VERSION)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    opts->version = version;
+    opts->algo = 1;
+    opts->fb = 32;
+    opts->btMode = 1;
+    opts->numHashBytes = 4;
+    opts->mc = 32;
+    opts->matchFinderThreads = 1;
+    if (version >= 2) opts->mulHash = 0;
+    if (version >= 3) opts->ringWindow = 0;
+
+    if (preset == ELZMA_PRESET_FAST) {
+        /* greedy parsing over a hash chain which gives up early */
+        opts->algo = 0;
+        opts->fb = 16;
+        opts->btMode = 0;
+        opts->mc = 8;
+    } else if (preset == ELZMA_PRESET_LAZY) {
+        /* lazy parsing over a hash chain which searches a little longer */
+        opts->algo = 2;
+        opts->btMode = 0;
+    } else if (preset == ELZMA_PRESET_BEST) {
+        opts->fb = 64;
+        opts->mc = 48;
+    } else if (preset != ELZMA_PRESET_DEFAULT) {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    return ELZMA_E_OK;
+}
+
+int
+elzma_compress_set_options(elzma_compress_handle hand,
+                           const elzma_compress_options * opts)
+{
+    /* fields beyond the caller's version aren't there to be read */
+    unsigned int mulHash, ringWindow;
+
+    if (hand == NULL || opts == NULL || opts->version < 1 ||
+        opts->version > ELZMA_COMPRESS_OPTIONS_VERSION)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+    mulHash = (opts->version >= 2) ? opts->mulHash : 0;
+    ringWindow = (opts->version >= 3) ? opts->ringWindow : 0;
+
+    if (opts->algo > 2 || opts->fb < 5 || opts->fb > ELZMA_FB_MAX ||
+        opts->btMode > 1 || opts->numHashBytes < 2 ||
+        opts->numHashBytes > 4 || opts->mc < 1 || opts->mc > (1 << 30) ||
+        opts->matchFinderThreads < 1 || opts->matchFinderThreads > 2 ||
+        mulHash > 1 || ringWindow > 1)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    hand->props.algo = (int) opts->algo;
+    hand->props.fb = (int) opts->fb;
+    hand->props.btMode = (int) opts->btMode;
+    hand->props.numHashBytes = (int) opts->numHashBytes;
+    hand->props.mc = opts->mc;
+    hand->props.numThreads = (int) opts->matchFinderThreads;
+    hand->props.mulHash = (int) mulHash;
+    /* a mapped window can't come from the client's routines */
+    hand->ringWindow = ringWindow;
+    hand->props.ringWindow = (ringWindow != 0 &&
+                              hand->allocStruct.clientMallocFunc == NULL);
+
+    return ELZMA_E_OK;
+}
+
+int
+elzma_compress_get_options_version(elzma_compress_handle hand,
+                                   elzma_compress_options * opts,
+                                   unsigned int version)
+{
+    if (hand == NULL || opts == NULL || version < 1 ||
+        version > ELZMA_COMPRESS_OPTIONS_VERSION)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    opts->version = version;
+    opts->algo = (unsigned int) hand->props.algo;
+    opts->fb = (unsigned int) hand->props.fb;
+    opts->btMode = (unsigned int) hand->props.btMode;
+    opts->numHashBytes = (unsigned int) hand->props.numHashBytes;
+    opts->mc = hand->props.mc;
+    opts->matchFinderThreads = (unsigned int) hand->props.numThreads;
+    if (version >= 2) opts->mulHash = (unsigned int) hand->props.mulHash;
+    if (version >= 3) opts->ringWindow = hand->ringWindow;
+
+    return ELZMA_E_OK;
+}
+
+int
+elzma_compress_set_dictionary(elzma_compress_handle hand,
+                              const void * dict, size_t dictSize)
+{
+    if (hand == NULL || (dict == NULL && dictSize > 0) ||
+        dictSize > ELZMA_PRESET_DICT_SIZE_MAX || pushStreamOpen(hand))
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    freePresetDict(hand);
+    if (dictSize > 0) {
+        hand->presetDict = (unsigned char *)
+            hand->allocStruct.Alloc(&(hand->allocStruct), dictSize);
+        if (hand->presetDict == NULL) return ELZMA_E_COMPRESS_ERROR;
+        memcpy((void *) hand->presetDict, dict, dictSize);
+        hand->presetDictSize = dictSize;
+    }
+
+    return ELZMA_E_OK;
+}
+
+int
+elzma_compress_set_abort_callback(elzma_compress_handle hand,
+                                  elzma_abort_callback abortCallback,
+                                  void * abortContext)
+{
+    if (hand == NULL) return ELZMA_E_BAD_PARAMS;
+    hand->abortCallback = abortCallback;
+    hand->abortContext = abortContext;
+    return ELZMA_E_OK;
+}
+
+int
+elzma_compress_set_clock(elzma_compress_handle hand,
+                         elzma_clock_callback clockCallback,
+                         void * clockContext)
+{
+    if (hand == NULL) return ELZMA_E_BAD_PARAMS;
+    hand->clockCallback = clockCallback;
+    hand->clockContext = clockContext;
+    return ELZMA_E_OK;
+}
+
+/* the time in microseconds by the handle's clock */
+static unsigned long long
+handleNow(elzma_compress_handle hand)
+{
+    if (hand->clockCallback) return hand->clockCallback(hand->clockContext);
+    return elzmaNowMicroseconds();
+}
+
+int
+elzma_compress_set_long_range(elzma_compress_handle hand,
+                              unsigned int chunkSize)
+{
+    if (hand == NULL) return ELZMA_E_BAD_PARAMS;
+    if (chunkSize != 0 &&
+        (chunkSize < ELZMA_DEDUP_CHUNK_MIN ||
+         chunkSize > ELZMA_DEDUP_CHUNK_MAX ||
+         (chunkSize & (chunkSize - 1)) != 0))
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    hand->longRangeChunk = chunkSize;
+
+    return ELZMA_E_OK;
+}
+
+int
+elzma_compress_set_throughput(elzma_compress_handle hand,
+                              unsigned int kbPerSecond,
+                              unsigned int timeBudget)
+{
+    if (hand == NULL) return ELZMA_E_BAD_PARAMS;
+
+    hand->targetRate = kbPerSecond;
+    hand->timeBudget = timeBudget;
+
+    return ELZMA_E_OK;
+}
+
+int
+elzma_compress_set_threads(elzma_compress_handle hand,
+                           unsigned int numThreads,
+                           unsigned int blockSize)
+{
+    if (hand == NULL) return ELZMA_E_BAD_PARAMS;
+    if (blockSize != 0 && blockSize < ELZMA_MT_MIN_BLOCK_SIZE) {
+        return ELZMA_E_BAD_PARAMS;
     }
 
+    hand->numThreads = (numThreads < 1) ? 1 : numThreads;
+    hand->blockSize = blockSize;
+
     return ELZMA_E_OK;
 }
 
@@ -111,6 +418,7 @@ struct elzmaInStream
     unsigned int crc32b;
     unsigned int crc32c;
     int calculateCRC;
+    unsigned long long size;
 };
 
 static SRes elzmaReadFunc(void *p, void *buf, size_t *size)
@@ -118,8 +426,9 @@ static SRes elzmaReadFunc(void *p, void *buf, size_t *size)
     int rv;
     struct elzmaInStream * is = (struct elzmaInStream *) p;
     rv = is->inputStream(is->inputContext, buf, size);
-    if (rv == 0 && *size > 0 && is->calculateCRC) {
-        is->crc32 = CrcUpdate(is->crc32, buf, *size);
+    if (rv == 0 && *size > 0) {
+        if (is->calculateCRC) is->crc32 = CrcUpdate(is->crc32, buf, *size);
+        is->size += *size;
     }
     return rv;
 }
@@ -128,12 +437,128 @@ struct elzmaOutStream {
     size_t (*WritePtr)(void *p, const void *buf, size_t size);
     elzma_write_callback outputStream;
     void * outputContext;
+    unsigned long long size;
 };
 
 static size_t elzmaWriteFunc(void *p, const void *buf, size_t size)
 {
+    size_t wt;
     struct elzmaOutStream * os = (struct elzmaOutStream *) p;
-    return os->outputStream(os->outputContext, buf, size);
+    wt = os->outputStream(os->outputContext, buf, size);
+    os->size += wt;
+    return wt;
+}
+
+/* the effort levels a throughput target steps between, from the
+ * fastest.  The match finder is sized for the most fast bytes of any
+ * level (or the configured number, if that's more) */
+#define ELZMA_EFFORT_MAX_FB 64
+
+static const struct {
+    unsigned char algo;
+    unsigned char fb;
+    unsigned char mc;
+} effortLevels[] = {
+    { 0, 8, 2 }, { 0, 16, 4 }, { 0, 16, 8 }, { 0, 32, 16 },
+    { 2, 32, 16 }, { 2, 32, 32 },
+    { 1, 32, 16 }, { 1, 32, 32 }, { 1, ELZMA_EFFORT_MAX_FB, 48 }
+};
+
+#define ELZMA_EFFORT_LEVELS (sizeof(effortLevels) / sizeof(effortLevels[0]))
+
+/* speed is measured over windows at least this long, in microseconds */
+#define ELZMA_EFFORT_WINDOW 50000
+
+/* a step up which proves too slow is retried after at most this many
+ * windows */
+#define ELZMA_EFFORT_BACKOFF_MAX 64
+
+struct elzmaEffort
+{
+    elzma_compress_handle hand;
+    /* input wanted per second, in bytes */
+    unsigned long long rate;
+    /* when the run must be done by, zero for no deadline */
+    unsigned long long deadline;
+    unsigned long long totalSize;
+    unsigned int level;
+    unsigned long long windowStart;
+    unsigned long long windowIn;
+    unsigned int windows;
+    /* after a step up fails, the next is tried once windows reaches
+     * retryAt, the wait doubling with each failure */
+    int steppedUp;
+    unsigned int retryAt;
+    unsigned int backoff;
+};
+
+static void
+initEffort(struct elzmaEffort * e, elzma_compress_handle hand)
+{
+    e->hand = hand;
+    e->rate = (unsigned long long) hand->targetRate * 1024;
+    e->windowStart = handleNow(hand);
+    e->deadline = hand->timeBudget ?
+        e->windowStart + (unsigned long long) hand->timeBudget * 1000 : 0;
+    e->totalSize = hand->uncompressedSize;
+    /* start from the configured parser */
+    e->level = (hand->props.algo == 0) ? 2 : (hand->props.algo == 2) ? 5
+                                                                        : 7;
+    e->windowIn = 0;
+    e->windows = 0;
+    e->steppedUp = 0;
+    e->retryAt = 0;
+    e->backoff = 1;
+}
+
+/* called between blocks with the input coded so far */
+static void
+updateEffort(struct elzmaEffort * e, unsigned long long inSize)
+{
+    unsigned long long now = handleNow(e->hand);
+    unsigned long long elapsed = now - e->windowStart;
+    unsigned long long rate, want = e->rate;
+    unsigned int level = e->level;
+
+    if (elapsed < ELZMA_EFFORT_WINDOW) return;
+    rate = (inSize - e->windowIn) * 1000000 / elapsed;
+
+    /* the rate which finishes the rest in time */
+    if (e->deadline) {
+        unsigned long long left =
+            (e->totalSize > inSize) ? e->totalSize - inSize : 0;
+        if (now >= e->deadline) {
+            want = (unsigned long long) -1;
+        } else if (left * 1000000 / (e->deadline - now) > want) {
+            want = left * 1000000 / (e->deadline - now);
+        }
+    }
+
+    e->windows++;
+    if (rate < want) {
+        if (e->steppedUp) {
+            if (e->backoff < ELZMA_EFFORT_BACKOFF_MAX) e->backoff *= 2;
+            e->retryAt = e->windows + e->backoff;
+        }
+        if (level > 0) level--;
+    } else {
+        if (e->steppedUp) e->backoff = 1;
+        /* the next level up is a good deal slower */
+        if (rate - want > want / 4 && level + 1 < ELZMA_EFFORT_LEVELS &&
+            e->windows >= e->retryAt)
+        {
+            level++;
+        }
+    }
+
+    e->steppedUp = (level > e->level);
+    if (level != e->level) {
+        e->level = level;
+        LzmaEnc_SetEffort(e->hand->encHand, effortLevels[level].algo,
+                          effortLevels[level].fb, effortLevels[level].mc);
+    }
+    e->windowStart = now;
+    e->windowIn = inSize;
 }
 
 /* use Igor's stream hooks for compression. */
@@ -143,124 +568,108 @@ struct elzmaProgressStruct
     long long unsigned int uncompressedSize;
     elzma_progress_callback progressCallback;
     void * progressContext;
-
+    elzma_abort_callback abortCallback;
+    void * abortContext;
+    /* input consumed by earlier xz blocks */
+    long long unsigned int offset;
+    /* adapts the encoder to a throughput target, or NULL */
+    struct elzmaEffort * effort;
 };
 
-#include <stdio.h>
+/* the encoders unwind with SZ_ERROR_PROGRESS when this fails */
 static SRes elzmaProgress(void *p, UInt64 inSize, UInt64 outSize)
 {
     struct elzmaProgressStruct * ps = (struct elzmaProgressStruct *) p;
+    if (ps->effort) updateEffort(ps->effort, inSize);
     if (ps->progressCallback) {
-        ps->progressCallback(ps->progressContext, inSize,
+        ps->progressCallback(ps->progressContext, ps->offset + inSize,
                              ps->uncompressedSize);
     }
+    if (ps->abortCallback && ps->abortCallback(ps->abortContext)) {
+        return SZ_ERROR_PROGRESS;
+    }
     return SZ_OK;
 }
 
-void elzma_compress_set_allocation_callbacks(
-    elzma_compress_handle hand,
-    elzma_malloc mallocFunc, void * mallocFuncContext,
-    elzma_free freeFunc, void * freeFuncContext)
+static void
+initProgress(elzma_compress_handle hand, struct elzmaProgressStruct * ps,
+             elzma_progress_callback progressCallback,
+             void * progressContext)
 {
-    if (hand) {
-        init_alloc_struct(&(hand->allocStruct),
-                          mallocFunc, mallocFuncContext,
-                          freeFunc, freeFuncContext);
-    }
+    ps->Progress = elzmaProgress;
+    ps->uncompressedSize = hand->uncompressedSize;
+    ps->progressCallback = progressCallback;
+    ps->progressContext = progressContext;
+    ps->abortCallback = hand->abortCallback;
+    ps->abortContext = hand->abortContext;
+    ps->offset = 0;
+    ps->effort = NULL;
 }
 
-int
-elzma_compress_run(elzma_compress_handle hand,
-                   elzma_read_callback inputStream, void * inputContext,
-                   elzma_write_callback outputStream, void * outputContext,
-                   elzma_progress_callback progressCallback,
-                   void * progressContext)
+/* create an encoding object, or reuse the one from an earlier run
+ * which keeps its match finder, range coder and probability tables
+ * unless the new configuration requires larger ones, and initialize it
+ * with compression parameters */
+static int
+prepareEncoder(elzma_compress_handle hand, const CLzmaEncProps * props)
 {
-    struct elzmaInStream inStreamStruct;
-    struct elzmaOutStream outStreamStruct;    
-    struct elzmaProgressStruct progressStruct;    
-	SRes r;
-
-    CrcGenerateTable();
-
-    if (hand == NULL || inputStream == NULL) return ELZMA_E_BAD_PARAMS;
-
-    /* initialize stream structrures */
-    inStreamStruct.ReadPtr = elzmaReadFunc;
-    inStreamStruct.inputStream = inputStream;    
-    inStreamStruct.inputContext = inputContext;    
-    inStreamStruct.crc32 = CRC_INIT_VAL;
-    inStreamStruct.calculateCRC =
-        (hand->formatHandler.serialize_footer != NULL);
-
-    outStreamStruct.WritePtr = elzmaWriteFunc;
-    outStreamStruct.outputStream = outputStream;    
-    outStreamStruct.outputContext = outputContext;    
-
-    progressStruct.Progress = elzmaProgress;
-    progressStruct.uncompressedSize = hand->uncompressedSize;
-    progressStruct.progressCallback = progressCallback;
-    progressStruct.progressContext = progressContext;
-
-    /* create an encoding object */
-    hand->encHand = LzmaEnc_Create((ISzAlloc *) &(hand->allocStruct));
-
     if (hand->encHand == NULL) {
-        return ELZMA_E_COMPRESS_ERROR;
+        hand->encHand = LzmaEnc_Create((ISzAlloc *) &(hand->allocStruct));
+
+        if (hand->encHand == NULL) {
+            return ELZMA_E_COMPRESS_ERROR;
+        }
     }
 
-    /* inintialize with compression parameters */
-    if (SZ_OK != LzmaEnc_SetProps(hand->encHand, &(hand->props)))
+    if (SZ_OK != LzmaEnc_SetProps(hand->encHand, props) ||
+        SZ_OK != LzmaEnc_SetMaxFastBytes(hand->encHand, 0) ||
+        SZ_OK != LzmaEnc_SetPresetDict(hand->encHand, hand->presetDict,
+                                       hand->presetDictSize))
     {
         return ELZMA_E_BAD_PARAMS;
     }
+    return ELZMA_E_OK;
+}
 
-    /* verify format is sane */
-    if (ELZMA_lzma != hand->format && ELZMA_lzip != hand->format) {
-        return ELZMA_E_UNSUPPORTED_FORMAT;
-    }
+/* write the file (or member) header, a zero uncompressedSize means the
+ * size isn't known */
+static int
+writeHeader(elzma_compress_handle hand, struct elzmaOutStream * os,
+            unsigned long long uncompressedSize)
+{
+    unsigned char * hdr =
+        hand->allocStruct.Alloc(&(hand->allocStruct),
+                                hand->formatHandler.header_size);
+    struct elzma_file_header h;
+    size_t wt;
 
-    /* now write the compression header header */ 
-    {
-        unsigned char * hdr =
-            hand->allocStruct.Alloc(&(hand->allocStruct),
-                                    hand->formatHandler.header_size);
-        
-        struct elzma_file_header h;
-        size_t wt;
+    hand->formatHandler.init_header(&h);
+    h.pb = (unsigned char) hand->props.pb;
+    h.lp = (unsigned char) hand->props.lp;
+    h.lc = (unsigned char) hand->props.lc;
+    h.dictSize = hand->props.dictSize;
+    h.isStreamed = (unsigned char) (uncompressedSize == 0);
+    h.uncompressedSize = uncompressedSize;
 
-        hand->formatHandler.init_header(&h);
-        h.pb = (unsigned char) hand->props.pb;
-        h.lp = (unsigned char) hand->props.lp;
-        h.lc = (unsigned char) hand->props.lc;
-        h.dictSize = hand->props.dictSize;
-        h.isStreamed = (unsigned char) (hand->uncompressedSize == 0);
-        h.uncompressedSize = hand->uncompressedSize;
+    hand->formatHandler.serialize_header(hdr, &h);
 
-        hand->formatHandler.serialize_header(hdr, &h);
+    wt = elzmaWriteFunc((void *) os, (void *) hdr,
+                        hand->formatHandler.header_size);
 
-        wt = outputStream(outputContext, (void *) hdr,
-                          hand->formatHandler.header_size);
+    hand->allocStruct.Free(&(hand->allocStruct), hdr);
 
-        hand->allocStruct.Free(&(hand->allocStruct), hdr);
-        
-        if (wt != hand->formatHandler.header_size) {
-            return ELZMA_E_OUTPUT_ERROR;
-        }
+    if (wt != hand->formatHandler.header_size) {
+        return ELZMA_E_OUTPUT_ERROR;
     }
-    
-    /* begin LZMA encoding */
-    /* XXX: expose encoding progress */
-    r = LzmaEnc_Encode(hand->encHand,
-                       (ISeqOutStream *) &outStreamStruct,
-                       (ISeqInStream *) &inStreamStruct,
-                       (ICompressProgress *) &progressStruct,
-                       (ISzAlloc *) &(hand->allocStruct),
-                       (ISzAlloc *) &(hand->allocStruct));
-
-    if (r != SZ_OK) return ELZMA_E_COMPRESS_ERROR;
+    return ELZMA_E_OK;
+}
 
-    /* support a footer! (lzip) */
+/* write the footer for formats which have one (lzip), os->size must
+ * count the member's header and data */
+static int
+writeFooter(elzma_compress_handle hand, struct elzmaOutStream * os,
+            unsigned int crc32, unsigned long long uncompressedSize)
+{
     if (hand->formatHandler.serialize_footer != NULL &&
         hand->formatHandler.footer_size > 0)
     {
@@ -269,13 +678,14 @@ elzma_compress_run(elzma_compress_handle hand,
             hand->allocStruct.Alloc(&(hand->allocStruct),
                                     hand->formatHandler.footer_size);
         struct elzma_file_footer ftr;
-        ftr.crc32 = inStreamStruct.crc32 ^ 0xFFFFFFFF;
-        ftr.uncompressedSize = hand->uncompressedSize;
+        ftr.crc32 = crc32 ^ 0xFFFFFFFF;
+        ftr.uncompressedSize = uncompressedSize;
+        ftr.memberSize = os->size + hand->formatHandler.footer_size;
 
         hand->formatHandler.serialize_footer(&ftr, ftrBuf);
 
-        wt = outputStream(outputContext, (void *) ftrBuf,
-                          hand->formatHandler.footer_size);
+        wt = elzmaWriteFunc((void *) os, (void *) ftrBuf,
+                            hand->formatHandler.footer_size);
 
         hand->allocStruct.Free(&(hand->allocStruct), ftrBuf);
         
@@ -283,10 +693,1112 @@ elzma_compress_run(elzma_compress_handle hand,
             return ELZMA_E_OUTPUT_ERROR;
         }
     }
-    
     return ELZMA_E_OK;
 }
 
+void elzma_compress_set_allocation_callbacks(
+    elzma_compress_handle hand,
+    elzma_malloc mallocFunc, void * mallocFuncContext,
+    elzma_free freeFunc, void * freeFuncContext)
+{
+    if (hand) {
+        /* the encoder's memory must be returned with the routines that
+         * allocated it */
+        freePushStream(hand);
+        destroyEncoder(hand);
+        init_alloc_struct(&(hand->allocStruct),
+                          mallocFunc, mallocFuncContext,
+                          freeFunc, freeFuncContext);
+        hand->props.ringWindow = (hand->ringWindow != 0 &&
+                                  mallocFunc == NULL);
+    }
+}
+
+/* create the LZMA2 encoder, or reuse the one from an earlier run, and
+ * configure it.  A nonzero blockSize limits the dictionary to it. */
+static int
+prepareLzma2Encoder(elzma_compress_handle hand, size_t blockSize)
+{
+    CLzma2EncProps props2;
+
+    if (hand->enc2Hand == NULL) {
+        hand->enc2Hand = Lzma2Enc_Create((ISzAlloc *) &(hand->allocStruct),
+                                         (ISzAlloc *) &(hand->allocStruct.big));
+        if (hand->enc2Hand == NULL) return ELZMA_E_COMPRESS_ERROR;
+    }
+
+    Lzma2EncProps_Init(&props2);
+    props2.lzmaProps = hand->props;
+    props2.blockSize = blockSize;
+    if (SZ_OK != Lzma2Enc_SetProps(hand->enc2Hand, &props2)) {
+        return ELZMA_E_BAD_PARAMS;
+    }
+    return ELZMA_E_OK;
+}
+
+/* LZMA2 data is a series of chunks ended by a zero byte, which the
+ * LZMA2 encoder writes itself, all we add is the dictionary size byte */
+static int
+runLzma2Compression(elzma_compress_handle hand,
+                    struct elzmaInStream * is,
+                    struct elzmaOutStream * os,
+                    struct elzmaProgressStruct * ps)
+{
+    SRes r;
+    int rc;
+
+    rc = prepareLzma2Encoder(hand, 0);
+    if (rc != ELZMA_E_OK) return rc;
+
+    rc = writeHeader(hand, os, 0);
+    if (rc != ELZMA_E_OK) return rc;
+
+    r = Lzma2Enc_Encode(hand->enc2Hand, (ISeqOutStream *) os,
+                        (ISeqInStream *) is, (ICompressProgress *) ps);
+
+    if (r == SZ_ERROR_PROGRESS) return ELZMA_E_ABORTED;
+    if (r != SZ_OK) return ELZMA_E_COMPRESS_ERROR;
+    return ELZMA_E_OK;
+}
+
+/* the input of one xz block: at most 'remaining' bytes of the run's
+ * input, with the block's integrity check computed on the way */
+struct elzmaXZBlockInStream
+{
+    SRes (*ReadPtr)(void *p, void *buf, size_t *size);
+    struct elzmaInStream * is;
+    unsigned long long remaining;
+    unsigned long long size;
+    struct elzma_xz_check check;
+    /* a byte read ahead to learn whether any input is left */
+    int havePeek;
+    unsigned char peek;
+};
+
+static SRes elzmaXZBlockReadFunc(void *p, void *buf, size_t *size)
+{
+    struct elzmaXZBlockInStream * bs = (struct elzmaXZBlockInStream *) p;
+    size_t want = *size, got = 0;
+    SRes r = SZ_OK;
+
+    if (want > bs->remaining) want = (size_t) bs->remaining;
+    if (want > 0 && bs->havePeek) {
+        *(unsigned char *) buf = bs->peek;
+        bs->havePeek = 0;
+        got = 1;
+    }
+    if (want > got) {
+        size_t sz = want - got;
+        r = elzmaReadFunc((void *) bs->is, (unsigned char *) buf + got, &sz);
+        got += sz;
+    }
+
+    elzmaXZCheckUpdate(&(bs->check), buf, got);
+    bs->remaining -= got;
+    bs->size += got;
+    *size = got;
+    return r;
+}
+
+/* an xz stream of one block, or of blockSize blocks when set.  The
+ * sizes aren't known when a block header is written, so they're left
+ * out of it and only recorded in the index. */
+static int
+runXZCompression(elzma_compress_handle hand,
+                 struct elzmaInStream * is,
+                 struct elzmaOutStream * os,
+                 struct elzmaProgressStruct * ps)
+{
+    struct elzma_xz_index idx;
+    struct elzma_file_header h;
+    unsigned char buf[ELZMA_XZ_BLOCK_HEADER_SIZE_BOUND +
+                      ELZMA_XZ_CHECK_SIZE_MAX];
+    int rc;
+
+    rc = prepareLzma2Encoder(hand, hand->blockSize);
+    if (rc != ELZMA_E_OK) return rc;
+
+    rc = writeHeader(hand, os, 0);
+    if (rc != ELZMA_E_OK) return rc;
+    hand->formatHandler.init_header(&h);
+
+    elzmaXZIndexInit(&idx);
+
+    for (;;) {
+        struct elzmaXZBlockInStream bs;
+        struct elzma_xz_block_header bh;
+        unsigned long long dataStart, compressed;
+        unsigned int pad, checkSize;
+        size_t one = 1;
+
+        bs.ReadPtr = elzmaXZBlockReadFunc;
+        bs.is = is;
+        bs.remaining = hand->blockSize ? hand->blockSize
+                                       : ELZMA_XZ_SIZE_UNKNOWN;
+        bs.size = 0;
+        elzmaXZCheckInit(&(bs.check), h.checkType);
+
+        /* empty input makes a stream without blocks */
+        if (SZ_OK != elzmaReadFunc((void *) is, &(bs.peek), &one)) {
+            rc = ELZMA_E_INPUT_ERROR;
+            break;
+        }
+        if (one == 0) break;
+        bs.havePeek = 1;
+
+        bh.compressedSize = ELZMA_XZ_SIZE_UNKNOWN;
+        bh.uncompressedSize = ELZMA_XZ_SIZE_UNKNOWN;
+        bh.dictProp = Lzma2Enc_WriteProperties(hand->enc2Hand);
+        bh.longRange = hand->longRangeChunk > 0;
+        elzmaXZSerializeBlockHeader(buf, &bh);
+        if (elzmaWriteFunc((void *) os, buf, bh.headerSize) != bh.headerSize) {
+            rc = ELZMA_E_OUTPUT_ERROR;
+            break;
+        }
+
+        dataStart = os->size;
+        {
+            SRes r = Lzma2Enc_Encode(hand->enc2Hand, (ISeqOutStream *) os,
+                                     (ISeqInStream *) &bs,
+                                     (ICompressProgress *) ps);
+            if (r != SZ_OK) {
+                rc = (r == SZ_ERROR_PROGRESS) ? ELZMA_E_ABORTED
+                                              : ELZMA_E_COMPRESS_ERROR;
+                break;
+            }
+        }
+        compressed = os->size - dataStart;
+        ps->offset += bs.size;
+
+        /* padding, then the check */
+        pad = elzmaXZPadding(compressed);
+        memset(buf, 0, pad);
+        checkSize = elzmaXZCheckFinish(&(bs.check), buf + pad);
+        if (elzmaWriteFunc((void *) os, buf, pad + checkSize) !=
+            pad + checkSize)
+        {
+            rc = ELZMA_E_OUTPUT_ERROR;
+            break;
+        }
+
+        if (elzmaXZIndexAppend(&idx, &(hand->allocStruct),
+                               bh.headerSize + compressed + checkSize,
+                               bs.size))
+        {
+            rc = ELZMA_E_COMPRESS_ERROR;
+            break;
+        }
+    }
+
+    if (rc == ELZMA_E_OK) {
+        rc = elzmaXZWriteIndexAndFooter(&idx, h.checkType,
+                                        &(hand->allocStruct),
+                                        elzmaWriteFunc, (void *) os);
+    }
+    elzmaXZIndexFree(&idx, &(hand->allocStruct));
+
+    return rc;
+}
+
+static int
+compressRun(elzma_compress_handle hand,
+            elzma_read_callback inputStream, void * inputContext,
+            elzma_write_callback outputStream, void * outputContext,
+            elzma_progress_callback progressCallback,
+            void * progressContext)
+{
+    struct elzmaInStream inStreamStruct;
+    struct elzmaOutStream outStreamStruct;    
+    struct elzmaProgressStruct progressStruct;    
+    struct elzmaEffort effort;
+    int adapt;
+	SRes r;
+
+    CrcGenerateTable();
+
+    if (hand == NULL || inputStream == NULL || pushStreamOpen(hand)) {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    /* initialize stream structrures */
+    inStreamStruct.ReadPtr = elzmaReadFunc;
+    inStreamStruct.inputStream = inputStream;    
+    inStreamStruct.inputContext = inputContext;    
+    inStreamStruct.crc32 = CRC_INIT_VAL;
+    inStreamStruct.calculateCRC =
+        (hand->formatHandler.serialize_footer != NULL);
+    inStreamStruct.size = 0;
+
+    outStreamStruct.WritePtr = elzmaWriteFunc;
+    outStreamStruct.outputStream = outputStream;    
+    outStreamStruct.outputContext = outputContext;    
+    outStreamStruct.size = 0;
+
+    initProgress(hand, &progressStruct, progressCallback, progressContext);
+
+    /* verify format is sane */
+    if (ELZMA_lzma != hand->format && ELZMA_lzip != hand->format &&
+        ELZMA_lzma2 != hand->format && ELZMA_xz != hand->format)
+    {
+        return ELZMA_E_UNSUPPORTED_FORMAT;
+    }
+
+    /* LZMA2 chunks start from an empty dictionary, and only a single
+     * LZMA encoder adapts to a throughput target */
+    adapt = (hand->targetRate > 0 || hand->timeBudget > 0);
+    if ((hand->presetDictSize > 0 || adapt) &&
+        (hand->format == ELZMA_lzma2 || hand->format == ELZMA_xz))
+    {
+        return ELZMA_E_UNSUPPORTED_FORMAT;
+    }
+    if (hand->timeBudget > 0 && hand->uncompressedSize == 0) {
+        return ELZMA_E_BAD_PARAMS;
+    }
+    /* nor do blocks coded in parallel */
+    if (adapt && (hand->numThreads > 1 || hand->blockSize != 0)) {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    if (hand->format == ELZMA_lzma2) {
+        return runLzma2Compression(hand, &inStreamStruct, &outStreamStruct,
+                                   &progressStruct);
+    }
+
+    /* lzip streams may consist of multiple members and xz streams of
+     * multiple blocks, which lets us split the work across threads.  A
+     * block size given with a single thread is split the same way, so
+     * that the output doesn't depend on the number of threads */
+    if ((hand->numThreads > 1 || hand->blockSize != 0) &&
+        hand->presetDictSize == 0 &&
+        (hand->format == ELZMA_lzip || hand->format == ELZMA_xz))
+    {
+        return runParallelCompression(&(hand->props), hand->format,
+                                      hand->numThreads, hand->blockSize,
+                                      hand->longRangeChunk > 0,
+                                      &(hand->allocStruct),
+                                      inputStream, inputContext,
+                                      outputStream, outputContext,
+                                      progressCallback, progressContext,
+                                      hand->abortCallback,
+                                      hand->abortContext,
+                                      hand->uncompressedSize);
+    }
+
+    if (hand->format == ELZMA_xz) {
+        return runXZCompression(hand, &inStreamStruct, &outStreamStruct,
+                                &progressStruct);
+    }
+
+    if (adapt) {
+        /* the target is per core, so match finding stays in this thread */
+        CLzmaEncProps props = hand->props;
+        int rc;
+        props.numThreads = 1;
+        rc = prepareEncoder(hand, &props);
+        if (rc != ELZMA_E_OK) return rc;
+        /* so that the top levels get their fast bytes from any start */
+        LzmaEnc_SetMaxFastBytes(hand->encHand, ELZMA_EFFORT_MAX_FB);
+        initEffort(&effort, hand);
+        progressStruct.effort = &effort;
+    } else {
+        int rc = prepareEncoder(hand, &(hand->props));
+        if (rc != ELZMA_E_OK) return rc;
+    }
+
+    /* now write the compression header header */ 
+    {
+        int rc = writeHeader(hand, &outStreamStruct, hand->uncompressedSize);
+        if (rc != ELZMA_E_OK) return rc;
+    }
+    
+    /* begin LZMA encoding */
+    r = LzmaEnc_Encode(hand->encHand,
+                       (ISeqOutStream *) &outStreamStruct,
+                       (ISeqInStream *) &inStreamStruct,
+                       (ICompressProgress *) &progressStruct,
+                       (ISzAlloc *) &(hand->allocStruct),
+                       (ISzAlloc *) &(hand->allocStruct.big));
+
+    if (r == SZ_ERROR_PROGRESS) return ELZMA_E_ABORTED;
+    if (r != SZ_OK) return ELZMA_E_COMPRESS_ERROR;
+
+    /* support a footer! (lzip) */
+    return writeFooter(hand, &outStreamStruct, inStreamStruct.crc32,
+                       inStreamStruct.size);
+}
+
+int
+elzma_compress_run(elzma_compress_handle hand,
+                   elzma_read_callback inputStream, void * inputContext,
+                   elzma_write_callback outputStream, void * outputContext,
+                   elzma_progress_callback progressCallback,
+                   void * progressContext)
+{
+    struct elzmaDedupEncoder * dedup;
+    unsigned long long uncompressedSize;
+    int rc;
+
+    if (hand == NULL || inputStream == NULL) return ELZMA_E_BAD_PARAMS;
+
+    if (hand->longRangeChunk == 0) {
+        return compressRun(hand, inputStream, inputContext, outputStream,
+                           outputContext, progressCallback,
+                           progressContext);
+    }
+
+    /* only xz block headers can say the data is filtered */
+    if (hand->format != ELZMA_xz) return ELZMA_E_UNSUPPORTED_FORMAT;
+
+    /* everything downstream sees the filtered data, whose size isn't
+     * known up front */
+    dedup = elzmaDedupEncoderCreate(inputStream, inputContext,
+                                    hand->longRangeChunk,
+                                    &(hand->allocStruct));
+    if (dedup == NULL) return ELZMA_E_COMPRESS_ERROR;
+
+    uncompressedSize = hand->uncompressedSize;
+    hand->uncompressedSize = 0;
+    rc = compressRun(hand, elzmaDedupRead, (void *) dedup, outputStream,
+                     outputContext, progressCallback, progressContext);
+    hand->uncompressedSize = uncompressedSize;
+
+    elzmaDedupEncoderFree(dedup);
+
+    return rc;
+}
+
+/* LzmaLib's recommended output size for LZMA data, which covers
+ * incompressible input */
+#define ELZMA_LZMA_BOUND(inLen) ((inLen) + (inLen) / 3 + 128)
+
+size_t
+elzma_compress_bound(elzma_compress_handle hand, size_t inLen)
+{
+    size_t framing = 0;
+    if (hand) {
+        framing = hand->formatHandler.header_size;
+        if (hand->formatHandler.serialize_footer != NULL) {
+            framing += hand->formatHandler.footer_size;
+        }
+    }
+    return ELZMA_LZMA_BOUND(inLen) + framing;
+}
+
+/* elzma_compress_buffer, or with inCoded elzma_compress_buffer_partial */
+static int
+compressBuffer(elzma_compress_handle hand,
+               const unsigned char * in, size_t inLen, size_t * inCoded,
+               unsigned char * out, size_t * outLen)
+{
+    struct elzmaProgressStruct progressStruct;
+    int rc;
+
+    if (hand == NULL || outLen == NULL || out == NULL ||
+        (in == NULL && inLen > 0) || pushStreamOpen(hand) ||
+        hand->longRangeChunk > 0)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    /* verify format is sane */
+    if (ELZMA_lzma != hand->format && ELZMA_lzip != hand->format) {
+        return ELZMA_E_UNSUPPORTED_FORMAT;
+    }
+
+    CrcGenerateTable();
+
+    rc = prepareEncoder(hand, &(hand->props));
+    if (rc != ELZMA_E_OK) return rc;
+
+    initProgress(hand, &progressStruct, NULL, NULL);
+    return elzmaEncodeBuffer(hand->encHand, &(hand->props),
+                             &(hand->formatHandler), &(hand->allocStruct),
+                             hand->abortCallback ?
+                                 (ICompressProgress *) &progressStruct :
+                                 NULL,
+                             in, inLen, inCoded, out, outLen);
+}
+
+int
+elzma_compress_buffer(elzma_compress_handle hand,
+                      const unsigned char * in, size_t inLen,
+                      unsigned char * out, size_t * outLen)
+{
+    return compressBuffer(hand, in, inLen, NULL, out, outLen);
+}
+
+int
+elzma_compress_buffer_partial(elzma_compress_handle hand,
+                              const unsigned char * in, size_t * inLen,
+                              unsigned char * out, size_t * outLen)
+{
+    if (inLen == NULL) return ELZMA_E_BAD_PARAMS;
+    return compressBuffer(hand, in, *inLen, inLen, out, outLen);
+}
+
+int
+elzma_compress_batch(elzma_compress_handle hand, unsigned int count,
+                     const unsigned char * const * in,
+                     const size_t * inLens,
+                     unsigned char ** out, size_t * outLens)
+{
+    CLzmaEncProps props;
+    unsigned int i;
+
+    if (hand == NULL || pushStreamOpen(hand) || hand->longRangeChunk > 0 ||
+        (count > 0 && (in == NULL || inLens == NULL || out == NULL ||
+                       outLens == NULL)))
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+    for (i = 0; i < count; i++) {
+        if ((in[i] == NULL && inLens[i] > 0) || out[i] == NULL) {
+            return ELZMA_E_BAD_PARAMS;
+        }
+    }
+
+    /* verify format is sane */
+    if (ELZMA_lzma != hand->format && ELZMA_lzip != hand->format) {
+        return ELZMA_E_UNSUPPORTED_FORMAT;
+    }
+
+    if (count == 0) return ELZMA_E_OK;
+
+    /* the pool is sized by elzma_compress_set_threads */
+    if (hand->batch != NULL &&
+        elzmaBatchPoolSize(hand->batch) != hand->numThreads)
+    {
+        elzmaBatchPoolFree(hand->batch);
+        hand->batch = NULL;
+    }
+    if (hand->batch == NULL) {
+        hand->batch = elzmaBatchPoolCreate(hand->numThreads,
+                                           &(hand->allocStruct));
+        if (hand->batch == NULL) return ELZMA_E_COMPRESS_ERROR;
+    }
+
+    CrcGenerateTable();
+
+    /* for inputs this small the match finder's own threads would cost
+     * more to set going than they save */
+    props = hand->props;
+    props.numThreads = 1;
+
+    return elzmaBatchRun(hand->batch, &props, hand->presetDict,
+                         hand->presetDictSize, &(hand->formatHandler),
+                         hand->abortCallback, hand->abortContext,
+                         count, in, inLens, out, outLens);
+}
+
+int
+elzma_compress_evaluate_dictionary(
+    elzma_compress_handle hand,
+    const void * dict, size_t dictSize,
+    const unsigned char * samples, const size_t * sampleSizes,
+    unsigned int numSamples,
+    unsigned long long * sizeWithout, unsigned long long * sizeWith)
+{
+    unsigned char * savedDict;
+    size_t savedDictSize;
+    unsigned char * out;
+    size_t outAlloc = 0;
+    unsigned long long totals[2] = { 0, 0 };
+    unsigned int i;
+    int pass, rc = ELZMA_E_OK;
+
+    if (hand == NULL || (dict == NULL && dictSize > 0) ||
+        dictSize > ELZMA_PRESET_DICT_SIZE_MAX ||
+        (samples == NULL && numSamples > 0) ||
+        (sampleSizes == NULL && numSamples > 0) ||
+        sizeWithout == NULL || sizeWith == NULL)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    for (i = 0; i < numSamples; i++) {
+        size_t bound = elzma_compress_bound(hand, sampleSizes[i]);
+        if (bound > outAlloc) outAlloc = bound;
+    }
+    out = (unsigned char *)
+        hand->allocStruct.Alloc(&(hand->allocStruct), outAlloc);
+    if (out == NULL && outAlloc > 0) return ELZMA_E_COMPRESS_ERROR;
+
+    /* the caller's dictionary stands in for the handle's own while
+     * measuring, it's only read */
+    savedDict = hand->presetDict;
+    savedDictSize = hand->presetDictSize;
+
+    for (pass = 0; pass < 2 && rc == ELZMA_E_OK; pass++) {
+        const unsigned char * in = samples;
+        hand->presetDict = pass ? (unsigned char *) dict : NULL;
+        hand->presetDictSize = pass ? dictSize : 0;
+
+        for (i = 0; i < numSamples; i++) {
+            size_t outLen = outAlloc;
+            rc = elzma_compress_buffer(hand, in, sampleSizes[i],
+                                       out, &outLen);
+            if (rc != ELZMA_E_OK) break;
+            totals[pass] += outLen;
+            in += sampleSizes[i];
+        }
+    }
+
+    hand->presetDict = savedDict;
+    hand->presetDictSize = savedDictSize;
+    if (out) hand->allocStruct.Free(&(hand->allocStruct), out);
+
+    if (rc == ELZMA_E_OK) {
+        *sizeWithout = totals[0];
+        *sizeWith = totals[1];
+    }
+
+    return rc;
+}
+
+/* push mode compression.  Written input is queued in buf[bufPos, bufLen)
+ * until the encoder reads it, which it does through ReadPtr.  Positions
+ * are offsets into the whole stream of input. */
+#define ELZMA_PUSH_NONE 0    /* no stream, or it was abandoned */
+#define ELZMA_PUSH_MEMBER 1  /* the encoder is coding a member */
+#define ELZMA_PUSH_BETWEEN 2 /* a member was flushed, the next one starts
+                              * when there's input for it */
+#define ELZMA_PUSH_DONE 3    /* the stream was finished */
+
+#define ELZMA_PUSH_OPEN_END ((unsigned long long) -1)
+#define ELZMA_PUSH_MIN_BUFSIZE (1024 * 64)
+
+/* a step keeps this much input queued ahead of the encoder */
+#define ELZMA_STEP_READ_SIZE (1024 * 64)
+
+struct elzmaPushStream
+{
+    SRes (*ReadPtr)(void *p, void *buf, size_t *size);
+    struct elzmaOutStream outStream;
+    int state;
+    int finishing;
+    size_t workLimit;
+    /* when nonzero, work stops once the handle's clock reaches it */
+    unsigned long long deadline;
+    /* input coded so far, over all members */
+    unsigned long long coded;
+
+    /* a stepped stream reads its own input, see elzma_compress_step */
+    elzma_read_callback pullStream;
+    void * pullContext;
+
+    unsigned char * buf;
+    size_t bufAlloc;
+    size_t bufPos;
+    size_t bufLen;
+
+    /* input written, and read by the encoder */
+    unsigned long long written;
+    unsigned long long read;
+    /* the latest flush (or finish), and where the current member
+     * starts, and ends once a flush falls within it */
+    unsigned long long flushPos;
+    unsigned long long memberStart;
+    unsigned long long memberEnd;
+    /* input coded into the current member */
+    unsigned long long memberCoded;
+    unsigned int crc32;
+};
+
+static SRes elzmaPushReadFunc(void *p, void *buf, size_t *size)
+{
+    struct elzmaPushStream * ps = (struct elzmaPushStream *) p;
+    size_t avail = ps->bufLen - ps->bufPos;
+
+    /* a flushed member ends where the flush was */
+    if (ps->memberEnd != ELZMA_PUSH_OPEN_END &&
+        ps->memberEnd - ps->read < avail)
+    {
+        avail = (size_t) (ps->memberEnd - ps->read);
+    }
+    if (*size > avail) *size = avail;
+
+    memcpy(buf, (void *) (ps->buf + ps->bufPos), *size);
+    ps->crc32 = CrcUpdate(ps->crc32, buf, *size);
+    ps->bufPos += *size;
+    ps->read += *size;
+
+    return SZ_OK;
+}
+
+static int
+pushStreamOpen(elzma_compress_handle hand)
+{
+    return (hand->push != NULL &&
+            (hand->push->state == ELZMA_PUSH_MEMBER ||
+             hand->push->state == ELZMA_PUSH_BETWEEN));
+}
+
+/* leave an open stream, so that the handle may be used for other runs */
+static void
+abandonPushStream(elzma_compress_handle hand)
+{
+    if (hand->push) {
+        if (hand->push->state == ELZMA_PUSH_MEMBER) {
+            LzmaEnc_Finish(hand->encHand);
+        }
+        hand->push->state = ELZMA_PUSH_NONE;
+    }
+}
+
+static void
+freePushStream(elzma_compress_handle hand)
+{
+    if (hand->push) {
+        if (hand->push->state == ELZMA_PUSH_MEMBER) {
+            LzmaEnc_Finish(hand->encHand);
+        }
+        if (hand->push->buf) {
+            hand->allocStruct.Free(&(hand->allocStruct), hand->push->buf);
+        }
+        hand->allocStruct.Free(&(hand->allocStruct), hand->push);
+        hand->push = NULL;
+    }
+}
+
+/* write a member header and set the encoder up to code from the queue */
+static int
+startPushMember(elzma_compress_handle hand)
+{
+    struct elzmaPushStream * ps = hand->push;
+    CLzmaEncProps props = hand->props;
+    int rc;
+
+    /* the multi-threaded match finder reads ahead of the encoder, past
+     * input which hasn't been written yet */
+    props.numThreads = 1;
+    rc = prepareEncoder(hand, &props);
+    if (rc != ELZMA_E_OK) return rc;
+
+    ps->outStream.size = 0;
+    rc = writeHeader(hand, &(ps->outStream), 0);
+    if (rc != ELZMA_E_OK) return rc;
+
+    if (SZ_OK != LzmaEnc_Prepare(hand->encHand, (ISeqInStream *) ps,
+                                 (ISeqOutStream *) &(ps->outStream),
+                                 (ISzAlloc *) &(hand->allocStruct),
+                                 (ISzAlloc *) &(hand->allocStruct.big)))
+    {
+        return ELZMA_E_COMPRESS_ERROR;
+    }
+
+    ps->memberStart = ps->read;
+    ps->memberEnd = (ps->flushPos > ps->read) ?
+        ps->flushPos : ELZMA_PUSH_OPEN_END;
+    ps->memberCoded = 0;
+    ps->crc32 = CRC_INIT_VAL;
+    ps->state = ELZMA_PUSH_MEMBER;
+
+    return ELZMA_E_OK;
+}
+
+/* code queued input until the encoder needs more of it than has been
+ * written, or the work limit is reached */
+static int
+pushWork(elzma_compress_handle hand)
+{
+    struct elzmaPushStream * ps = hand->push;
+    unsigned long long worked = 0;
+    int rc = ELZMA_E_OK;
+
+    for (;;) {
+        UInt64 coded;
+        Bool finished;
+        SRes r;
+
+        if (ps->state == ELZMA_PUSH_BETWEEN) {
+            if (ps->read == ps->written) {
+                if (ps->finishing) ps->state = ELZMA_PUSH_DONE;
+                break;
+            }
+            rc = startPushMember(hand);
+            if (rc != ELZMA_E_OK) break;
+        }
+        if (ps->state != ELZMA_PUSH_MEMBER) break;
+
+        /* each call does some work before a deadline can stop it */
+        if ((ps->workLimit > 0 && worked >= ps->workLimit) ||
+            (ps->deadline != 0 && worked > 0 &&
+             handleNow(hand) >= ps->deadline))
+        {
+            rc = ELZMA_E_AGAIN;
+            break;
+        }
+
+        r = LzmaEnc_CodeAvail(hand->encHand, ps->written - ps->memberStart,
+                              (Bool) (ps->memberEnd != ELZMA_PUSH_OPEN_END),
+                              &coded, &finished);
+        if (r != SZ_OK) {
+            rc = ELZMA_E_COMPRESS_ERROR;
+            break;
+        }
+
+        worked += coded - ps->memberCoded;
+        ps->coded += coded - ps->memberCoded;
+        if (hand->abortCallback && hand->abortCallback(hand->abortContext)) {
+            rc = ELZMA_E_ABORTED;
+            break;
+        }
+        if (finished) {
+            LzmaEnc_Finish(hand->encHand);
+            ps->state = ELZMA_PUSH_BETWEEN;
+            rc = writeFooter(hand, &(ps->outStream), ps->crc32,
+                             ps->read - ps->memberStart);
+            if (rc != ELZMA_E_OK) break;
+        } else if (coded == ps->memberCoded) {
+            /* waiting for input */
+            break;
+        }
+        ps->memberCoded = coded;
+    }
+
+    /* an error leaves no stream to continue */
+    if (rc != ELZMA_E_OK && rc != ELZMA_E_AGAIN) abandonPushStream(hand);
+
+    return rc;
+}
+
+/* end the current member at the input written so far, or if it already
+ * has an end, the member after it */
+static void
+requestFlush(struct elzmaPushStream * ps)
+{
+    ps->flushPos = ps->written;
+    if (ps->state == ELZMA_PUSH_MEMBER &&
+        ps->memberEnd == ELZMA_PUSH_OPEN_END)
+    {
+        ps->memberEnd = ps->flushPos;
+    }
+}
+
+int
+elzma_compress_stream_begin(elzma_compress_handle hand,
+                            elzma_write_callback outputStream,
+                            void * outputContext,
+                            size_t workLimit)
+{
+    struct elzmaPushStream * ps;
+    int rc;
+
+    if (hand == NULL || outputStream == NULL || hand->longRangeChunk > 0) {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    /* verify format is sane */
+    if (ELZMA_lzma != hand->format && ELZMA_lzip != hand->format) {
+        return ELZMA_E_UNSUPPORTED_FORMAT;
+    }
+
+    CrcGenerateTable();
+
+    /* abandon any open stream, keeping its queue allocation */
+    if (hand->push == NULL) {
+        hand->push = hand->allocStruct.Alloc(&(hand->allocStruct),
+                                             sizeof(struct elzmaPushStream));
+        if (hand->push == NULL) return ELZMA_E_COMPRESS_ERROR;
+        memset((void *) hand->push, 0, sizeof(struct elzmaPushStream));
+    }
+    abandonPushStream(hand);
+    ps = hand->push;
+
+    ps->ReadPtr = elzmaPushReadFunc;
+    ps->outStream.WritePtr = elzmaWriteFunc;
+    ps->outStream.outputStream = outputStream;
+    ps->outStream.outputContext = outputContext;
+    ps->outStream.size = 0;
+    ps->state = ELZMA_PUSH_NONE;
+    ps->finishing = 0;
+    ps->workLimit = workLimit;
+    ps->deadline = 0;
+    ps->coded = 0;
+    ps->pullStream = NULL;
+    ps->pullContext = NULL;
+    ps->bufPos = ps->bufLen = 0;
+    ps->written = ps->read = ps->flushPos = 0;
+
+    /* the first member starts right away so that even empty input
+     * makes a complete file */
+    rc = startPushMember(hand);
+    if (rc != ELZMA_E_OK) ps->state = ELZMA_PUSH_NONE;
+
+    return rc;
+}
+
+/* make room for size more bytes at the end of the queue */
+static int
+reserveQueue(elzma_compress_handle hand, size_t size)
+{
+    struct elzmaPushStream * ps = hand->push;
+
+    if (ps->bufAlloc - ps->bufLen < size) {
+        /* drop what the encoder has read, then grow if that's not
+         * enough */
+        memmove((void *) ps->buf, (void *) (ps->buf + ps->bufPos),
+                ps->bufLen - ps->bufPos);
+        ps->bufLen -= ps->bufPos;
+        ps->bufPos = 0;
+
+        if (ps->bufAlloc - ps->bufLen < size) {
+            size_t newAlloc = ps->bufAlloc * 2;
+            unsigned char * newBuf;
+
+            if (newAlloc < ps->bufLen + size) newAlloc = ps->bufLen + size;
+            if (newAlloc < ELZMA_PUSH_MIN_BUFSIZE) {
+                newAlloc = ELZMA_PUSH_MIN_BUFSIZE;
+            }
+            newBuf = hand->allocStruct.Alloc(&(hand->allocStruct), newAlloc);
+            if (newBuf == NULL) return ELZMA_E_COMPRESS_ERROR;
+            if (ps->buf) {
+                memcpy((void *) newBuf, (void *) ps->buf, ps->bufLen);
+                hand->allocStruct.Free(&(hand->allocStruct), ps->buf);
+            }
+            ps->buf = newBuf;
+            ps->bufAlloc = newAlloc;
+        }
+    }
+
+    return ELZMA_E_OK;
+}
+
+int
+elzma_compress_stream_write(elzma_compress_handle hand,
+                            const void * buf, size_t size)
+{
+    struct elzmaPushStream * ps;
+    int rc;
+
+    if (hand == NULL || !pushStreamOpen(hand) || hand->push->finishing ||
+        hand->push->pullStream != NULL || (buf == NULL && size > 0))
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+    ps = hand->push;
+
+    rc = reserveQueue(hand, size);
+    if (rc != ELZMA_E_OK) return rc;
+
+    memcpy((void *) (ps->buf + ps->bufLen), buf, size);
+    ps->bufLen += size;
+    ps->written += size;
+
+    return pushWork(hand);
+}
+
+int
+elzma_compress_stream_flush(elzma_compress_handle hand)
+{
+    if (hand == NULL || !pushStreamOpen(hand) ||
+        hand->push->pullStream != NULL)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+    if (hand->format != ELZMA_lzip) return ELZMA_E_UNSUPPORTED_FORMAT;
+
+    requestFlush(hand->push);
+    return pushWork(hand);
+}
+
+int
+elzma_compress_stream_finish(elzma_compress_handle hand)
+{
+    if (hand == NULL || !pushStreamOpen(hand) ||
+        hand->push->pullStream != NULL)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    hand->push->finishing = 1;
+    requestFlush(hand->push);
+    return pushWork(hand);
+}
+
+int
+elzma_compress_stream_continue(elzma_compress_handle hand)
+{
+    if (hand == NULL || hand->push == NULL) return ELZMA_E_BAD_PARAMS;
+    return pushWork(hand);
+}
+
+int
+elzma_compress_stream_fork(elzma_compress_handle dest,
+                           elzma_compress_handle src,
+                           elzma_write_callback outputStream,
+                           void * outputContext)
+{
+    struct elzmaPushStream * ps;
+    struct elzmaPushStream * destPs;
+    unsigned char * buf;
+    size_t bufAlloc, queued;
+    int rc;
+
+    if (dest == NULL || src == NULL || dest == src || outputStream == NULL ||
+        !pushStreamOpen(src) || src->push->finishing ||
+        src->push->pullStream != NULL)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+    ps = src->push;
+
+    /* dest takes src's configuration */
+    abandonPushStream(dest);
+    rc = elzma_compress_set_dictionary(dest, src->presetDict,
+                                       src->presetDictSize);
+    if (rc != ELZMA_E_OK) return rc;
+    dest->props = src->props;
+    dest->uncompressedSize = src->uncompressedSize;
+    dest->format = src->format;
+    dest->formatHandler = src->formatHandler;
+    dest->numThreads = src->numThreads;
+    dest->blockSize = src->blockSize;
+
+    if (dest->push == NULL) {
+        dest->push = dest->allocStruct.Alloc(&(dest->allocStruct),
+                                             sizeof(struct elzmaPushStream));
+        if (dest->push == NULL) return ELZMA_E_COMPRESS_ERROR;
+        memset((void *) dest->push, 0, sizeof(struct elzmaPushStream));
+    }
+    destPs = dest->push;
+
+    /* the input src's encoder hasn't read yet is queued for dest's */
+    queued = ps->bufLen - ps->bufPos;
+    destPs->bufPos = destPs->bufLen = 0;
+    rc = reserveQueue(dest, queued);
+    if (rc != ELZMA_E_OK) return rc;
+    buf = destPs->buf;
+    bufAlloc = destPs->bufAlloc;
+
+    *destPs = *ps;
+    destPs->buf = buf;
+    destPs->bufAlloc = bufAlloc;
+    destPs->bufPos = 0;
+    destPs->bufLen = queued;
+    if (queued > 0) {
+        memcpy((void *) buf, (void *) (ps->buf + ps->bufPos), queued);
+    }
+    destPs->outStream.outputStream = outputStream;
+    destPs->outStream.outputContext = outputContext;
+    destPs->deadline = 0;
+
+    if (ps->state == ELZMA_PUSH_MEMBER) {
+        CLzmaEncProps props = dest->props;
+
+        destPs->state = ELZMA_PUSH_NONE;
+        props.numThreads = 1;
+        rc = prepareEncoder(dest, &props);
+        if (rc != ELZMA_E_OK) return rc;
+        if (SZ_OK != LzmaEnc_Fork(dest->encHand, src->encHand,
+                                  (ISeqInStream *) destPs,
+                                  (ISeqOutStream *) &(destPs->outStream),
+                                  (ISzAlloc *) &(dest->allocStruct),
+                                  (ISzAlloc *) &(dest->allocStruct.big)))
+        {
+            return ELZMA_E_COMPRESS_ERROR;
+        }
+        destPs->state = ELZMA_PUSH_MEMBER;
+    }
+
+    return ELZMA_E_OK;
+}
+
+/* stepped compression is push mode compression which reads its input
+ * from a callback, one queue's worth ahead of the encoder */
+int
+elzma_compress_step_begin(elzma_compress_handle hand,
+                          elzma_read_callback inputStream,
+                          void * inputContext,
+                          elzma_write_callback outputStream,
+                          void * outputContext)
+{
+    int rc;
+
+    if (hand == NULL || inputStream == NULL) return ELZMA_E_BAD_PARAMS;
+
+    rc = elzma_compress_stream_begin(hand, outputStream, outputContext, 0);
+    if (rc == ELZMA_E_OK) {
+        hand->push->pullStream = inputStream;
+        hand->push->pullContext = inputContext;
+    }
+
+    return rc;
+}
+
+int
+elzma_compress_step(elzma_compress_handle hand, size_t workLimit,
+                    unsigned long timeLimit)
+{
+    struct elzmaPushStream * ps;
+    unsigned long long start;
+    int rc;
+
+    if (hand == NULL || hand->push == NULL ||
+        hand->push->pullStream == NULL)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+    ps = hand->push;
+    if (ps->state == ELZMA_PUSH_DONE) return ELZMA_E_OK;
+    if (!pushStreamOpen(hand)) return ELZMA_E_BAD_PARAMS;
+
+    start = ps->coded;
+    ps->deadline = (timeLimit > 0) ? handleNow(hand) + timeLimit : 0;
+
+    for (;;) {
+        if ((workLimit > 0 && ps->coded - start >= workLimit) ||
+            (ps->deadline != 0 && ps->coded > start &&
+             handleNow(hand) >= ps->deadline))
+        {
+            rc = ELZMA_E_AGAIN;
+            break;
+        }
+
+        if (!ps->finishing && ps->written - ps->read < ELZMA_STEP_READ_SIZE) {
+            size_t sz = ELZMA_STEP_READ_SIZE;
+            rc = reserveQueue(hand, sz);
+            if (rc == ELZMA_E_OK &&
+                0 != ps->pullStream(ps->pullContext, ps->buf + ps->bufLen,
+                                    &sz))
+            {
+                rc = ELZMA_E_INPUT_ERROR;
+            }
+            if (rc != ELZMA_E_OK) {
+                abandonPushStream(hand);
+                break;
+            }
+            ps->bufLen += sz;
+            ps->written += sz;
+            if (sz == 0) {
+                ps->finishing = 1;
+                requestFlush(ps);
+            }
+        }
+
+        ps->workLimit = (workLimit > 0) ?
+            workLimit - (size_t) (ps->coded - start) : 0;
+        rc = pushWork(hand);
+        /* stopped at a limit, failed, or done */
+        if (rc != ELZMA_E_OK || ps->state == ELZMA_PUSH_DONE) break;
+    }
+
+    ps->deadline = 0;
+    return rc;
+}
+
+unsigned long long
+elzma_compress_huge_page_bytes(elzma_compress_handle hand)
+{
+    unsigned long long bytes = 0;
+
+    if (hand == NULL) return 0;
+    if (hand->encHand) bytes += LzmaEnc_GetLargePageBytes(hand->encHand);
+    if (hand->enc2Hand) bytes += Lzma2Enc_GetLargePageBytes(hand->enc2Hand);
+
+    return bytes;
+}
+
 unsigned int
 elzma_get_dict_size(unsigned long long size)
 {
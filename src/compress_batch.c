@@ -0,0 +1,328 @@
+/*
+ * Written in 2009 by Lloyd Hilaiel
+ *
+ * License
+ *
+ * All the cruft you find here is public domain.  You don't have to credit
+ * anyone to use this code, but my personal request is that you mention
+ * Igor Pavlov for his hard, high quality work.
+ */
+
+#include "compress_batch.h"
+
+#include "pavlov/7zCrc.h"
+#include "pavlov/Threads.h"
+
+#include <string.h>
+
+/* polls the abort callback for the encoders */
+struct elzmaBatchProgress
+{
+    SRes (*Progress)(void *p, UInt64 inSize, UInt64 outSize);
+    elzma_abort_callback abortCallback;
+    void * abortContext;
+};
+
+static SRes batchProgress(void *p, UInt64 inSize, UInt64 outSize)
+{
+    struct elzmaBatchProgress * bp = (struct elzmaBatchProgress *) p;
+    return bp->abortCallback(bp->abortContext) ? SZ_ERROR_PROGRESS : SZ_OK;
+}
+
+/* per encoder state.  The worker threads wait on startEvent for a batch
+ * and signal doneEvent once there are no records left to claim. */
+struct elzmaBatchWorker
+{
+    CThread thread;
+    CAutoResetEvent startEvent;
+    CAutoResetEvent doneEvent;
+    struct elzmaBatchPool * pool;
+    CLzmaEncHandle encHand;
+    /* set by the calling thread to ask the worker to exit */
+    int stop;
+};
+
+struct elzmaBatchPool
+{
+    struct elzma_alloc_struct * allocStruct;
+    unsigned int numWorkers;
+    /* workers[0] is the calling thread's */
+    struct elzmaBatchWorker * workers;
+    CCriticalSection lock;
+    int lockCreated;
+
+    /* the batch being run, read only while it runs */
+    const CLzmaEncProps * props;
+    const struct elzma_format_handler * formatHandler;
+    elzma_abort_callback abortCallback;
+    void * abortContext;
+    ICompressProgress * progress;
+    const unsigned char * const * in;
+    const size_t * inLens;
+    unsigned char ** out;
+    size_t * outLens;
+
+    /* records [next, end) are yet to be claimed, end drops to the first
+     * record which failed.  guarded by lock */
+    unsigned int next;
+    unsigned int end;
+    int rc;
+};
+
+int
+elzmaEncodeBuffer(CLzmaEncHandle encHand, const CLzmaEncProps * props,
+                  const struct elzma_format_handler * formatHandler,
+                  struct elzma_alloc_struct * as,
+                  ICompressProgress * progress,
+                  const unsigned char * in, size_t inLen, size_t * inCoded,
+                  unsigned char * out, size_t * outLen)
+{
+    struct elzma_file_header h;
+    size_t hdrSize, ftrSize;
+    SizeT destLen, srcLen = inLen;
+    SRes r;
+
+    hdrSize = formatHandler->header_size;
+    ftrSize = (formatHandler->serialize_footer != NULL) ?
+        formatHandler->footer_size : 0;
+    if (*outLen < hdrSize + ftrSize) return ELZMA_E_OUTPUT_ERROR;
+
+    /* lzip members always end with a mark, lzma files which carry their
+     * size don't need one */
+    destLen = *outLen - hdrSize - ftrSize;
+    if (inCoded != NULL) {
+        r = LzmaEnc_MemEncodePart(encHand, out + hdrSize, &destLen, in,
+                                  &srcLen, (ftrSize > 0), progress,
+                                  (ISzAlloc *) as, (ISzAlloc *) &(as->big));
+    } else {
+        r = LzmaEnc_MemEncode(encHand, out + hdrSize, &destLen, in, inLen,
+                              (ftrSize > 0), progress, (ISzAlloc *) as,
+                              (ISzAlloc *) &(as->big));
+    }
+
+    if (r == SZ_ERROR_OUTPUT_EOF) return ELZMA_E_OUTPUT_ERROR;
+    if (r == SZ_ERROR_PROGRESS) return ELZMA_E_ABORTED;
+    if (r != SZ_OK) return ELZMA_E_COMPRESS_ERROR;
+
+    /* the header goes straight into the output buffer, once the size of
+     * the input coded is known */
+    formatHandler->init_header(&h);
+    h.pb = (unsigned char) props->pb;
+    h.lp = (unsigned char) props->lp;
+    h.lc = (unsigned char) props->lc;
+    h.dictSize = props->dictSize;
+    h.isStreamed = 0;
+    h.uncompressedSize = srcLen;
+    formatHandler->serialize_header(out, &h);
+
+    if (ftrSize > 0) {
+        struct elzma_file_footer ftr;
+        ftr.crc32 = CrcCalc(in, srcLen);
+        ftr.uncompressedSize = srcLen;
+        ftr.memberSize = hdrSize + destLen + ftrSize;
+        formatHandler->serialize_footer(&ftr, out + hdrSize + destLen);
+    }
+
+    *outLen = hdrSize + destLen + ftrSize;
+    if (inCoded != NULL) *inCoded = srcLen;
+
+    return ELZMA_E_OK;
+}
+
+/* claim and compress records until there are none left */
+static void
+batchWork(struct elzmaBatchWorker * w)
+{
+    struct elzmaBatchPool * pool = w->pool;
+
+    for (;;) {
+        unsigned int i;
+        int rc;
+
+        CriticalSection_Enter(&(pool->lock));
+        i = pool->next;
+        if (i < pool->end) pool->next++;
+        CriticalSection_Leave(&(pool->lock));
+        if (i >= pool->end) break;
+
+        if (pool->abortCallback &&
+            pool->abortCallback(pool->abortContext))
+        {
+            rc = ELZMA_E_ABORTED;
+        } else {
+            rc = elzmaEncodeBuffer(w->encHand, pool->props,
+                                   pool->formatHandler, pool->allocStruct,
+                                   pool->progress, pool->in[i],
+                                   pool->inLens[i], NULL, pool->out[i],
+                                   pool->outLens + i);
+        }
+
+        if (rc != ELZMA_E_OK) {
+            CriticalSection_Enter(&(pool->lock));
+            if (i < pool->end) {
+                pool->end = i;
+                pool->rc = rc;
+            }
+            CriticalSection_Leave(&(pool->lock));
+        }
+    }
+}
+
+static THREAD_FUNC_DECL
+batchThread(void * p)
+{
+    struct elzmaBatchWorker * w = (struct elzmaBatchWorker *) p;
+
+    for (;;) {
+        Event_Wait(&(w->startEvent));
+        if (w->stop) break;
+        batchWork(w);
+        Event_Set(&(w->doneEvent));
+    }
+
+    return 0;
+}
+
+struct elzmaBatchPool *
+elzmaBatchPoolCreate(unsigned int numThreads,
+                     struct elzma_alloc_struct * as)
+{
+    struct elzmaBatchPool * pool;
+    unsigned int i;
+
+    if (numThreads < 1) numThreads = 1;
+
+    pool = as->Alloc(as, sizeof(struct elzmaBatchPool));
+    if (pool == NULL) return NULL;
+    memset((void *) pool, 0, sizeof(struct elzmaBatchPool));
+    pool->allocStruct = as;
+
+    pool->workers = as->Alloc(as,
+                              numThreads * sizeof(struct elzmaBatchWorker));
+    if (pool->workers == NULL) {
+        as->Free(as, pool);
+        return NULL;
+    }
+    memset((void *) pool->workers, 0,
+           numThreads * sizeof(struct elzmaBatchWorker));
+
+    if (0 != CriticalSection_Init(&(pool->lock))) {
+        elzmaBatchPoolFree(pool);
+        return NULL;
+    }
+    pool->lockCreated = 1;
+
+    for (i = 0; i < numThreads; i++) {
+        struct elzmaBatchWorker * w = pool->workers + i;
+        pool->numWorkers++;
+        Thread_Construct(&(w->thread));
+        Event_Construct(&(w->startEvent));
+        Event_Construct(&(w->doneEvent));
+        w->pool = pool;
+        w->encHand = LzmaEnc_Create((ISzAlloc *) as);
+
+        if (w->encHand == NULL ||
+            (i > 0 &&
+             (0 != AutoResetEvent_CreateNotSignaled(&(w->startEvent)) ||
+              0 != AutoResetEvent_CreateNotSignaled(&(w->doneEvent)) ||
+              0 != Thread_Create(&(w->thread), batchThread, (void *) w))))
+        {
+            elzmaBatchPoolFree(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void
+elzmaBatchPoolFree(struct elzmaBatchPool * pool)
+{
+    struct elzma_alloc_struct * as;
+    unsigned int i;
+
+    if (pool == NULL) return;
+    as = pool->allocStruct;
+
+    for (i = 0; i < pool->numWorkers; i++) {
+        struct elzmaBatchWorker * w = pool->workers + i;
+        if (Thread_WasCreated(&(w->thread))) {
+            w->stop = 1;
+            Event_Set(&(w->startEvent));
+            Thread_Wait(&(w->thread));
+            Thread_Close(&(w->thread));
+        }
+        if (w->encHand) LzmaEnc_Destroy(w->encHand, (ISzAlloc *) as,
+                                        (ISzAlloc *) &(as->big));
+        if (Event_IsCreated(&(w->startEvent))) Event_Close(&(w->startEvent));
+        if (Event_IsCreated(&(w->doneEvent))) Event_Close(&(w->doneEvent));
+    }
+
+    if (pool->lockCreated) CriticalSection_Delete(&(pool->lock));
+    as->Free(as, pool->workers);
+    as->Free(as, pool);
+}
+
+unsigned int
+elzmaBatchPoolSize(const struct elzmaBatchPool * pool)
+{
+    return pool->numWorkers;
+}
+
+int
+elzmaBatchRun(struct elzmaBatchPool * pool,
+              const CLzmaEncProps * props,
+              const unsigned char * presetDict, size_t presetDictSize,
+              const struct elzma_format_handler * formatHandler,
+              elzma_abort_callback abortCallback, void * abortContext,
+              unsigned int count,
+              const unsigned char * const * in, const size_t * inLens,
+              unsigned char ** out, size_t * outLens)
+{
+    struct elzmaBatchProgress progress;
+    unsigned int i;
+
+    /* the encoders are idle between batches */
+    for (i = 0; i < pool->numWorkers; i++) {
+        CLzmaEncHandle encHand = pool->workers[i].encHand;
+        if (SZ_OK != LzmaEnc_SetProps(encHand, props) ||
+            SZ_OK != LzmaEnc_SetPresetDict(encHand, presetDict,
+                                           presetDictSize))
+        {
+            return ELZMA_E_BAD_PARAMS;
+        }
+    }
+
+    progress.Progress = batchProgress;
+    progress.abortCallback = abortCallback;
+    progress.abortContext = abortContext;
+
+    pool->props = props;
+    pool->formatHandler = formatHandler;
+    pool->abortCallback = abortCallback;
+    pool->abortContext = abortContext;
+    pool->progress = abortCallback ? (ICompressProgress *) &progress : NULL;
+    pool->in = in;
+    pool->inLens = inLens;
+    pool->out = out;
+    pool->outLens = outLens;
+    pool->next = 0;
+    pool->end = count;
+    pool->rc = ELZMA_E_OK;
+
+    /* records are claimed one at a time, so a few large ones don't hold
+     * up the rest */
+    for (i = 1; i < pool->numWorkers; i++) {
+        Event_Set(&(pool->workers[i].startEvent));
+    }
+    batchWork(pool->workers);
+    for (i = 1; i < pool->numWorkers; i++) {
+        Event_Wait(&(pool->workers[i].doneEvent));
+    }
+
+    if (pool->rc != ELZMA_E_OK) {
+        for (i = pool->end; i < count; i++) outLens[i] = 0;
+    }
+
+    return pool->rc;
+}
@@ -0,0 +1,62 @@
+/*
+ * Written in 2009 by Lloyd Hilaiel
+ *
+ * License
+ *
+ * All the cruft you find here is public domain.  You don't have to credit
+ * anyone to use this code, but my personal request is that you mention
+ * Igor Pavlov for his hard, high quality work.
+ *
+ * compress_batch.h - compression of many small independent buffers.  A
+ *                    pool of encoders is kept between batches, the first
+ *                    runs on the calling thread and each of the others on
+ *                    a worker thread of its own.
+ */
+
+#ifndef __ELZMA_COMPRESS_BATCH_H__
+#define __ELZMA_COMPRESS_BATCH_H__
+
+#include "common_internal.h"
+#include "pavlov/LzmaEnc.h"
+
+struct elzmaBatchPool;
+
+/* compress in into a complete lzma file or lzip member in out with an
+ * encoder whose properties are set, outLen is in/out as for
+ * elzma_compress_buffer.  When inCoded isn't NULL as much of in as fits
+ * is compressed, and *inCoded receives the amount.  The CRC table must
+ * have been generated. */
+int elzmaEncodeBuffer(CLzmaEncHandle encHand, const CLzmaEncProps * props,
+                      const struct elzma_format_handler * formatHandler,
+                      struct elzma_alloc_struct * as,
+                      ICompressProgress * progress,
+                      const unsigned char * in, size_t inLen,
+                      size_t * inCoded,
+                      unsigned char * out, size_t * outLen);
+
+/* allocate a pool of numThreads encoders and start its worker threads,
+ * returns NULL on failure */
+struct elzmaBatchPool * elzmaBatchPoolCreate(unsigned int numThreads,
+                                             struct elzma_alloc_struct * as);
+
+/* stop the worker threads and release the pool */
+void elzmaBatchPoolFree(struct elzmaBatchPool * pool);
+
+/* the number of encoders (and so threads, the caller's included) */
+unsigned int elzmaBatchPoolSize(const struct elzmaBatchPool * pool);
+
+/* compress count records as elzmaEncodeBuffer would, spread over the
+ * pool.  The abort callback is polled between records and as they're
+ * coded, from every thread.  On failure the error of the first record
+ * which failed is returned, and the sizes of it and all the records
+ * after it are zeroed. */
+int elzmaBatchRun(struct elzmaBatchPool * pool,
+                  const CLzmaEncProps * props,
+                  const unsigned char * presetDict, size_t presetDictSize,
+                  const struct elzma_format_handler * formatHandler,
+                  elzma_abort_callback abortCallback, void * abortContext,
+                  unsigned int count,
+                  const unsigned char * const * in, const size_t * inLens,
+                  unsigned char ** out, size_t * outLens);
+
+#endif
@@ -0,0 +1,470 @@
+/*
+ * Written in 2009 by Lloyd Hilaiel
+ *
+ * License
+ *
+ * All the cruft you find here is public domain.  You don't have to credit
+ * anyone to use this code, but my personal request is that you mention
+ * Igor Pavlov for his hard, high quality work.
+ */
+
+#include "compress_mt.h"
+#include "lzip_header.h"
+#include "xz_header.h"
+
+#include "pavlov/7zCrc.h"
+#include "pavlov/Threads.h"
+
+#include <string.h>
+
+/* polls the abort callback for the encoders, from the worker threads */
+struct elzmaWorkerProgress
+{
+    SRes (*Progress)(void *p, UInt64 inSize, UInt64 outSize);
+    elzma_abort_callback abortCallback;
+    void * abortContext;
+};
+
+static SRes workerProgress(void *p, UInt64 inSize, UInt64 outSize)
+{
+    struct elzmaWorkerProgress * wp = (struct elzmaWorkerProgress *) p;
+    return wp->abortCallback(wp->abortContext) ? SZ_ERROR_PROGRESS : SZ_OK;
+}
+
+/* per thread state.  The main thread hands a block to a worker by filling
+ * inBuf and signaling startEvent, the worker signals doneEvent when outBuf
+ * holds a complete lzip member or xz block. */
+struct elzmaWorker
+{
+    CThread thread;
+    CAutoResetEvent startEvent;
+    CAutoResetEvent doneEvent;
+
+    /* shared, read only during the run */
+    const CLzmaEncProps * props;
+    struct elzma_alloc_struct * allocStruct;
+    elzma_file_format format;
+    /* NULL without an abort callback */
+    ICompressProgress * progress;
+
+    CLzmaEncHandle encHand;
+    /* xz blocks are LZMA2 */
+    CLzma2EncHandle enc2Hand;
+    unsigned char dictProp;
+    int longRange;
+    unsigned long long unpaddedSize;
+
+    unsigned char * inBuf;
+    size_t inSize;
+
+    unsigned char * outBuf;
+    size_t outSize;
+    size_t outCap;
+
+    /* nonzero when a block has been handed to the worker and its output
+     * has not yet been written (only touched by the main thread) */
+    int busy;
+    /* set by the main thread to ask the worker to exit */
+    int stop;
+    SRes res;
+};
+
+/* compress the block in inBuf into a complete lzip member in outBuf */
+static SRes
+encodeMember(struct elzmaWorker * w)
+{
+    struct elzma_format_handler lzip;
+    struct elzma_file_header h;
+    struct elzma_file_footer ftr;
+    SizeT destLen;
+    SRes r;
+
+    initializeLZIPFormatHandler(&lzip);
+
+    lzip.init_header(&h);
+    h.pb = (unsigned char) w->props->pb;
+    h.lp = (unsigned char) w->props->lp;
+    h.lc = (unsigned char) w->props->lc;
+    h.dictSize = w->props->dictSize;
+    lzip.serialize_header(w->outBuf, &h);
+
+    destLen = w->outCap - lzip.header_size - lzip.footer_size;
+    r = LzmaEnc_MemEncode(w->encHand, w->outBuf + lzip.header_size,
+                          &destLen, w->inBuf, w->inSize, 1, w->progress,
+                          (ISzAlloc *) w->allocStruct,
+                          (ISzAlloc *) &(w->allocStruct->big));
+    if (r != SZ_OK) return r;
+
+    ftr.crc32 = CrcCalc(w->inBuf, w->inSize);
+    ftr.uncompressedSize = w->inSize;
+    ftr.memberSize = lzip.header_size + destLen + lzip.footer_size;
+    lzip.serialize_footer(&ftr, w->outBuf + lzip.header_size + destLen);
+
+    w->outSize = (size_t) ftr.memberSize;
+
+    return SZ_OK;
+}
+
+/* the LZMA2 encoder only has a streaming interface, these feed it from
+ * and to memory */
+struct elzmaMemInStream
+{
+    SRes (*ReadPtr)(void *p, void *buf, size_t *size);
+    const unsigned char * data;
+    size_t rem;
+};
+
+static SRes memReadFunc(void *p, void *buf, size_t *size)
+{
+    struct elzmaMemInStream * is = (struct elzmaMemInStream *) p;
+    if (*size > is->rem) *size = is->rem;
+    memcpy(buf, is->data, *size);
+    is->data += *size;
+    is->rem -= *size;
+    return SZ_OK;
+}
+
+struct elzmaMemOutStream
+{
+    size_t (*WritePtr)(void *p, const void *buf, size_t size);
+    unsigned char * data;
+    size_t rem;
+};
+
+static size_t memWriteFunc(void *p, const void *buf, size_t size)
+{
+    struct elzmaMemOutStream * os = (struct elzmaMemOutStream *) p;
+    if (size > os->rem) size = os->rem;
+    memcpy(os->data, buf, size);
+    os->data += size;
+    os->rem -= size;
+    return size;
+}
+
+/* compress the block in inBuf into a complete xz block in outBuf.  The
+ * data is encoded first, leaving room for the block header which records
+ * its sizes, so they're available to readers that seek */
+static SRes
+encodeXZBlock(struct elzmaWorker * w)
+{
+    struct elzma_xz_block_header bh;
+    struct elzma_xz_check check;
+    struct elzmaMemInStream is;
+    struct elzmaMemOutStream os;
+    unsigned char hdr[ELZMA_XZ_BLOCK_HEADER_SIZE_BOUND];
+    size_t compressed, pos;
+    unsigned int checkSize;
+    SRes r;
+
+    is.ReadPtr = memReadFunc;
+    is.data = w->inBuf;
+    is.rem = w->inSize;
+    os.WritePtr = memWriteFunc;
+    os.data = w->outBuf + ELZMA_XZ_BLOCK_HEADER_SIZE_BOUND;
+    os.rem = w->outCap - ELZMA_XZ_BLOCK_HEADER_SIZE_BOUND - 3 -
+        ELZMA_XZ_CHECK_SIZE_MAX;
+
+    r = Lzma2Enc_Encode(w->enc2Hand, (ISeqOutStream *) &os,
+                        (ISeqInStream *) &is, w->progress);
+    if (r != SZ_OK) return r;
+    compressed = os.data - (w->outBuf + ELZMA_XZ_BLOCK_HEADER_SIZE_BOUND);
+
+    bh.compressedSize = compressed;
+    bh.uncompressedSize = w->inSize;
+    bh.dictProp = w->dictProp;
+    bh.longRange = w->longRange;
+    elzmaXZSerializeBlockHeader(hdr, &bh);
+    memmove(w->outBuf + bh.headerSize,
+            w->outBuf + ELZMA_XZ_BLOCK_HEADER_SIZE_BOUND, compressed);
+    memcpy(w->outBuf, hdr, bh.headerSize);
+
+    pos = bh.headerSize + compressed;
+    while (pos & 3) w->outBuf[pos++] = 0;
+
+    elzmaXZCheckInit(&check, ELZMA_XZ_CHECK_CRC64);
+    elzmaXZCheckUpdate(&check, w->inBuf, w->inSize);
+    checkSize = elzmaXZCheckFinish(&check, w->outBuf + pos);
+
+    w->unpaddedSize = bh.headerSize + compressed + checkSize;
+    w->outSize = pos + checkSize;
+
+    return SZ_OK;
+}
+
+static THREAD_FUNC_DECL
+workerThread(void * p)
+{
+    struct elzmaWorker * w = (struct elzmaWorker *) p;
+
+    for (;;) {
+        Event_Wait(&(w->startEvent));
+        if (w->stop) break;
+        w->res = (w->format == ELZMA_xz) ? encodeXZBlock(w) : encodeMember(w);
+        Event_Set(&(w->doneEvent));
+    }
+
+    return 0;
+}
+
+/* read until buf is full or the input stream hits EOF */
+static int
+readBlock(elzma_read_callback inputStream, void * inputContext,
+          unsigned char * buf, size_t bufSize, size_t * amt, int * eof)
+{
+    *amt = 0;
+    while (*amt < bufSize) {
+        size_t sz = bufSize - *amt;
+        if (0 != inputStream(inputContext, buf + *amt, &sz)) {
+            return ELZMA_E_INPUT_ERROR;
+        }
+        if (sz == 0) {
+            *eof = 1;
+            break;
+        }
+        *amt += sz;
+    }
+    return ELZMA_E_OK;
+}
+
+static void
+destroyWorkers(struct elzmaWorker * workers, unsigned int numWorkers,
+               struct elzma_alloc_struct * as)
+{
+    unsigned int i;
+
+    /* first stop all threads, a worker may still be encoding if we're
+     * bailing out on an error */
+    for (i = 0; i < numWorkers; i++) {
+        struct elzmaWorker * w = workers + i;
+        if (Thread_WasCreated(&(w->thread))) {
+            w->stop = 1;
+            Event_Set(&(w->startEvent));
+            Thread_Wait(&(w->thread));
+            Thread_Close(&(w->thread));
+        }
+    }
+
+    for (i = 0; i < numWorkers; i++) {
+        struct elzmaWorker * w = workers + i;
+        if (w->encHand) {
+            LzmaEnc_Destroy(w->encHand, (ISzAlloc *) as,
+                            (ISzAlloc *) &(as->big));
+        }
+        if (w->enc2Hand) Lzma2Enc_Destroy(w->enc2Hand);
+        as->big.Free(&(as->big), w->inBuf);
+        as->Free(as, w->outBuf);
+        if (Event_IsCreated(&(w->startEvent))) Event_Close(&(w->startEvent));
+        if (Event_IsCreated(&(w->doneEvent))) Event_Close(&(w->doneEvent));
+    }
+
+    as->Free(as, workers);
+}
+
+int
+runParallelCompression(const CLzmaEncProps * props,
+                       elzma_file_format format,
+                       unsigned int numThreads,
+                       unsigned int blockSize,
+                       int longRange,
+                       struct elzma_alloc_struct * as,
+                       elzma_read_callback inputStream,
+                       void * inputContext,
+                       elzma_write_callback outputStream,
+                       void * outputContext,
+                       elzma_progress_callback progressCallback,
+                       void * progressContext,
+                       elzma_abort_callback abortCallback,
+                       void * abortContext,
+                       unsigned long long uncompressedSize)
+{
+    struct elzmaWorker * workers;
+    struct elzmaWorkerProgress progress;
+    CLzmaEncProps blockProps;
+    CLzma2EncProps blockProps2;
+    struct elzma_xz_index idx;
+    unsigned long long consumed = 0;
+    unsigned int membersStarted = 0;
+    unsigned int i;
+    int eof = 0;
+    int rc = ELZMA_E_OK;
+
+    if (numThreads < 1) numThreads = 1;
+
+    if (blockSize == 0) {
+        unsigned long long defaultSize =
+            (unsigned long long) props->dictSize *
+            ELZMA_MT_DEFAULT_BLOCK_FACTOR;
+        blockSize = (defaultSize > ELZMA_MT_MAX_DEFAULT_BLOCK_SIZE) ?
+            ELZMA_MT_MAX_DEFAULT_BLOCK_SIZE : (unsigned int) defaultSize;
+    }
+    if (blockSize < ELZMA_MT_MIN_BLOCK_SIZE) {
+        blockSize = ELZMA_MT_MIN_BLOCK_SIZE;
+    }
+
+    /* there's no point in a dictionary larger than a block, and a
+     * smaller dictionary keeps per thread memory usage down */
+    blockProps = *props;
+    blockProps.numThreads = 1;
+    blockProps.writeEndMark = 1;
+    blockProps.dictSize = ELZMA_MT_MIN_BLOCK_SIZE;
+    while (blockProps.dictSize < blockSize &&
+           blockProps.dictSize < ((unsigned int) 1 << 30))
+    {
+        blockProps.dictSize <<= 1;
+    }
+    if (blockProps.dictSize > props->dictSize) {
+        blockProps.dictSize = props->dictSize;
+    }
+
+    Lzma2EncProps_Init(&blockProps2);
+    blockProps2.lzmaProps = blockProps;
+
+    progress.Progress = workerProgress;
+    progress.abortCallback = abortCallback;
+    progress.abortContext = abortContext;
+
+    workers = as->Alloc(as, numThreads * sizeof(struct elzmaWorker));
+    if (workers == NULL) return ELZMA_E_COMPRESS_ERROR;
+    memset((void *) workers, 0, numThreads * sizeof(struct elzmaWorker));
+
+    for (i = 0; i < numThreads; i++) {
+        struct elzmaWorker * w = workers + i;
+        Thread_Construct(&(w->thread));
+        Event_Construct(&(w->startEvent));
+        Event_Construct(&(w->doneEvent));
+        w->props = &blockProps;
+        w->allocStruct = as;
+        w->format = format;
+        w->longRange = longRange;
+        w->progress = abortCallback ? (ICompressProgress *) &progress : NULL;
+        /* worst case LZMA expansion, plus lzip or xz framing */
+        w->outCap = blockSize + blockSize / 3 + 128 + 64 +
+            ELZMA_XZ_CHECK_SIZE_MAX;
+        /* lzip members are coded in place, with inBuf as the window */
+        w->inBuf = as->big.Alloc(&(as->big), blockSize);
+        w->outBuf = as->Alloc(as, w->outCap);
+        if (format == ELZMA_xz) {
+            w->enc2Hand = Lzma2Enc_Create((ISzAlloc *) as,
+                                          (ISzAlloc *) &(as->big));
+        } else {
+            w->encHand = LzmaEnc_Create((ISzAlloc *) as);
+        }
+
+        if (w->inBuf == NULL || w->outBuf == NULL ||
+            (w->encHand == NULL && w->enc2Hand == NULL))
+        {
+            rc = ELZMA_E_COMPRESS_ERROR;
+        } else if (w->encHand &&
+                   SZ_OK != LzmaEnc_SetProps(w->encHand, &blockProps))
+        {
+            rc = ELZMA_E_BAD_PARAMS;
+        } else if (w->enc2Hand &&
+                   SZ_OK != Lzma2Enc_SetProps(w->enc2Hand, &blockProps2))
+        {
+            rc = ELZMA_E_BAD_PARAMS;
+        } else if (0 != AutoResetEvent_CreateNotSignaled(&(w->startEvent)) ||
+                   0 != AutoResetEvent_CreateNotSignaled(&(w->doneEvent)) ||
+                   0 != Thread_Create(&(w->thread), workerThread,
+                                      (void *) w))
+        {
+            rc = ELZMA_E_COMPRESS_ERROR;
+        }
+
+        if (rc != ELZMA_E_OK) {
+            destroyWorkers(workers, numThreads, as);
+            return rc;
+        }
+        if (w->enc2Hand) w->dictProp = Lzma2Enc_WriteProperties(w->enc2Hand);
+    }
+
+    /* an xz stream starts with a header, the blocks are listed in the
+     * index which ends it */
+    elzmaXZIndexInit(&idx);
+    if (format == ELZMA_xz) {
+        struct elzma_format_handler xz;
+        struct elzma_file_header h;
+        unsigned char hdr[ELZMA_XZ_STREAM_HEADER_SIZE];
+        initializeXZFormatHandler(&xz);
+        xz.init_header(&h);
+        xz.serialize_header(hdr, &h);
+        if (outputStream(outputContext, hdr, xz.header_size) !=
+            xz.header_size)
+        {
+            destroyWorkers(workers, numThreads, as);
+            return ELZMA_E_OUTPUT_ERROR;
+        }
+    }
+
+    /* blocks are dispatched to workers round robin, and collected in the
+     * same order, so output order is independent of thread scheduling */
+    for (i = 0; ; i = (i + 1) % numThreads) {
+        struct elzmaWorker * w = workers + i;
+
+        if (w->busy) {
+            Event_Wait(&(w->doneEvent));
+            w->busy = 0;
+
+            if (w->res != SZ_OK) {
+                rc = (w->res == SZ_ERROR_PROGRESS) ? ELZMA_E_ABORTED
+                                                   : ELZMA_E_COMPRESS_ERROR;
+                break;
+            }
+            if (outputStream(outputContext, w->outBuf,
+                             w->outSize) != w->outSize)
+            {
+                rc = ELZMA_E_OUTPUT_ERROR;
+                break;
+            }
+            if (format == ELZMA_xz &&
+                elzmaXZIndexAppend(&idx, as, w->unpaddedSize, w->inSize))
+            {
+                rc = ELZMA_E_COMPRESS_ERROR;
+                break;
+            }
+
+            consumed += w->inSize;
+            if (progressCallback) {
+                progressCallback(progressContext, (size_t) consumed,
+                                 (size_t) uncompressedSize);
+            }
+            if (abortCallback && abortCallback(abortContext)) {
+                rc = ELZMA_E_ABORTED;
+                break;
+            }
+        }
+
+        if (!eof) {
+            rc = readBlock(inputStream, inputContext, w->inBuf, blockSize,
+                           &(w->inSize), &eof);
+            if (rc != ELZMA_E_OK) break;
+
+            /* empty input still yields a single (empty) lzip member,
+             * an xz stream may have no blocks */
+            if (w->inSize > 0 ||
+                (membersStarted == 0 && format != ELZMA_xz))
+            {
+                membersStarted++;
+                w->busy = 1;
+                Event_Set(&(w->startEvent));
+            }
+        } else {
+            /* once input is exhausted, we're done when all outstanding
+             * members have been written */
+            unsigned int j;
+            for (j = 0; j < numThreads; j++) {
+                if (workers[j].busy) break;
+            }
+            if (j == numThreads) break;
+        }
+    }
+
+    destroyWorkers(workers, numThreads, as);
+
+    if (rc == ELZMA_E_OK && format == ELZMA_xz) {
+        rc = elzmaXZWriteIndexAndFooter(&idx, ELZMA_XZ_CHECK_CRC64, as,
+                                        outputStream, outputContext);
+    }
+    elzmaXZIndexFree(&idx, as);
+
+    return rc;
+}
@@ -0,0 +1,55 @@
+/*
+ * Written in 2009 by Lloyd Hilaiel
+ *
+ * License
+ *
+ * All the cruft you find here is public domain.  You don't have to credit
+ * anyone to use this code, but my personal request is that you mention
+ * Igor Pavlov for his hard, high quality work.
+ *
+ * compress_mt.h - block parallel compression.  The input is split into
+ *                 fixed size blocks which are compressed independently
+ *                 on a set of worker threads and written in order as
+ *                 lzip members or xz blocks.
+ */
+
+#ifndef __ELZMA_COMPRESS_MT_H__
+#define __ELZMA_COMPRESS_MT_H__
+
+#include "common_internal.h"
+#include "pavlov/LzmaEnc.h"
+#include "pavlov/Lzma2Enc.h"
+
+/* the default block size is a multiple of the dictionary size, the same
+ * trade off plzip makes */
+#define ELZMA_MT_DEFAULT_BLOCK_FACTOR 2
+
+/* and is capped so that the multiply can't overflow a block size */
+#define ELZMA_MT_MAX_DEFAULT_BLOCK_SIZE 0xFFFFF000U
+
+/* the smallest block size we'll allow */
+#define ELZMA_MT_MIN_BLOCK_SIZE (1 << 12)
+
+/* compress the entirety of the input stream into a multi-member lzip
+ * stream or a multi-block xz stream.  Output depends only on the
+ * properties and block size, not on the number of threads or how they
+ * are scheduled.  The abort callback is polled by the workers as they
+ * code, and by the calling thread as blocks complete.  longRange marks xz
+ * blocks as holding long range filtered data. */
+int runParallelCompression(const CLzmaEncProps * props,
+                           elzma_file_format format,
+                           unsigned int numThreads,
+                           unsigned int blockSize,
+                           int longRange,
+                           struct elzma_alloc_struct * allocStruct,
+                           elzma_read_callback inputStream,
+                           void * inputContext,
+                           elzma_write_callback outputStream,
+                           void * outputContext,
+                           elzma_progress_callback progressCallback,
+                           void * progressContext,
+                           elzma_abort_callback abortCallback,
+                           void * abortContext,
+                           unsigned long long uncompressedSize);
+
+#endif
@@ -10,10 +10,16 @@
 
 #include "easylzma/decompress.h"
 #include "pavlov/LzmaDec.h"
+#include "pavlov/Lzma2Dec.h"
 #include "pavlov/7zCrc.h"
+#include "pavlov/XzCrc64.h"
+#include "pavlov/Alloc.h"
 #include "common_internal.h"
 #include "lzma_header.h"
 #include "lzip_header.h"
+#include "lzma2_header.h"
+#include "xz_header.h"
+#include "dedup.h"
 
 #include <string.h>
 #include <assert.h>
@@ -26,6 +32,23 @@ struct _elzma_decompress_handle {
     char inbuf[ELZMA_DECOMPRESS_INPUT_BUFSIZE];
     char outbuf[ELZMA_DECOMPRESS_OUTPUT_BUFSIZE];    
     struct elzma_alloc_struct allocStruct;
+
+    /* the range of inbuf which holds unconsumed input, and whether the
+     * input stream has reached EOF */
+    size_t inPos;
+    size_t inLen;
+    int inEOF;
+
+    /* a copy of the preset dictionary (lzma and lzip only) */
+    unsigned char * presetDict;
+    size_t presetDictSize;
+
+    /* set when the data is long range filtered */
+    elzma_read_back_callback readBack;
+    void * readBackContext;
+
+    /* the bytes of the last run's dictionary in huge pages */
+    unsigned long long hugePageBytes;
 };
 
 elzma_decompress_handle
@@ -51,26 +74,634 @@ void elzma_decompress_set_allocation_callbacks(
 }
 
 
+static void
+freePresetDict(elzma_decompress_handle hand)
+{
+    if (hand->presetDict) {
+        hand->allocStruct.Free(&(hand->allocStruct), hand->presetDict);
+    }
+    hand->presetDict = NULL;
+    hand->presetDictSize = 0;
+}
+
 void
 elzma_decompress_free(elzma_decompress_handle * hand)
 {
-    if (*hand) free(*hand);
+    if (*hand) {
+        freePresetDict(*hand);
+        free(*hand);
+    }
     *hand = NULL;
 }
 
+int
+elzma_decompress_set_dictionary(elzma_decompress_handle hand,
+                                const void * dict, size_t dictSize)
+{
+    if (hand == NULL || (dict == NULL && dictSize > 0) ||
+        dictSize > ELZMA_PRESET_DICT_SIZE_MAX)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    freePresetDict(hand);
+    if (dictSize > 0) {
+        hand->presetDict = (unsigned char *)
+            hand->allocStruct.Alloc(&(hand->allocStruct), dictSize);
+        if (hand->presetDict == NULL) return ELZMA_E_DECOMPRESS_ERROR;
+        memcpy((void *) hand->presetDict, dict, dictSize);
+        hand->presetDictSize = dictSize;
+    }
+
+    return ELZMA_E_OK;
+}
+
+int
+elzma_decompress_set_long_range(elzma_decompress_handle hand,
+                                elzma_read_back_callback readBack,
+                                void * readBackContext)
+{
+    if (hand == NULL) return ELZMA_E_BAD_PARAMS;
+
+    hand->readBack = readBack;
+    hand->readBackContext = readBackContext;
+
+    return ELZMA_E_OK;
+}
+
+unsigned long long
+elzma_decompress_huge_page_bytes(elzma_decompress_handle hand)
+{
+    return (hand != NULL) ? hand->hugePageBytes : 0;
+}
+
+/* ensure at least 'want' bytes of input are buffered, unless the input
+ * stream hits EOF first.  previously consumed bytes are discarded. */
+static int
+fillInput(elzma_decompress_handle hand,
+          elzma_read_callback inputStream, void * inputContext,
+          size_t want)
+{
+    assert(want <= ELZMA_DECOMPRESS_INPUT_BUFSIZE);
+
+    if (hand->inPos > 0) {
+        memmove((void *) hand->inbuf, (void *) (hand->inbuf + hand->inPos),
+                hand->inLen - hand->inPos);
+        hand->inLen -= hand->inPos;
+        hand->inPos = 0;
+    }
+
+    while (!hand->inEOF && hand->inLen < want) {
+        size_t sz = ELZMA_DECOMPRESS_INPUT_BUFSIZE - hand->inLen;
+        if (0 != inputStream(inputContext, hand->inbuf + hand->inLen, &sz)) {
+            return ELZMA_E_INPUT_ERROR;
+        }
+        if (sz == 0) hand->inEOF = 1;
+        hand->inLen += sz;
+    }
+
+    return ELZMA_E_OK;
+}
+
+/* the LzmaDec_Allocate call requires 5 bytes which have compression
+ * properties encoded in them.  In the case of lzip, the header format
+ * does not already contain what LzmaDec_Allocate expects, so we must
+ * craft it, silly */
+static void
+craftProps(const struct elzma_file_header * h, unsigned char * propsBuf)
+{
+    unsigned char hdrBuf[13];
+    struct elzma_format_handler lzmaHand;
+    initializeLZMAFormatHandler(&lzmaHand);
+    lzmaHand.serialize_header(hdrBuf, h);
+    memcpy((void *) propsBuf, (void *) hdrBuf, LZMA_PROPS_SIZE);
+}
+
+/* a dictionary never needs to be larger than the output, plus any
+ * preset dictionary before it.  Capping it there keeps the dictionary
+ * of a small input off the huge page path of the big allocator, whose
+ * mapping and first huge page fault cost far more than decoding it */
+static void
+capDictSize(unsigned char * propsBuf, unsigned long long size)
+{
+    unsigned long long dictSize =
+        (unsigned long long) propsBuf[1] |
+        ((unsigned long long) propsBuf[2] << 8) |
+        ((unsigned long long) propsBuf[3] << 16) |
+        ((unsigned long long) propsBuf[4] << 24);
+    if (size < (1 << 12)) size = 1 << 12;
+    if (size < dictSize) {
+        propsBuf[1] = (unsigned char) size;
+        propsBuf[2] = (unsigned char) (size >> 8);
+        propsBuf[3] = (unsigned char) (size >> 16);
+        propsBuf[4] = (unsigned char) (size >> 24);
+    }
+}
+
+/* the same for an LZMA2 dictionary property, which steps through sizes
+ * of 2 and 3 times powers of two */
+static unsigned char
+capDictProp(unsigned char prop, unsigned long long size)
+{
+    while (prop > 0 && prop <= 40 &&
+           ((unsigned long long) (2 | ((prop - 1) & 1)) <<
+            ((prop - 1) / 2 + 11)) >= size)
+    {
+        prop--;
+    }
+    return prop;
+}
+
+/* note how much of a decoder's dictionary is in huge pages, before it's
+ * released at the end of a run.  LargePageBytes only reads that from the
+ * system for a dictionary of a huge page or more, which costs less than
+ * faulting in the dictionary did */
+static void
+noteHugePages(elzma_decompress_handle hand, const CLzmaDec * dec)
+{
+    hand->hugePageBytes = (dec->dic != NULL) ?
+        LargePageBytes(dec->dic, dec->dicBufSize) : 0;
+}
+
+/* LZMA2 streams are a single member without a footer, they carry their
+ * own end marker and the decoder keeps its state between chunks */
+static int
+decompressLzma2(elzma_decompress_handle hand,
+                elzma_read_callback inputStream, void * inputContext,
+                elzma_write_callback outputStream, void * outputContext)
+{
+    CLzma2Dec dec;
+    struct elzma_format_handler formatHandler;
+    struct elzma_file_header h;
+    int errorCode;
+
+    initializeLZMA2FormatHandler(&formatHandler);
+    formatHandler.init_header(&h);
+
+    errorCode = fillInput(hand, inputStream, inputContext,
+                          formatHandler.header_size);
+    if (errorCode != ELZMA_E_OK) return errorCode;
+    if (hand->inLen - hand->inPos < formatHandler.header_size) {
+        return ELZMA_E_INPUT_ERROR;
+    }
+    if (0 != formatHandler.parse_header(
+            (unsigned char *) hand->inbuf + hand->inPos, &h))
+    {
+        return ELZMA_E_CORRUPT_HEADER;
+    }
+
+    Lzma2Dec_Construct(&dec);
+    if (SZ_OK != Lzma2Dec_Allocate(&dec, (Byte) hand->inbuf[hand->inPos],
+                                   (ISzAlloc *) &(hand->allocStruct.big)))
+    {
+        return ELZMA_E_DECOMPRESS_ERROR;
+    }
+    hand->inPos += formatHandler.header_size;
+    Lzma2Dec_Init(&dec);
+
+    for (;;)
+    {
+        size_t dstLen = ELZMA_DECOMPRESS_OUTPUT_BUFSIZE;
+        size_t srcLen;
+        ELzmaStatus stat = LZMA_STATUS_NOT_SPECIFIED;
+        SRes r;
+
+        if (hand->inPos == hand->inLen) {
+            errorCode = fillInput(hand, inputStream, inputContext, 1);
+            if (errorCode != ELZMA_E_OK) break;
+
+            /* handle the case where the input prematurely finishes */
+            if (hand->inLen == 0) {
+                errorCode = ELZMA_E_INSUFFICIENT_INPUT;
+                break;
+            }
+        }
+
+        srcLen = hand->inLen - hand->inPos;
+        r = Lzma2Dec_DecodeToBuf(&dec, (Byte *) hand->outbuf, &dstLen,
+                                 (Byte *) hand->inbuf + hand->inPos,
+                                 &srcLen, LZMA_FINISH_ANY, &stat);
+        hand->inPos += srcLen;
+
+        if (r != SZ_OK) {
+            errorCode = ELZMA_E_DECOMPRESS_ERROR;
+            break;
+        }
+
+        if (dstLen > 0 &&
+            outputStream(outputContext, hand->outbuf, dstLen) != dstLen)
+        {
+            errorCode = ELZMA_E_OUTPUT_ERROR;
+            break;
+        }
+
+        if (stat == LZMA_STATUS_FINISHED_WITH_MARK) break;
+    }
+
+    noteHugePages(hand, &(dec.decoder));
+    Lzma2Dec_Free(&dec, (ISzAlloc *) &(hand->allocStruct.big));
+
+    return errorCode;
+}
+
+/* copy exactly size bytes of input into buf, for the small structures
+ * which surround xz blocks */
+static int
+readInput(elzma_decompress_handle hand,
+          elzma_read_callback inputStream, void * inputContext,
+          unsigned char * buf, size_t size)
+{
+    while (size > 0) {
+        size_t n;
+        if (hand->inPos == hand->inLen) {
+            int errorCode = fillInput(hand, inputStream, inputContext, 1);
+            if (errorCode != ELZMA_E_OK) return errorCode;
+            if (hand->inLen == 0) return ELZMA_E_INSUFFICIENT_INPUT;
+        }
+        n = hand->inLen - hand->inPos;
+        if (n > size) n = size;
+        memcpy((void *) buf, (void *) (hand->inbuf + hand->inPos), n);
+        hand->inPos += n;
+        buf += n;
+        size -= n;
+    }
+    return ELZMA_E_OK;
+}
+
+/* read one multibyte integer of an xz index, updating the index's crc32
+ * and size */
+static int
+readXZVarint(elzma_decompress_handle hand,
+             elzma_read_callback inputStream, void * inputContext,
+             unsigned long long * num, unsigned int * crc32,
+             unsigned long long * size)
+{
+    unsigned char buf[ELZMA_XZ_VARINT_MAX_BYTES];
+    unsigned int i;
+
+    for (i = 0; i < ELZMA_XZ_VARINT_MAX_BYTES; i++) {
+        int errorCode = readInput(hand, inputStream, inputContext,
+                                  buf + i, 1);
+        if (errorCode != ELZMA_E_OK) return errorCode;
+        if (!(buf[i] & 0x80)) break;
+    }
+    if (i == ELZMA_XZ_VARINT_MAX_BYTES ||
+        elzmaXZDecodeVarint(buf, i + 1, num) != i + 1)
+    {
+        return ELZMA_E_CORRUPT_HEADER;
+    }
+    *crc32 = CrcUpdate(*crc32, buf, i + 1);
+    *size += i + 1;
+    return ELZMA_E_OK;
+}
+
+/* read the index which follows a stream's blocks (its indicator byte has
+ * been consumed already) and compare it with the blocks we decoded.  The
+ * index may be larger than our input buffer so it's checked as it's
+ * read. */
+static int
+readXZIndex(elzma_decompress_handle hand,
+            elzma_read_callback inputStream, void * inputContext,
+            const struct elzma_xz_index * idx,
+            unsigned long long * indexSize)
+{
+    unsigned int crc32 = CrcUpdate(CRC_INIT_VAL, "", 1);
+    unsigned long long size = 1, n, i;
+    unsigned char buf[4];
+    unsigned int pad;
+    int errorCode;
+
+    errorCode = readXZVarint(hand, inputStream, inputContext,
+                             &n, &crc32, &size);
+    if (errorCode != ELZMA_E_OK) return errorCode;
+    if (n != idx->numRecords) return ELZMA_E_SIZE_MISMATCH;
+
+    for (i = 0; i < n; i++) {
+        unsigned long long unpadded, uncompressed;
+        errorCode = readXZVarint(hand, inputStream, inputContext,
+                                 &unpadded, &crc32, &size);
+        if (errorCode != ELZMA_E_OK) return errorCode;
+        errorCode = readXZVarint(hand, inputStream, inputContext,
+                                 &uncompressed, &crc32, &size);
+        if (errorCode != ELZMA_E_OK) return errorCode;
+        if (unpadded != idx->records[i].unpaddedSize ||
+            uncompressed != idx->records[i].uncompressedSize)
+        {
+            return ELZMA_E_SIZE_MISMATCH;
+        }
+    }
+
+    pad = elzmaXZPadding(size);
+    errorCode = readInput(hand, inputStream, inputContext, buf, pad);
+    if (errorCode != ELZMA_E_OK) return errorCode;
+    for (i = 0; i < pad; i++) {
+        if (buf[i] != 0) return ELZMA_E_CORRUPT_HEADER;
+    }
+    crc32 = CrcUpdate(crc32, buf, pad);
+    size += pad;
+
+    errorCode = readInput(hand, inputStream, inputContext, buf, 4);
+    if (errorCode != ELZMA_E_OK) return errorCode;
+    crc32 = CRC_GET_DIGEST(crc32);
+    if (buf[0] != (crc32 & 0xFF) || buf[1] != ((crc32 >> 8) & 0xFF) ||
+        buf[2] != ((crc32 >> 16) & 0xFF) || buf[3] != (crc32 >> 24))
+    {
+        return ELZMA_E_CORRUPT_HEADER;
+    }
+
+    *indexSize = size + 4;
+    return ELZMA_E_OK;
+}
+
+/* decode one xz block whose header has been parsed, through to the end
+ * of its check.  The block's record is appended to idx. */
+static int
+decompressXZBlock(elzma_decompress_handle hand,
+                  elzma_read_callback inputStream, void * inputContext,
+                  elzma_write_callback outputStream, void * outputContext,
+                  CLzma2Dec * dec, const struct elzma_xz_block_header * bh,
+                  unsigned int checkType, struct elzma_xz_index * idx)
+{
+    unsigned long long compressed = 0, uncompressed = 0;
+    unsigned char stored[ELZMA_XZ_CHECK_SIZE_MAX];
+    unsigned char computed[ELZMA_XZ_CHECK_SIZE_MAX];
+    struct elzma_xz_check check;
+    unsigned int checkSize, pad, i;
+    int errorCode;
+
+    if (SZ_OK != Lzma2Dec_Allocate(dec,
+                                   (bh->uncompressedSize ==
+                                    ELZMA_XZ_SIZE_UNKNOWN) ? bh->dictProp :
+                                   capDictProp(bh->dictProp,
+                                               bh->uncompressedSize),
+                                   (ISzAlloc *) &(hand->allocStruct.big)))
+    {
+        return ELZMA_E_DECOMPRESS_ERROR;
+    }
+    Lzma2Dec_Init(dec);
+    elzmaXZCheckInit(&check, checkType);
+
+    for (;;)
+    {
+        size_t dstLen = ELZMA_DECOMPRESS_OUTPUT_BUFSIZE;
+        size_t srcLen;
+        ELzmaStatus stat = LZMA_STATUS_NOT_SPECIFIED;
+        SRes r;
+
+        if (hand->inPos == hand->inLen) {
+            errorCode = fillInput(hand, inputStream, inputContext, 1);
+            if (errorCode != ELZMA_E_OK) return errorCode;
+            if (hand->inLen == 0) return ELZMA_E_INSUFFICIENT_INPUT;
+        }
+
+        srcLen = hand->inLen - hand->inPos;
+        r = Lzma2Dec_DecodeToBuf(dec, (Byte *) hand->outbuf, &dstLen,
+                                 (Byte *) hand->inbuf + hand->inPos,
+                                 &srcLen, LZMA_FINISH_ANY, &stat);
+        hand->inPos += srcLen;
+        compressed += srcLen;
+        uncompressed += dstLen;
+
+        if (r != SZ_OK) return ELZMA_E_DECOMPRESS_ERROR;
+
+        /* don't run past sizes the block header promises */
+        if (compressed > bh->compressedSize) {
+            return ELZMA_E_DECOMPRESS_ERROR;
+        } else if (uncompressed > bh->uncompressedSize) {
+            return ELZMA_E_SIZE_MISMATCH;
+        }
+
+        if (dstLen > 0) {
+            elzmaXZCheckUpdate(&check, hand->outbuf, dstLen);
+            if (outputStream(outputContext, hand->outbuf, dstLen) != dstLen) {
+                return ELZMA_E_OUTPUT_ERROR;
+            }
+        }
+
+        if (stat == LZMA_STATUS_FINISHED_WITH_MARK) break;
+    }
+
+    if (bh->compressedSize != ELZMA_XZ_SIZE_UNKNOWN &&
+        bh->compressedSize != compressed)
+    {
+        return ELZMA_E_DECOMPRESS_ERROR;
+    } else if (bh->uncompressedSize != ELZMA_XZ_SIZE_UNKNOWN &&
+               bh->uncompressedSize != uncompressed)
+    {
+        return ELZMA_E_SIZE_MISMATCH;
+    }
+
+    /* the block padding, then the check */
+    pad = elzmaXZPadding(compressed);
+    errorCode = readInput(hand, inputStream, inputContext, stored, pad);
+    if (errorCode != ELZMA_E_OK) return errorCode;
+    for (i = 0; i < pad; i++) {
+        if (stored[i] != 0) return ELZMA_E_DECOMPRESS_ERROR;
+    }
+
+    checkSize = elzmaXZCheckSize(checkType);
+    errorCode = readInput(hand, inputStream, inputContext, stored,
+                          checkSize);
+    if (errorCode != ELZMA_E_OK) return errorCode;
+    elzmaXZCheckFinish(&check, computed);
+    if ((checkType == ELZMA_XZ_CHECK_CRC32 ||
+         checkType == ELZMA_XZ_CHECK_CRC64) &&
+        memcmp((void *) stored, (void *) computed, checkSize) != 0)
+    {
+        return ELZMA_E_CRC32_MISMATCH;
+    }
+
+    if (elzmaXZIndexAppend(idx, &(hand->allocStruct),
+                           bh->headerSize + compressed + checkSize,
+                           uncompressed))
+    {
+        return ELZMA_E_DECOMPRESS_ERROR;
+    }
+
+    return ELZMA_E_OK;
+}
+
+/* output which counts what passes through it, so that a long range
+ * filtered stream knows how much output precedes it */
+struct elzmaCountedOutput
+{
+    elzma_write_callback outputStream;
+    void * outputContext;
+    unsigned long long size;
+};
+
+static size_t
+countedWriteFunc(void * ctx, const void * buf, size_t size)
+{
+    struct elzmaCountedOutput * co = (struct elzmaCountedOutput *) ctx;
+    size_t written = co->outputStream(co->outputContext, buf, size);
+    co->size += written;
+    return written;
+}
+
+/* xz files are one or more streams, optionally separated by zero
+ * padding in multiples of four bytes.  Each stream's blocks are decoded
+ * in order and then checked against its index and footer.  When the
+ * block headers list the long range filter, which they must all do or
+ * none may, the stream's data goes through the filter's decoder. */
+static int
+decompressXZ(elzma_decompress_handle hand,
+             elzma_read_callback inputStream, void * inputContext,
+             elzma_write_callback outputStream, void * outputContext)
+{
+    struct elzma_format_handler formatHandler;
+    struct elzma_xz_index idx;
+    struct elzmaCountedOutput out;
+    struct elzmaDedupDecoder * dedup = NULL;
+    CLzma2Dec dec;
+    unsigned char buf[ELZMA_XZ_BLOCK_HEADER_SIZE_MAX];
+    int firstStream = 1;
+    int errorCode = ELZMA_E_OK;
+
+    out.outputStream = outputStream;
+    out.outputContext = outputContext;
+    out.size = 0;
+
+    initializeXZFormatHandler(&formatHandler);
+    Lzma2Dec_Construct(&dec);
+    elzmaXZIndexInit(&idx);
+
+    for (;;)
+    {
+        struct elzma_file_header h;
+        struct elzma_file_footer f;
+        unsigned long long indexSize;
+
+        errorCode = fillInput(hand, inputStream, inputContext,
+                              formatHandler.header_size);
+        if (errorCode != ELZMA_E_OK) break;
+
+        /* skip stream padding */
+        if (!firstStream) {
+            while (hand->inLen - hand->inPos >= 4 &&
+                   0 == memcmp((void *) (hand->inbuf + hand->inPos),
+                               "\0\0\0\0", 4))
+            {
+                hand->inPos += 4;
+                errorCode = fillInput(hand, inputStream, inputContext,
+                                      formatHandler.header_size);
+                if (errorCode != ELZMA_E_OK) goto decompressEnd;
+            }
+        }
+
+        formatHandler.init_header(&h);
+
+        if (hand->inLen - hand->inPos < formatHandler.header_size ||
+            0 != formatHandler.parse_header(
+                (unsigned char *) hand->inbuf + hand->inPos, &h))
+        {
+            /* after the first stream, anything that isn't a stream
+             * header is trailing garbage which we ignore. */
+            if (!firstStream) break;
+
+            if (hand->inLen - hand->inPos < formatHandler.header_size) {
+                errorCode = ELZMA_E_INPUT_ERROR;
+            } else {
+                errorCode = ELZMA_E_CORRUPT_HEADER;
+            }
+            break;
+        }
+        hand->inPos += formatHandler.header_size;
+        idx.numRecords = 0;
+
+        /* blocks, up to the index indicator */
+        for (;;)
+        {
+            struct elzma_xz_block_header bh;
+
+            errorCode = readInput(hand, inputStream, inputContext, buf, 1);
+            if (errorCode != ELZMA_E_OK) goto decompressEnd;
+            if (buf[0] == 0) break;
+
+            errorCode = readInput(hand, inputStream, inputContext, buf + 1,
+                                  ((size_t) buf[0] + 1) * 4 - 1);
+            if (errorCode != ELZMA_E_OK) goto decompressEnd;
+            errorCode = elzmaXZParseBlockHeader(buf, &bh);
+            if (errorCode != ELZMA_E_OK) goto decompressEnd;
+
+            if (idx.numRecords == 0 && bh.longRange) {
+                if (hand->readBack == NULL) {
+                    errorCode = ELZMA_E_LONG_RANGE;
+                    goto decompressEnd;
+                }
+                dedup = elzmaDedupDecoderCreate(countedWriteFunc,
+                                                (void *) &out,
+                                                hand->readBack,
+                                                hand->readBackContext,
+                                                out.size,
+                                                &(hand->allocStruct));
+                if (dedup == NULL) {
+                    errorCode = ELZMA_E_DECOMPRESS_ERROR;
+                    goto decompressEnd;
+                }
+            } else if ((dedup != NULL) != (bh.longRange != 0)) {
+                errorCode = ELZMA_E_CORRUPT_HEADER;
+                goto decompressEnd;
+            }
+
+            if (dedup != NULL) {
+                errorCode = decompressXZBlock(hand, inputStream,
+                                              inputContext, elzmaDedupWrite,
+                                              (void *) dedup, &dec, &bh,
+                                              h.checkType, &idx);
+            } else {
+                errorCode = decompressXZBlock(hand, inputStream,
+                                              inputContext, countedWriteFunc,
+                                              (void *) &out, &dec, &bh,
+                                              h.checkType, &idx);
+            }
+            if (errorCode != ELZMA_E_OK) goto decompressEnd;
+        }
+
+        errorCode = readXZIndex(hand, inputStream, inputContext, &idx,
+                                &indexSize);
+        if (errorCode != ELZMA_E_OK) break;
+
+        errorCode = readInput(hand, inputStream, inputContext, buf,
+                              formatHandler.footer_size);
+        if (errorCode != ELZMA_E_OK) break;
+        if (0 != formatHandler.parse_footer(buf, &f) ||
+            f.indexSize != indexSize || f.checkType != h.checkType)
+        {
+            errorCode = ELZMA_E_CORRUPT_HEADER;
+            break;
+        }
+
+        if (dedup != NULL) {
+            errorCode = elzmaDedupDecoderFinish(dedup, errorCode);
+            dedup = NULL;
+            if (errorCode != ELZMA_E_OK) break;
+        }
+
+        firstStream = 0;
+    }
+
+  decompressEnd:
+    if (dedup != NULL) errorCode = elzmaDedupDecoderFinish(dedup, errorCode);
+    noteHugePages(hand, &(dec.decoder));
+    Lzma2Dec_Free(&dec, (ISzAlloc *) &(hand->allocStruct.big));
+    elzmaXZIndexFree(&idx, &(hand->allocStruct));
+
+    return errorCode;
+}
+
 int
 elzma_decompress_run(elzma_decompress_handle hand,
                      elzma_read_callback inputStream, void * inputContext,
                      elzma_write_callback outputStream, void * outputContext,
                      elzma_file_format format)
 {
-    unsigned long long int totalRead = 0; /* total amount read from stream */
-    unsigned int crc32 = CRC_INIT_VAL; /* running crc32 (lzip case) */     
     CLzmaDec dec;
-    unsigned int errorCode = ELZMA_E_OK;
+    int errorCode = ELZMA_E_OK;
+    int firstMember = 1;
     struct elzma_format_handler formatHandler;
-    struct elzma_file_header h;
-    struct elzma_file_footer f;
+
+    if (hand == NULL) return ELZMA_E_BAD_PARAMS;
 
     /* switch between supported formats */ 
     if (format == ELZMA_lzma) {
@@ -78,95 +709,114 @@ elzma_decompress_run(elzma_decompress_handle hand,
     } else if (format == ELZMA_lzip) {
         CrcGenerateTable();        
         initializeLZIPFormatHandler(&formatHandler);
-    } else {
+    } else if (format != ELZMA_lzma2 && format != ELZMA_xz) {
         return ELZMA_E_BAD_PARAMS;        
     }
 
-    /* initialize footer */
-    f.crc32 = 0;
-    f.uncompressedSize = 0;
-    
+    hand->inPos = hand->inLen = 0;
+    hand->inEOF = 0;
+
+    /* LZMA2 chunks start from an empty dictionary */
+    if (hand->presetDictSize > 0 &&
+        (format == ELZMA_lzma2 || format == ELZMA_xz))
+    {
+        return ELZMA_E_UNSUPPORTED_FORMAT;
+    }
+
+    if (format == ELZMA_lzma2) {
+        return decompressLzma2(hand, inputStream, inputContext,
+                               outputStream, outputContext);
+    } else if (format == ELZMA_xz) {
+        return decompressXZ(hand, inputStream, inputContext,
+                            outputStream, outputContext);
+    }
+
     /* initialize decoder memory */
     memset((void *) &dec, 0, sizeof(dec));
     LzmaDec_Init(&dec);
 
-    /* decode the header. */
+    /* lzip files may consist of several concatenated members, each with
+     * its own header and footer.  We decode members until the input is
+     * exhausted. */
+    for (;;)
     {
-        unsigned char * hdr = 
-            hand->allocStruct.Alloc(&(hand->allocStruct),
-                                    formatHandler.header_size);
+        unsigned long long int totalRead = 0; /* amount decoded in member */
+        unsigned int crc32 = CRC_INIT_VAL; /* running crc32 (lzip case) */     
+        unsigned int footerSize = formatHandler.footer_size;
+        struct elzma_file_header h;
+        struct elzma_file_footer f;
 
-        size_t sz = formatHandler.header_size;
+        /* decode the header. */
+        errorCode = fillInput(hand, inputStream, inputContext,
+                              formatHandler.header_size);
+        if (errorCode != ELZMA_E_OK) break;
 
         formatHandler.init_header(&h);        
 
-        if (inputStream(inputContext, hdr, &sz) != 0 ||
-            sz != formatHandler.header_size)
+        if (hand->inLen - hand->inPos < formatHandler.header_size ||
+            0 != formatHandler.parse_header(
+                (unsigned char *) hand->inbuf + hand->inPos, &h))
         {
-            hand->allocStruct.Free(&(hand->allocStruct), hdr);
-            return ELZMA_E_INPUT_ERROR;
-        }
+            /* after the first member, anything that isn't a member
+             * header is trailing garbage which we ignore. */
+            if (!firstMember) break;
 
-        if (0 != formatHandler.parse_header(hdr, &h)) {
-            hand->allocStruct.Free(&(hand->allocStruct), hdr);
-            return ELZMA_E_CORRUPT_HEADER;
+            if (hand->inLen - hand->inPos < formatHandler.header_size) {
+                errorCode = ELZMA_E_INPUT_ERROR;
+            } else {
+                errorCode = ELZMA_E_CORRUPT_HEADER;
+            }
+            break;
         }
+        hand->inPos += formatHandler.header_size;
 
-        /* the LzmaDec_Allocate call requires 5 bytes which have
-         * compression properties encoded in them.  In the case of
-         * lzip, the header format does not already contain what
-         * LzmaDec_Allocate expects, so we must craft it, silly */
         {
-            unsigned char propsBuf[13];
-            const unsigned char * propsPtr = hdr;            
-
-            if (format == ELZMA_lzip) {
-                struct elzma_format_handler lzmaHand;
-                initializeLZMAFormatHandler(&lzmaHand);
-                lzmaHand.serialize_header(propsBuf, &h);
-                propsPtr = propsBuf;
+            unsigned char propsBuf[LZMA_PROPS_SIZE];
+            craftProps(&h, propsBuf);
+            if (!h.isStreamed && h.uncompressedSize >> 32 == 0) {
+                capDictSize(propsBuf,
+                            h.uncompressedSize + hand->presetDictSize);
             }
 
-            /* now we're ready to allocate the decoder */
-            LzmaDec_Allocate(&dec, propsPtr, 5,
-                             (ISzAlloc *) &(hand->allocStruct));
+            /* now we're ready to allocate the decoder, (a no-op when
+             * subsequent members share properties) */
+            if (SZ_OK != LzmaDec_Allocate(
+                    &dec, propsBuf, LZMA_PROPS_SIZE,
+                    (ISzAlloc *) &(hand->allocStruct.big)))
+            {
+                errorCode = ELZMA_E_DECOMPRESS_ERROR;
+                break;
+            }
+            LzmaDec_Init(&dec);
+            LzmaDec_SetPresetDict(&dec, hand->presetDict,
+                                  hand->presetDictSize);
         }
-        
-        hand->allocStruct.Free(&(hand->allocStruct), hdr);
-    }
 
-    /* perform the decoding */
-    for (;;)
-    {
-        size_t dstLen = ELZMA_DECOMPRESS_OUTPUT_BUFSIZE;
-        size_t srcLen = ELZMA_DECOMPRESS_INPUT_BUFSIZE;
-        size_t amt = 0;
-        size_t bufOff = 0;
-		ELzmaStatus stat;
-
-        if (0 != inputStream(inputContext, hand->inbuf, &srcLen))
+        /* perform the decoding */
+        for (;;)
         {
-            errorCode = ELZMA_E_INPUT_ERROR;
-            goto decompressEnd;                    
-        }
+            size_t dstLen = ELZMA_DECOMPRESS_OUTPUT_BUFSIZE;
+            size_t srcLen;
+            ELzmaStatus stat = LZMA_STATUS_NOT_SPECIFIED;
+            SRes r;
 
-        /* handle the case where the input prematurely finishes */
-        if (srcLen == 0) {
-            errorCode = ELZMA_E_INSUFFICIENT_INPUT;
-            goto decompressEnd;
-        }
-        
-        amt = srcLen;
+            if (hand->inPos == hand->inLen) {
+                errorCode = fillInput(hand, inputStream, inputContext, 1);
+                if (errorCode != ELZMA_E_OK) goto decompressEnd;
 
-        /* handle the case where a single read buffer of compressed bytes
-         * will translate into multiple buffers of uncompressed bytes,
-         * with this inner loop */
-        stat = LZMA_STATUS_NOT_SPECIFIED;
+                /* handle the case where the input prematurely finishes */
+                if (hand->inLen == 0) {
+                    errorCode = ELZMA_E_INSUFFICIENT_INPUT;
+                    goto decompressEnd;
+                }
+            }
 
-        while (bufOff < srcLen) {
-            SRes r = LzmaDec_DecodeToBuf(&dec, (Byte *) hand->outbuf, &dstLen,
-                                         ((Byte *) hand->inbuf + bufOff), &amt,
-                                         LZMA_FINISH_ANY, &stat);
+            srcLen = hand->inLen - hand->inPos;
+            r = LzmaDec_DecodeToBuf(&dec, (Byte *) hand->outbuf, &dstLen,
+                                    (Byte *) hand->inbuf + hand->inPos,
+                                    &srcLen, LZMA_FINISH_ANY, &stat);
+            hand->inPos += srcLen;
+            assert(hand->inPos <= hand->inLen);
 
             /* XXX deal with result code more granularly*/
             if (r != SZ_OK) {
@@ -175,13 +825,12 @@ elzma_decompress_run(elzma_decompress_handle hand,
             }
             
             /* write what we've read */
-            {
+            if (dstLen > 0) {
                 size_t wt;
                 
                 /* if decoding lzip, update our crc32 value */
-                if (format == ELZMA_lzip && dstLen > 0) {
+                if (footerSize > 0) {
                     crc32 = CrcUpdate(crc32, hand->outbuf, dstLen);
-
                 }
                 totalRead += dstLen;
                 
@@ -191,64 +840,511 @@ elzma_decompress_run(elzma_decompress_handle hand,
                     goto decompressEnd;                    
                 }
             }
-            
-            /* do we have more data on the input buffer? */
-            bufOff += amt;
-            assert( bufOff <= srcLen );
-            if (bufOff >= srcLen) break;
-            amt = srcLen - bufOff;
-
-            /* with lzip, we will have the footer left on the buffer! */
-            if (stat == LZMA_STATUS_FINISHED_WITH_MARK) {
-                break;
-            }
+
+            /* with lzip, the footer follows the end mark */
+            if (stat == LZMA_STATUS_FINISHED_WITH_MARK) break;
+
+            /* for LZMA utils,  we don't always have a finished mark */
+            if (!h.isStreamed && totalRead >= h.uncompressedSize) break;
         }
 
-        /* now check status */
-        if (stat == LZMA_STATUS_FINISHED_WITH_MARK) {
-            /* read a footer if one is expected and
-             * present */ 
-            if (formatHandler.footer_size > 0 &&
-                amt >= formatHandler.footer_size &&
-                formatHandler.parse_footer != NULL)
-            {
-                formatHandler.parse_footer(
-                    (unsigned char *) hand->inbuf + bufOff, &f);
+        /* formats without a footer contain exactly one member, all that's
+         * left to do is compare the size in the header (if present) with
+         * how much we actually read */
+        if (footerSize == 0 || formatHandler.parse_footer == NULL) {
+            if (!h.isStreamed && h.uncompressedSize != totalRead) {
+                errorCode = ELZMA_E_SIZE_MISMATCH;
             }
-
             break;
         }
-        /* for LZMA utils,  we don't always have a finished mark */
-        if (!h.isStreamed && totalRead >= h.uncompressedSize) {
+
+        /* read the footer and check that the calculated crc32 matches
+         * the encoded crc32, and that the sizes match */
+        if (format == ELZMA_lzip && h.version == 0) {
+            footerSize = ELZMA_LZIP_V0_FOOTER_SIZE;
+        }
+        errorCode = fillInput(hand, inputStream, inputContext, footerSize);
+        if (errorCode != ELZMA_E_OK) break;
+        if (hand->inLen - hand->inPos < footerSize) {
+            errorCode = ELZMA_E_INSUFFICIENT_INPUT;
             break;
         }
-    }
+        formatHandler.parse_footer(
+            (unsigned char *) hand->inbuf + hand->inPos, &f);
+        hand->inPos += footerSize;
 
-    /* finish the calculated crc32 */
-    crc32 ^= 0xFFFFFFFF;
+        /* finish the calculated crc32 */
+        crc32 ^= 0xFFFFFFFF;
 
-    /* if we have a footer, check that the calculated crc32 matches
-     * the encoded crc32, and that the sizes match */
-    if (formatHandler.footer_size)
-    {
         if (f.crc32 != crc32) {
             errorCode = ELZMA_E_CRC32_MISMATCH;
+            break;
         } else if (f.uncompressedSize != totalRead) {
             errorCode = ELZMA_E_SIZE_MISMATCH;            
+            break;
         }
+
+        firstMember = 0;
     }
-    else if (!h.isStreamed)
+
+  decompressEnd:
+    noteHugePages(hand, &dec);
+    LzmaDec_Free(&dec, (ISzAlloc *) &(hand->allocStruct.big));
+
+    return errorCode;
+}
+
+/* locate the stream which ends at inLen (after any stream padding) and
+ * append its blocks to the list in reverse order.  Returns the offset
+ * at which the stream begins in *streamStart. */
+static int
+readXZStreamIndex(elzma_decompress_handle hand,
+                  const unsigned char * in, size_t inLen,
+                  elzma_xz_block ** blocks, unsigned int * numBlocks,
+                  unsigned int * allocated, size_t * streamStart)
+{
+    struct elzma_format_handler formatHandler;
+    struct elzma_file_header h;
+    struct elzma_file_footer f;
+    struct elzma_xz_index idx;
+    unsigned long long blocksSize = 0;
+    size_t indexStart, end;
+    unsigned int i;
+    int errorCode;
+
+    initializeXZFormatHandler(&formatHandler);
+
+    if (inLen < formatHandler.header_size + formatHandler.footer_size) {
+        return ELZMA_E_INSUFFICIENT_INPUT;
+    }
+    if (0 != formatHandler.parse_footer(in + inLen - formatHandler.footer_size,
+                                        &f) ||
+        f.indexSize > inLen - formatHandler.footer_size -
+                      formatHandler.header_size)
     {
-        /* if the format does not support a footer and has an uncompressed
-         * size in the header, let's compare that with how much we actually
-         * read */
-        if (h.uncompressedSize != totalRead) {
-            errorCode = ELZMA_E_SIZE_MISMATCH;
+        return ELZMA_E_CORRUPT_HEADER;
+    }
+    indexStart = inLen - formatHandler.footer_size - (size_t) f.indexSize;
+
+    elzmaXZIndexInit(&idx);
+    errorCode = elzmaXZParseIndex(in + indexStart, (size_t) f.indexSize,
+                                  &idx, &(hand->allocStruct));
+    if (errorCode != ELZMA_E_OK) goto readStreamEnd;
+
+    /* every block must fit in what's left before the index, which also
+     * keeps the sum from wrapping */
+    for (i = 0; i < idx.numRecords; i++) {
+        unsigned long long avail =
+            indexStart - formatHandler.header_size - blocksSize;
+        unsigned long long unpadded = idx.records[i].unpaddedSize;
+        if (unpadded > avail ||
+            elzmaXZPadding(unpadded) > avail - unpadded)
+        {
+            errorCode = ELZMA_E_CORRUPT_HEADER;
+            goto readStreamEnd;
         }
+        blocksSize += unpadded + elzmaXZPadding(unpadded);
     }
 
-  decompressEnd:
-    LzmaDec_Free(&dec, (ISzAlloc *) &(hand->allocStruct));
+    formatHandler.init_header(&h);
+    if (0 != formatHandler.parse_header(
+            in + indexStart - (size_t) blocksSize - formatHandler.header_size,
+            &h) ||
+        h.checkType != f.checkType)
+    {
+        errorCode = ELZMA_E_CORRUPT_HEADER;
+        goto readStreamEnd;
+    }
+    *streamStart = indexStart - (size_t) blocksSize -
+                   formatHandler.header_size;
+
+    /* walking backwards from the index, the last block comes first */
+    end = indexStart;
+    for (i = idx.numRecords; i > 0; i--) {
+        const struct elzma_xz_index_record * rec = idx.records + i - 1;
+        elzma_xz_block * b;
+
+        if (*numBlocks == *allocated) {
+            unsigned int n = *allocated ? *allocated * 2 : 16;
+            elzma_xz_block * nb = (elzma_xz_block *)
+                hand->allocStruct.Alloc(&(hand->allocStruct),
+                                        n * sizeof(elzma_xz_block));
+            if (nb == NULL) {
+                errorCode = ELZMA_E_DECOMPRESS_ERROR;
+                goto readStreamEnd;
+            }
+            if (*blocks) {
+                memcpy((void *) nb, (void *) *blocks,
+                       *numBlocks * sizeof(elzma_xz_block));
+                hand->allocStruct.Free(&(hand->allocStruct), *blocks);
+            }
+            *blocks = nb;
+            *allocated = n;
+        }
+
+        b = *blocks + (*numBlocks)++;
+        b->compressedSize = rec->unpaddedSize +
+                            elzmaXZPadding(rec->unpaddedSize);
+        end -= (size_t) b->compressedSize;
+        b->compressedOffset = end;
+        b->uncompressedSize = rec->uncompressedSize;
+        b->checkType = h.checkType;
+    }
+
+  readStreamEnd:
+    elzmaXZIndexFree(&idx, &(hand->allocStruct));
+    return errorCode;
+}
+
+int
+elzma_xz_read_index(elzma_decompress_handle hand,
+                    const unsigned char * in, size_t inLen,
+                    elzma_xz_block ** blocks, unsigned int * numBlocks)
+{
+    unsigned int allocated = 0, i;
+    unsigned long long uncompressedOffset = 0;
+    int errorCode = ELZMA_E_OK;
+
+    if (hand == NULL || blocks == NULL || numBlocks == NULL ||
+        (in == NULL && inLen > 0))
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    *blocks = NULL;
+    *numBlocks = 0;
+
+    /* streams are found from the end of the file, each footer leads to
+     * its index and from there to its stream header */
+    do {
+        size_t streamStart;
+
+        while (inLen >= 4 && 0 == memcmp((void *) (in + inLen - 4),
+                                         "\0\0\0\0", 4))
+        {
+            inLen -= 4;
+        }
+
+        errorCode = readXZStreamIndex(hand, in, inLen, blocks, numBlocks,
+                                      &allocated, &streamStart);
+        if (errorCode != ELZMA_E_OK) break;
+        inLen = streamStart;
+    } while (inLen > 0);
+
+    if (errorCode != ELZMA_E_OK) {
+        elzma_xz_free_index(hand, *blocks);
+        *blocks = NULL;
+        *numBlocks = 0;
+        return errorCode;
+    }
+
+    /* put the blocks in file order and assign their output offsets */
+    for (i = 0; i < *numBlocks / 2; i++) {
+        elzma_xz_block tmp = (*blocks)[i];
+        (*blocks)[i] = (*blocks)[*numBlocks - 1 - i];
+        (*blocks)[*numBlocks - 1 - i] = tmp;
+    }
+    for (i = 0; i < *numBlocks; i++) {
+        (*blocks)[i].uncompressedOffset = uncompressedOffset;
+        uncompressedOffset += (*blocks)[i].uncompressedSize;
+    }
+
+    return ELZMA_E_OK;
+}
+
+void
+elzma_xz_free_index(elzma_decompress_handle hand, elzma_xz_block * blocks)
+{
+    if (hand && blocks) hand->allocStruct.Free(&(hand->allocStruct), blocks);
+}
+
+int
+elzma_xz_decompress_block(elzma_decompress_handle hand,
+                          const elzma_xz_block * block,
+                          const unsigned char * in, size_t inLen,
+                          unsigned char * out, size_t * outLen)
+{
+    struct elzma_xz_block_header bh;
+    struct elzma_xz_check check;
+    unsigned char computed[ELZMA_XZ_CHECK_SIZE_MAX];
+    unsigned int checkSize, i;
+    ELzmaStatus stat = LZMA_STATUS_NOT_SPECIFIED;
+    SizeT dstLen, srcLen;
+    size_t pos;
+    int errorCode;
+    SRes r;
+
+    if (hand == NULL || block == NULL || outLen == NULL ||
+        (in == NULL && inLen > 0) || (out == NULL && *outLen > 0) ||
+        hand->readBack != NULL)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    CrcGenerateTable();
+    Crc64GenerateTable();
+
+    if (inLen < block->compressedSize) return ELZMA_E_INSUFFICIENT_INPUT;
+    inLen = (size_t) block->compressedSize;
+    if (block->uncompressedSize > *outLen) return ELZMA_E_OUTPUT_ERROR;
+
+    checkSize = elzmaXZCheckSize(block->checkType);
+    if (inLen < 4 || ((size_t) in[0] + 1) * 4 + checkSize > inLen) {
+        return ELZMA_E_CORRUPT_HEADER;
+    }
+    errorCode = elzmaXZParseBlockHeader(in, &bh);
+    if (errorCode != ELZMA_E_OK) return errorCode;
+    /* the long range filter's state spans the stream */
+    if (bh.longRange) return ELZMA_E_LONG_RANGE;
+    if (bh.uncompressedSize != ELZMA_XZ_SIZE_UNKNOWN &&
+        bh.uncompressedSize != block->uncompressedSize)
+    {
+        return ELZMA_E_SIZE_MISMATCH;
+    }
+
+    /* the index gives the output size, and the data must end exactly
+     * there */
+    dstLen = (SizeT) block->uncompressedSize;
+    srcLen = inLen - bh.headerSize - checkSize;
+    r = Lzma2Decode(out, &dstLen, in + bh.headerSize, &srcLen, bh.dictProp,
+                    LZMA_FINISH_END, &stat,
+                    (ISzAlloc *) &(hand->allocStruct));
+    if (r == SZ_ERROR_INPUT_EOF) return ELZMA_E_INSUFFICIENT_INPUT;
+    if (r != SZ_OK || stat != LZMA_STATUS_FINISHED_WITH_MARK) {
+        return ELZMA_E_DECOMPRESS_ERROR;
+    }
+    if (dstLen != block->uncompressedSize) return ELZMA_E_SIZE_MISMATCH;
+    if (bh.compressedSize != ELZMA_XZ_SIZE_UNKNOWN &&
+        bh.compressedSize != srcLen)
+    {
+        return ELZMA_E_DECOMPRESS_ERROR;
+    }
+
+    /* what's between the data and the check must be the padding */
+    pos = bh.headerSize + srcLen;
+    if (inLen - checkSize - pos != elzmaXZPadding(srcLen)) {
+        return ELZMA_E_DECOMPRESS_ERROR;
+    }
+    for (i = 0; pos + i < inLen - checkSize; i++) {
+        if (in[pos + i] != 0) return ELZMA_E_DECOMPRESS_ERROR;
+    }
+
+    elzmaXZCheckInit(&check, block->checkType);
+    elzmaXZCheckUpdate(&check, out, dstLen);
+    elzmaXZCheckFinish(&check, computed);
+    if ((block->checkType == ELZMA_XZ_CHECK_CRC32 ||
+         block->checkType == ELZMA_XZ_CHECK_CRC64) &&
+        memcmp((void *) (in + inLen - checkSize), (void *) computed,
+               checkSize) != 0)
+    {
+        return ELZMA_E_CRC32_MISMATCH;
+    }
+
+    *outLen = dstLen;
+
+    return ELZMA_E_OK;
+}
+
+/* xz files are located through their indexes, then each block is
+ * decoded straight into its place in the output */
+static int
+decompressXZBuffer(elzma_decompress_handle hand,
+                   const unsigned char * in, size_t inLen,
+                   unsigned char * out, size_t * outLen)
+{
+    elzma_xz_block * blocks;
+    unsigned int numBlocks, i;
+    unsigned long long total;
+    int errorCode;
+
+    errorCode = elzma_xz_read_index(hand, in, inLen, &blocks, &numBlocks);
+    if (errorCode != ELZMA_E_OK) return errorCode;
+
+    total = numBlocks ? blocks[numBlocks - 1].uncompressedOffset +
+                        blocks[numBlocks - 1].uncompressedSize : 0;
+    if (total > *outLen) errorCode = ELZMA_E_OUTPUT_ERROR;
+
+    for (i = 0; errorCode == ELZMA_E_OK && i < numBlocks; i++) {
+        size_t len = (size_t) blocks[i].uncompressedSize;
+        errorCode = elzma_xz_decompress_block(
+            hand, blocks + i, in + blocks[i].compressedOffset,
+            (size_t) blocks[i].compressedSize,
+            out + blocks[i].uncompressedOffset, &len);
+    }
+
+    elzma_xz_free_index(hand, blocks);
+    if (errorCode == ELZMA_E_OK) *outLen = (size_t) total;
 
     return errorCode;
 }
+
+/* LzmaDecode, but through the decoder's own dictionary buffer, which is
+ * primed with the preset dictionary */
+static SRes
+lzmaDecodeWithDict(elzma_decompress_handle hand,
+                   Byte * dest, SizeT * destLen,
+                   const Byte * src, SizeT * srcLen,
+                   const Byte * propData, ELzmaFinishMode finishMode,
+                   ELzmaStatus * status)
+{
+    CLzmaDec dec;
+    SRes r;
+
+    LzmaDec_Construct(&dec);
+    r = LzmaDec_Allocate(&dec, propData, LZMA_PROPS_SIZE,
+                         (ISzAlloc *) &(hand->allocStruct.big));
+    if (r != SZ_OK) return r;
+    LzmaDec_Init(&dec);
+    LzmaDec_SetPresetDict(&dec, hand->presetDict, hand->presetDictSize);
+
+    r = LzmaDec_DecodeToBuf(&dec, dest, destLen, src, srcLen, finishMode,
+                            status);
+    if (r == SZ_OK && *status == LZMA_STATUS_NEEDS_MORE_INPUT) {
+        r = SZ_ERROR_INPUT_EOF;
+    }
+    LzmaDec_Free(&dec, (ISzAlloc *) &(hand->allocStruct.big));
+
+    return r;
+}
+
+int
+elzma_decompress_buffer(elzma_decompress_handle hand,
+                        const unsigned char * in, size_t inLen,
+                        unsigned char * out, size_t * outLen,
+                        elzma_file_format format)
+{
+    struct elzma_format_handler formatHandler;
+    size_t inPos = 0;
+    size_t outPos = 0;
+    int firstMember = 1;
+
+    if (hand == NULL || outLen == NULL || (in == NULL && inLen > 0) ||
+        (out == NULL && *outLen > 0) || hand->readBack != NULL)
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    /* switch between supported formats */ 
+    if (format == ELZMA_lzma) {
+        initializeLZMAFormatHandler(&formatHandler);
+    } else if (format == ELZMA_lzip) {
+        CrcGenerateTable();        
+        initializeLZIPFormatHandler(&formatHandler);
+    } else if (format == ELZMA_lzma2) {
+        initializeLZMA2FormatHandler(&formatHandler);
+    } else if (format == ELZMA_xz) {
+        if (hand->presetDictSize > 0) return ELZMA_E_UNSUPPORTED_FORMAT;
+        return decompressXZBuffer(hand, in, inLen, out, outLen);
+    } else {
+        return ELZMA_E_BAD_PARAMS;        
+    }
+
+    /* LZMA2 chunks start from an empty dictionary */
+    if (hand->presetDictSize > 0 && format == ELZMA_lzma2) {
+        return ELZMA_E_UNSUPPORTED_FORMAT;
+    }
+
+    /* each lzip member is decoded into the output right after the
+     * previous one */
+    for (;;)
+    {
+        unsigned int footerSize = formatHandler.footer_size;
+        unsigned char propsBuf[LZMA_PROPS_SIZE];
+        struct elzma_file_header h;
+        struct elzma_file_footer f;
+        ELzmaStatus stat = LZMA_STATUS_NOT_SPECIFIED;
+        SizeT dstLen, srcLen;
+        SRes r;
+
+        formatHandler.init_header(&h);
+
+        if (inLen - inPos < formatHandler.header_size ||
+            0 != formatHandler.parse_header(in + inPos, &h))
+        {
+            /* after the first member, anything that isn't a member
+             * header is trailing garbage which we ignore. */
+            if (!firstMember) break;
+
+            if (inLen - inPos < formatHandler.header_size) {
+                return ELZMA_E_INSUFFICIENT_INPUT;
+            }
+            return ELZMA_E_CORRUPT_HEADER;
+        }
+        inPos += formatHandler.header_size;
+
+        /* when the size is known we decode exactly that much, otherwise
+         * until the end mark, which FINISH_END looks for even once the
+         * output is full */
+        dstLen = *outLen - outPos;
+        if (!h.isStreamed) {
+            if (h.uncompressedSize > dstLen) return ELZMA_E_OUTPUT_ERROR;
+            dstLen = (SizeT) h.uncompressedSize;
+        }
+
+        srcLen = inLen - inPos;
+        if (format == ELZMA_lzma2) {
+            r = Lzma2Decode(out + outPos, &dstLen, in + inPos, &srcLen,
+                            in[inPos - formatHandler.header_size],
+                            LZMA_FINISH_END, &stat,
+                            (ISzAlloc *) &(hand->allocStruct));
+        } else if (hand->presetDictSize > 0) {
+            craftProps(&h, propsBuf);
+            r = lzmaDecodeWithDict(hand, out + outPos, &dstLen, in + inPos,
+                                   &srcLen, propsBuf,
+                                   h.isStreamed ? LZMA_FINISH_END
+                                                : LZMA_FINISH_ANY,
+                                   &stat);
+        } else {
+            craftProps(&h, propsBuf);
+            r = LzmaDecode(out + outPos, &dstLen, in + inPos, &srcLen,
+                           propsBuf, LZMA_PROPS_SIZE,
+                           h.isStreamed ? LZMA_FINISH_END : LZMA_FINISH_ANY,
+                           &stat, (ISzAlloc *) &(hand->allocStruct));
+        }
+        inPos += srcLen;
+
+        if (r == SZ_ERROR_INPUT_EOF) return ELZMA_E_INSUFFICIENT_INPUT;
+        /* with a full output, data where the end mark should be means
+         * the output was too small */
+        if (r == SZ_ERROR_DATA && h.isStreamed &&
+            dstLen == *outLen - outPos)
+        {
+            return ELZMA_E_OUTPUT_ERROR;
+        }
+        if (r != SZ_OK) return ELZMA_E_DECOMPRESS_ERROR;
+
+        if (h.isStreamed) {
+            /* the output filled up before the end mark */
+            if (stat != LZMA_STATUS_FINISHED_WITH_MARK) {
+                return ELZMA_E_OUTPUT_ERROR;
+            }
+        } else if (h.uncompressedSize != dstLen) {
+            return ELZMA_E_SIZE_MISMATCH;
+        }
+
+        outPos += dstLen;
+
+        /* formats without a footer contain exactly one member */
+        if (footerSize == 0 || formatHandler.parse_footer == NULL) break;
+
+        /* check the footer's crc32 and size against what we decoded */
+        if (format == ELZMA_lzip && h.version == 0) {
+            footerSize = ELZMA_LZIP_V0_FOOTER_SIZE;
+        }
+        if (inLen - inPos < footerSize) return ELZMA_E_INSUFFICIENT_INPUT;
+        formatHandler.parse_footer(in + inPos, &f);
+        inPos += footerSize;
+
+        if (f.crc32 != CrcCalc(out + outPos - dstLen, dstLen)) {
+            return ELZMA_E_CRC32_MISMATCH;
+        } else if (f.uncompressedSize != dstLen) {
+            return ELZMA_E_SIZE_MISMATCH;
+        }
+
+        firstMember = 0;
+    }
+
+    *outLen = outPos;
+
+    return ELZMA_E_OK;
+}
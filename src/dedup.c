@@ -0,0 +1,568 @@
+/*
+ * Written in 2009 by Lloyd Hilaiel
+ *
+ * License
+ *
+ * All the cruft you find here is public domain.  You don't have to credit
+ * anyone to use this code, but my personal request is that you mention
+ * Igor Pavlov for his hard, high quality work.
+ */
+
+#include "dedup.h"
+
+#include "pavlov/7zCrc.h"
+#include "pavlov/XzCrc64.h"
+
+#include <string.h>
+
+static const unsigned char elzmaDedupMagic[5] = { 'E', 'L', 'D', 'D', 1 };
+
+#define ELZMA_DEDUP_READ_SIZE (1024 * 64)
+#define ELZMA_DEDUP_COPY_SIZE (1024 * 64)
+#define ELZMA_DEDUP_TABLE_MIN (1 << 12)
+
+/* room for the records around a chunk of literal data */
+#define ELZMA_DEDUP_OUT_SLACK 64
+
+/* a chunk's first occurrence.  Chunks are told apart by 128 bits of
+ * fingerprint, a CRC64 and a multiplicative hash, and the decoder checks
+ * a CRC32 of the result. */
+struct elzmaDedupChunk
+{
+    UInt64 fpA;
+    UInt64 fpB;
+    UInt64 offset;
+    /* zero for an empty slot */
+    UInt32 len;
+};
+
+struct elzmaDedupEncoder
+{
+    elzma_read_callback inputStream;
+    void * inputContext;
+    struct elzma_alloc_struct * as;
+
+    /* chunking: a cut is made where the top bits of the rolling hash
+     * are clear, between minChunk and maxChunk bytes in */
+    UInt32 gear[256];
+    UInt32 cutMask;
+    size_t minChunk;
+    size_t maxChunk;
+
+    unsigned char * inBuf;
+    size_t inPos;
+    size_t inLen;
+    int eof;
+
+    /* the chunk just gathered, and its offset in the input */
+    unsigned char * chunk;
+    size_t chunkLen;
+    UInt64 pos;
+    UInt32 crc;
+
+    /* open addressed, at most half full */
+    struct elzmaDedupChunk * table;
+    size_t tableSize;
+    size_t tableUsed;
+
+    /* a reference which may still grow, matchLen is zero when there's
+     * none */
+    UInt64 matchOffset;
+    UInt64 matchLen;
+
+    /* filtered output waiting to be read */
+    unsigned char * out;
+    size_t outPos;
+    size_t outLen;
+    int finished;
+};
+
+static void
+putVarint(struct elzmaDedupEncoder * enc, UInt64 num)
+{
+    while (num >= 0x80) {
+        enc->out[enc->outLen++] = (unsigned char) (num | 0x80);
+        num >>= 7;
+    }
+    enc->out[enc->outLen++] = (unsigned char) num;
+}
+
+static void
+flushMatch(struct elzmaDedupEncoder * enc)
+{
+    if (enc->matchLen > 0) {
+        /* the copy lands at pos - matchLen */
+        putVarint(enc, (enc->matchLen << 1) | 1);
+        putVarint(enc, enc->pos - enc->matchLen - enc->matchOffset);
+        enc->matchLen = 0;
+    }
+}
+
+static void
+fingerprint(const unsigned char * p, size_t len, UInt64 * fpA, UInt64 * fpB)
+{
+    UInt64 h = len;
+    size_t i;
+
+    *fpA = Crc64Update(CRC64_INIT_VAL, p, len);
+
+    for (i = 0; i + 4 <= len; i += 4) {
+        UInt32 w = p[i] | (p[i + 1] << 8) | (p[i + 2] << 16) |
+                   ((UInt32) p[i + 3] << 24);
+        h = (h ^ w) * UINT64_CONST(0x9E3779B97F4A7C15);
+        h ^= h >> 32;
+    }
+    for (; i < len; i++) {
+        h = (h ^ p[i]) * UINT64_CONST(0x9E3779B97F4A7C15);
+        h ^= h >> 32;
+    }
+    *fpB = h;
+}
+
+/* the slot holding the chunk, or the empty one where it belongs */
+static struct elzmaDedupChunk *
+findChunk(struct elzmaDedupChunk * table, size_t tableSize,
+          UInt64 fpA, UInt64 fpB, UInt32 len)
+{
+    size_t i = (size_t) fpA & (tableSize - 1);
+    while (table[i].len != 0) {
+        if (table[i].fpA == fpA && table[i].fpB == fpB &&
+            table[i].len == len)
+        {
+            break;
+        }
+        i = (i + 1) & (tableSize - 1);
+    }
+    return table + i;
+}
+
+/* double the table, leaving it as is when out of memory */
+static void
+growTable(struct elzmaDedupEncoder * enc)
+{
+    size_t newSize = enc->tableSize * 2, i;
+    struct elzmaDedupChunk * newTable;
+
+    if (newSize * sizeof(struct elzmaDedupChunk) / newSize !=
+        sizeof(struct elzmaDedupChunk))
+    {
+        return;
+    }
+    newTable = enc->as->Alloc(enc->as,
+                              newSize * sizeof(struct elzmaDedupChunk));
+    if (newTable == NULL) return;
+    memset((void *) newTable, 0, newSize * sizeof(struct elzmaDedupChunk));
+
+    for (i = 0; i < enc->tableSize; i++) {
+        const struct elzmaDedupChunk * c = enc->table + i;
+        if (c->len != 0) {
+            *findChunk(newTable, newSize, c->fpA, c->fpB, c->len) = *c;
+        }
+    }
+    enc->as->Free(enc->as, enc->table);
+    enc->table = newTable;
+    enc->tableSize = newSize;
+}
+
+/* gather the next chunk, chunkLen is zero at the end of the input */
+static int
+gatherChunk(struct elzmaDedupEncoder * enc)
+{
+    UInt32 h = 0;
+
+    enc->chunkLen = 0;
+    for (;;) {
+        const unsigned char * p;
+        size_t n, i;
+        int cut = 0;
+
+        if (enc->inPos == enc->inLen) {
+            size_t sz = ELZMA_DEDUP_READ_SIZE;
+            if (enc->eof) break;
+            if (0 != enc->inputStream(enc->inputContext, enc->inBuf, &sz)) {
+                return ELZMA_E_INPUT_ERROR;
+            }
+            enc->inPos = 0;
+            enc->inLen = sz;
+            if (sz == 0) enc->eof = 1;
+            continue;
+        }
+
+        p = enc->inBuf + enc->inPos;
+        n = enc->inLen - enc->inPos;
+        if (n > enc->maxChunk - enc->chunkLen) {
+            n = enc->maxChunk - enc->chunkLen;
+        }
+        for (i = 0; i < n; i++) {
+            h = (h << 1) + enc->gear[p[i]];
+            if ((h & enc->cutMask) == 0 &&
+                enc->chunkLen + i + 1 >= enc->minChunk)
+            {
+                i++;
+                cut = 1;
+                break;
+            }
+        }
+
+        memcpy(enc->chunk + enc->chunkLen, p, i);
+        enc->chunkLen += i;
+        enc->inPos += i;
+        if (cut || enc->chunkLen == enc->maxChunk) break;
+    }
+
+    return ELZMA_E_OK;
+}
+
+/* turn the next chunk into filtered output, or a reference which may
+ * grow with the chunks after it */
+static int
+filterChunk(struct elzmaDedupEncoder * enc)
+{
+    struct elzmaDedupChunk * c;
+    UInt64 fpA, fpB;
+    UInt32 len;
+    int rc;
+
+    rc = gatherChunk(enc);
+    if (rc != ELZMA_E_OK) return rc;
+
+    if (enc->chunkLen == 0) {
+        unsigned int i;
+        flushMatch(enc);
+        putVarint(enc, 0);
+        for (i = 0; i < 4; i++) {
+            enc->out[enc->outLen++] =
+                (unsigned char) (CRC_GET_DIGEST(enc->crc) >> (8 * i));
+        }
+        enc->finished = 1;
+        return ELZMA_E_OK;
+    }
+
+    len = (UInt32) enc->chunkLen;
+    enc->crc = CrcUpdate(enc->crc, enc->chunk, enc->chunkLen);
+    fingerprint(enc->chunk, enc->chunkLen, &fpA, &fpB);
+    c = findChunk(enc->table, enc->tableSize, fpA, fpB, len);
+
+    if (c->len != 0) {
+        if (enc->matchLen > 0 &&
+            enc->matchOffset + enc->matchLen == c->offset)
+        {
+            enc->matchLen += len;
+        } else {
+            flushMatch(enc);
+            enc->matchOffset = c->offset;
+            enc->matchLen = len;
+        }
+        enc->pos += len;
+        return ELZMA_E_OK;
+    }
+
+    if ((enc->tableUsed + 1) * 2 <= enc->tableSize) {
+        c->fpA = fpA;
+        c->fpB = fpB;
+        c->offset = enc->pos;
+        c->len = len;
+        enc->tableUsed++;
+        if (enc->tableUsed * 2 >= enc->tableSize) growTable(enc);
+    }
+
+    flushMatch(enc);
+    putVarint(enc, (UInt64) len << 1);
+    memcpy(enc->out + enc->outLen, enc->chunk, enc->chunkLen);
+    enc->outLen += enc->chunkLen;
+    enc->pos += len;
+
+    return ELZMA_E_OK;
+}
+
+struct elzmaDedupEncoder *
+elzmaDedupEncoderCreate(elzma_read_callback inputStream, void * inputContext,
+                        unsigned int chunkSize,
+                        struct elzma_alloc_struct * as)
+{
+    struct elzmaDedupEncoder * enc;
+    unsigned int bits = 0, i;
+    UInt32 x = 0x2545F491;
+
+    CrcGenerateTable();
+    Crc64GenerateTable();
+
+    enc = as->Alloc(as, sizeof(struct elzmaDedupEncoder));
+    if (enc == NULL) return NULL;
+    memset((void *) enc, 0, sizeof(struct elzmaDedupEncoder));
+    enc->inputStream = inputStream;
+    enc->inputContext = inputContext;
+    enc->as = as;
+
+    /* half of the chunks' length is the minimum, the rest the expected
+     * wait for a cut */
+    while (((unsigned int) 2 << bits) < chunkSize) bits++;
+    enc->cutMask = (((UInt32) 1 << bits) - 1) << (32 - bits);
+    enc->minChunk = chunkSize / 2;
+    enc->maxChunk = (size_t) chunkSize * 4;
+
+    /* any well mixed table will do, the decoder doesn't depend on it */
+    for (i = 0; i < 256; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        enc->gear[i] = x;
+    }
+
+    enc->crc = CRC_INIT_VAL;
+    enc->tableSize = ELZMA_DEDUP_TABLE_MIN;
+    enc->table = as->Alloc(as, enc->tableSize *
+                           sizeof(struct elzmaDedupChunk));
+    enc->inBuf = as->Alloc(as, ELZMA_DEDUP_READ_SIZE);
+    enc->chunk = as->Alloc(as, enc->maxChunk);
+    enc->out = as->Alloc(as, enc->maxChunk + ELZMA_DEDUP_OUT_SLACK);
+    if (enc->table == NULL || enc->inBuf == NULL || enc->chunk == NULL ||
+        enc->out == NULL)
+    {
+        elzmaDedupEncoderFree(enc);
+        return NULL;
+    }
+    memset((void *) enc->table, 0,
+           enc->tableSize * sizeof(struct elzmaDedupChunk));
+
+    memcpy(enc->out, elzmaDedupMagic, sizeof(elzmaDedupMagic));
+    enc->outLen = sizeof(elzmaDedupMagic);
+
+    return enc;
+}
+
+void
+elzmaDedupEncoderFree(struct elzmaDedupEncoder * enc)
+{
+    if (enc) {
+        struct elzma_alloc_struct * as = enc->as;
+        as->Free(as, enc->table);
+        as->Free(as, enc->inBuf);
+        as->Free(as, enc->chunk);
+        as->Free(as, enc->out);
+        as->Free(as, enc);
+    }
+}
+
+int
+elzmaDedupRead(void * ctx, void * buf, size_t * size)
+{
+    struct elzmaDedupEncoder * enc = (struct elzmaDedupEncoder *) ctx;
+    size_t n;
+
+    while (enc->outPos == enc->outLen && !enc->finished) {
+        enc->outPos = enc->outLen = 0;
+        if (ELZMA_E_OK != filterChunk(enc)) return 1;
+    }
+
+    n = enc->outLen - enc->outPos;
+    if (n > *size) n = *size;
+    memcpy(buf, enc->out + enc->outPos, n);
+    enc->outPos += n;
+    *size = n;
+
+    return 0;
+}
+
+/* decoder states */
+#define ELZMA_DEDUP_HEADER 0
+#define ELZMA_DEDUP_TOKEN 1
+#define ELZMA_DEDUP_LITERAL 2
+#define ELZMA_DEDUP_DISTANCE 3
+#define ELZMA_DEDUP_TRAILER 4
+#define ELZMA_DEDUP_DONE 5
+
+struct elzmaDedupDecoder
+{
+    elzma_write_callback outputStream;
+    void * outputContext;
+    elzma_read_back_callback readBack;
+    void * readBackContext;
+    struct elzma_alloc_struct * as;
+
+    int state;
+    /* bytes of the header or trailer matched so far */
+    unsigned int have;
+    unsigned char trailer[4];
+    /* a varint being decoded */
+    UInt64 num;
+    unsigned int shift;
+    /* what's left of a literal, or the length of a copy */
+    UInt64 len;
+
+    /* output preceding the filtered data, output written so far and its
+     * CRC32 */
+    UInt64 base;
+    UInt64 written;
+    UInt32 crc;
+
+    unsigned char * copyBuf;
+    int error;
+};
+
+struct elzmaDedupDecoder *
+elzmaDedupDecoderCreate(elzma_write_callback outputStream,
+                        void * outputContext,
+                        elzma_read_back_callback readBack,
+                        void * readBackContext,
+                        unsigned long long base,
+                        struct elzma_alloc_struct * as)
+{
+    struct elzmaDedupDecoder * dec;
+
+    CrcGenerateTable();
+
+    dec = as->Alloc(as, sizeof(struct elzmaDedupDecoder));
+    if (dec == NULL) return NULL;
+    memset((void *) dec, 0, sizeof(struct elzmaDedupDecoder));
+    dec->outputStream = outputStream;
+    dec->outputContext = outputContext;
+    dec->readBack = readBack;
+    dec->readBackContext = readBackContext;
+    dec->base = base;
+    dec->as = as;
+    dec->state = ELZMA_DEDUP_HEADER;
+    dec->crc = CRC_INIT_VAL;
+
+    dec->copyBuf = as->Alloc(as, ELZMA_DEDUP_COPY_SIZE);
+    if (dec->copyBuf == NULL) {
+        as->Free(as, dec);
+        return NULL;
+    }
+
+    return dec;
+}
+
+static int
+emit(struct elzmaDedupDecoder * dec, const unsigned char * buf, size_t size)
+{
+    if (dec->outputStream(dec->outputContext, buf, size) != size) {
+        return ELZMA_E_OUTPUT_ERROR;
+    }
+    dec->crc = CrcUpdate(dec->crc, buf, size);
+    dec->written += size;
+    return ELZMA_E_OK;
+}
+
+/* copy len bytes from dist bytes back, in pieces no longer than dist so
+ * that an overlapping copy reads what it has just written */
+static int
+copyBack(struct elzmaDedupDecoder * dec, UInt64 dist)
+{
+    if (dist == 0 || dist > dec->written) return ELZMA_E_DECOMPRESS_ERROR;
+
+    while (dec->len > 0) {
+        size_t n = ELZMA_DEDUP_COPY_SIZE;
+        int rc;
+        if ((UInt64) n > dec->len) n = (size_t) dec->len;
+        if ((UInt64) n > dist) n = (size_t) dist;
+        if (0 != dec->readBack(dec->readBackContext,
+                               dec->base + dec->written - dist,
+                               dec->copyBuf, n))
+        {
+            return ELZMA_E_OUTPUT_ERROR;
+        }
+        rc = emit(dec, dec->copyBuf, n);
+        if (rc != ELZMA_E_OK) return rc;
+        dec->len -= n;
+    }
+
+    return ELZMA_E_OK;
+}
+
+/* accumulate a varint, returns nonzero once it's complete */
+static int
+takeVarint(struct elzmaDedupDecoder * dec, unsigned char b)
+{
+    if (dec->shift > 63 || (dec->shift == 63 && (b & 0x7F) > 1)) {
+        dec->error = ELZMA_E_DECOMPRESS_ERROR;
+        return 0;
+    }
+    dec->num |= (UInt64) (b & 0x7F) << dec->shift;
+    dec->shift += 7;
+    return (b & 0x80) == 0;
+}
+
+size_t
+elzmaDedupWrite(void * ctx, const void * buf, size_t size)
+{
+    struct elzmaDedupDecoder * dec = (struct elzmaDedupDecoder *) ctx;
+    const unsigned char * p = (const unsigned char *) buf;
+    const unsigned char * end = p + size;
+
+    while (p < end && dec->error == ELZMA_E_OK) {
+        switch (dec->state) {
+            case ELZMA_DEDUP_HEADER:
+                if (*p++ != elzmaDedupMagic[dec->have++]) {
+                    dec->error = ELZMA_E_CORRUPT_HEADER;
+                } else if (dec->have == sizeof(elzmaDedupMagic)) {
+                    dec->state = ELZMA_DEDUP_TOKEN;
+                }
+                break;
+            case ELZMA_DEDUP_TOKEN:
+                if (!takeVarint(dec, *p++)) break;
+                dec->len = dec->num >> 1;
+                if (dec->num == 0) {
+                    dec->have = 0;
+                    dec->state = ELZMA_DEDUP_TRAILER;
+                } else if (dec->len == 0) {
+                    dec->error = ELZMA_E_DECOMPRESS_ERROR;
+                } else {
+                    dec->state = (dec->num & 1) ? ELZMA_DEDUP_DISTANCE
+                                                : ELZMA_DEDUP_LITERAL;
+                }
+                dec->num = 0;
+                dec->shift = 0;
+                break;
+            case ELZMA_DEDUP_LITERAL: {
+                size_t n = end - p;
+                if ((UInt64) n > dec->len) n = (size_t) dec->len;
+                dec->error = emit(dec, p, n);
+                p += n;
+                dec->len -= n;
+                if (dec->len == 0) dec->state = ELZMA_DEDUP_TOKEN;
+                break;
+            }
+            case ELZMA_DEDUP_DISTANCE:
+                if (!takeVarint(dec, *p++)) break;
+                dec->error = copyBack(dec, dec->num);
+                dec->num = 0;
+                dec->shift = 0;
+                dec->state = ELZMA_DEDUP_TOKEN;
+                break;
+            case ELZMA_DEDUP_TRAILER:
+                dec->trailer[dec->have++] = *p++;
+                if (dec->have == 4) {
+                    UInt32 crc = dec->trailer[0] |
+                        (dec->trailer[1] << 8) | (dec->trailer[2] << 16) |
+                        ((UInt32) dec->trailer[3] << 24);
+                    if (crc != CRC_GET_DIGEST(dec->crc)) {
+                        dec->error = ELZMA_E_CRC32_MISMATCH;
+                    }
+                    dec->state = ELZMA_DEDUP_DONE;
+                }
+                break;
+            default:
+                /* nothing may follow the trailer */
+                dec->error = ELZMA_E_DECOMPRESS_ERROR;
+                break;
+        }
+    }
+
+    return (dec->error == ELZMA_E_OK) ? size : 0;
+}
+
+int
+elzmaDedupDecoderFinish(struct elzmaDedupDecoder * dec, int rc)
+{
+    if (dec->error != ELZMA_E_OK) {
+        rc = dec->error;
+    } else if (rc == ELZMA_E_OK && dec->state != ELZMA_DEDUP_DONE) {
+        rc = ELZMA_E_INSUFFICIENT_INPUT;
+    }
+
+    dec->as->Free(dec->as, dec->copyBuf);
+    dec->as->Free(dec->as, dec);
+
+    return rc;
+}
@@ -0,0 +1,77 @@
+/*
+ * Written in 2009 by Lloyd Hilaiel
+ *
+ * License
+ *
+ * All the cruft you find here is public domain.  You don't have to credit
+ * anyone to use this code, but my personal request is that you mention
+ * Igor Pavlov for his hard, high quality work.
+ *
+ * dedup.h - long range deduplication, a filter between the input and the
+ *           LZMA encoder which replaces repeats of earlier data, however
+ *           far back, with references to it.
+ *
+ * The input is cut into chunks where a rolling hash of the last 32 bytes
+ * hits a pattern, so that repeated data is cut the same way wherever it
+ * lies.  A chunk seen before becomes a reference to its first occurrence,
+ * and references to consecutive chunks merge.  The filtered stream is a
+ * header, a sequence of records and a trailer:
+ *
+ *   "ELDD" 0x01                        header (magic, version)
+ *   varint (len << 1), len bytes       literal data, len > 0
+ *   varint (len << 1 | 1), varint dist a copy of len bytes starting dist
+ *                                      bytes back in the output
+ *   varint 0                           end of records
+ *   CRC32 (little endian)              of the unfiltered data
+ *
+ * varints are encoded as in xz, seven bits per byte, low bits first.
+ * Decoding reads the output back to resolve references, so it needs
+ * random access to what has been written.  The filtered stream is only
+ * carried in xz, whose block headers list the filter ahead of LZMA2 (see
+ * xz_header.c), so decoders never have to guess whether data is filtered.
+ */
+
+#ifndef __ELZMA_DEDUP_H__
+#define __ELZMA_DEDUP_H__
+
+#include "common_internal.h"
+#include "easylzma/compress.h"
+#include "easylzma/decompress.h"
+
+/* the range of average chunk sizes */
+#define ELZMA_DEDUP_CHUNK_MIN (1 << 12)
+#define ELZMA_DEDUP_CHUNK_MAX (1 << 24)
+
+struct elzmaDedupEncoder;
+struct elzmaDedupDecoder;
+
+/* filter inputStream, chunkSize (a power of two within the range above)
+ * is the average chunk size.  Returns NULL when out of memory. */
+struct elzmaDedupEncoder * elzmaDedupEncoderCreate(
+    elzma_read_callback inputStream, void * inputContext,
+    unsigned int chunkSize, struct elzma_alloc_struct * as);
+
+void elzmaDedupEncoderFree(struct elzmaDedupEncoder * enc);
+
+/* an elzma_read_callback producing the filtered stream, ctx is the
+ * encoder */
+int elzmaDedupRead(void * ctx, void * buf, size_t * size);
+
+/* reverse the filter into outputStream, reading back earlier output
+ * through readBack.  base is the amount of output which precedes the
+ * filtered data.  Returns NULL when out of memory. */
+struct elzmaDedupDecoder * elzmaDedupDecoderCreate(
+    elzma_write_callback outputStream, void * outputContext,
+    elzma_read_back_callback readBack, void * readBackContext,
+    unsigned long long base, struct elzma_alloc_struct * as);
+
+/* an elzma_write_callback consuming the filtered stream, ctx is the
+ * decoder.  It consumes nothing once it has hit an error. */
+size_t elzmaDedupWrite(void * ctx, const void * buf, size_t size);
+
+/* release the decoder, returning the outcome of a decompression which
+ * returned rc: the decoder's error if it hit one, otherwise rc, or an
+ * error if rc is ELZMA_E_OK but the filtered stream was incomplete */
+int elzmaDedupDecoderFinish(struct elzmaDedupDecoder * dec, int rc);
+
+#endif
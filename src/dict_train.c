@@ -0,0 +1,227 @@
+/*
+ * Written in 2009 by Lloyd Hilaiel
+ *
+ * License
+ *
+ * All the cruft you find here is public domain.  You don't have to credit
+ * anyone to use this code, but my personal request is that you mention
+ * Igor Pavlov for his hard, high quality work.
+ *
+ * dict_train.c - build preset dictionaries from sample inputs
+ *
+ * The dictionary is assembled from segments of the samples.  A segment
+ * is worth the number of other samples which contain each of its d-mers
+ * (short substrings, long enough for the match finder's hash to find
+ * them), and a d-mer only counts in the first segment picked.  The
+ * samples are divided into epochs which each contribute their best
+ * segment in turn, so that the dictionary covers the whole corpus rather
+ * than its most repetitive corner.  Segments picked first end up last
+ * in the dictionary, where the encoder reaches them with the shortest
+ * (cheapest) distances.
+ */
+
+#include "easylzma/compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* d-mer and segment lengths */
+#define ELZMA_TRAIN_DMER 8
+#define ELZMA_TRAIN_SEGMENT 64
+
+/* d-mer counts are kept in a table of at most 2^22 entries, collisions
+ * only blur the scores */
+#define ELZMA_TRAIN_HASH_LOG_MIN 10
+#define ELZMA_TRAIN_HASH_LOG_MAX 22
+
+struct trainState
+{
+    const unsigned char * samples;
+    size_t total;
+    /* where each sample ends in samples */
+    size_t * ends;
+    unsigned int numSamples;
+    unsigned int hashLog;
+    /* for each d-mer, the number of samples containing it beyond the
+     * first, zeroed once it's in the dictionary */
+    unsigned int * freq;
+};
+
+static unsigned int
+hashDmer(const unsigned char * p, unsigned int hashLog)
+{
+    unsigned int a = p[0] | (p[1] << 8) | (p[2] << 16) |
+                     ((unsigned int) p[3] << 24);
+    unsigned int b = p[4] | (p[5] << 8) | (p[6] << 16) |
+                     ((unsigned int) p[7] << 24);
+    unsigned int h = (a * 2654435761U) ^ (b * 2246822519U);
+    return (h & 0xFFFFFFFF) >> (32 - hashLog);
+}
+
+/* count, for each d-mer, the samples which contain it */
+static int
+countDmers(struct trainState * st)
+{
+    unsigned int * last;
+    size_t hashSize = (size_t) 1 << st->hashLog;
+    size_t start = 0, i, pos;
+    unsigned int s;
+
+    st->freq = (unsigned int *) calloc(hashSize, sizeof(unsigned int));
+    last = (unsigned int *) malloc(hashSize * sizeof(unsigned int));
+    if (st->freq == NULL || last == NULL) {
+        free(last);
+        return ELZMA_E_COMPRESS_ERROR;
+    }
+    for (i = 0; i < hashSize; i++) last[i] = (unsigned int) -1;
+
+    for (s = 0; s < st->numSamples; s++) {
+        for (pos = start; pos + ELZMA_TRAIN_DMER <= st->ends[s]; pos++) {
+            unsigned int h = hashDmer(st->samples + pos, st->hashLog);
+            if (last[h] != s) {
+                /* the first sample to contain a d-mer gains nothing */
+                if (last[h] != (unsigned int) -1) st->freq[h]++;
+                last[h] = s;
+            }
+        }
+        start = st->ends[s];
+    }
+
+    free(last);
+    return ELZMA_E_OK;
+}
+
+/* find the best segment starting in [from, to), returns its score and
+ * sets *segStart and *segLen */
+static unsigned long
+bestSegment(const struct trainState * st, size_t from, size_t to,
+            size_t * segStart, size_t * segLen)
+{
+    unsigned long best = 0;
+    unsigned int s = 0;
+
+    /* the sample holding 'from' */
+    while (s < st->numSamples && st->ends[s] <= from) s++;
+
+    while (from < to && s < st->numSamples) {
+        size_t end = (to < st->ends[s]) ? to : st->ends[s];
+        size_t sampleEnd = st->ends[s];
+        unsigned long score = 0;
+        size_t head = from, tail = from;
+
+        /* a window of d-mers, each wholly within the sample, slides
+         * over it */
+        for (; head + ELZMA_TRAIN_DMER <= sampleEnd && head < end +
+               (ELZMA_TRAIN_SEGMENT - ELZMA_TRAIN_DMER); head++)
+        {
+            score += st->freq[hashDmer(st->samples + head, st->hashLog)];
+            if (head - tail > ELZMA_TRAIN_SEGMENT - ELZMA_TRAIN_DMER) {
+                score -= st->freq[hashDmer(st->samples + tail,
+                                           st->hashLog)];
+                tail++;
+            }
+            if (score > best) {
+                best = score;
+                *segStart = tail;
+                *segLen = head + ELZMA_TRAIN_DMER - tail;
+            }
+        }
+
+        from = sampleEnd;
+        s++;
+    }
+
+    return best;
+}
+
+int
+elzma_train_dictionary(const unsigned char * samples,
+                       const size_t * sampleSizes,
+                       unsigned int numSamples,
+                       unsigned char * dict, size_t * dictSize)
+{
+    struct trainState st;
+    size_t capacity, used = 0, epochSize;
+    unsigned int s, numEpochs, e;
+    int rc, progress;
+
+    if (samples == NULL || sampleSizes == NULL || numSamples == 0 ||
+        dictSize == NULL || (dict == NULL && *dictSize > 0))
+    {
+        return ELZMA_E_BAD_PARAMS;
+    }
+
+    capacity = *dictSize;
+    if (capacity > ELZMA_PRESET_DICT_SIZE_MAX) {
+        capacity = ELZMA_PRESET_DICT_SIZE_MAX;
+    }
+
+    memset((void *) &st, 0, sizeof(st));
+    st.samples = samples;
+    st.numSamples = numSamples;
+    st.ends = (size_t *) malloc(numSamples * sizeof(size_t));
+    if (st.ends == NULL) return ELZMA_E_COMPRESS_ERROR;
+    for (s = 0; s < numSamples; s++) {
+        st.total += sampleSizes[s];
+        st.ends[s] = st.total;
+    }
+
+    st.hashLog = ELZMA_TRAIN_HASH_LOG_MIN;
+    while (st.hashLog < ELZMA_TRAIN_HASH_LOG_MAX &&
+           ((size_t) 1 << st.hashLog) < st.total * 2)
+    {
+        st.hashLog++;
+    }
+
+    rc = countDmers(&st);
+    if (rc != ELZMA_E_OK) goto trainEnd;
+
+    /* one epoch per segment the dictionary holds, but no epochs smaller
+     * than a segment */
+    numEpochs = (unsigned int) (capacity / ELZMA_TRAIN_SEGMENT);
+    if ((size_t) numEpochs > st.total / ELZMA_TRAIN_SEGMENT) {
+        numEpochs = (unsigned int) (st.total / ELZMA_TRAIN_SEGMENT);
+    }
+    if (numEpochs == 0) numEpochs = 1;
+    epochSize = (st.total + numEpochs - 1) / numEpochs;
+
+    /* segments fill the dictionary from its end */
+    do {
+        progress = 0;
+        for (e = 0; e < numEpochs && used < capacity; e++) {
+            size_t segStart = 0, segLen = 0, i;
+            size_t from = e * epochSize;
+            size_t to = from + epochSize;
+            if (to > st.total) to = st.total;
+
+            if (0 == bestSegment(&st, from, to, &segStart, &segLen)) {
+                continue;
+            }
+
+            if (segLen > capacity - used) {
+                segLen = capacity - used;
+                if (segLen < ELZMA_TRAIN_DMER) break;
+            }
+            used += segLen;
+            memcpy((void *) (dict + capacity - used),
+                   (const void *) (samples + segStart), segLen);
+
+            /* what's in the dictionary already is worth nothing more */
+            for (i = segStart; i + ELZMA_TRAIN_DMER <= segStart + segLen;
+                 i++)
+            {
+                st.freq[hashDmer(samples + i, st.hashLog)] = 0;
+            }
+            progress = 1;
+        }
+    } while (progress && used + ELZMA_TRAIN_DMER <= capacity);
+
+    memmove((void *) dict, (const void *) (dict + capacity - used), used);
+    *dictSize = used;
+
+  trainEnd:
+    free(st.freq);
+    free(st.ends);
+
+    return rc;
+}
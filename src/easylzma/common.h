@@ -61,18 +61,36 @@ extern "C" {
 /** for formats which have an emebedded uncompressed content length,
  *  this error indicates that the amount we read was not what we expected */
 #define ELZMA_E_SIZE_MISMATCH                   20
+/** not an error: a push mode compression call stopped at its work limit
+ *  with queued input left, call elzma_compress_stream_continue (or a
+ *  step stopped at its limits, call elzma_compress_step again) */
+#define ELZMA_E_AGAIN                           21
+/** compression was stopped by the abort callback */
+#define ELZMA_E_ABORTED                         22
+/** the xz data was compressed with long range deduplication, and can
+ *  only be decompressed with it (elzma_decompress_set_long_range) */
+#define ELZMA_E_LONG_RANGE                      23
 
 
 /** Supported file formats */
+/** the largest preset dictionary accepted by
+ *  elzma_compress_set_dictionary and elzma_decompress_set_dictionary */
+#define ELZMA_PRESET_DICT_SIZE_MAX (1 << 30)
+
 typedef enum {
     ELZMA_lzip, /**< the lzip format which includes a magic number and
                  *   CRC check */
-    ELZMA_lzma  /**< the LZMA-Alone format, originally designed by
+    ELZMA_lzma, /**< the LZMA-Alone format, originally designed by
                  *   Igor Pavlov and in widespread use due to lzmautils,
                  *   lacking both aforementioned features of lzip */
-/* XXX: future, potentially   ,
-    ELZMA_xz 
-*/
+    ELZMA_lzma2,/**< a raw LZMA2 stream behind a one byte dictionary size,
+                 *   as found inside 7z and xz files.  LZMA2 splits the
+                 *   data into chunks of at most 2MB, storing those which
+                 *   don't compress, and requires lc + lp <= 4 */
+    ELZMA_xz    /**< the xz format of xz utils: LZMA2 compressed blocks
+                 *   with CRC64 checks and an index of the blocks, which
+                 *   allows seeking.  Only the LZMA2 filter is supported,
+                 *   files using others (such as BCJ) are rejected */
 } elzma_file_format;
 
 /**
@@ -108,6 +126,22 @@ typedef int (*elzma_read_callback)(void *ctx, void *buf,
 typedef void (*elzma_progress_callback)(void *ctx, size_t complete,
                                         size_t total);
 
+/**
+ * A callback polled while compressing, wherever progress is reported,
+ * which stops the work when it returns nonzero.
+ *
+ * \returns nonzero to abort
+ */
+typedef int (*elzma_abort_callback)(void *ctx);
+
+/**
+ * A callback which reads a clock, for the time limits of compression.
+ *
+ * \returns the time in microseconds from an arbitrary start, which must
+ *          not go backwards
+ */
+typedef unsigned long long (*elzma_clock_callback)(void *ctx);
+
 
 /** pointer to a malloc function, supporting client overriding memory
  *  allocation routines */
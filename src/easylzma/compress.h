@@ -48,6 +48,17 @@ void EASYLZMA_API elzma_compress_set_allocation_callbacks(
  */ 
 void EASYLZMA_API elzma_compress_free(elzma_compress_handle * hand);
 
+/**
+ * Restore the default configuration of a compressor object, as if it
+ * were freshly allocated.  A handle may be used for any number of
+ * compression runs, and the encoder's large allocations (match finder
+ * window and tables, probability tables) are kept between runs and
+ * only reallocated when a run needs larger ones (a bigger dictionary or
+ * lc + lp).  Reset retains those allocations, use elzma_compress_free
+ * to release them.  An open push mode or stepped stream is abandoned.
+ */ 
+void EASYLZMA_API elzma_compress_reset(elzma_compress_handle hand);
+
 /**
  * Set configuration paramters for a compression run.  If not called,
  * reasonable defaults will be used.
@@ -61,15 +72,432 @@ int EASYLZMA_API elzma_compress_config(elzma_compress_handle hand,
                                        elzma_file_format format,
                                        unsigned long long uncompressedSize);
 
+/** named encoder tunings, see elzma_compress_options_init */
+typedef enum {
+    /** optimal parsing over binary trees, what a fresh handle uses */
+    ELZMA_PRESET_DEFAULT,
+    /** greedy parsing over hash chains, several times faster than the
+     *  default at a modest cost in ratio */
+    ELZMA_PRESET_FAST,
+    /** optimal parsing with more fast bytes and match finder cycles,
+     *  slower than the default for a slightly better ratio */
+    ELZMA_PRESET_BEST,
+    /** lazy parsing over hash chains, between the fast and default
+     *  presets in both speed and ratio */
+    ELZMA_PRESET_LAZY
+} elzma_compress_preset;
+
+/** the version of elzma_compress_options described by this header,
+ *  which grows with the structure: version 1 ends with
+ *  matchFinderThreads, 2 adds mulHash and 3 adds ringWindow */
+#define ELZMA_COMPRESS_OPTIONS_VERSION 3
+
+/**
+ * Encoder tunings beyond those of elzma_compress_config, which still
+ * sets lc, lp, pb, level and the dictionary size.  Fill the structure
+ * with elzma_compress_options_init and adjust from there, so that
+ * fields added in later versions keep sensible values.  Structures of
+ * earlier versions are still accepted, fields they lack take the
+ * default preset's values.
+ */
+typedef struct {
+    /** ELZMA_COMPRESS_OPTIONS_VERSION, set by elzma_compress_options_init */
+    unsigned int version;
+    /** parsing: 0 - fast (greedy), 1 - normal (optimal), 2 - lazy (a
+     *  match is put off when one starting a byte or two later is
+     *  cheaper) */
+    unsigned int algo;
+    /** fast bytes, matches at least this long are taken without looking
+     *  for better ones (5 - 273) */
+    unsigned int fb;
+    /** match finder: 0 - hash chains, 1 - binary trees */
+    unsigned int btMode;
+    /** bytes hashed to find match candidates (2 - 4), hash chains
+     *  always use 4 */
+    unsigned int numHashBytes;
+    /** match finder cycles, the number of candidates visited at each
+     *  position (1 - (1 << 30)) */
+    unsigned int mc;
+    /** 1 (the default), or 2 to move binary tree match finding into
+     *  two threads of its own, which leaves the output unchanged.  Only
+     *  builds with EASYLZMA_MT_MATCH_FINDER have them, and only normal
+     *  parsing over binary trees uses them.  Throughput targets, push
+     *  mode, forks and batches always find matches in one thread. */
+    unsigned int matchFinderThreads;
+    /** match finder hashing: 0 - through a CRC table, 1 - multiplicative,
+     *  which needs no table lookups.  Both collide about as often.
+     *  Either decompresses the same, but the matches found and so the
+     *  output differ. */
+    unsigned int mulHash;
+    /** the encoder's window: 0 - a flat block, moved back as the input
+     *  goes by, 1 - on linux, memory mapped twice in a row so that it
+     *  wraps around instead, which costs more than it saves on small
+     *  inputs.  Ignored when the client's allocation routines are set.
+     *  A child process after fork() doesn't inherit the mapping: it
+     *  maps another for the streams it begins, but going on with a push
+     *  mode stream begun before the fork fails with
+     *  ELZMA_E_COMPRESS_ERROR. */
+    unsigned int ringWindow;
+} elzma_compress_options;
+
+/**
+ * Fill an options structure with the values of a preset.  version is the
+ * version of the structure, only the fields it has are written.  Call it
+ * through elzma_compress_options_init, which passes the version of this
+ * header.
+ */
+int EASYLZMA_API elzma_compress_options_init_version(
+    elzma_compress_options * opts, elzma_compress_preset preset,
+    unsigned int version);
+
+#define elzma_compress_options_init(opts, preset)                    \
+    elzma_compress_options_init_version((opts), (preset),            \
+                                        ELZMA_COMPRESS_OPTIONS_VERSION)
+
+/**
+ * Apply encoder options to a compressor object, for the following runs.
+ * Returns ELZMA_E_BAD_PARAMS for an unknown version or values out of
+ * range, leaving the handle unchanged.  elzma_compress_reset restores
+ * the default preset.
+ */
+int EASYLZMA_API elzma_compress_set_options(
+    elzma_compress_handle hand, const elzma_compress_options * opts);
+
+/**
+ * Read back the encoder options of a compressor object.  The structure
+ * is filled to version, whatever it held before.  Call it through
+ * elzma_compress_get_options, which passes the version of this header.
+ */
+int EASYLZMA_API elzma_compress_get_options_version(
+    elzma_compress_handle hand, elzma_compress_options * opts,
+    unsigned int version);
+
+#define elzma_compress_get_options(hand, opts)                       \
+    elzma_compress_get_options_version((hand), (opts),               \
+                                       ELZMA_COMPRESS_OPTIONS_VERSION)
+
+/**
+ * Set a preset dictionary (optional).  Data which resembles the input,
+ * such as a few typical messages, is loaded into the encoder's window
+ * before each run so that matches can refer to it from the first byte,
+ * which helps a lot with small inputs.  The dictionary isn't stored in
+ * the output: the decompressor must be given the same one with
+ * elzma_decompress_set_dictionary.  Only its last dictionarySize bytes
+ * (see elzma_compress_config) can be referred to.
+ *
+ * The data is copied.  Only the lzma and lzip formats support preset
+ * dictionaries, each member of a multi-member lzip file continues the
+ * dictionary, and compression is single threaded.  A NULL dict (or
+ * elzma_compress_reset) removes it.
+ */
+int EASYLZMA_API elzma_compress_set_dictionary(elzma_compress_handle hand,
+                                               const void * dict,
+                                               size_t dictSize);
+
+/**
+ * Build a preset dictionary from sample inputs, such as a few hundred
+ * typical messages.  The samples are concatenated in samples, their
+ * sizes given in sampleSizes.  Substrings which recur across samples are
+ * gathered, the most widespread last, into a dictionary of at most
+ * *dictSize bytes written to dict.  *dictSize is set to the size
+ * produced, which is smaller when the samples have little in common.
+ * A dictionary of a few tens of kilobytes suits most message sets.
+ */
+int EASYLZMA_API elzma_train_dictionary(const unsigned char * samples,
+                                        const size_t * sampleSizes,
+                                        unsigned int numSamples,
+                                        unsigned char * dict,
+                                        size_t * dictSize);
+
+/**
+ * Measure what a preset dictionary gains: each sample is compressed on
+ * its own with the handle's configuration (lzma or lzip format), once
+ * without and once with dict, and the total compressed sizes are
+ * returned in sizeWithout and sizeWith.  Use samples which weren't
+ * trained on to get a fair estimate.  The handle's own dictionary, if
+ * any, is left in place.
+ */
+int EASYLZMA_API elzma_compress_evaluate_dictionary(
+    elzma_compress_handle hand,
+    const void * dict, size_t dictSize,
+    const unsigned char * samples, const size_t * sampleSizes,
+    unsigned int numSamples,
+    unsigned long long * sizeWithout, unsigned long long * sizeWith);
+
+/**
+ * Enable long range deduplication (optional), for inputs many times the
+ * size of the dictionary with repeats far apart, such as backups.  The
+ * input is cut into chunks of about chunkSize bytes, at points set by
+ * its content so that repeated data is cut the same way wherever it
+ * occurs, and a chunk seen before (any distance back) is replaced with
+ * a reference to it.  Only what's left is LZMA compressed, which is
+ * faster as well as smaller when there's much repetition.
+ *
+ * chunkSize is a power of two between 4k and 16MB, zero turns it off.
+ * Smaller chunks find more repeats, and the encoder keeps about 64
+ * bytes of memory per chunk of input.  The output must be decompressed
+ * with elzma_decompress_set_long_range.  Only elzma_compress_run
+ * supports it, and only for xz, where the filter is listed ahead of LZMA2
+ * in each block header (with a custom filter ID) so that decoders which
+ * don't know it refuse the file.  Its state spans the stream, so blocks
+ * can't be decoded on their own and their sizes and checks cover the
+ * filtered data.  Other formats fail with ELZMA_E_UNSUPPORTED_FORMAT.
+ */
+int EASYLZMA_API elzma_compress_set_long_range(elzma_compress_handle hand,
+                                               unsigned int chunkSize);
+
+/**
+ * Set a throughput target (optional), for the best ratio that keeps up
+ * with it.  The speed of the run is measured as it goes, and between
+ * blocks of input the parser (greedy, lazy or optimal), the fast bytes
+ * and the match finder cycles are stepped down while it falls short and
+ * back up while there's room, starting from the configured options.
+ * The match finder itself stays as configured, hash chains (see
+ * ELZMA_PRESET_LAZY) reach the highest speeds.
+ *
+ * kbPerSecond is the input to compress per second, in KiB.  timeBudget
+ * is a time in milliseconds for the whole run, which needs the
+ * uncompressed size (elzma_compress_config), the rate to finish in time
+ * is worked out again as the run goes.  The stricter of the two
+ * applies, zero turns either off.  The target is per core: only
+ * elzma_compress_run of lzma and lzip data adapts and it runs in a
+ * single thread, other formats return ELZMA_E_UNSUPPORTED_FORMAT and
+ * runs with several threads or a block size (elzma_compress_set_threads)
+ * return ELZMA_E_BAD_PARAMS.
+ */
+int EASYLZMA_API elzma_compress_set_throughput(elzma_compress_handle hand,
+                                               unsigned int kbPerSecond,
+                                               unsigned int timeBudget);
+
+/**
+ * Set a callback which can stop compression (optional).  It's polled
+ * wherever progress is reported, about every 32k of input coded, by
+ * elzma_compress_run, elzma_compress_buffer and the push mode and
+ * stepped calls.  When it returns nonzero the call unwinds and returns
+ * ELZMA_E_ABORTED, leaving partial output behind and the handle ready
+ * for another run.  With block parallel compression, or a batch on
+ * several threads, it's also polled from the worker threads, so it must
+ * be thread safe then.
+ */
+int EASYLZMA_API elzma_compress_set_abort_callback(
+    elzma_compress_handle hand,
+    elzma_abort_callback abortCallback, void * abortContext);
+
+/**
+ * Replace the clock which times compression (optional, the system's
+ * monotonic time is used otherwise).  It measures the speed and budget
+ * of a throughput target (elzma_compress_set_throughput) and the time
+ * limits of the push mode and stepped calls.  A clock which is only
+ * advanced by the client makes those decisions repeatable.  A NULL
+ * clockCallback restores the system clock.
+ */
+int EASYLZMA_API elzma_compress_set_clock(
+    elzma_compress_handle hand,
+    elzma_clock_callback clockCallback, void * clockContext);
+
+/**
+ * Enable block parallel compression (optional, if not called compression
+ * is single threaded).  The input is split into blocks of blockSize
+ * bytes which are compressed independently by numThreads worker threads
+ * and written in order as members of a multi-member lzip file, or as
+ * the blocks of an xz stream.  The output does not depend on
+ * numThreads, only on blockSize.  Smaller blocks allow more parallelism
+ * at some cost in compression ratio.  A blockSize of zero selects a
+ * default of twice the dictionary size, except with a single thread,
+ * where it leaves the input in one member or block as without this
+ * call.  A single thread with a blockSize splits the input as many
+ * threads would, so that readers can decode xz blocks independently
+ * (see elzma_xz_read_index).
+ *
+ * Only the lzip and xz formats support multiple members or blocks, with
+ * other formats compression remains single threaded.  elzma_compress_batch
+ * spreads its buffers over numThreads threads in either lzma or lzip
+ * format, blockSize doesn't apply to it.
+ */
+int EASYLZMA_API elzma_compress_set_threads(elzma_compress_handle hand,
+                                            unsigned int numThreads,
+                                            unsigned int blockSize);
+
 /**
  * Run compression
- */ 
+ */
 int EASYLZMA_API elzma_compress_run(
     elzma_compress_handle hand,
     elzma_read_callback inputStream, void * inputContext,
     elzma_write_callback outputStream, void * outputContext,
     elzma_progress_callback progressCallback, void * progressContext);
 
+/**
+ * Compress a buffer held in memory in a single call, using the format
+ * and parameters configured on the handle.  The encoder reads straight
+ * from the input buffer and the compressed file (header, data and
+ * footer) is written straight to the output buffer, with no callbacks.
+ * The uncompressed size is always recorded in lzma headers.  Block
+ * parallel compression is not used.
+ *
+ * outLen is an in/out argument.  On input it's the size of the output
+ * buffer, on output the size of the compressed file.  If the output
+ * doesn't fit ELZMA_E_OUTPUT_ERROR is returned,
+ * elzma_compress_bound() gives a size which always suffices.
+ */
+int EASYLZMA_API elzma_compress_buffer(elzma_compress_handle hand,
+                                       const unsigned char * in,
+                                       size_t inLen,
+                                       unsigned char * out,
+                                       size_t * outLen);
+
+/**
+ * Compress as much of a buffer as fits in the output buffer, for data
+ * packed into fixed size pages or packets.  As elzma_compress_buffer,
+ * except that when the whole input doesn't fit, compression stops at the
+ * last symbol which does rather than failing, which leaves the file
+ * within a few bytes of the size of the buffer.  inLen is an in/out
+ * argument too, on output it's the size of the input the file holds,
+ * the rest is left for the next page.  ELZMA_E_OUTPUT_ERROR is returned
+ * only when the buffer can't hold an empty file.
+ */
+int EASYLZMA_API elzma_compress_buffer_partial(elzma_compress_handle hand,
+                                               const unsigned char * in,
+                                               size_t * inLen,
+                                               unsigned char * out,
+                                               size_t * outLen);
+
+/**
+ * The largest output elzma_compress_buffer() can produce for inLen bytes
+ * of input in the handle's configured format.
+ */
+size_t EASYLZMA_API elzma_compress_bound(elzma_compress_handle hand,
+                                         size_t inLen);
+
+/**
+ * Compress many small independent buffers, such as records or messages,
+ * each into a file of its own as elzma_compress_buffer would, in a
+ * single call.  Buffer i is in[i] of inLens[i] bytes, and is compressed
+ * into out[i] whose size is given in outLens[i], which is set to the size
+ * of the compressed file.  The lzma and lzip formats are supported.
+ *
+ * Setting up an encoder costs as much as coding a few hundred bytes, so
+ * the encoders and their tables are kept on the handle from one batch to
+ * the next.  With elzma_compress_set_threads the buffers are shared out
+ * among numThreads threads (the caller's and numThreads - 1 workers,
+ * which are also kept); the output doesn't depend on it.
+ *
+ * If any buffer fails the error of the first one which did is returned,
+ * and its outLens entry and those of all the buffers after it are set
+ * to zero.  The abort callback is polled before each buffer as well as
+ * while it's coded.
+ */
+int EASYLZMA_API elzma_compress_batch(elzma_compress_handle hand,
+                                      unsigned int count,
+                                      const unsigned char * const * in,
+                                      const size_t * inLens,
+                                      unsigned char ** out,
+                                      size_t * outLens);
+
+/**
+ * Begin push mode compression, for callers which receive their input in
+ * pieces and can't block waiting for the rest (an event loop, for
+ * instance).  Input is handed over with elzma_compress_stream_write and
+ * the compressed file is passed to outputStream as it's produced, using
+ * the format and parameters configured on the handle.  A handle runs one
+ * push mode stream at a time, and no other compression while it's open.
+ * Compression is single threaded.
+ *
+ * Each write, flush, finish or continue call compresses at most
+ * workLimit bytes of queued input (zero for no limit), rounded up to the
+ * encoder's 32k step, and returns ELZMA_E_AGAIN when it stopped with
+ * work left over, which elzma_compress_stream_continue picks up.
+ * The encoder needs a few kilobytes of input ahead of what it codes, so
+ * it only makes progress once that much is queued or the stream is
+ * finishing.
+ */
+int EASYLZMA_API elzma_compress_stream_begin(
+    elzma_compress_handle hand,
+    elzma_write_callback outputStream, void * outputContext,
+    size_t workLimit);
+
+/**
+ * Queue input for push mode compression.  The data is copied.
+ */
+int EASYLZMA_API elzma_compress_stream_write(elzma_compress_handle hand,
+                                             const void * buf,
+                                             size_t size);
+
+/**
+ * Make all the input written so far decodable from the output written
+ * so far, by ending the current lzip member (later input goes to a new
+ * member).  Only the lzip format supports this, LZMA-Alone files
+ * consist of a single stream.
+ */
+int EASYLZMA_API elzma_compress_stream_flush(elzma_compress_handle hand);
+
+/**
+ * End the input of a push mode stream.  Once this (or a following
+ * continue call) returns ELZMA_E_OK the compressed file is complete.
+ */
+int EASYLZMA_API elzma_compress_stream_finish(elzma_compress_handle hand);
+
+/**
+ * Resume push mode compression after ELZMA_E_AGAIN.
+ */
+int EASYLZMA_API elzma_compress_stream_continue(elzma_compress_handle hand);
+
+/**
+ * Fork an open push mode stream, for many outputs which share a common
+ * prefix: dest takes src's configuration and becomes a copy of its
+ * stream, which it then continues on its own, passing further output to
+ * outputStream.  The compressed file for dest is the output src produced
+ * before the fork followed by dest's output.  src is unaffected and may
+ * be forked again, so the prefix is compressed once rather than for each
+ * output.  A fork copies the encoder's window and match finder tables,
+ * which costs up to a few times the dictionary size but doesn't grow
+ * with the input.  Stepped streams and finishing streams can't be
+ * forked.
+ */
+int EASYLZMA_API elzma_compress_stream_fork(elzma_compress_handle dest,
+                                            elzma_compress_handle src,
+                                            elzma_write_callback outputStream,
+                                            void * outputContext);
+
+/**
+ * Begin stepped compression, elzma_compress_run split into slices of
+ * bounded work so that a scheduler can interleave many compressions on
+ * one thread.  Input is read from inputStream and output passed to
+ * outputStream as elzma_compress_step calls do the work, using the
+ * format and parameters configured on the handle.  This is push mode
+ * compression which reads its own input, so the same restrictions
+ * apply: lzma and lzip formats only, single threaded, and one push
+ * mode or stepped stream per handle at a time.  Stop early with
+ * elzma_compress_reset.
+ */
+int EASYLZMA_API elzma_compress_step_begin(
+    elzma_compress_handle hand,
+    elzma_read_callback inputStream, void * inputContext,
+    elzma_write_callback outputStream, void * outputContext);
+
+/**
+ * Do some of the work of a stepped compression: at most workLimit bytes
+ * of input coded, and at most timeLimit microseconds spent (zero for no
+ * limit on either).  Both are rounded up to the encoder's 32k step, so
+ * a call always makes progress.  Returns ELZMA_E_AGAIN when it stopped
+ * at a limit, and ELZMA_E_OK once the compressed file is complete.
+ */
+int EASYLZMA_API elzma_compress_step(elzma_compress_handle hand,
+                                     size_t workLimit,
+                                     unsigned long timeLimit);
+
+/**
+ * The number of bytes of the window and match finder tables which the
+ * system backs with huge pages, after a run.  On Linux these are asked
+ * for with MAP_HUGETLB, or else madvise(MADV_HUGEPAGE), so that a large
+ * dictionary doesn't thrash the TLB.  0 where there are none or the
+ * system can't tell, or when the tables came from the client's
+ * allocation routines.  Runs split over worker threads (see
+ * elzma_compress_set_threads) code with encoders of their own, which
+ * aren't counted.
+ */
+unsigned long long EASYLZMA_API elzma_compress_huge_page_bytes(
+    elzma_compress_handle hand);
 
 /**
  * a heuristic utility routine to guess a dictionary size that gets near
@@ -41,6 +41,50 @@ void EASYLZMA_API elzma_decompress_set_allocation_callbacks(
  */ 
 void EASYLZMA_API elzma_decompress_free(elzma_decompress_handle * hand);
 
+/**
+ * Set the preset dictionary the data was compressed with (see
+ * elzma_compress_set_dictionary), for the following runs.  The data is
+ * copied, a NULL dict removes it.  Only the lzma and lzip formats
+ * support preset dictionaries.
+ */
+int EASYLZMA_API elzma_decompress_set_dictionary(
+    elzma_decompress_handle hand, const void * dict, size_t dictSize);
+
+/**
+ * A callback invoked during elzma_decompress_run of long range filtered
+ * data to read back size bytes of the output already written, starting
+ * offset bytes into it.  The bytes must all be read.
+ *
+ * \returns nonzero on failure.
+ */
+typedef int (*elzma_read_back_callback)(void *ctx,
+                                        unsigned long long offset,
+                                        void *buf, size_t size);
+
+/**
+ * Undo long range deduplication (see elzma_compress_set_long_range) in
+ * the following runs, for data compressed with it.  References to
+ * earlier data are resolved by reading back the output through
+ * readBack, so it must have random access to everything written, a file
+ * for instance.  A NULL readBack turns it off.  Only elzma_decompress_run
+ * supports it, xz streams whose block headers list the filter go through
+ * its decoder and everything else decompresses as usual.  Without it,
+ * those streams (and elzma_xz_decompress_block or elzma_decompress_buffer
+ * on them) fail with ELZMA_E_LONG_RANGE.
+ */
+int EASYLZMA_API elzma_decompress_set_long_range(
+    elzma_decompress_handle hand,
+    elzma_read_back_callback readBack, void * readBackContext);
+
+/**
+ * The number of bytes of the dictionary of the last elzma_decompress_run
+ * which the system backed with huge pages, as with
+ * elzma_compress_huge_page_bytes.  Buffer decoding uses the output as
+ * its dictionary and isn't counted.
+ */
+unsigned long long EASYLZMA_API elzma_decompress_huge_page_bytes(
+    elzma_decompress_handle hand);
+
 /**
  * Perform decompression
  *
@@ -54,6 +98,72 @@ int EASYLZMA_API elzma_decompress_run(
     elzma_write_callback outputStream, void * outputContext,
     elzma_file_format format);
 
+/**
+ * Decompress a file held in memory in a single call.  The data is
+ * decoded straight into the output buffer, with no callbacks and no
+ * intermediate copies.  As with elzma_decompress_run, all members of a
+ * multi-member lzip file are decoded and trailing garbage is ignored.
+ * xz files are located through their index, which is read from the end
+ * of the buffer, so they can't be followed by garbage.
+ *
+ * outLen is an in/out argument.  On input it's the size of the output
+ * buffer, on output the size of the decompressed data.  If the data
+ * doesn't fit ELZMA_E_OUTPUT_ERROR is returned.
+ */
+int EASYLZMA_API elzma_decompress_buffer(
+    elzma_decompress_handle hand,
+    const unsigned char * in, size_t inLen,
+    unsigned char * out, size_t * outLen,
+    elzma_file_format format);
+
+/** the location of one block of an xz file, as found in its index */
+typedef struct {
+    /** where the block (header, data, padding and check) begins in the
+     *  file, and its size */
+    unsigned long long compressedOffset;
+    unsigned long long compressedSize;
+    /** where the block's data begins in the decompressed output, and
+     *  its size */
+    unsigned long long uncompressedOffset;
+    unsigned long long uncompressedSize;
+    /** the integrity check type of the block's stream */
+    unsigned int checkType;
+} elzma_xz_block;
+
+/**
+ * Read the indexes of an xz file held in memory, producing the list of
+ * its blocks in file order, across all of its streams.  With it a
+ * reader can decompress only the blocks covering a range of the output,
+ * or hand blocks to several threads.  Only the stream headers, indexes
+ * and footers are read.
+ *
+ * On success *blocks must be released with elzma_xz_free_index.
+ */
+int EASYLZMA_API elzma_xz_read_index(
+    elzma_decompress_handle hand,
+    const unsigned char * in, size_t inLen,
+    elzma_xz_block ** blocks, unsigned int * numBlocks);
+
+/**
+ * Free a block list returned by elzma_xz_read_index.
+ */
+void EASYLZMA_API elzma_xz_free_index(elzma_decompress_handle hand,
+                                      elzma_xz_block * blocks);
+
+/**
+ * Decompress a single xz block.  in points at the block's first byte
+ * (compressedOffset in the file) and must hold at least compressedSize
+ * bytes.  The block's integrity check is verified (CRC32 and CRC64,
+ * other check types are not).
+ *
+ * outLen is an in/out argument as with elzma_decompress_buffer, the
+ * output buffer must hold the block's uncompressedSize bytes.
+ */
+int EASYLZMA_API elzma_xz_decompress_block(
+    elzma_decompress_handle hand,
+    const elzma_xz_block * block,
+    const unsigned char * in, size_t inLen,
+    unsigned char * out, size_t * outLen);
 
 #ifdef __cplusplus
 };
@@ -3,7 +3,11 @@
 #include <string.h>
 
 #define ELZMA_LZIP_HEADER_SIZE 6
-#define ELZMA_LZIP_FOOTER_SIZE 12
+#define ELZMA_LZIP_FOOTER_SIZE 20
+
+/* lzip dictionaries may range from 4k to 512m */
+#define ELZMA_LZIP_MIN_DICT_BITS 12
+#define ELZMA_LZIP_MAX_DICT_BITS 29
 
 static
 void initLzipHeader(struct elzma_file_header * hdr)
@@ -15,15 +19,29 @@ static
 int parseLzipHeader(const unsigned char * hdrBuf,
                     struct elzma_file_header * hdr)
 {
+    unsigned int bits;
+
     if (0 != strncmp("LZIP", (char *) hdrBuf, 4)) return 1;
-    /* XXX: ignore version for now */
+    /* we understand version 0 and 1 files */
+    if (hdrBuf[4] > 1) return 1;
+    hdr->version = hdrBuf[4];
     hdr->pb = 2;
     hdr->lp = 0;    
     hdr->lc = 3;        
     /* unknown at this point */
     hdr->isStreamed = 1;
     hdr->uncompressedSize = 0;    
-    hdr->dictSize = 1 << (hdrBuf[5] & 0x1F);
+
+    bits = hdrBuf[5] & 0x1F;
+    if (bits < ELZMA_LZIP_MIN_DICT_BITS || bits > ELZMA_LZIP_MAX_DICT_BITS) {
+        return 1;
+    }
+    hdr->dictSize = 1 << bits;
+    /* version 1 files may shave up to 7/16ths off of the power of two,
+     * this is encoded in the high three bits */
+    if (hdr->version > 0) {
+        hdr->dictSize -= (hdr->dictSize / 16) * ((hdrBuf[5] >> 5) & 0x7);
+    }
     return 0;
 }
 
@@ -31,16 +49,33 @@ static int
 serializeLzipHeader(unsigned char * hdrBuf,
                     const struct elzma_file_header * hdr)
 {
+    unsigned int bits = ELZMA_LZIP_MIN_DICT_BITS;
+    unsigned int fraction = 0;
+
     hdrBuf[0] = 'L';
     hdrBuf[1] = 'Z';
     hdrBuf[2] = 'I';
     hdrBuf[3] = 'P';
-    hdrBuf[4] = 0;
+    hdrBuf[4] = 1;
+
+    /* find the smallest representable dictionary size that is at least as
+     * large as what the encoder will use, it's fine for the decoder to
+     * have more room than it needs, but not less */
+    while (bits < ELZMA_LZIP_MAX_DICT_BITS &&
+           ((unsigned int) 1 << bits) < hdr->dictSize)
     {
-        int r = 0;
-        while ((hdr->dictSize >> r) != 0) r++;
-        hdrBuf[5] = (unsigned char) (r-1) & 0x1F;
-    }        
+        bits++;
+    }
+    if (bits > ELZMA_LZIP_MIN_DICT_BITS) {
+        unsigned int base = 1 << bits;
+        while (fraction < 7 &&
+               base - (base / 16) * (fraction + 1) >= hdr->dictSize)
+        {
+            fraction++;
+        }
+    }
+    hdrBuf[5] = (unsigned char) ((fraction << 5) | bits);
+
     return 0;
 }
 
@@ -60,7 +95,10 @@ serializeLzipFooter(struct elzma_file_footer * ftr,
         *(ftrBuf++) = (unsigned char) (ftr->uncompressedSize >> (i * 8)); 
     }
 
-    /* write version 0 files, omit member length for now*/
+    /* version 1 files end with the total member size */
+    for (i = 0; i < 8; i++) {
+        *(ftrBuf++) = (unsigned char) (ftr->memberSize >> (i * 8)); 
+    }
     
     return 0;
 }
@@ -84,7 +122,10 @@ parseLzipFooter(const unsigned char * ftrBuf,
         ftr->uncompressedSize +=
             (unsigned long long) *(ftrBuf++) << (i * 8); 
     }
-    /* read version 0 files, omit member length for now*/
+    /* the member size is only present in version 1 files, it's up to
+     * the caller to know how large the footer is (see
+     * ELZMA_LZIP_V0_FOOTER_SIZE) */
+    ftr->memberSize = 0;
     
     return 0;
 }
@@ -6,6 +6,10 @@
 /* lzip file format documented here:
  * http://download.savannah.gnu.org/releases-noredirect/lzip/manual/ */
 
+/* the format handler describes version 1 files which we write.  Version 0
+ * files have a shorter footer which lacks the trailing member size. */
+#define ELZMA_LZIP_V0_FOOTER_SIZE 12
+
 void initializeLZIPFormatHandler(struct elzma_format_handler * hand);
 
 #endif
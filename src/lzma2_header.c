@@ -0,0 +1,74 @@
+/*
+ * Written in 2009 by Lloyd Hilaiel
+ *
+ * License
+ * 
+ * All the cruft you find here is public domain.  You don't have to credit
+ * anyone to use this code, but my personal request is that you mention
+ * Igor Pavlov for his hard, high quality work.
+ */
+
+#include "lzma2_header.h"
+
+#include <string.h>
+
+#define ELZMA_LZMA2_HEADER_SIZE 1
+/* property 40 stands for a dictionary of 4GB - 1 */
+#define ELZMA_LZMA2_DICT_PROP_MAX 40
+
+/* dictionary sizes run 4k, 6k, 8k, 12k, ... alternating between 2 << n
+ * and 3 << n */
+static unsigned int
+dictSizeFromProp(unsigned char prop)
+{
+    if (prop == ELZMA_LZMA2_DICT_PROP_MAX) return 0xFFFFFFFF;
+    return (2 | (prop & 1)) << (prop / 2 + 11);
+}
+
+unsigned char
+elzmaLZMA2DictProp(unsigned int dictSize)
+{
+    unsigned char prop;
+    for (prop = 0; prop < ELZMA_LZMA2_DICT_PROP_MAX; prop++) {
+        if (dictSize <= dictSizeFromProp(prop)) break;
+    }
+    return prop;
+}
+
+static void
+initLzma2Header(struct elzma_file_header * hdr)
+{
+    memset((void *) hdr, 0, sizeof(struct elzma_file_header));
+    /* lc, lp and pb are carried by the chunks themselves, and the end of
+     * the data is marked by a terminating chunk */
+    hdr->isStreamed = 1;
+}
+
+static int
+parseLzma2Header(const unsigned char * hdrBuf,
+                 struct elzma_file_header * hdr)
+{
+    if (*hdrBuf > ELZMA_LZMA2_DICT_PROP_MAX) return 1;
+    hdr->dictSize = dictSizeFromProp(*hdrBuf);
+    return 0;
+}
+
+static int
+serializeLzma2Header(unsigned char * hdrBuf,
+                     const struct elzma_file_header * hdr)
+{
+    *hdrBuf = elzmaLZMA2DictProp(hdr->dictSize);
+    return 0;
+}
+
+void
+initializeLZMA2FormatHandler(struct elzma_format_handler * hand)
+{
+    hand->header_size = ELZMA_LZMA2_HEADER_SIZE;
+    hand->init_header = initLzma2Header;
+    hand->parse_header = parseLzma2Header;    
+    hand->serialize_header = serializeLzma2Header;    
+    hand->footer_size = 0;    
+    hand->serialize_footer = NULL;
+    hand->parse_footer = NULL;
+}
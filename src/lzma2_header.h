@@ -0,0 +1,14 @@
+#ifndef __EASYLZMA_LZMA2_HEADER__
+#define __EASYLZMA_LZMA2_HEADER__
+
+#include "common_internal.h"
+
+/* a raw LZMA2 stream preceded by the single dictionary size byte which
+ * 7-Zip and xz use as LZMA2's filter properties */
+
+void initializeLZMA2FormatHandler(struct elzma_format_handler * hand);
+
+/* the smallest dictionary size property which covers dictSize */
+unsigned char elzmaLZMA2DictProp(unsigned int dictSize);
+
+#endif
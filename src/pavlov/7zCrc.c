@@ -4,11 +4,16 @@ Igor Pavlov
 Public domain */
 
 #include "7zCrc.h"
+#include "Threads.h"
 
 #define kCrcPoly 0xEDB88320
 UInt32 g_CrcTable[256];
 
-void MY_FAST_CALL CrcGenerateTable(void)
+/* the match finder threads of one encoder may be reading the table while
+   another thread asks for it, so it's written only once */
+static COnce g_CrcTableOnce = ONCE_INIT;
+
+static void CrcGenerateTableOnce(void)
 {
   UInt32 i;
   for (i = 0; i < 256; i++)
@@ -21,6 +26,11 @@ void MY_FAST_CALL CrcGenerateTable(void)
   }
 }
 
+void MY_FAST_CALL CrcGenerateTable(void)
+{
+  Once_Run(&g_CrcTableOnce, CrcGenerateTableOnce);
+}
+
 UInt32 MY_FAST_CALL CrcUpdate(UInt32 v, const void *data, size_t size)
 {
   const Byte *p = (const Byte *)data;
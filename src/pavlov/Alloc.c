@@ -3,11 +3,24 @@
 Igor Pavlov
 Public domain */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #endif
 #include <stdlib.h>
 
+#ifdef __linux__
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #include "Alloc.h"
 
 /* #define _SZ_ALLOC_DEBUG */
@@ -124,4 +137,379 @@ void BigFree(void *address)
   VirtualFree(address, 0, MEM_RELEASE);
 }
 
+size_t LargePageBytes(const void *address, size_t size)
+{
+  (void)address;
+  (void)size;
+  return 0;
+}
+
+void *RingAlloc(size_t *size)
+{
+  (void)size;
+  return 0;
+}
+
+void RingFree(void *address, size_t size)
+{
+  (void)address;
+  (void)size;
+}
+
+unsigned RingGeneration(void)
+{
+  return 0;
+}
+
+#elif defined(__linux__)
+
+/* blocks of a huge page or more are mapped on their own: from the
+   reserved huge pages (MAP_HUGETLB) while there are enough of them,
+   otherwise from normal pages aligned to huge pages and marked for
+   transparent huge pages (MADV_HUGEPAGE).  The advice then belongs to
+   that mapping and goes away with it in BigFree, instead of staying on
+   heap pages which malloc hands out again for anything.  Smaller blocks,
+   which can't fill a huge page, come from malloc.  Each block is
+   preceded by a header holding the length mapped, 0 for those from
+   malloc, which BigFree needs to release it */
+
+#define kBigAllocHeaderSize 64
+#define kDefaultHugePageSize ((size_t)1 << 21)
+
+static size_t g_HugePageSize = 0;
+static unsigned long g_HugePagesTotal = 0;
+static pthread_once_t g_HugePageSizeOnce = PTHREAD_ONCE_INIT;
+
+static void ReadHugePageSize(void)
+{
+  char line[256];
+  unsigned long kb;
+  FILE *f = fopen("/proc/meminfo", "r");
+  if (f == 0)
+    return;
+  /* the reserved huge pages are counted ahead of their size */
+  while (fgets(line, sizeof(line), f) != 0)
+  {
+    if (sscanf(line, "HugePages_Total: %lu", &kb) == 1)
+      g_HugePagesTotal = kb;
+    else if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+    {
+      size_t size = (size_t)kb << 10;
+      if (size != 0 && (size & (size - 1)) == 0)
+        g_HugePageSize = size;
+      break;
+    }
+  }
+  fclose(f);
+  if (g_HugePageSize == 0)
+    g_HugePagesTotal = 0;
+}
+
+static size_t GetHugePageSize(void)
+{
+  pthread_once(&g_HugePageSizeOnce, ReadHugePageSize);
+  return g_HugePageSize != 0 ? g_HugePageSize : kDefaultHugePageSize;
+}
+
+void *BigAlloc(size_t size)
+{
+  size_t pageSize, mapSize, head;
+  char *p;
+  if (size == 0)
+    return 0;
+  #ifdef _SZ_ALLOC_DEBUG
+  fprintf(stderr, "\nAlloc_Big %10d bytes;  count = %10d", size, g_allocCountBig++);
+  #endif
+
+  pageSize = GetHugePageSize();
+  if (size < pageSize)
+  {
+    p = (char *)malloc(size + kBigAllocHeaderSize);
+    if (p == 0)
+      return 0;
+    *(size_t *)p = 0;
+    return p + kBigAllocHeaderSize;
+  }
+  if (size > ((size_t)0 - 1) - kBigAllocHeaderSize - pageSize * 2)
+    return 0;
+  mapSize = (size + kBigAllocHeaderSize + pageSize - 1) & ~(pageSize - 1);
+
+  #ifdef MAP_HUGETLB
+  if (g_HugePagesTotal != 0)
+  {
+    p = (char *)mmap(0, mapSize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != (char *)MAP_FAILED)
+    {
+      *(size_t *)p = mapSize;
+      return p + kBigAllocHeaderSize;
+    }
+  }
+  #endif
+
+  /* a huge page more is mapped, and trimmed, to align the block */
+  p = (char *)mmap(0, mapSize + pageSize, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == (char *)MAP_FAILED)
+    return 0;
+  head = (pageSize - ((size_t)p & (pageSize - 1))) & (pageSize - 1);
+  if (head != 0)
+    munmap(p, head);
+  munmap(p + head + mapSize, pageSize - head);
+  p += head;
+  #ifdef MADV_HUGEPAGE
+  madvise(p, mapSize, MADV_HUGEPAGE);
+  #endif
+  *(size_t *)p = mapSize;
+  return p + kBigAllocHeaderSize;
+}
+
+void BigFree(void *address)
+{
+  char *p;
+  size_t mapSize;
+  #ifdef _SZ_ALLOC_DEBUG
+  if (address != 0)
+    fprintf(stderr, "\nFree_Big; count = %10d", --g_allocCountBig);
+  #endif
+
+  if (address == 0)
+    return;
+  p = (char *)address - kBigAllocHeaderSize;
+  mapSize = *(size_t *)p;
+  if (mapSize == 0)
+    free(p);
+  else
+    munmap(p, mapSize);
+}
+
+/* the mappings overlapping the block are looked up in /proc/self/smaps:
+   all of those with pages larger than normal (hugetlbfs) count, and of the
+   others as much as their AnonHugePages, the transparent huge pages */
+size_t LargePageBytes(const void *address, size_t size)
+{
+  char line[1024];
+  unsigned long start = (unsigned long)address, end = start + size;
+  unsigned long lo, hi, kb, pageKb = (unsigned long)sysconf(_SC_PAGESIZE) >> 10;
+  size_t overlap = 0, res = 0;
+  FILE *f;
+  /* nothing smaller than a huge page can be in them */
+  if (size < GetHugePageSize())
+    return 0;
+  f = fopen("/proc/self/smaps", "r");
+  if (f == 0)
+    return 0;
+  while (fgets(line, sizeof(line), f) != 0)
+  {
+    if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+    {
+      if (lo < start)
+        lo = start;
+      if (hi > end)
+        hi = end;
+      overlap = (lo < hi) ? hi - lo : 0;
+    }
+    else if (overlap == 0)
+      continue;
+    else if (sscanf(line, "KernelPageSize: %lu kB", &kb) == 1)
+    {
+      if (kb > pageKb)
+      {
+        res += overlap;
+        overlap = 0;
+      }
+    }
+    else if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+    {
+      res += ((size_t)kb << 10) < overlap ? ((size_t)kb << 10) : overlap;
+      overlap = 0;
+    }
+  }
+  fclose(f);
+  return res;
+}
+
+/* the ring is a memfd mapped over both halves of an address range
+   reserved in one piece.  Reserved huge pages (MFD_HUGETLB) are tried
+   first, and normal pages are marked for transparent huge pages, which
+   shared memory gets where the system enables them for it */
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 4U
+#endif
+
+static char *RingMap(size_t ringSize, size_t align, unsigned flags)
+{
+  #ifdef __NR_memfd_create
+  char *p, *q;
+  size_t head;
+  int fd = (int)syscall(__NR_memfd_create, "lzma-window", flags | MFD_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  p = (char *)MAP_FAILED;
+  if (ftruncate(fd, (off_t)ringSize) == 0)
+    p = (char *)mmap(0, ringSize * 2 + align, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == (char *)MAP_FAILED)
+  {
+    close(fd);
+    return 0;
+  }
+  head = (align - ((size_t)p & (align - 1))) & (align - 1);
+  if (head != 0)
+    munmap(p, head);
+  munmap(p + head + ringSize * 2, align - head);
+  p += head;
+  q = (char *)mmap(p, ringSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_FIXED, fd, 0);
+  if (q == p)
+    q = (char *)mmap(p + ringSize, ringSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED, fd, 0);
+  close(fd);
+  if (q != p + ringSize)
+  {
+    munmap(p, ringSize * 2);
+    return 0;
+  }
+  return p;
+  #else
+  (void)ringSize;
+  (void)align;
+  (void)flags;
+  return 0;
+  #endif
+}
+
+static int g_RingNormalPages = 0;
+static pthread_once_t g_RingNormalPagesOnce = PTHREAD_ONCE_INIT;
+
+/* whether the transparent huge page mode in the file at path is on, that
+   is anything but [never] or [deny] */
+static int ReadThpEnabled(const char *path)
+{
+  char line[256];
+  const char *mode;
+  int res = 0;
+  FILE *f = fopen(path, "r");
+  if (f == 0)
+    return 0;
+  if (fgets(line, sizeof(line), f) != 0 && (mode = strchr(line, '[')) != 0)
+    res = (strncmp(mode, "[never]", 7) != 0 && strncmp(mode, "[deny]", 6) != 0);
+  fclose(f);
+  return res;
+}
+
+/* a ring of normal pages is backed no worse than a block from BigAlloc
+   where shared memory gets transparent huge pages, or private memory
+   doesn't either.  Otherwise large rings are left to reserved huge
+   pages, since the TLB misses of normal ones cost more than moving the
+   window saves */
+static void ReadRingNormalPages(void)
+{
+  g_RingNormalPages =
+      ReadThpEnabled("/sys/kernel/mm/transparent_hugepage/shmem_enabled") ||
+      !ReadThpEnabled("/sys/kernel/mm/transparent_hugepage/enabled");
+}
+
+/* counts the fork()s this process is a child through, since the first
+   ring was mapped */
+static unsigned g_RingGeneration = 0;
+static pthread_once_t g_RingForkOnce = PTHREAD_ONCE_INIT;
+
+static void RingForked(void)
+{
+  g_RingGeneration++;
+}
+
+static void RegisterRingFork(void)
+{
+  pthread_atfork(0, 0, RingForked);
+}
+
+unsigned RingGeneration(void)
+{
+  return g_RingGeneration;
+}
+
+void *RingAlloc(size_t *size)
+{
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t hugePageSize = GetHugePageSize();
+  size_t ringSize;
+  char *p = 0;
+  if (*size == 0 || *size > ((size_t)0 - 1) / 4)
+    return 0;
+  pthread_once(&g_RingForkOnce, RegisterRingFork);
+  if (*size >= hugePageSize)
+  {
+    pageSize = hugePageSize;
+    ringSize = (*size + pageSize - 1) & ~(pageSize - 1);
+    if (g_HugePageSize != 0)
+      p = RingMap(ringSize, pageSize, MFD_HUGETLB);
+  }
+  else
+    ringSize = (*size + pageSize - 1) & ~(pageSize - 1);
+  if (p == 0)
+  {
+    if (pageSize == hugePageSize)
+    {
+      pthread_once(&g_RingNormalPagesOnce, ReadRingNormalPages);
+      if (!g_RingNormalPages)
+        return 0;
+    }
+    p = RingMap(ringSize, pageSize, 0);
+    if (p == 0)
+      return 0;
+    #ifdef MADV_HUGEPAGE
+    if (pageSize == hugePageSize)
+      madvise(p, ringSize * 2, MADV_HUGEPAGE);
+    #endif
+  }
+  /* the memfd is shared, so a child after fork() would write the
+     parent's window (MADV_WIPEONFORK only takes private memory), and
+     copying it at each fork() would cost a fork()+exec() the whole
+     window: the child gets no mapping at all instead, and
+     RingGeneration tells it so */
+  #ifdef MADV_DONTFORK
+  madvise(p, ringSize * 2, MADV_DONTFORK);
+  #endif
+  *size = ringSize;
+  return p;
+}
+
+void RingFree(void *address, size_t size)
+{
+  if (address != 0)
+    munmap(address, size * 2);
+}
+
+#else
+
+size_t LargePageBytes(const void *address, size_t size)
+{
+  (void)address;
+  (void)size;
+  return 0;
+}
+
+void *RingAlloc(size_t *size)
+{
+  (void)size;
+  return 0;
+}
+
+void RingFree(void *address, size_t size)
+{
+  (void)address;
+  (void)size;
+}
+
+unsigned RingGeneration(void)
+{
+  return 0;
+}
+
 #endif
@@ -24,9 +24,39 @@ void BigFree(void *address);
 
 #define MidAlloc(size) MyAlloc(size)
 #define MidFree(address) MyFree(address)
+
+#ifdef __linux__
+
+void *BigAlloc(size_t size);
+void BigFree(void *address);
+
+#else
+
 #define BigAlloc(size) MyAlloc(size)
 #define BigFree(address) MyFree(address)
 
 #endif
 
 #endif
+
+/* LargePageBytes returns how many of the size bytes at address the system
+   has backed with large pages, 0 where it can't tell (all but Linux) */
+size_t LargePageBytes(const void *address, size_t size);
+
+/* RingAlloc maps the same memory twice in a row, so that address[i] and
+   address[i + *size] are one byte, for windows which wrap around without
+   moving.  *size is rounded up to whole pages, large ones where it's at
+   least a large page.  It returns 0 where the system can't (all but
+   Linux), and for sizes of a large page or more where it could only use
+   normal pages while BigAlloc would get large ones.  RingFree takes the
+   rounded size.
+
+   The mapping isn't inherited by fork(): RingGeneration changes in the
+   child, and a ring allocated under another generation must be dropped
+   without RingFree, since the child may have mapped something else at
+   its address since */
+void *RingAlloc(size_t *size);
+void RingFree(void *address, size_t size);
+unsigned RingGeneration(void);
+
+#endif
@@ -3,51 +3,238 @@
 
 #include <string.h>
 
+#include "Alloc.h"
 #include "LzFind.h"
 #include "LzHash.h"
+#include "CpuArch.h"
+#include "Threads.h"
+
+/* SSE2 is always there on x86-64; 32-bit x86 builds check for it */
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define MF_SSE2
+#define MF_SSE2_FUNC
+#elif defined(__i386__) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define MF_SSE2
+#define MF_SSE2_FUNC __attribute__((target("sse2")))
+#define MF_SSE2_CHECK
+#endif
+
+#ifdef MF_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define MF_PREFETCH(a) __builtin_prefetch(a)
+#elif defined(_MSC_VER) && defined(MF_SSE2)
+#define MF_PREFETCH(a) _mm_prefetch((const char *)(a), _MM_HINT_T0)
+#else
+#define MF_PREFETCH(a)
+#endif
 
 #define kEmptyHashValue 0
 #define kMaxValForNormalize ((UInt32)0xFFFFFFFF)
+#ifdef _LZ_POS64
+#define kMaxValForReuse ((CLzRef)1 << 62)
+#else
+#define kMaxValForReuse ((UInt32)1 << 31)
+#endif
 #define kNormalizeStepMin (1 << 10) /* it must be power of 2 */
 #define kNormalizeMask (~(kNormalizeStepMin - 1))
 #define kMaxHistorySize ((UInt32)3 << 30)
 
 #define kStartMaxLen 3
 
+/* ---------- Match lengths ----------
+
+The match finders extend a match between pb and cur, which agree on their
+first len bytes, with MatchLen: it returns where they first differ, or
+lenLimit.  Nothing past lenLimit is read, as the window may end there.
+Most matches end within a word, which is compared inline; the rest go to
+the widest compare the CPU has, chosen at MatchFinder_Construct.  All of
+them give the same lengths. */
+
+typedef UInt32 (*Mf_MatchLen_Func)(const Byte *pb, const Byte *cur, UInt32 len, UInt32 lenLimit);
+
+static UInt32 MatchLen_Bytes(const Byte *pb, const Byte *cur, UInt32 len, UInt32 lenLimit)
+{
+  for (; len != lenLimit; len++)
+    if (pb[len] != cur[len])
+      break;
+  return len;
+}
+
+#if defined(__GNUC__)
+#define MF_CTZ32(x) ((UInt32)__builtin_ctz(x))
+#define MF_CTZ64(x) ((UInt32)__builtin_ctzll(x))
+#elif defined(_MSC_VER)
+static UInt32 MF_CTZ32(UInt32 x) { unsigned long i; _BitScanForward(&i, x); return (UInt32)i; }
+#if defined(_M_X64) || defined(_M_AMD64)
+static UInt32 MF_CTZ64(UInt64 x) { unsigned long i; _BitScanForward64(&i, x); return (UInt32)i; }
+#define MF_CTZ64 MF_CTZ64
+#endif
+#endif
+
+/* the first differing byte of two little endian words is the lowest set
+   byte of their xor */
+#if defined(LITTLE_ENDIAN_UNALIGN) && defined(MF_CTZ64)
+#define MF_WORDS
+#endif
+
+#ifdef MF_WORDS
+
+static UInt32 MatchLen_Words(const Byte *pb, const Byte *cur, UInt32 len, UInt32 lenLimit)
+{
+  while (lenLimit - len >= 8)
+  {
+    UInt64 x = GetUi64(pb + len) ^ GetUi64(cur + len);
+    if (x != 0)
+      return len + (MF_CTZ64(x) >> 3);
+    len += 8;
+  }
+  return MatchLen_Bytes(pb, cur, len, lenLimit);
+}
+
+#else
+#define MatchLen_Words MatchLen_Bytes
+#endif
+
+#ifdef MF_SSE2
+
+MF_SSE2_FUNC
+static UInt32 MatchLen_Sse2(const Byte *pb, const Byte *cur, UInt32 len, UInt32 lenLimit)
+{
+  while (lenLimit - len >= 16)
+  {
+    UInt32 m = (UInt32)_mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *)(pb + len)),
+        _mm_loadu_si128((const __m128i *)(cur + len))));
+    if (m != 0xFFFF)
+      return len + MF_CTZ32(~m);
+    len += 16;
+  }
+  return MatchLen_Words(pb, cur, len, lenLimit);
+}
+
+#endif
+
+/* set once, by the first match finder constructed, as the match finder
+   threads of other encoders may be reading it */
+static Mf_MatchLen_Func g_MatchLen = MatchLen_Words;
+static COnce g_MatchLenOnce = ONCE_INIT;
+
+static void MatchLen_Init(void)
+{
+  Mf_MatchLen_Func f = MatchLen_Words;
+  #if defined(MF_SSE2_CHECK)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    f = MatchLen_Sse2;
+  #elif defined(MF_SSE2)
+  f = MatchLen_Sse2;
+  #endif
+  g_MatchLen = f;
+}
+
+static UInt32 MatchLen(const Byte *pb, const Byte *cur, UInt32 len, UInt32 lenLimit)
+{
+  #ifdef MF_WORDS
+  if (lenLimit - len >= 8)
+  {
+    UInt64 x = GetUi64(pb + len) ^ GetUi64(cur + len);
+    if (x != 0)
+      return len + (MF_CTZ64(x) >> 3);
+    len += 8;
+  }
+  #endif
+  return g_MatchLen(pb, cur, len, lenLimit);
+}
+
+int MatchFinder_WindowLost(const CMatchFinder *p)
+{
+  return p->ringSize != 0 && p->ringGeneration != RingGeneration();
+}
+
 static void LzInWindow_Free(CMatchFinder *p, ISzAlloc *alloc)
 {
-  if (!p->directInput)
+  if (p->ringSize != 0)
   {
-    alloc->Free(alloc, p->bufferBase);
-    p->bufferBase = 0;
+    if (!MatchFinder_WindowLost(p))
+      RingFree(p->bufferAlloc, p->ringSize);
   }
+  else
+    alloc->Free(alloc, p->bufferAlloc);
+  p->bufferAlloc = 0;
+  p->bufferAllocSize = 0;
+  p->ringSize = 0;
+  if (!p->directInput)
+    p->bufferBase = 0;
 }
 
 /* keepSizeBefore + keepSizeAfter + keepSizeReserv must be < 4G) */
 
+#define kMaxRingSize ((UInt32)1 << 31)
+
 static int LzInWindow_Create(CMatchFinder *p, UInt32 keepSizeReserv, ISzAlloc *alloc)
 {
   UInt32 blockSize = p->keepSizeBefore + p->keepSizeAfter + keepSizeReserv;
+  p->blockSize = blockSize;
+  /* the caller's buffer is the window, an allocated one is kept for later
+     streams */
   if (p->directInput)
-  {
-    p->blockSize = blockSize;
     return 1;
+  /* a window mapped twice never needs moving: when buffer gets near the
+     end of the second mapping it goes back to the same bytes in the first
+     (MatchFinder_MoveBlock).  blockSize covers both mappings, so it must
+     stay below 4G */
+  if (p->ringWindow && blockSize < kMaxRingSize)
+  {
+    if (p->ringSize == 0 || p->ringSize < blockSize || MatchFinder_WindowLost(p))
+    {
+      size_t size = blockSize;
+      LzInWindow_Free(p, alloc);
+      p->bufferAlloc = (Byte *)RingAlloc(&size);
+      if (p->bufferAlloc != 0 && size >= kMaxRingSize)
+      {
+        RingFree(p->bufferAlloc, size);
+        p->bufferAlloc = 0;
+      }
+      if (p->bufferAlloc != 0)
+      {
+        p->bufferAllocSize = p->ringSize = (UInt32)size;
+        p->ringGeneration = RingGeneration();
+      }
+    }
+    if (p->ringSize != 0)
+    {
+      p->blockSize = p->ringSize * 2;
+      p->bufferBase = p->bufferAlloc;
+      return 1;
+    }
   }
-  if (p->bufferBase == 0 || p->blockSize != blockSize)
+  /* otherwise a flat one, from which MatchFinder_MoveBlock copies.  A
+     window left over from an earlier stream is reused if it's large
+     enough */
+  if (p->ringSize != 0 || p->bufferAlloc == 0 || p->bufferAllocSize < blockSize)
   {
     LzInWindow_Free(p, alloc);
-    p->blockSize = blockSize;
-    p->bufferBase = (Byte *)alloc->Alloc(alloc, (size_t)blockSize);
+    p->bufferAlloc = (Byte *)alloc->Alloc(alloc, (size_t)blockSize);
+    if (p->bufferAlloc != 0)
+      p->bufferAllocSize = blockSize;
   }
+  p->bufferBase = p->bufferAlloc;
   return (p->bufferBase != 0);
 }
 
 Byte *MatchFinder_GetPointerToCurrentPos(CMatchFinder *p) { return p->buffer; }
 Byte MatchFinder_GetIndexByte(CMatchFinder *p, Int32 index) { return p->buffer[index]; }
 
-UInt32 MatchFinder_GetNumAvailableBytes(CMatchFinder *p) { return p->streamPos - p->pos; }
+UInt32 MatchFinder_GetNumAvailableBytes(CMatchFinder *p) { return (UInt32)(p->streamPos - p->pos); }
 
-void MatchFinder_ReduceOffsets(CMatchFinder *p, UInt32 subValue)
+void MatchFinder_ReduceOffsets(CMatchFinder *p, CLzRef subValue)
 {
   p->posLimit -= subValue;
   p->pos -= subValue;
@@ -58,10 +245,33 @@ static void MatchFinder_ReadBlock(CMatchFinder *p)
 {
   if (p->streamEndWasReached || p->result != SZ_OK)
     return;
+  if (p->directInput)
+  {
+    #ifdef _LZ_POS64
+    UInt32 curSize = 0xFFFFFFFF - (UInt32)(p->streamPos - p->pos);
+    #else
+    UInt32 curSize = 0xFFFFFFFF - p->streamPos;
+    #endif
+    if (curSize > p->directInputRem)
+      curSize = (UInt32)p->directInputRem;
+    p->directInputRem -= curSize;
+    p->streamPos += curSize;
+    if (p->directInputRem == 0)
+      p->streamEndWasReached = 1;
+    return;
+  }
   for (;;)
   {
     Byte *dest = p->buffer + (p->streamPos - p->pos);
     size_t size = (p->bufferBase + p->blockSize - dest);
+    if (p->ringSize != 0)
+    {
+      /* the bytes past dest are those kept before buffer, a ring further
+         on, and only the rest of the ring is free */
+      size_t held = (size_t)(dest - p->buffer) + p->keepSizeBefore;
+      if (size > p->ringSize - held)
+        size = p->ringSize - held;
+    }
     if (size == 0)
       return;
     p->result = p->stream->Read(p->stream, dest, &size);
@@ -80,6 +290,13 @@ static void MatchFinder_ReadBlock(CMatchFinder *p)
 
 void MatchFinder_MoveBlock(CMatchFinder *p)
 {
+  if (p->ringSize != 0)
+  {
+    /* buffer is at least a ring past keepSizeBefore, and the same bytes
+       are a ring back */
+    p->buffer -= p->ringSize;
+    return;
+  }
   memmove(p->bufferBase,
     p->buffer - p->keepSizeBefore,
     (size_t)(p->streamPos - p->pos + p->keepSizeBefore));
@@ -89,6 +306,8 @@ void MatchFinder_MoveBlock(CMatchFinder *p)
 int MatchFinder_NeedMove(CMatchFinder *p)
 {
   /* if (p->streamEndWasReached) return 0; */
+  if (p->directInput)
+    return 0;
   return ((size_t)(p->bufferBase + p->blockSize - p->buffer) <= p->keepSizeAfter);
 }
 
@@ -115,32 +334,33 @@ static void MatchFinder_SetDefaultSettings(CMatchFinder *p)
   /* p->skipModeBits = 0; */
   p->directInput = 0;
   p->bigHash = 0;
+  p->mulHash = 0;
+  p->ringWindow = 0;
 }
 
-#define kCrcPoly 0xEDB88320
 
 void MatchFinder_Construct(CMatchFinder *p)
 {
-  UInt32 i;
   p->bufferBase = 0;
+  p->bufferAlloc = 0;
+  p->bufferAllocSize = 0;
+  p->ringSize = 0;
   p->directInput = 0;
+  p->directInputRem = 0;
   p->hash = 0;
+  p->refsAllocSize = 0;
+  p->hashIsValid = 0;
   MatchFinder_SetDefaultSettings(p);
-
-  for (i = 0; i < 256; i++)
-  {
-    UInt32 r = i;
-    int j;
-    for (j = 0; j < 8; j++)
-      r = (r >> 1) ^ (kCrcPoly & ~((r & 1) - 1));
-    p->crc[i] = r;
-  }
+  Once_Run(&g_MatchLenOnce, MatchLen_Init);
+  CrcGenerateTable();
 }
 
 static void MatchFinder_FreeThisClassMemory(CMatchFinder *p, ISzAlloc *alloc)
 {
   alloc->Free(alloc, p->hash);
   p->hash = 0;
+  p->refsAllocSize = 0;
+  p->hashIsValid = 0;
 }
 
 void MatchFinder_Free(CMatchFinder *p, ISzAlloc *alloc)
@@ -211,19 +431,30 @@ int MatchFinder_Create(CMatchFinder *p, UInt32 historySize,
     }
 
     {
-      UInt32 prevSize = p->hashSizeSum + p->numSons;
       UInt32 newSize;
+      /* Normalize only covers hashSizeSum + numSons refs, so a stream
+         with another layout can't trust what lies beyond */
+      if (p->hashIsValid && (p->hashSizeSum != hs ||
+          p->numSons != (p->btMode ? newCyclicBufferSize * 2 : newCyclicBufferSize)))
+        p->hashIsValid = 0;
       p->historySize = historySize;
       p->hashSizeSum = hs;
       p->cyclicBufferSize = newCyclicBufferSize;
       p->numSons = (p->btMode ? newCyclicBufferSize * 2 : newCyclicBufferSize);
       newSize = p->hashSizeSum + p->numSons;
-      if (p->hash != 0 && prevSize == newSize)
+      /* only MatchFinder_Init's clearing of the hash is required between
+         streams, so tables from an earlier stream are reused if they're
+         large enough */
+      if (p->hash != 0 && p->refsAllocSize >= newSize)
+      {
+        p->son = p->hash + p->hashSizeSum;
         return 1;
+      }
       MatchFinder_FreeThisClassMemory(p, alloc);
       p->hash = AllocRefs(newSize, alloc);
       if (p->hash != 0)
       {
+        p->refsAllocSize = newSize;
         p->son = p->hash + p->hashSizeSum;
         return 1;
       }
@@ -235,11 +466,14 @@ int MatchFinder_Create(CMatchFinder *p, UInt32 historySize,
 
 static void MatchFinder_SetLimits(CMatchFinder *p)
 {
-  UInt32 limit = kMaxValForNormalize - p->pos;
-  UInt32 limit2 = p->cyclicBufferSize - p->cyclicBufferPos;
+  UInt32 limit = p->cyclicBufferSize - p->cyclicBufferPos;
+  UInt32 limit2;
+  #ifndef _LZ_POS64
+  limit2 = kMaxValForNormalize - p->pos;
   if (limit2 < limit)
     limit = limit2;
-  limit2 = p->streamPos - p->pos;
+  #endif
+  limit2 = (UInt32)(p->streamPos - p->pos);
   if (limit2 <= p->keepSizeAfter)
   {
     if (limit2 > 0)
@@ -250,7 +484,7 @@ static void MatchFinder_SetLimits(CMatchFinder *p)
   if (limit2 < limit)
     limit = limit2;
   {
-    UInt32 lenLimit = p->streamPos - p->pos;
+    UInt32 lenLimit = (UInt32)(p->streamPos - p->pos);
     if (lenLimit > p->matchMaxLen)
       lenLimit = p->matchMaxLen;
     p->lenLimit = lenLimit;
@@ -260,29 +494,91 @@ static void MatchFinder_SetLimits(CMatchFinder *p)
 
 void MatchFinder_Init(CMatchFinder *p)
 {
-  UInt32 i;
-  for (i = 0; i < p->hashSizeSum; i++)
-    p->hash[i] = kEmptyHashValue;
+  CLzRef startPos = p->cyclicBufferSize;
+  if (p->hashIsValid && p->pos < kMaxValForReuse &&
+      p->cyclicBufferSize < kMaxValForReuse)
+  {
+    /* every ref left by the previous stream is at most p->pos, so a
+       stream starting a full window past it sees them all as out of
+       range, exactly like kEmptyHashValue, and the hash needn't be
+       cleared */
+    startPos = p->pos + p->cyclicBufferSize;
+  }
+  else
+  {
+    UInt32 i;
+    for (i = 0; i < p->hashSizeSum; i++)
+      p->hash[i] = kEmptyHashValue;
+  }
+  p->hashIsValid = 1;
   p->cyclicBufferPos = 0;
   p->buffer = p->bufferBase;
-  p->pos = p->streamPos = p->cyclicBufferSize;
+  p->pos = p->streamPos = startPos;
   p->result = SZ_OK;
   p->streamEndWasReached = 0;
   MatchFinder_ReadBlock(p);
   MatchFinder_SetLimits(p);
 }
 
-static UInt32 MatchFinder_GetSubValue(CMatchFinder *p)
+UInt32 MatchFinder_ReadAhead(CMatchFinder *p, UInt32 size)
 {
-  return (p->pos - p->historySize - 1) & kNormalizeMask;
+  if (size > p->keepSizeAfter && (UInt32)(p->streamPos - p->pos) < size &&
+      !p->directInput)
+  {
+    /* ReadBlock stops once more than keepSizeAfter bytes are ahead, and
+       the window is moved first if they wouldn't fit before its end */
+    UInt32 keepSizeAfter = p->keepSizeAfter;
+    if ((size_t)(p->bufferBase + p->blockSize - p->buffer) < size)
+      MatchFinder_MoveBlock(p);
+    p->keepSizeAfter = size - 1;
+    MatchFinder_ReadBlock(p);
+    p->keepSizeAfter = keepSizeAfter;
+    MatchFinder_SetLimits(p);
+  }
+  return (UInt32)(p->streamPos - p->pos);
+}
+
+#define REPEATS_AT(ref) { UInt32 delta = LzRef_Delta(p->pos, ref); \
+  if (delta < p->cyclicBufferSize && memcmp(p->buffer - delta, cur, 8) == 0) \
+    { count++; continue; } }
+
+UInt32 MatchFinder_CountRepeats(CMatchFinder *p, UInt32 size, UInt32 step)
+{
+  UInt32 i, count = 0;
+  /* the heads hold the newest positions with each hash, all of them
+     before p->pos */
+  for (i = 0; i + 8 <= size; i += step)
+  {
+    const Byte *cur = p->buffer + i;
+    UInt32 hash2Value, hash3Value, hashValue;
+    if (p->numHashBytes == 2)
+    {
+      HASH2_CALC;
+      REPEATS_AT(p->hash[hashValue]);
+    }
+    else if (p->numHashBytes == 3)
+    {
+      HASH3_CALC;
+      REPEATS_AT(p->hash[kFix3HashSize + hashValue]);
+      REPEATS_AT(p->hash[hash2Value]);
+    }
+    else
+    {
+      HASH4_CALC;
+      REPEATS_AT(p->hash[kFix4HashSize + hashValue]);
+      REPEATS_AT(p->hash[kFix3HashSize + hash3Value]);
+      REPEATS_AT(p->hash[hash2Value]);
+    }
+  }
+  return count;
 }
 
-void MatchFinder_Normalize3(UInt32 subValue, CLzRef *items, UInt32 numItems)
+void MatchFinder_Normalize3(CLzRef subValue, CLzRef *items, UInt32 numItems)
 {
   UInt32 i;
   for (i = 0; i < numItems; i++)
   {
-    UInt32 value = items[i];
+    CLzRef value = items[i];
     if (value <= subValue)
       value = kEmptyHashValue;
     else
@@ -291,17 +587,26 @@ void MatchFinder_Normalize3(UInt32 subValue, CLzRef *items, UInt32 numItems)
   }
 }
 
+#ifndef _LZ_POS64
+static UInt32 MatchFinder_GetSubValue(CMatchFinder *p)
+{
+  return (p->pos - p->historySize - 1) & kNormalizeMask;
+}
+
 static void MatchFinder_Normalize(CMatchFinder *p)
 {
   UInt32 subValue = MatchFinder_GetSubValue(p);
   MatchFinder_Normalize3(subValue, p->hash, p->hashSizeSum + p->numSons);
   MatchFinder_ReduceOffsets(p, subValue);
 }
+#endif
 
 static void MatchFinder_CheckLimits(CMatchFinder *p)
 {
+  #ifndef _LZ_POS64
   if (p->pos == kMaxValForNormalize)
     MatchFinder_Normalize(p);
+  #endif
   if (!p->streamEndWasReached && p->keepSizeAfter == p->streamPos - p->pos)
     MatchFinder_CheckAndMoveAndRead(p);
   if (p->cyclicBufferPos == p->cyclicBufferSize)
@@ -309,14 +614,14 @@ static void MatchFinder_CheckLimits(CMatchFinder *p)
   MatchFinder_SetLimits(p);
 }
 
-static UInt32 * Hc_GetMatchesSpec(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const Byte *cur, CLzRef *son,
+static UInt32 * Hc_GetMatchesSpec(UInt32 lenLimit, CLzRef curMatch, CLzRef pos, const Byte *cur, CLzRef *son,
     UInt32 _cyclicBufferPos, UInt32 _cyclicBufferSize, UInt32 cutValue,
     UInt32 *distances, UInt32 maxLen)
 {
   son[_cyclicBufferPos] = curMatch;
   for (;;)
   {
-    UInt32 delta = pos - curMatch;
+    UInt32 delta = LzRef_Delta(pos, curMatch);
     if (cutValue-- == 0 || delta >= _cyclicBufferSize)
       return distances;
     {
@@ -324,10 +629,7 @@ static UInt32 * Hc_GetMatchesSpec(UInt32 lenLimit, UInt32 curMatch, UInt32 pos,
       curMatch = son[_cyclicBufferPos - delta + ((delta > _cyclicBufferPos) ? _cyclicBufferSize : 0)];
       if (pb[maxLen] == cur[maxLen] && *pb == *cur)
       {
-        UInt32 len = 0;
-        while (++len != lenLimit)
-          if (pb[len] != cur[len])
-            break;
+        UInt32 len = MatchLen(pb, cur, 1, lenLimit);
         if (maxLen < len)
         {
           *distances++ = maxLen = len;
@@ -340,7 +642,20 @@ static UInt32 * Hc_GetMatchesSpec(UInt32 lenLimit, UInt32 curMatch, UInt32 pos,
   }
 }
 
-UInt32 * GetMatchesSpec1(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const Byte *cur, CLzRef *son,
+/* with a large dictionary nearly every step of the tree walks misses the
+   cache, so the next node's pair and bytes are fetched as soon as it's
+   known, while the loop checks its limits.  Smaller trees stay cached and
+   the prefetches would only cost */
+#define kPrefetchMinCyclicBufferSize ((UInt32)1 << 24)
+
+#define PREFETCH_NODE(m) do { \
+  if (_cyclicBufferSize > kPrefetchMinCyclicBufferSize) { \
+    UInt32 d = LzRef_Delta(pos, m); \
+    if (d < _cyclicBufferSize) { \
+      MF_PREFETCH(son + ((_cyclicBufferPos - d + ((d > _cyclicBufferPos) ? _cyclicBufferSize : 0)) << 1)); \
+      MF_PREFETCH(cur - d + len); }}} while (0)
+
+UInt32 * GetMatchesSpec1(UInt32 lenLimit, CLzRef curMatch, CLzRef pos, const Byte *cur, CLzRef *son,
     UInt32 _cyclicBufferPos, UInt32 _cyclicBufferSize, UInt32 cutValue,
     UInt32 *distances, UInt32 maxLen)
 {
@@ -349,7 +664,7 @@ UInt32 * GetMatchesSpec1(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const Byt
   UInt32 len0 = 0, len1 = 0;
   for (;;)
   {
-    UInt32 delta = pos - curMatch;
+    UInt32 delta = LzRef_Delta(pos, curMatch);
     if (cutValue-- == 0 || delta >= _cyclicBufferSize)
     {
       *ptr0 = *ptr1 = kEmptyHashValue;
@@ -362,9 +677,7 @@ UInt32 * GetMatchesSpec1(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const Byt
       if (pb[len] == cur[len])
       {
         if (++len != lenLimit && pb[len] == cur[len])
-          while (++len != lenLimit)
-            if (pb[len] != cur[len])
-              break;
+          len = MatchLen(pb, cur, len + 1, lenLimit);
         if (maxLen < len)
         {
           *distances++ = maxLen = len;
@@ -383,6 +696,7 @@ UInt32 * GetMatchesSpec1(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const Byt
         ptr1 = pair + 1;
         curMatch = *ptr1;
         len1 = len;
+        PREFETCH_NODE(curMatch);
       }
       else
       {
@@ -390,12 +704,13 @@ UInt32 * GetMatchesSpec1(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const Byt
         ptr0 = pair;
         curMatch = *ptr0;
         len0 = len;
+        PREFETCH_NODE(curMatch);
       }
     }
   }
 }
 
-static void SkipMatchesSpec(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const Byte *cur, CLzRef *son,
+static void SkipMatchesSpec(UInt32 lenLimit, CLzRef curMatch, CLzRef pos, const Byte *cur, CLzRef *son,
     UInt32 _cyclicBufferPos, UInt32 _cyclicBufferSize, UInt32 cutValue)
 {
   CLzRef *ptr0 = son + (_cyclicBufferPos << 1) + 1;
@@ -403,7 +718,7 @@ static void SkipMatchesSpec(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const
   UInt32 len0 = 0, len1 = 0;
   for (;;)
   {
-    UInt32 delta = pos - curMatch;
+    UInt32 delta = LzRef_Delta(pos, curMatch);
     if (cutValue-- == 0 || delta >= _cyclicBufferSize)
     {
       *ptr0 = *ptr1 = kEmptyHashValue;
@@ -415,9 +730,7 @@ static void SkipMatchesSpec(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const
       UInt32 len = (len0 < len1 ? len0 : len1);
       if (pb[len] == cur[len])
       {
-        while (++len != lenLimit)
-          if (pb[len] != cur[len])
-            break;
+        len = MatchLen(pb, cur, len + 1, lenLimit);
         {
           if (len == lenLimit)
           {
@@ -433,6 +746,7 @@ static void SkipMatchesSpec(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const
         ptr1 = pair + 1;
         curMatch = *ptr1;
         len1 = len;
+        PREFETCH_NODE(curMatch);
       }
       else
       {
@@ -440,6 +754,7 @@ static void SkipMatchesSpec(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const
         ptr0 = pair;
         curMatch = *ptr0;
         len0 = len;
+        PREFETCH_NODE(curMatch);
       }
     }
   }
@@ -455,13 +770,25 @@ static void SkipMatchesSpec(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const
 static void MatchFinder_MovePos(CMatchFinder *p) { MOVE_POS; }
 
 #define GET_MATCHES_HEADER2(minLen, ret_op) \
-  UInt32 lenLimit; UInt32 hashValue; const Byte *cur; UInt32 curMatch; \
+  UInt32 lenLimit; UInt32 hashValue; const Byte *cur; CLzRef curMatch; \
   lenLimit = p->lenLimit; { if (lenLimit < minLen) { MatchFinder_MovePos(p); ret_op; }} \
   cur = p->buffer;
 
 #define GET_MATCHES_HEADER(minLen) GET_MATCHES_HEADER2(minLen, return 0)
 #define SKIP_HEADER(minLen)        GET_MATCHES_HEADER2(minLen, continue)
 
+/* the next position's hash heads are fetched before this one's tree walk,
+   which gives them all of it to arrive in.  The hash is sized from the
+   dictionary, and is mostly cached in the same cases as the tree */
+#define PREFETCH_NEXT_HASH4 do { \
+  if (p->cyclicBufferSize > kPrefetchMinCyclicBufferSize && lenLimit > 4) { \
+    const Byte *cur = p->buffer + 1; \
+    UInt32 hash2Value, hash3Value, hashValue; \
+    HASH4_CALC; \
+    MF_PREFETCH(p->hash + hash2Value); \
+    MF_PREFETCH(p->hash + kFix3HashSize + hash3Value); \
+    MF_PREFETCH(p->hash + kFix4HashSize + hashValue); }} while (0)
+
 #define MF_PARAMS(p) p->pos, p->buffer, p->son, p->cyclicBufferPos, p->cyclicBufferSize, p->cutValue
 
 #define GET_MATCHES_FOOTER(offset, maxLen) \
@@ -500,7 +827,7 @@ static UInt32 Bt3_MatchFinder_GetMatches(CMatchFinder *p, UInt32 *distances)
 
   HASH3_CALC;
 
-  delta2 = p->pos - p->hash[hash2Value];
+  delta2 = LzRef_Delta(p->pos, p->hash[hash2Value]);
   curMatch = p->hash[kFix3HashSize + hashValue];
   
   p->hash[hash2Value] =
@@ -532,9 +859,10 @@ static UInt32 Bt4_MatchFinder_GetMatches(CMatchFinder *p, UInt32 *distances)
   GET_MATCHES_HEADER(4)
 
   HASH4_CALC;
+  PREFETCH_NEXT_HASH4;
 
-  delta2 = p->pos - p->hash[                hash2Value];
-  delta3 = p->pos - p->hash[kFix3HashSize + hash3Value];
+  delta2 = LzRef_Delta(p->pos, p->hash[                hash2Value]);
+  delta3 = LzRef_Delta(p->pos, p->hash[kFix3HashSize + hash3Value]);
   curMatch = p->hash[kFix4HashSize + hashValue];
   
   p->hash[                hash2Value] =
@@ -580,8 +908,8 @@ static UInt32 Hc4_MatchFinder_GetMatches(CMatchFinder *p, UInt32 *distances)
 
   HASH4_CALC;
 
-  delta2 = p->pos - p->hash[                hash2Value];
-  delta3 = p->pos - p->hash[kFix3HashSize + hash3Value];
+  delta2 = LzRef_Delta(p->pos, p->hash[                hash2Value]);
+  delta3 = LzRef_Delta(p->pos, p->hash[kFix3HashSize + hash3Value]);
   curMatch = p->hash[kFix4HashSize + hashValue];
 
   p->hash[                hash2Value] =
@@ -682,6 +1010,7 @@ static void Bt4_MatchFinder_Skip(CMatchFinder *p, UInt32 num)
     UInt32 hash2Value, hash3Value;
     SKIP_HEADER(4)
     HASH4_CALC;
+    PREFETCH_NEXT_HASH4;
     curMatch = p->hash[kFix4HashSize + hashValue];
     p->hash[                hash2Value] =
     p->hash[kFix3HashSize + hash3Value] = p->pos;
@@ -749,3 +1078,80 @@ void MatchFinder_CreateVTable(CMatchFinder *p, IMatchFinder *vTable)
     vTable->Skip = (Mf_Skip_Func)Bt4_MatchFinder_Skip;
   }
 }
+
+/* in a run of one byte value each position takes the run as its whole match
+   to the position before: its hash chain link is that position, and its
+   tree node becomes a copy of that one's.  MatchFinder_SkipRun is Skip,
+   which works this out comparing the run over again for every position,
+   with the links and nodes written directly.  For the tree the last
+   position of each stretch is skipped as usual, finding the stretch's start
+   through the hash with the node all the others copied */
+void MatchFinder_SkipRun(CMatchFinder *p, UInt32 num)
+{
+  IMatchFinder vt;
+  MatchFinder_CreateVTable(p, &vt);
+  if (p->cutValue == 0)
+  {
+    vt.Skip(p, num);
+    return;
+  }
+  while (num != 0)
+  {
+    const Byte *cur = p->buffer;
+    UInt32 n = 0;
+    if (cur != p->bufferBase && p->lenLimit == p->matchMaxLen)
+    {
+      UInt32 lim = (UInt32)(p->streamPos - p->pos), len = 0;
+      if (lim > num - 1 + p->matchMaxLen)
+        lim = num - 1 + p->matchMaxLen;
+      while (len != lim && cur[len] == cur[-1])
+        len++;
+      if (len >= p->matchMaxLen)
+      {
+        n = len - p->matchMaxLen + 1;
+        if (n > p->posLimit - p->pos)
+          n = (UInt32)(p->posLimit - p->pos);
+      }
+    }
+    if (n <= 1)
+    {
+      vt.Skip(p, 1);
+      num--;
+      continue;
+    }
+    num -= n;
+    if (p->btMode)
+    {
+      const CLzRef *pair = p->son + ((p->cyclicBufferPos == 0 ?
+          p->cyclicBufferSize : p->cyclicBufferPos) - 1) * 2;
+      CLzRef *son = p->son + p->cyclicBufferPos * 2;
+      UInt32 i;
+      for (i = 0; i < n - 1; i++)
+      {
+        son[i * 2] = pair[0];
+        son[i * 2 + 1] = pair[1];
+      }
+      p->cyclicBufferPos += n - 1;
+      p->buffer += n - 1;
+      p->pos += n - 1;
+      vt.Skip(p, 1);
+    }
+    else
+    {
+      UInt32 hash2Value, hash3Value, hashValue, i;
+      CLzRef *son = p->son + p->cyclicBufferPos;
+      for (i = 0; i < n; i++)
+        son[i] = p->pos + i - 1;
+      cur += n - 1;
+      HASH4_CALC;
+      p->hash[                hash2Value] =
+      p->hash[kFix3HashSize + hash3Value] =
+      p->hash[kFix4HashSize + hashValue] = p->pos + n - 1;
+      p->cyclicBufferPos += n;
+      p->buffer += n;
+      p->pos += n;
+      if (p->pos == p->posLimit)
+        MatchFinder_CheckLimits(p);
+    }
+  }
+}
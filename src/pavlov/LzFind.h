@@ -6,14 +6,30 @@
 
 #include "Types.h"
 
+/* #define _LZ_POS64 */
+/* _LZ_POS64 makes match finder positions 64-bit, so they never reach the
+   limit where hash and son are normalized: a sweep which rewrites both
+   tables every 4 GB of input, stalling the encoder while it runs.  Both
+   tables take twice the memory, and with the extra cache misses encoding
+   is slower overall */
+
+#ifdef _LZ_POS64
+typedef UInt64 CLzRef;
+/* a distance back from pos to ref, which is beyond any cyclicBufferSize
+   when it doesn't fit 32 bits */
+#define LzRef_Delta(pos, ref) ((pos) - (ref) > (UInt32)0xFFFFFFFF ? \
+    (UInt32)0xFFFFFFFF : (UInt32)((pos) - (ref)))
+#else
 typedef UInt32 CLzRef;
+#define LzRef_Delta(pos, ref) ((pos) - (ref))
+#endif
 
 typedef struct _CMatchFinder
 {
   Byte *buffer;
-  UInt32 pos;
-  UInt32 posLimit;
-  UInt32 streamPos;
+  CLzRef pos;
+  CLzRef posLimit;
+  CLzRef streamPos;
   UInt32 lenLimit;
 
   UInt32 cyclicBufferPos;
@@ -30,32 +46,61 @@ typedef struct _CMatchFinder
   int streamEndWasReached;
 
   UInt32 blockSize;
+  Byte *bufferAlloc; /* the window for stream input, bufferBase unless directInput */
+  UInt32 bufferAllocSize; /* bytes allocated at bufferAlloc */
+  int ringWindow; /* map the window twice in a row (RingAlloc) where the system can */
+  UInt32 ringSize; /* bytes mapped twice at bufferAlloc, blockSize is twice that, 0 - a flat window */
+  unsigned ringGeneration; /* RingGeneration() when the ring was mapped */
   UInt32 keepSizeBefore;
   UInt32 keepSizeAfter;
 
   UInt32 numHashBytes;
-  int directInput;
+  int directInput; /* bufferBase is the caller's whole input */
+  SizeT directInputRem;
   int btMode;
   /* int skipModeBits; */
   int bigHash;
+  int mulHash; /* hash by multiplying (see LzHash.h) rather than through g_CrcTable */
   UInt32 historySize;
   UInt32 fixedHashSize;
   UInt32 hashSizeSum;
   UInt32 numSons;
+  UInt32 refsAllocSize; /* CLzRefs allocated at hash, >= hashSizeSum + numSons */
+  int hashIsValid; /* hash and son hold no position above pos */
   SRes result;
-  UInt32 crc[256];
 } CMatchFinder;
 
 #define Inline_MatchFinder_GetPointerToCurrentPos(p) ((p)->buffer)
 #define Inline_MatchFinder_GetIndexByte(p, index) ((p)->buffer[(Int32)(index)])
 
-#define Inline_MatchFinder_GetNumAvailableBytes(p) ((p)->streamPos - (p)->pos)
+#define Inline_MatchFinder_GetNumAvailableBytes(p) ((UInt32)((p)->streamPos - (p)->pos))
 
 int MatchFinder_NeedMove(CMatchFinder *p);
 Byte *MatchFinder_GetPointerToCurrentPos(CMatchFinder *p);
 void MatchFinder_MoveBlock(CMatchFinder *p);
 void MatchFinder_ReadIfRequired(CMatchFinder *p);
 
+/* MatchFinder_ReadAhead reads until at least size bytes are past the
+   current position, or the stream ends, and returns how many are.  size
+   must be at most 512 KB, the least room the window keeps for input */
+UInt32 MatchFinder_ReadAhead(CMatchFinder *p, UInt32 size);
+
+/* MatchFinder_CountRepeats samples every step-th of the next size bytes,
+   which must be available and not yet passed, and counts those whose
+   first 8 bytes are found again at one of the newest positions in the
+   history with the same hashes.  It's a cheap estimate of how much of them repeat
+   earlier input, without changing the match finder */
+UInt32 MatchFinder_CountRepeats(CMatchFinder *p, UInt32 size, UInt32 step);
+
+/* MatchFinder_SkipRun leaves p as the vtable's Skip would, and does it
+   without comparing the bytes over again inside runs of one byte value */
+void MatchFinder_SkipRun(CMatchFinder *p, UInt32 num);
+
+/* MatchFinder_WindowLost tells whether the window is a ring mapped
+   before a fork() this process is the child of, which isn't there any
+   more.  A new stream maps another, but one begun before can't go on */
+int MatchFinder_WindowLost(const CMatchFinder *p);
+
 void MatchFinder_Construct(CMatchFinder *p);
 
 /* Conditions:
@@ -66,10 +111,10 @@ int MatchFinder_Create(CMatchFinder *p, UInt32 historySize,
     UInt32 keepAddBufferBefore, UInt32 matchMaxLen, UInt32 keepAddBufferAfter,
     ISzAlloc *alloc);
 void MatchFinder_Free(CMatchFinder *p, ISzAlloc *alloc);
-void MatchFinder_Normalize3(UInt32 subValue, CLzRef *items, UInt32 numItems);
-void MatchFinder_ReduceOffsets(CMatchFinder *p, UInt32 subValue);
+void MatchFinder_Normalize3(CLzRef subValue, CLzRef *items, UInt32 numItems);
+void MatchFinder_ReduceOffsets(CMatchFinder *p, CLzRef subValue);
 
-UInt32 * GetMatchesSpec1(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const Byte *buffer, CLzRef *son,
+UInt32 * GetMatchesSpec1(UInt32 lenLimit, CLzRef curMatch, CLzRef pos, const Byte *buffer, CLzRef *son,
     UInt32 _cyclicBufferPos, UInt32 _cyclicBufferSize, UInt32 _cutValue,
     UInt32 *distances, UInt32 maxLen);
 
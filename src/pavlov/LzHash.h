@@ -4,6 +4,9 @@
 #ifndef __LZHASH_H
 #define __LZHASH_H
 
+#include "7zCrc.h"
+#include "CpuArch.h"
+
 #define kHash2Size (1 << 10)
 #define kHash3Size (1 << 16)
 #define kHash4Size (1 << 20)
@@ -14,41 +17,62 @@
 
 #define HASH2_CALC hashValue = cur[0] | ((UInt32)cur[1] << 8);
 
-#define HASH3_CALC { \
-  UInt32 temp = p->crc[cur[0]] ^ cur[1]; \
+/* the hashes of CMatchFinder.mulHash multiply the bytes hashed, read as a
+   little endian number, by 2^64 / golden ratio, and keep the high half of
+   the low 64 bits of the product, where every byte is well mixed in.  The
+   others go through g_CrcTable (from CrcGenerateTable) */
+#define kHashMul (((UInt64)0x9E3779B9 << 32) | 0x7F4A7C15)
+#define HASH_MUL(v) ((UInt32)(((UInt64)(v) * kHashMul) >> 32))
+#define HASH_MUL2(cur) HASH_MUL(GetUi16(cur))
+#define HASH_MUL3(cur) HASH_MUL(GetUi16(cur) | ((UInt32)(cur)[2] << 16))
+#define HASH_MUL4(cur) HASH_MUL(GetUi32(cur))
+
+#define HASH3_CALC if (p->mulHash) { \
+  hash2Value = HASH_MUL2(cur) & (kHash2Size - 1); \
+  hashValue = HASH_MUL3(cur) & p->hashMask; } else { \
+  UInt32 temp = g_CrcTable[cur[0]] ^ cur[1]; \
   hash2Value = temp & (kHash2Size - 1); \
   hashValue = (temp ^ ((UInt32)cur[2] << 8)) & p->hashMask; }
 
-#define HASH4_CALC { \
-  UInt32 temp = p->crc[cur[0]] ^ cur[1]; \
+#define HASH4_CALC if (p->mulHash) { \
+  hash2Value = HASH_MUL2(cur) & (kHash2Size - 1); \
+  hash3Value = HASH_MUL3(cur) & (kHash3Size - 1); \
+  hashValue = HASH_MUL4(cur) & p->hashMask; } else { \
+  UInt32 temp = g_CrcTable[cur[0]] ^ cur[1]; \
   hash2Value = temp & (kHash2Size - 1); \
   hash3Value = (temp ^ ((UInt32)cur[2] << 8)) & (kHash3Size - 1); \
-  hashValue = (temp ^ ((UInt32)cur[2] << 8) ^ (p->crc[cur[3]] << 5)) & p->hashMask; }
+  hashValue = (temp ^ ((UInt32)cur[2] << 8) ^ (g_CrcTable[cur[3]] << 5)) & p->hashMask; }
 
 #define HASH5_CALC { \
-  UInt32 temp = p->crc[cur[0]] ^ cur[1]; \
+  UInt32 temp = g_CrcTable[cur[0]] ^ cur[1]; \
   hash2Value = temp & (kHash2Size - 1); \
   hash3Value = (temp ^ ((UInt32)cur[2] << 8)) & (kHash3Size - 1); \
-  hash4Value = (temp ^ ((UInt32)cur[2] << 8) ^ (p->crc[cur[3]] << 5)); \
-  hashValue = (hash4Value ^ (p->crc[cur[4]] << 3)) & p->hashMask; \
+  hash4Value = (temp ^ ((UInt32)cur[2] << 8) ^ (g_CrcTable[cur[3]] << 5)); \
+  hashValue = (hash4Value ^ (g_CrcTable[cur[4]] << 3)) & p->hashMask; \
   hash4Value &= (kHash4Size - 1); }
 
-/* #define HASH_ZIP_CALC hashValue = ((cur[0] | ((UInt32)cur[1] << 8)) ^ p->crc[cur[2]]) & 0xFFFF; */
-#define HASH_ZIP_CALC hashValue = ((cur[2] | ((UInt32)cur[0] << 8)) ^ p->crc[cur[1]]) & 0xFFFF;
+/* #define HASH_ZIP_CALC hashValue = ((cur[0] | ((UInt32)cur[1] << 8)) ^ g_CrcTable[cur[2]]) & 0xFFFF; */
+#define HASH_ZIP_CALC hashValue = ((cur[2] | ((UInt32)cur[0] << 8)) ^ g_CrcTable[cur[1]]) & 0xFFFF;
 
 
-#define MT_HASH2_CALC \
-  hash2Value = (p->crc[cur[0]] ^ cur[1]) & (kHash2Size - 1);
+#define MT_HASH2_CALC if (p->mulHash) \
+  hash2Value = HASH_MUL2(cur) & (kHash2Size - 1); else \
+  hash2Value = (g_CrcTable[cur[0]] ^ cur[1]) & (kHash2Size - 1);
 
-#define MT_HASH3_CALC { \
-  UInt32 temp = p->crc[cur[0]] ^ cur[1]; \
+#define MT_HASH3_CALC if (p->mulHash) { \
+  hash2Value = HASH_MUL2(cur) & (kHash2Size - 1); \
+  hash3Value = HASH_MUL3(cur) & (kHash3Size - 1); } else { \
+  UInt32 temp = g_CrcTable[cur[0]] ^ cur[1]; \
   hash2Value = temp & (kHash2Size - 1); \
   hash3Value = (temp ^ ((UInt32)cur[2] << 8)) & (kHash3Size - 1); }
 
-#define MT_HASH4_CALC { \
-  UInt32 temp = p->crc[cur[0]] ^ cur[1]; \
+#define MT_HASH4_CALC if (p->mulHash) { \
+  hash2Value = HASH_MUL2(cur) & (kHash2Size - 1); \
+  hash3Value = HASH_MUL3(cur) & (kHash3Size - 1); \
+  hash4Value = HASH_MUL4(cur) & (kHash4Size - 1); } else { \
+  UInt32 temp = g_CrcTable[cur[0]] ^ cur[1]; \
   hash2Value = temp & (kHash2Size - 1); \
   hash3Value = (temp ^ ((UInt32)cur[2] << 8)) & (kHash3Size - 1); \
-  hash4Value = (temp ^ ((UInt32)cur[2] << 8) ^ (p->crc[cur[3]] << 5)) & (kHash4Size - 1); }
+  hash4Value = (temp ^ ((UInt32)cur[2] << 8) ^ (g_CrcTable[cur[3]] << 5)) & (kHash4Size - 1); }
 
 #endif
@@ -0,0 +1,419 @@
+/* Lzma2Enc.c -- LZMA2 Encoder
+2009-05-03 : Igor Pavlov : Public domain */
+
+/* #include <stdio.h> */
+#include <string.h>
+
+#include "Lzma2Enc.h"
+#include "CpuArch.h"
+
+#define LZMA2_CONTROL_LZMA (1 << 7)
+#define LZMA2_CONTROL_COPY_NO_RESET 2
+#define LZMA2_CONTROL_COPY_RESET_DIC 1
+#define LZMA2_CONTROL_EOF 0
+
+#define LZMA2_LCLP_MAX 4
+
+#define LZMA2_DIC_SIZE_FROM_PROP(p) (((UInt32)2 | ((p) & 1)) << ((p) / 2 + 11))
+
+#define LZMA2_PACK_SIZE_MAX (1 << 16)
+#define LZMA2_COPY_CHUNK_SIZE LZMA2_PACK_SIZE_MAX
+#define LZMA2_UNPACK_SIZE_MAX (1 << 21)
+#define LZMA2_KEEP_WINDOW_SIZE LZMA2_UNPACK_SIZE_MAX
+
+#define LZMA2_CHUNK_SIZE_COMPRESSED_MAX ((1 << 16) + 16)
+
+#define PRF(x) /* x */
+
+/* ---------- CLzma2EncInt ---------- */
+
+typedef struct
+{
+  CLzmaEncHandle enc;
+  UInt64 srcPos;
+  Byte props;
+  Bool needInitState;
+  Bool needInitProp;
+} CLzma2EncInt;
+
+static SRes Lzma2EncInt_Init(CLzma2EncInt *p, const CLzma2EncProps *props)
+{
+  Byte propsEncoded[LZMA_PROPS_SIZE];
+  SizeT propsSize = LZMA_PROPS_SIZE;
+  RINOK(LzmaEnc_SetProps(p->enc, &props->lzmaProps));
+  RINOK(LzmaEnc_WriteProperties(p->enc, propsEncoded, &propsSize));
+  p->srcPos = 0;
+  p->props = propsEncoded[0];
+  p->needInitState = True;
+  p->needInitProp = True;
+  return SZ_OK;
+}
+
+SRes LzmaEnc_PrepareForLzma2(CLzmaEncHandle pp, ISeqInStream *inStream, UInt32 keepWindowSize,
+    ISzAlloc *alloc, ISzAlloc *allocBig);
+SRes LzmaEnc_CodeOneMemBlock(CLzmaEncHandle pp, Bool reInit,
+    Byte *dest, size_t *destLen, UInt32 desiredPackSize, UInt32 *unpackSize);
+const Byte *LzmaEnc_GetCurBuf(CLzmaEncHandle pp);
+void LzmaEnc_SaveState(CLzmaEncHandle p);
+void LzmaEnc_RestoreState(CLzmaEncHandle p);
+UInt32 LzmaEnc_ReadAhead(CLzmaEncHandle pp, UInt32 size);
+UInt32 LzmaEnc_CountRepeats(CLzmaEncHandle pp, UInt32 size, UInt32 step);
+SRes LzmaEnc_SkipUncoded(CLzmaEncHandle pp, UInt32 size);
+
+static SRes Lzma2EncInt_EncodeSubblock(CLzma2EncInt *p, Byte *outBuf,
+    size_t *packSizeRes, ISeqOutStream *outStream)
+{
+  size_t packSizeLimit = *packSizeRes;
+  size_t packSize = packSizeLimit;
+  UInt32 unpackSize = LZMA2_UNPACK_SIZE_MAX;
+  unsigned lzHeaderSize = 5 + (p->needInitProp ? 1 : 0);
+  Bool useCopyBlock;
+  SRes res;
+
+  *packSizeRes = 0;
+  if (packSize < lzHeaderSize)
+    return SZ_ERROR_OUTPUT_EOF;
+  packSize -= lzHeaderSize;
+  
+  LzmaEnc_SaveState(p->enc);
+  res = LzmaEnc_CodeOneMemBlock(p->enc, p->needInitState,
+      outBuf + lzHeaderSize, &packSize, LZMA2_PACK_SIZE_MAX, &unpackSize);
+  
+  PRF(printf("\npackSize = %7d unpackSize = %7d  ", packSize, unpackSize));
+
+  if (unpackSize == 0)
+    return res;
+
+  if (res == SZ_OK)
+    useCopyBlock = (packSize + 2 >= unpackSize || packSize > (1 << 16));
+  else
+  {
+    if (res != SZ_ERROR_OUTPUT_EOF)
+      return res;
+    res = SZ_OK;
+    useCopyBlock = True;
+  }
+
+  if (useCopyBlock)
+  {
+    size_t destPos = 0;
+    PRF(printf("################# COPY           "));
+    while (unpackSize > 0)
+    {
+      UInt32 u = (unpackSize < LZMA2_COPY_CHUNK_SIZE) ? unpackSize : LZMA2_COPY_CHUNK_SIZE;
+      if (packSizeLimit - destPos < u + 3)
+        return SZ_ERROR_OUTPUT_EOF;
+      outBuf[destPos++] = (Byte)(p->srcPos == 0 ? LZMA2_CONTROL_COPY_RESET_DIC : LZMA2_CONTROL_COPY_NO_RESET);
+      outBuf[destPos++] = (Byte)((u - 1) >> 8);
+      outBuf[destPos++] = (Byte)(u - 1);
+      memcpy(outBuf + destPos, LzmaEnc_GetCurBuf(p->enc) - unpackSize, u);
+      unpackSize -= u;
+      destPos += u;
+      p->srcPos += u;
+      if (outStream)
+      {
+        *packSizeRes += destPos;
+        if (outStream->Write(outStream, outBuf, destPos) != destPos)
+          return SZ_ERROR_WRITE;
+        destPos = 0;
+      }
+      else
+        *packSizeRes = destPos;
+    }
+    LzmaEnc_RestoreState(p->enc);
+    return SZ_OK;
+  }
+  {
+    size_t destPos = 0;
+    UInt32 u = unpackSize - 1;
+    UInt32 pm = (UInt32)(packSize - 1);
+    unsigned mode = (p->srcPos == 0) ? 3 : (p->needInitState ? (p->needInitProp ? 2 : 1) : 0);
+
+    outBuf[destPos++] = (Byte)(LZMA2_CONTROL_LZMA | (mode << 5) | ((u >> 16) & 0x1F));
+    outBuf[destPos++] = (Byte)(u >> 8);
+    outBuf[destPos++] = (Byte)u;
+    outBuf[destPos++] = (Byte)(pm >> 8);
+    outBuf[destPos++] = (Byte)pm;
+    
+    if (p->needInitProp)
+      outBuf[destPos++] = p->props;
+    
+    p->needInitProp = False;
+    p->needInitState = False;
+    destPos += packSize;
+    p->srcPos += unpackSize;
+
+    if (outStream)
+      if (outStream->Write(outStream, outBuf, destPos) != destPos)
+        return SZ_ERROR_WRITE;
+    *packSizeRes = destPos;
+    return SZ_OK;
+  }
+}
+
+/* ---------- Incompressible data detection ---------- */
+
+/* Before each chunk the next 64 KB window of input is probed.  A window
+   which looks incompressible is passed through the match finder without
+   being coded, so later input can still match it, and is written as a
+   stored chunk.  The parser and the range coder never see it.  The LZMA
+   state is left alone, as the decoder leaves it over a stored chunk.
+   The threaded match finder reads on its own, so it gets no probe. */
+
+#define LZMA2_PROBE_WINDOW_SIZE LZMA2_COPY_CHUNK_SIZE
+#define LZMA2_PROBE_HASH_BITS 12
+
+/* a window is incompressible when its bytes are spread almost evenly
+   (an order-0 collision entropy above about 7.93 bits per byte, the
+   probability of two bytes matching is below 1 / 244), under 1 / 32 of
+   it repeats 8-byte strings from earlier in the window, and under 1 / 32
+   of the positions sampled every 16 bytes start 8 bytes found in the
+   dictionary */
+#define LZMA2_PROBE_ENTROPY_FACTOR 244
+#define LZMA2_PROBE_MATCH_SHIFT 5
+#define LZMA2_PROBE_SAMPLE_STEP 16
+
+static Bool Lzma2Probe_IsIncompressible(const Byte *buf, UInt32 size, UInt32 *hash)
+{
+  UInt32 counts[256];
+  UInt64 sumSq = 0;
+  UInt32 i, matched = 0;
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < size; i++)
+    counts[buf[i]]++;
+  for (i = 0; i < 256; i++)
+    sumSq += (UInt64)counts[i] * counts[i];
+  /* sumSq - size counts the ordered pairs of equal bytes */
+  if ((sumSq - size) * LZMA2_PROBE_ENTROPY_FACTOR > (UInt64)size * (size - 1))
+    return False;
+
+  memset(hash, 0, sizeof(UInt32) << LZMA2_PROBE_HASH_BITS);
+  for (i = 0; i + 8 <= size; i++)
+  {
+    UInt32 h = (UInt32)(GetUi32(buf + i) * 2654435761U) >> (32 - LZMA2_PROBE_HASH_BITS);
+    UInt32 cand = hash[h];
+    hash[h] = i + 1;
+    if (cand != 0 && memcmp(buf + cand - 1, buf + i, 8) == 0)
+    {
+      matched += 8;
+      if (matched > (size >> LZMA2_PROBE_MATCH_SHIFT))
+        return False;
+      i += 7;
+    }
+  }
+  return True;
+}
+
+/* the size of the window to store next, 0 to code the next chunk.  Only
+   whole windows are stored, the end of the input is left to the encoder */
+static UInt32 Lzma2EncInt_Probe(CLzma2EncInt *p, UInt32 *hash)
+{
+  UInt32 size = LzmaEnc_ReadAhead(p->enc, LZMA2_PROBE_WINDOW_SIZE);
+  if (size < LZMA2_PROBE_WINDOW_SIZE)
+    return 0;
+  size = LZMA2_PROBE_WINDOW_SIZE;
+  if (!Lzma2Probe_IsIncompressible(LzmaEnc_GetCurBuf(p->enc), size, hash))
+    return 0;
+  if (LzmaEnc_CountRepeats(p->enc, size, LZMA2_PROBE_SAMPLE_STEP) >
+      ((size / LZMA2_PROBE_SAMPLE_STEP) >> LZMA2_PROBE_MATCH_SHIFT))
+    return 0;
+  return size;
+}
+
+/* writes a probed window as a stored chunk */
+static SRes Lzma2EncInt_EncodeStored(CLzma2EncInt *p, UInt32 size,
+    ISeqOutStream *outStream, size_t *packSizeRes)
+{
+  Byte header[3];
+  RINOK(LzmaEnc_SkipUncoded(p->enc, size));
+  header[0] = (Byte)(p->srcPos == 0 ? LZMA2_CONTROL_COPY_RESET_DIC : LZMA2_CONTROL_COPY_NO_RESET);
+  header[1] = (Byte)((size - 1) >> 8);
+  header[2] = (Byte)(size - 1);
+  if (outStream->Write(outStream, header, 3) != 3 ||
+      outStream->Write(outStream, LzmaEnc_GetCurBuf(p->enc) - size, size) != size)
+    return SZ_ERROR_WRITE;
+  p->srcPos += size;
+  *packSizeRes = 3 + size;
+  return SZ_OK;
+}
+
+/* ---------- Lzma2 Props ---------- */
+
+void Lzma2EncProps_Init(CLzma2EncProps *p)
+{
+  LzmaEncProps_Init(&p->lzmaProps);
+  p->blockSize = 0;
+}
+
+void Lzma2EncProps_Normalize(CLzma2EncProps *p)
+{
+  LzmaEncProps_Normalize(&p->lzmaProps);
+  /* a block never looks back further than its own start */
+  if (p->blockSize != 0 && p->blockSize < p->lzmaProps.dictSize)
+    p->lzmaProps.dictSize = (p->blockSize < ((UInt32)1 << 12)) ?
+        ((UInt32)1 << 12) : (UInt32)p->blockSize;
+}
+
+static SRes Progress(ICompressProgress *p, UInt64 inSize, UInt64 outSize)
+{
+  return (p && p->Progress(p, inSize, outSize) != SZ_OK) ? SZ_ERROR_PROGRESS : SZ_OK;
+}
+
+/* ---------- Lzma2 ---------- */
+
+/* reads at most limit bytes of the real stream, for one block */
+typedef struct
+{
+  ISeqInStream funcTable;
+  ISeqInStream *realStream;
+  UInt64 processed;
+  UInt64 limit;
+  Bool finished;
+} CLimitedSeqInStream;
+
+static SRes LimitedSeqInStream_Read(void *pp, void *data, size_t *size)
+{
+  CLimitedSeqInStream *p = (CLimitedSeqInStream *)pp;
+  size_t size2 = *size;
+  SRes res = SZ_OK;
+  if (p->limit - p->processed < size2)
+    size2 = (size_t)(p->limit - p->processed);
+  if (size2 != 0)
+  {
+    res = p->realStream->Read(p->realStream, data, &size2);
+    p->finished = (size2 == 0);
+    p->processed += size2;
+  }
+  *size = size2;
+  return res;
+}
+
+typedef struct
+{
+  CLzma2EncProps props;
+  Byte *outBuf;
+  UInt32 *probeHash;
+  ISzAlloc *alloc;
+  ISzAlloc *allocBig;
+  CLzma2EncInt coder;
+} CLzma2Enc;
+
+CLzma2EncHandle Lzma2Enc_Create(ISzAlloc *alloc, ISzAlloc *allocBig)
+{
+  CLzma2Enc *p = (CLzma2Enc *)alloc->Alloc(alloc, sizeof(CLzma2Enc));
+  if (p == 0)
+    return 0;
+  Lzma2EncProps_Init(&p->props);
+  Lzma2EncProps_Normalize(&p->props);
+  p->outBuf = 0;
+  p->probeHash = 0;
+  p->alloc = alloc;
+  p->allocBig = allocBig;
+  p->coder.enc = LzmaEnc_Create(alloc);
+  if (p->coder.enc == 0)
+  {
+    alloc->Free(alloc, p);
+    return 0;
+  }
+  return p;
+}
+
+void Lzma2Enc_Destroy(CLzma2EncHandle pp)
+{
+  CLzma2Enc *p = (CLzma2Enc *)pp;
+  LzmaEnc_Destroy(p->coder.enc, p->alloc, p->allocBig);
+  p->alloc->Free(p->alloc, p->outBuf);
+  p->alloc->Free(p->alloc, p->probeHash);
+  p->alloc->Free(p->alloc, pp);
+}
+
+UInt64 Lzma2Enc_GetLargePageBytes(CLzma2EncHandle pp)
+{
+  return LzmaEnc_GetLargePageBytes(((CLzma2Enc *)pp)->coder.enc);
+}
+
+SRes Lzma2Enc_SetProps(CLzma2EncHandle pp, const CLzma2EncProps *props)
+{
+  CLzma2Enc *p = (CLzma2Enc *)pp;
+  CLzmaEncProps lzmaProps = props->lzmaProps;
+  LzmaEncProps_Normalize(&lzmaProps);
+  if (lzmaProps.lc + lzmaProps.lp > LZMA2_LCLP_MAX)
+    return SZ_ERROR_PARAM;
+  p->props = *props;
+  Lzma2EncProps_Normalize(&p->props);
+  return SZ_OK;
+}
+
+Byte Lzma2Enc_WriteProperties(CLzma2EncHandle pp)
+{
+  CLzma2Enc *p = (CLzma2Enc *)pp;
+  unsigned i;
+  UInt32 dicSize = LzmaEncProps_GetDictSize(&p->props.lzmaProps);
+  for (i = 0; i < 40; i++)
+    if (dicSize <= LZMA2_DIC_SIZE_FROM_PROP(i))
+      break;
+  return (Byte)i;
+}
+
+SRes Lzma2Enc_Encode(CLzma2EncHandle pp,
+    ISeqOutStream *outStream, ISeqInStream *inStream, ICompressProgress *progress)
+{
+  CLzma2Enc *p = (CLzma2Enc *)pp;
+  CLimitedSeqInStream limitedInStream;
+  UInt64 packTotal = 0;
+  UInt64 unpackTotal = 0;
+  Byte b = LZMA2_CONTROL_EOF;
+
+  if (p->outBuf == 0)
+  {
+    p->outBuf = (Byte *)p->alloc->Alloc(p->alloc, LZMA2_CHUNK_SIZE_COMPRESSED_MAX);
+    if (p->outBuf == 0)
+      return SZ_ERROR_MEM;
+  }
+  if (p->probeHash == 0)
+  {
+    p->probeHash = (UInt32 *)p->alloc->Alloc(p->alloc, sizeof(UInt32) << LZMA2_PROBE_HASH_BITS);
+    if (p->probeHash == 0)
+      return SZ_ERROR_MEM;
+  }
+
+  limitedInStream.funcTable.Read = LimitedSeqInStream_Read;
+  limitedInStream.realStream = inStream;
+  limitedInStream.processed = 0;
+  limitedInStream.finished = False;
+
+  /* each block starts with a dictionary reset, so it can be decoded on
+     its own once its first chunk is found */
+  do
+  {
+    SRes res = SZ_OK;
+    limitedInStream.limit = (p->props.blockSize == 0) ? (UInt64)(Int64)-1 :
+        limitedInStream.processed + p->props.blockSize;
+    RINOK(Lzma2EncInt_Init(&p->coder, &p->props));
+    RINOK(LzmaEnc_PrepareForLzma2(p->coder.enc, &limitedInStream.funcTable,
+        LZMA2_KEEP_WINDOW_SIZE, p->alloc, p->allocBig));
+    for (;;)
+    {
+      size_t packSize = LZMA2_CHUNK_SIZE_COMPRESSED_MAX;
+      UInt32 storedSize = Lzma2EncInt_Probe(&p->coder, p->probeHash);
+      if (storedSize != 0)
+        res = Lzma2EncInt_EncodeStored(&p->coder, storedSize, outStream, &packSize);
+      else
+        res = Lzma2EncInt_EncodeSubblock(&p->coder, p->outBuf, &packSize, outStream);
+      if (res != SZ_OK || packSize == 0)
+        break;
+      packTotal += packSize;
+      res = Progress(progress, unpackTotal + p->coder.srcPos, packTotal);
+      if (res != SZ_OK)
+        break;
+    }
+    LzmaEnc_Finish(p->coder.enc);
+    unpackTotal += p->coder.srcPos;
+    if (res != SZ_OK)
+      return res;
+  }
+  while (!limitedInStream.finished && limitedInStream.processed == limitedInStream.limit);
+
+  return (outStream->Write(outStream, &b, 1) == 1) ? SZ_OK : SZ_ERROR_WRITE;
+}
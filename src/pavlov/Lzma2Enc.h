@@ -0,0 +1,51 @@
+/* Lzma2Enc.h -- LZMA2 Encoder
+2009-05-03 : Igor Pavlov : Public domain */
+
+#ifndef __LZMA2ENC_H
+#define __LZMA2ENC_H
+
+#include "LzmaEnc.h"
+
+typedef struct
+{
+  CLzmaEncProps lzmaProps;
+  size_t blockSize;   /* 0 - one block for the whole stream,
+                         otherwise the dictionary is reset every blockSize bytes */
+} CLzma2EncProps;
+
+void Lzma2EncProps_Init(CLzma2EncProps *p);
+void Lzma2EncProps_Normalize(CLzma2EncProps *p);
+
+/* ---------- CLzmaEnc2Handle Interface ---------- */
+
+/* Lzma2Enc_* functions can return the following exit codes:
+Returns:
+  SZ_OK           - OK
+  SZ_ERROR_MEM    - Memory allocation error
+  SZ_ERROR_PARAM  - Incorrect paramater in props (lc + lp must not exceed 4)
+  SZ_ERROR_WRITE  - Write callback error
+  SZ_ERROR_PROGRESS - some break from progress callback
+  SZ_ERROR_THREAD - errors in multithreading functions (only for Mt version)
+*/
+
+/* The stream is cut into chunks of at most 2 MB of input and 64 KB of
+   packed data, so a decoder never needs more than that of either at
+   once.  A chunk which doesn't shrink is stored uncompressed instead,
+   and the encoder's state is rolled back to where it was before it.
+   Input which looks incompressible before coding (nearly uniform bytes,
+   few repeats in itself or the dictionary) is stored in 64 KB windows
+   without being parsed or coded, only passed through the match finder. */
+
+typedef void * CLzma2EncHandle;
+
+CLzma2EncHandle Lzma2Enc_Create(ISzAlloc *alloc, ISzAlloc *allocBig);
+void Lzma2Enc_Destroy(CLzma2EncHandle p);
+SRes Lzma2Enc_SetProps(CLzma2EncHandle p, const CLzma2EncProps *props);
+Byte Lzma2Enc_WriteProperties(CLzma2EncHandle p);
+SRes Lzma2Enc_Encode(CLzma2EncHandle p,
+    ISeqOutStream *outStream, ISeqInStream *inStream, ICompressProgress *progress);
+
+/* as LzmaEnc_GetLargePageBytes, for the LZMA encoder inside */
+UInt64 Lzma2Enc_GetLargePageBytes(CLzma2EncHandle p);
+
+#endif
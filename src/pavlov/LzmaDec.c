@@ -712,6 +712,20 @@ void LzmaDec_Init(CLzmaDec *p)
   LzmaDec_InitDicAndState(p, True, True);
 }
 
+void LzmaDec_SetPresetDict(CLzmaDec *p, const Byte *dict, SizeT dictSize)
+{
+  SizeT size = dictSize;
+  if (size == 0)
+    return;
+  if (size > p->dicBufSize)
+    size = p->dicBufSize;
+  memcpy(p->dic, dict + dictSize - size, size);
+  p->dicPos = size;
+  p->processedPos = (UInt32)dictSize;
+  if (dictSize >= p->prop.dicSize)
+    p->checkDicSize = p->prop.dicSize;
+}
+
 static void LzmaDec_InitStateReal(CLzmaDec *p)
 {
   UInt32 numProbs = Literal + ((UInt32)LZMA_LIT_SIZE << (p->prop.lc + p->prop.lp));
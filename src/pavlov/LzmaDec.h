@@ -68,6 +68,11 @@ typedef struct
 
 void LzmaDec_Init(CLzmaDec *p);
 
+/* LzmaDec_SetPresetDict primes the dictionary with the data a stream was
+   encoded to continue (see LzmaEnc_SetPresetDict).  Call it after
+   LzmaDec_Init, it uses as much of dict as the dictionary holds. */
+void LzmaDec_SetPresetDict(CLzmaDec *p, const Byte *dict, SizeT dictSize);
+
 /* There are two types of LZMA streams:
      0) Stream with end mark. That end mark adds about 6 bytes to compressed size.
      1) Stream without end mark. You must know exact uncompressed size to decompress such stream. */
@@ -12,6 +12,7 @@
 
 #include "LzmaEnc.h"
 
+#include "Alloc.h"
 #include "LzFind.h"
 #ifdef COMPRESS_MF_MT
 #include "LzFindMt.h"
@@ -48,6 +49,8 @@ void LzmaEncProps_Init(CLzmaEncProps *p)
   p->dictSize = p->mc = 0;
   p->lc = p->lp = p->pb = p->algo = p->fb = p->btMode = p->numHashBytes = p->numThreads = -1;
   p->writeEndMark = 0;
+  p->mulHash = 0;
+  p->ringWindow = 0;
 }
 
 void LzmaEncProps_Normalize(CLzmaEncProps *p)
@@ -246,6 +249,28 @@ static SRes MyRead(void *pp, void *data, size_t *size)
   return SZ_OK;
 }
 
+/* the preset dictionary followed by the input */
+typedef struct _CPresetDictInStream
+{
+  ISeqInStream funcTable;
+  const Byte *dict;
+  SizeT dictRem;
+  ISeqInStream *stream;
+} CPresetDictInStream;
+
+static SRes PresetDictRead(void *pp, void *data, size_t *size)
+{
+  CPresetDictInStream *p = (CPresetDictInStream *)pp;
+  if (p->dictRem == 0)
+    return p->stream->Read(p->stream, data, size);
+  if (*size > p->dictRem)
+    *size = p->dictRem;
+  memcpy(data, p->dict, *size);
+  p->dictRem -= *size;
+  p->dict += *size;
+  return SZ_OK;
+}
+
 typedef struct
 {
   CLzmaProb *litProbs;
@@ -268,6 +293,22 @@ typedef struct
   UInt32 state;
 } CSaveState;
 
+/* the prices LzmaEnc_InitPrices computes from freshly initialized
+   probabilities depend on nothing but these few parameters, so a stream
+   which starts like the one before copies them instead */
+typedef struct
+{
+  Bool valid;
+  Bool fastMode;
+  UInt32 distTableSize;
+  UInt32 tableSize;
+  UInt32 numPosStates;
+  UInt32 posSlotPrices[kNumLenToPosStates][kDistTableSizeMax];
+  UInt32 distancesPrices[kNumLenToPosStates][kNumFullDistances];
+  UInt32 alignPrices[kAlignTableSize];
+  UInt32 lenPrices[LZMA_NUM_PB_STATES_MAX][kLenNumSymbolsTotal];
+} CInitPrices;
+
 typedef struct _CLzmaEnc
 {
   IMatchFinder matchFinder;
@@ -299,6 +340,8 @@ typedef struct _CLzmaEnc
   UInt32 ProbPrices[kBitModelTotal >> kNumMoveReducingBits];
   UInt32 matches[LZMA_MATCH_LEN_MAX * 2 + 2 + 1];
   UInt32 numFastBytes;
+  UInt32 maxFastBytes; /* what the match finder is sized for beyond
+                          numFastBytes, see LzmaEnc_SetMaxFastBytes */
   UInt32 additionalOffset;
   UInt32 reps[LZMA_NUM_REPS];
   UInt32 state;
@@ -330,13 +373,19 @@ typedef struct _CLzmaEnc
   CLenPriceEnc repLenEnc;
 
   unsigned lclp;
+  unsigned lclpAlloc; /* litProbs are allocated for this lclp */
 
   Bool fastMode;
+  Bool lazyMode;
+  UInt32 lazyLiterals; /* literals the lazy parser has already decided on */
   
   CRangeEnc rc;
 
   Bool writeEndMark;
   UInt64 nowPos64;
+  UInt64 availSize; /* the input which exists so far, see LzmaEnc_CodeAvail */
+  UInt64 packLimit; /* the most bytes to code, zero for no limit, see
+                       LzmaEnc_MemEncodePart */
   UInt32 matchPriceCount;
   Bool finished;
   Bool multiThread;
@@ -348,7 +397,14 @@ typedef struct _CLzmaEnc
   ISeqInStream *inStream;
   CSeqInStreamBuf seqBufInStream;
 
+  /* data the input is coded as a continuation of, see
+     LzmaEnc_SetPresetDict */
+  const Byte *presetDict;
+  SizeT presetDictSize;
+  CPresetDictInStream presetDictInStream;
+
   CSaveState saveState;
+  CInitPrices initPrices;
 } CLzmaEnc;
 
 void LzmaEnc_SaveState(CLzmaEncHandle pp)
@@ -426,6 +482,7 @@ SRes LzmaEnc_SetProps(CLzmaEncHandle pp, const CLzmaEncProps *props2)
   p->lp = props.lp;
   p->pb = props.pb;
   p->fastMode = (props.algo == 0);
+  p->lazyMode = (props.algo == 2);
   p->matchFinderBase.btMode = props.btMode;
   {
     UInt32 numHashBytes = 4;
@@ -438,6 +495,8 @@ SRes LzmaEnc_SetProps(CLzmaEncHandle pp, const CLzmaEncProps *props2)
     }
     p->matchFinderBase.numHashBytes = numHashBytes;
   }
+  p->matchFinderBase.mulHash = (props.mulHash != 0);
+  p->matchFinderBase.ringWindow = (props.ringWindow != 0);
 
   p->matchFinderBase.cutValue = props.mc;
 
@@ -845,7 +904,8 @@ static UInt32 ReadMatchDistances(CLzmaEnc *p, UInt32 *numDistancePairsRes)
   if (numPairs > 0)
   {
     lenRes = p->matches[numPairs - 2];
-    if (lenRes == p->numFastBytes)
+    /* the match finder may be sized for more fast bytes than are used */
+    if (lenRes >= p->numFastBytes)
     {
       const Byte *pby = p->matchFinder.GetPointerToCurrentPos(p->matchFinderObj) - 1;
       UInt32 distance = p->matches[numPairs - 1] + 1;
@@ -1609,6 +1669,151 @@ static UInt32 GetOptimumFast(CLzmaEnc *p, UInt32 *backRes)
   return mainLen;
 }
 
+/* Lazy parsing: the cheapest match by approximate price per byte, which
+   is put off for a literal when one starting at the next position, or the
+   one after, costs less per byte including the literals before it.
+   Prices come from the current state and tables, the literals' effect on
+   the state is the only one followed. */
+
+static UInt32 GetLazyLiteralPrice(CLzmaEnc *p, UInt32 position, UInt32 state)
+{
+  const Byte *data = p->matchFinder.GetPointerToCurrentPos(p->matchFinderObj) - 1;
+  const CLzmaProb *probs = LIT_PROBS(position, *(data - 1));
+  return GET_PRICE_0(p->isMatch[state][position & p->pbMask]) +
+    (IsCharState(state) ?
+      LitEnc_GetPrice(probs, *data, p->ProbPrices) :
+      LitEnc_GetPriceMatched(probs, *data, *(data - p->reps[0] - 1), p->ProbPrices));
+}
+
+/* returns the length of the cheapest match at the last position read, 0 if
+   there is none, and a match of numFastBytes or more at once */
+static UInt32 GetLazyMatch(CLzmaEnc *p, UInt32 position, UInt32 state,
+    UInt32 mainLen, UInt32 numPairs, UInt32 *backRes, UInt32 *priceRes)
+{
+  UInt32 numAvail, posState, matchPrice, repMatchPrice, normalMatchPrice, i;
+  UInt32 bestLen = 0, bestPrice = 0;
+  const Byte *data;
+
+  numAvail = p->numAvail;
+  if (numAvail < 2)
+    return 0;
+  if (numAvail > LZMA_MATCH_LEN_MAX)
+    numAvail = LZMA_MATCH_LEN_MAX;
+  data = p->matchFinder.GetPointerToCurrentPos(p->matchFinderObj) - 1;
+  posState = position & p->pbMask;
+  matchPrice = GET_PRICE_1(p->isMatch[state][posState]);
+  repMatchPrice = matchPrice + GET_PRICE_1(p->isRep[state]);
+  normalMatchPrice = matchPrice + GET_PRICE_0(p->isRep[state]);
+
+  for (i = 0; i < LZMA_NUM_REPS; i++)
+  {
+    UInt32 len, price;
+    const Byte *data2 = data - (p->reps[i] + 1);
+    if (data[0] != data2[0] || data[1] != data2[1])
+      continue;
+    for (len = 2; len < numAvail && data[len] == data2[len]; len++);
+    if (len >= p->numFastBytes)
+    {
+      *backRes = i;
+      *priceRes = repMatchPrice + GetRepPrice(p, i, p->numFastBytes, state, posState);
+      return len;
+    }
+    price = repMatchPrice + GetRepPrice(p, i, len, state, posState);
+    if (bestLen == 0 || price * bestLen < bestPrice * len)
+    {
+      bestLen = len;
+      bestPrice = price;
+      *backRes = i;
+    }
+  }
+
+  for (i = 0; i < numPairs; i += 2)
+  {
+    UInt32 len = p->matches[i];
+    UInt32 distance = p->matches[i + 1];
+    UInt32 lenToPosState = GetLenToPosState(len);
+    UInt32 price;
+    if (i + 2 == numPairs)
+      len = mainLen;
+    price = normalMatchPrice + p->lenEnc.prices[posState]
+        [(len < p->numFastBytes ? len : p->numFastBytes) - LZMA_MATCH_LEN_MIN];
+    if (distance < kNumFullDistances)
+      price += p->distancesPrices[lenToPosState][distance];
+    else
+    {
+      UInt32 slot;
+      GetPosSlot2(distance, slot);
+      price += p->alignPrices[distance & kAlignMask] + p->posSlotPrices[lenToPosState][slot];
+    }
+    if (len >= p->numFastBytes || bestLen == 0 || price * bestLen < bestPrice * len)
+    {
+      bestLen = len;
+      bestPrice = price;
+      *backRes = distance + LZMA_NUM_REPS;
+    }
+  }
+
+  *priceRes = bestPrice;
+  return bestLen;
+}
+
+static UInt32 GetOptimumLazy(CLzmaEnc *p, UInt32 position, UInt32 *backRes)
+{
+  UInt32 mainLen, numPairs, len, back, price, litPrice, state, i;
+
+  *backRes = (UInt32)-1;
+  if (p->lazyLiterals != 0)
+  {
+    p->lazyLiterals--;
+    return 1;
+  }
+
+  if (p->additionalOffset == 0)
+    mainLen = ReadMatchDistances(p, &numPairs);
+  else
+  {
+    mainLen = p->longestMatchLength;
+    numPairs = p->numPairs;
+  }
+
+  len = GetLazyMatch(p, position, p->state, mainLen, numPairs, &back, &price);
+  if (len < 2)
+    return 1;
+  if (len >= p->numFastBytes)
+  {
+    *backRes = back;
+    MovePos(p, len - 1);
+    return len;
+  }
+
+  /* a short far match can cost more than literals */
+  litPrice = GetLazyLiteralPrice(p, position, p->state);
+  if (price >= litPrice * len)
+    return 1;
+
+  state = p->state;
+  for (i = 1; i <= 2; i++)
+  {
+    UInt32 len2, back2, price2;
+    /* the match can't end before the positions read */
+    if (p->numAvail <= 2 || (i == 2 && len < 3))
+      break;
+    state = kLiteralNextStates[state];
+    p->longestMatchLength = ReadMatchDistances(p, &p->numPairs);
+    len2 = GetLazyMatch(p, position + i, state, p->longestMatchLength, p->numPairs, &back2, &price2);
+    if (len2 >= 2 && (litPrice + price2) * len < price * (i + len2))
+    {
+      p->lazyLiterals = i - 1;
+      return 1;
+    }
+    litPrice += GetLazyLiteralPrice(p, position + i, state);
+  }
+
+  *backRes = back;
+  MovePos(p, len - i);
+  return len;
+}
+
 static void WriteEndMarker(CLzmaEnc *p, UInt32 posState)
 {
   UInt32 len;
@@ -1710,6 +1915,12 @@ void LzmaEnc_Construct(CLzmaEnc *p)
   LzmaEnc_InitPriceTables(p->ProbPrices);
   p->litProbs = 0;
   p->saveState.litProbs = 0;
+  p->lclpAlloc = 0;
+  p->presetDict = 0;
+  p->presetDictSize = 0;
+  p->maxFastBytes = 0;
+  p->packLimit = 0;
+  p->initPrices.valid = False;
 }
 
 CLzmaEncHandle LzmaEnc_Create(ISzAlloc *alloc)
@@ -1745,15 +1956,200 @@ void LzmaEnc_Destroy(CLzmaEncHandle p, ISzAlloc *alloc, ISzAlloc *allocBig)
   alloc->Free(alloc, p);
 }
 
-static SRes LzmaEnc_CodeOneBlock(CLzmaEnc *p, Bool useLimits, UInt32 maxPackSize, UInt32 maxUnpackSize)
+UInt64 LzmaEnc_GetLargePageBytes(CLzmaEncHandle pp)
+{
+  const CMatchFinder *mf = &((CLzmaEnc *)pp)->matchFinderBase;
+  UInt64 res = 0;
+  if (mf->hash != 0)
+    res += LargePageBytes(mf->hash, (size_t)mf->refsAllocSize * sizeof(CLzRef));
+  if (mf->bufferAlloc != 0)
+    res += LargePageBytes(mf->bufferAlloc, mf->bufferAllocSize);
+  return res;
+}
+
+/* input which repeats what's rep0 back (a run of one byte value, once
+   rep0 is within it) for a whole match of the longest length is coded as
+   that match, without the parser looking for anything better.  Only as
+   many bytes as the match finders always keep ahead are looked at, so that
+   the output doesn't depend on how the input arrives or on the threads */
+static Bool IsRunAhead(CLzmaEnc *p)
+{
+  const Byte *cur;
+  if (p->additionalOffset != 0 ||
+      p->matchFinder.GetNumAvailableBytes(p->matchFinderObj) < LZMA_MATCH_LEN_MAX)
+    return False;
+  cur = p->matchFinder.GetPointerToCurrentPos(p->matchFinderObj);
+  return (memcmp(cur - p->reps[0] - 1, cur, LZMA_MATCH_LEN_MAX) == 0);
+}
+
+/* codes a literal (pos == -1, len == 1), a short rep (pos == 0, len == 1)
+   or a match chosen by a parser at nowPos32 */
+static void EncodeSymbol(CLzmaEnc *p, UInt32 nowPos32, UInt32 pos, UInt32 len)
+{
+  UInt32 posState = nowPos32 & p->pbMask;
+  if (len == 1 && pos == (UInt32)-1)
+  {
+    Byte curByte;
+    CLzmaProb *probs;
+    const Byte *data;
+
+    RangeEnc_EncodeBit(&p->rc, &p->isMatch[p->state][posState], 0);
+    data = p->matchFinder.GetPointerToCurrentPos(p->matchFinderObj) - p->additionalOffset;
+    curByte = *data;
+    probs = LIT_PROBS(nowPos32, *(data - 1));
+    if (IsCharState(p->state))
+      LitEnc_Encode(&p->rc, probs, curByte);
+    else
+      LitEnc_EncodeMatched(&p->rc, probs, curByte, *(data - p->reps[0] - 1));
+    p->state = kLiteralNextStates[p->state];
+  }
+  else
+  {
+    RangeEnc_EncodeBit(&p->rc, &p->isMatch[p->state][posState], 1);
+    if (pos < LZMA_NUM_REPS)
+    {
+      RangeEnc_EncodeBit(&p->rc, &p->isRep[p->state], 1);
+      if (pos == 0)
+      {
+        RangeEnc_EncodeBit(&p->rc, &p->isRepG0[p->state], 0);
+        RangeEnc_EncodeBit(&p->rc, &p->isRep0Long[p->state][posState], ((len == 1) ? 0 : 1));
+      }
+      else
+      {
+        UInt32 distance = p->reps[pos];
+        RangeEnc_EncodeBit(&p->rc, &p->isRepG0[p->state], 1);
+        if (pos == 1)
+          RangeEnc_EncodeBit(&p->rc, &p->isRepG1[p->state], 0);
+        else
+        {
+          RangeEnc_EncodeBit(&p->rc, &p->isRepG1[p->state], 1);
+          RangeEnc_EncodeBit(&p->rc, &p->isRepG2[p->state], pos - 2);
+          if (pos == 3)
+            p->reps[3] = p->reps[2];
+          p->reps[2] = p->reps[1];
+        }
+        p->reps[1] = p->reps[0];
+        p->reps[0] = distance;
+      }
+      if (len == 1)
+        p->state = kShortRepNextStates[p->state];
+      else
+      {
+        LenEnc_Encode2(&p->repLenEnc, &p->rc, len - LZMA_MATCH_LEN_MIN, posState, !p->fastMode, p->ProbPrices);
+        p->state = kRepNextStates[p->state];
+      }
+    }
+    else
+    {
+      UInt32 posSlot;
+      RangeEnc_EncodeBit(&p->rc, &p->isRep[p->state], 0);
+      p->state = kMatchNextStates[p->state];
+      LenEnc_Encode2(&p->lenEnc, &p->rc, len - LZMA_MATCH_LEN_MIN, posState, !p->fastMode, p->ProbPrices);
+      pos -= LZMA_NUM_REPS;
+      GetPosSlot(pos, posSlot);
+      RcTree_Encode(&p->rc, p->posSlotEncoder[GetLenToPosState(len)], kNumPosSlotBits, posSlot);
+      
+      if (posSlot >= kStartPosModelIndex)
+      {
+        UInt32 footerBits = ((posSlot >> 1) - 1);
+        UInt32 base = ((2 | (posSlot & 1)) << footerBits);
+        UInt32 posReduced = pos - base;
+
+        if (posSlot < kEndPosModelIndex)
+          RcTree_ReverseEncode(&p->rc, p->posEncoders + base - posSlot - 1, footerBits, posReduced);
+        else
+        {
+          RangeEnc_EncodeDirectBits(&p->rc, posReduced >> kNumAlignBits, footerBits - kNumAlignBits);
+          RcTree_ReverseEncode(&p->rc, p->posAlignEncoder, kNumAlignBits, posReduced & kAlignMask);
+          p->alignPriceCount++;
+        }
+      }
+      p->reps[3] = p->reps[2];
+      p->reps[2] = p->reps[1];
+      p->reps[1] = p->reps[0];
+      p->reps[0] = pos;
+      p->matchPriceCount++;
+    }
+  }
+}
+
+/* a symbol codes at most 20 bytes and the end mark 16 (an adaptive bit
+   costs at most about 6 bits, the direct distance bits one each), and
+   flushing the range coder adds 4 */
+#define kPackReserve 48
+
+/* whether the stream still fits in packLimit bytes once the symbol and
+   the end of the stream are coded.  Until they're within kPackReserve of
+   the limit it does, after that they're coded, measured and rolled back */
+static Bool CheckPackLimit(CLzmaEnc *p, UInt32 nowPos32, UInt32 pos, UInt32 len)
+{
+  CRangeEnc rc;
+  UInt64 packSize;
+  if (RangeEnc_GetProcessed(&p->rc) + kPackReserve <= p->packLimit)
+    return True;
+  /* bytes the range coder has settled may be written out early, so that
+     the trial stays within its buffer */
+  if (p->rc.bufLim - p->rc.buf < kPackReserve)
+    RangeEnc_FlushStream(&p->rc);
+  rc = p->rc;
+  LzmaEnc_SaveState(p);
+  if (p->nowPos64 == 0 && nowPos32 == 0)
+  {
+    /* the first literal, which has no previous byte */
+    RangeEnc_EncodeBit(&p->rc, &p->isMatch[p->state][0], 0);
+    LitEnc_Encode(&p->rc, p->litProbs,
+        p->matchFinder.GetIndexByte(p->matchFinderObj, 0 - p->additionalOffset));
+  }
+  else
+    EncodeSymbol(p, nowPos32, pos, len);
+  if (p->writeEndMark)
+    WriteEndMarker(p, (nowPos32 + len) & p->pbMask);
+  RangeEnc_FlushData(&p->rc);
+  packSize = p->rc.processed + (p->rc.buf - p->rc.bufBase);
+  p->rc = rc;
+  LzmaEnc_RestoreState(p);
+  return (packSize <= p->packLimit);
+}
+
+/* between two points where the match finder is level with nowPos it
+   runs at most kNumOpts + LZMA_MATCH_LEN_MAX bytes ahead, and then wants
+   up to keepSizeAfter (<= 2 * LZMA_MATCH_LEN_MAX + 1) bytes beyond that */
+#define kAvailLookahead (kNumOpts + LZMA_MATCH_LEN_MAX * 4)
+
+/* starts the match finder on the stream once, before the first block */
+static void LzmaEnc_InitInput(CLzmaEnc *p)
 {
-  UInt32 nowPos32, startPos32;
   if (p->inStream != 0)
   {
     p->matchFinderBase.stream = p->inStream;
+    if (p->presetDictSize != 0)
+    {
+      /* the dictionary goes through the match finder without being
+         coded, so that the input can refer back to it */
+      p->presetDictInStream.funcTable.Read = PresetDictRead;
+      p->presetDictInStream.dict = p->presetDict;
+      p->presetDictInStream.dictRem = p->presetDictSize;
+      p->presetDictInStream.stream = p->inStream;
+      p->matchFinderBase.stream = &p->presetDictInStream.funcTable;
+    }
     p->matchFinder.Init(p->matchFinderObj);
+    if (p->presetDictSize != 0)
+      p->matchFinder.Skip(p->matchFinderObj, (UInt32)p->presetDictSize);
     p->inStream = 0;
   }
+}
+
+static SRes LzmaEnc_CodeOneBlock(CLzmaEnc *p, Bool useLimits, UInt32 maxPackSize, UInt32 maxUnpackSize)
+{
+  UInt32 nowPos32, startPos32;
+  /* a stream begun before fork() can't go on in the child without its
+     window */
+  if (MatchFinder_WindowLost(&p->matchFinderBase))
+  {
+    p->finished = True;
+    return p->result = SZ_ERROR_MEM;
+  }
+  LzmaEnc_InitInput(p);
 
   if (p->finished)
     return p->result;
@@ -1769,6 +2165,8 @@ static SRes LzmaEnc_CodeOneBlock(CLzmaEnc *p, Bool useLimits, UInt32 maxPackSize
     if (p->matchFinder.GetNumAvailableBytes(p->matchFinderObj) == 0)
       return Flush(p, nowPos32);
     ReadMatchDistances(p, &numPairs);
+    if (p->packLimit != 0 && !CheckPackLimit(p, nowPos32, (UInt32)-1, 1))
+      return Flush(p, nowPos32);
     RangeEnc_EncodeBit(&p->rc, &p->isMatch[p->state][0], 0);
     p->state = kLiteralNextStates[p->state];
     curByte = p->matchFinder.GetIndexByte(p->matchFinderObj, 0 - p->additionalOffset);
@@ -1780,10 +2178,22 @@ static SRes LzmaEnc_CodeOneBlock(CLzmaEnc *p, Bool useLimits, UInt32 maxPackSize
   if (p->matchFinder.GetNumAvailableBytes(p->matchFinderObj) != 0)
   for (;;)
   {
-    UInt32 pos, len, posState;
+    UInt32 pos, len;
 
-    if (p->fastMode)
+    if (IsRunAhead(p))
+    {
+      pos = 0;
+      len = LZMA_MATCH_LEN_MAX;
+      if (p->matchFinderObj == &p->matchFinderBase)
+        MatchFinder_SkipRun(&p->matchFinderBase, len);
+      else
+        p->matchFinder.Skip(p->matchFinderObj, len);
+      p->additionalOffset += len;
+    }
+    else if (p->fastMode)
       len = GetOptimumFast(p, &pos);
+    else if (p->lazyMode)
+      len = GetOptimumLazy(p, nowPos32, &pos);
     else
       len = GetOptimum(p, nowPos32, &pos);
 
@@ -1791,91 +2201,9 @@ static SRes LzmaEnc_CodeOneBlock(CLzmaEnc *p, Bool useLimits, UInt32 maxPackSize
     printf("\n pos = %4X,   len = %d   pos = %d", nowPos32, len, pos);
     #endif
 
-    posState = nowPos32 & p->pbMask;
-    if (len == 1 && pos == (UInt32)-1)
-    {
-      Byte curByte;
-      CLzmaProb *probs;
-      const Byte *data;
-
-      RangeEnc_EncodeBit(&p->rc, &p->isMatch[p->state][posState], 0);
-      data = p->matchFinder.GetPointerToCurrentPos(p->matchFinderObj) - p->additionalOffset;
-      curByte = *data;
-      probs = LIT_PROBS(nowPos32, *(data - 1));
-      if (IsCharState(p->state))
-        LitEnc_Encode(&p->rc, probs, curByte);
-      else
-        LitEnc_EncodeMatched(&p->rc, probs, curByte, *(data - p->reps[0] - 1));
-      p->state = kLiteralNextStates[p->state];
-    }
-    else
-    {
-      RangeEnc_EncodeBit(&p->rc, &p->isMatch[p->state][posState], 1);
-      if (pos < LZMA_NUM_REPS)
-      {
-        RangeEnc_EncodeBit(&p->rc, &p->isRep[p->state], 1);
-        if (pos == 0)
-        {
-          RangeEnc_EncodeBit(&p->rc, &p->isRepG0[p->state], 0);
-          RangeEnc_EncodeBit(&p->rc, &p->isRep0Long[p->state][posState], ((len == 1) ? 0 : 1));
-        }
-        else
-        {
-          UInt32 distance = p->reps[pos];
-          RangeEnc_EncodeBit(&p->rc, &p->isRepG0[p->state], 1);
-          if (pos == 1)
-            RangeEnc_EncodeBit(&p->rc, &p->isRepG1[p->state], 0);
-          else
-          {
-            RangeEnc_EncodeBit(&p->rc, &p->isRepG1[p->state], 1);
-            RangeEnc_EncodeBit(&p->rc, &p->isRepG2[p->state], pos - 2);
-            if (pos == 3)
-              p->reps[3] = p->reps[2];
-            p->reps[2] = p->reps[1];
-          }
-          p->reps[1] = p->reps[0];
-          p->reps[0] = distance;
-        }
-        if (len == 1)
-          p->state = kShortRepNextStates[p->state];
-        else
-        {
-          LenEnc_Encode2(&p->repLenEnc, &p->rc, len - LZMA_MATCH_LEN_MIN, posState, !p->fastMode, p->ProbPrices);
-          p->state = kRepNextStates[p->state];
-        }
-      }
-      else
-      {
-        UInt32 posSlot;
-        RangeEnc_EncodeBit(&p->rc, &p->isRep[p->state], 0);
-        p->state = kMatchNextStates[p->state];
-        LenEnc_Encode2(&p->lenEnc, &p->rc, len - LZMA_MATCH_LEN_MIN, posState, !p->fastMode, p->ProbPrices);
-        pos -= LZMA_NUM_REPS;
-        GetPosSlot(pos, posSlot);
-        RcTree_Encode(&p->rc, p->posSlotEncoder[GetLenToPosState(len)], kNumPosSlotBits, posSlot);
-        
-        if (posSlot >= kStartPosModelIndex)
-        {
-          UInt32 footerBits = ((posSlot >> 1) - 1);
-          UInt32 base = ((2 | (posSlot & 1)) << footerBits);
-          UInt32 posReduced = pos - base;
-
-          if (posSlot < kEndPosModelIndex)
-            RcTree_ReverseEncode(&p->rc, p->posEncoders + base - posSlot - 1, footerBits, posReduced);
-          else
-          {
-            RangeEnc_EncodeDirectBits(&p->rc, posReduced >> kNumAlignBits, footerBits - kNumAlignBits);
-            RcTree_ReverseEncode(&p->rc, p->posAlignEncoder, kNumAlignBits, posReduced & kAlignMask);
-            p->alignPriceCount++;
-          }
-        }
-        p->reps[3] = p->reps[2];
-        p->reps[2] = p->reps[1];
-        p->reps[1] = p->reps[0];
-        p->reps[0] = pos;
-        p->matchPriceCount++;
-      }
-    }
+    if (p->packLimit != 0 && !CheckPackLimit(p, nowPos32, pos, len))
+      break;
+    EncodeSymbol(p, nowPos32, pos, len);
     p->additionalOffset -= len;
     nowPos32 += len;
     if (p->additionalOffset == 0)
@@ -1897,7 +2225,8 @@ static SRes LzmaEnc_CodeOneBlock(CLzmaEnc *p, Bool useLimits, UInt32 maxPackSize
             RangeEnc_GetProcessed(&p->rc) + kNumOpts * 2 >= maxPackSize)
           break;
       }
-      else if (processed >= (1 << 15))
+      else if (processed >= (1 << 15) ||
+          p->nowPos64 + processed + kAvailLookahead > p->availSize)
       {
         p->nowPos64 += nowPos32 - startPos32;
         return CheckErrors(p);
@@ -1913,6 +2242,7 @@ static SRes LzmaEnc_CodeOneBlock(CLzmaEnc *p, Bool useLimits, UInt32 maxPackSize
 static SRes LzmaEnc_Alloc(CLzmaEnc *p, UInt32 keepWindowSize, ISzAlloc *alloc, ISzAlloc *allocBig)
 {
   UInt32 beforeSize = kNumOpts;
+  UInt32 matchMaxLen = p->numFastBytes;
   Bool btMode;
   if (!RangeEnc_Alloc(&p->rc, alloc))
     return SZ_ERROR_MEM;
@@ -1923,7 +2253,8 @@ static SRes LzmaEnc_Alloc(CLzmaEnc *p, UInt32 keepWindowSize, ISzAlloc *alloc, I
 
   {
     unsigned lclp = p->lc + p->lp;
-    if (p->litProbs == 0 || p->saveState.litProbs == 0 || p->lclp != lclp)
+    /* tables from an earlier run are reused unless they're too small */
+    if (p->litProbs == 0 || p->saveState.litProbs == 0 || p->lclpAlloc < lclp)
     {
       LzmaEnc_FreeLits(p, alloc);
       p->litProbs = (CLzmaProb *)alloc->Alloc(alloc, (0x300 << lclp) * sizeof(CLzmaProb));
@@ -1933,8 +2264,9 @@ static SRes LzmaEnc_Alloc(CLzmaEnc *p, UInt32 keepWindowSize, ISzAlloc *alloc, I
         LzmaEnc_FreeLits(p, alloc);
         return SZ_ERROR_MEM;
       }
-      p->lclp = lclp;
+      p->lclpAlloc = lclp;
     }
+    p->lclp = lclp;
   }
 
   p->matchFinderBase.bigHash = (p->dictSize > kBigHashDicLimit);
@@ -1942,17 +2274,20 @@ static SRes LzmaEnc_Alloc(CLzmaEnc *p, UInt32 keepWindowSize, ISzAlloc *alloc, I
   if (beforeSize + p->dictSize < keepWindowSize)
     beforeSize = keepWindowSize - p->dictSize;
 
+  if (matchMaxLen < p->maxFastBytes)
+    matchMaxLen = p->maxFastBytes;
+
   #ifdef COMPRESS_MF_MT
   if (p->mtMode)
   {
-    RINOK(MatchFinderMt_Create(&p->matchFinderMt, p->dictSize, beforeSize, p->numFastBytes, LZMA_MATCH_LEN_MAX, allocBig));
+    RINOK(MatchFinderMt_Create(&p->matchFinderMt, p->dictSize, beforeSize, matchMaxLen, LZMA_MATCH_LEN_MAX, allocBig));
     p->matchFinderObj = &p->matchFinderMt;
     MatchFinderMt_CreateVTable(&p->matchFinderMt, &p->matchFinder);
   }
   else
   #endif
   {
-    if (!MatchFinder_Create(&p->matchFinderBase, p->dictSize, beforeSize, p->numFastBytes, LZMA_MATCH_LEN_MAX, allocBig))
+    if (!MatchFinder_Create(&p->matchFinderBase, p->dictSize, beforeSize, matchMaxLen, LZMA_MATCH_LEN_MAX, allocBig))
       return SZ_ERROR_MEM;
     p->matchFinderObj = &p->matchFinderBase;
     MatchFinder_CreateVTable(&p->matchFinderBase, &p->matchFinder);
@@ -1985,9 +2320,13 @@ void LzmaEnc_Init(CLzmaEnc *p)
   }
 
   {
+    /* the first literal coder is set and then copied over the rest,
+       doubling each time, which keeps resets cheap for large lc + lp */
     UInt32 num = 0x300 << (p->lp + p->lc);
-    for (i = 0; i < num; i++)
+    for (i = 0; i < 0x300; i++)
       p->litProbs[i] = kProbInitValue;
+    for (i = 0x300; i < num; i <<= 1)
+      memcpy(p->litProbs + i, p->litProbs, i * sizeof(CLzmaProb));
   }
 
   {
@@ -2013,6 +2352,7 @@ void LzmaEnc_Init(CLzmaEnc *p)
   p->optimumEndIndex = 0;
   p->optimumCurrentIndex = 0;
   p->additionalOffset = 0;
+  p->lazyLiterals = 0;
 
   p->pbMask = (1 << p->pb) - 1;
   p->lpMask = (1 << p->lp) - 1;
@@ -2033,6 +2373,88 @@ void LzmaEnc_InitPrices(CLzmaEnc *p)
   LenPriceEnc_UpdateTables(&p->repLenEnc, 1 << p->pb, p->ProbPrices);
 }
 
+SRes LzmaEnc_SetMaxFastBytes(CLzmaEncHandle pp, UInt32 fb)
+{
+  CLzmaEnc *p = (CLzmaEnc *)pp;
+  if (fb > LZMA_MATCH_LEN_MAX)
+    return SZ_ERROR_PARAM;
+  p->maxFastBytes = fb;
+  return SZ_OK;
+}
+
+SRes LzmaEnc_SetEffort(CLzmaEncHandle pp, int algo, UInt32 fb, UInt32 mc)
+{
+  CLzmaEnc *p = (CLzmaEnc *)pp;
+  Bool fastMode = (algo == 0);
+  if (algo < 0 || algo > 2 || mc < 1)
+    return SZ_ERROR_PARAM;
+  #ifdef COMPRESS_MF_MT
+  if (p->mtMode)
+    return SZ_ERROR_PARAM;
+  #endif
+  if (fb < 5)
+    fb = 5;
+  if (fb > p->matchFinderBase.matchMaxLen)
+    fb = p->matchFinderBase.matchMaxLen;
+  p->matchFinderBase.cutValue = mc;
+  p->lazyMode = (algo == 2);
+  if (fastMode != p->fastMode || fb != p->numFastBytes)
+  {
+    /* the fast parser leaves the prices alone */
+    p->fastMode = fastMode;
+    p->numFastBytes = fb;
+    LzmaEnc_InitPrices(p);
+  }
+  return SZ_OK;
+}
+
+/* LzmaEnc_InitPrices for probabilities LzmaEnc_Init just reset */
+static void LzmaEnc_InitFreshPrices(CLzmaEnc *p)
+{
+  CInitPrices *ip = &p->initPrices;
+  UInt32 tableSize = p->numFastBytes + 1 - LZMA_MATCH_LEN_MIN;
+  UInt32 numPosStates = (UInt32)1 << p->pb;
+  UInt32 posState;
+
+  if (!ip->valid || ip->fastMode != p->fastMode ||
+      ip->distTableSize != p->distTableSize ||
+      ip->tableSize != tableSize || ip->numPosStates != numPosStates)
+  {
+    LzmaEnc_InitPrices(p);
+    if (!p->fastMode)
+    {
+      memcpy(ip->posSlotPrices, p->posSlotPrices, sizeof(p->posSlotPrices));
+      memcpy(ip->distancesPrices, p->distancesPrices, sizeof(p->distancesPrices));
+      memcpy(ip->alignPrices, p->alignPrices, sizeof(p->alignPrices));
+    }
+    /* both length coders start with the same probabilities */
+    for (posState = 0; posState < numPosStates; posState++)
+      memcpy(ip->lenPrices[posState], p->lenEnc.prices[posState], tableSize * sizeof(UInt32));
+    ip->fastMode = p->fastMode;
+    ip->distTableSize = p->distTableSize;
+    ip->tableSize = tableSize;
+    ip->numPosStates = numPosStates;
+    ip->valid = True;
+    return;
+  }
+
+  if (!p->fastMode)
+  {
+    memcpy(p->posSlotPrices, ip->posSlotPrices, sizeof(p->posSlotPrices));
+    memcpy(p->distancesPrices, ip->distancesPrices, sizeof(p->distancesPrices));
+    memcpy(p->alignPrices, ip->alignPrices, sizeof(p->alignPrices));
+    p->alignPriceCount = 0;
+    p->matchPriceCount = 0;
+  }
+  p->lenEnc.tableSize = p->repLenEnc.tableSize = tableSize;
+  for (posState = 0; posState < numPosStates; posState++)
+  {
+    memcpy(p->lenEnc.prices[posState], ip->lenPrices[posState], tableSize * sizeof(UInt32));
+    memcpy(p->repLenEnc.prices[posState], ip->lenPrices[posState], tableSize * sizeof(UInt32));
+    p->lenEnc.counters[posState] = p->repLenEnc.counters[posState] = tableSize;
+  }
+}
+
 static SRes LzmaEnc_AllocAndInit(CLzmaEnc *p, UInt32 keepWindowSize, ISzAlloc *alloc, ISzAlloc *allocBig)
 {
   UInt32 i;
@@ -2045,15 +2467,28 @@ static SRes LzmaEnc_AllocAndInit(CLzmaEnc *p, UInt32 keepWindowSize, ISzAlloc *a
   p->result = SZ_OK;
   RINOK(LzmaEnc_Alloc(p, keepWindowSize, alloc, allocBig));
   LzmaEnc_Init(p);
-  LzmaEnc_InitPrices(p);
-  p->nowPos64 = 0;
+  LzmaEnc_InitFreshPrices(p);
+  /* coding starts as if the preset dictionary had just been coded */
+  p->nowPos64 = p->presetDictSize;
+  p->availSize = (UInt64)(Int64)-1;
   return SZ_OK;
 }
 
-static SRes LzmaEnc_Prepare(CLzmaEncHandle pp, ISeqInStream *inStream, ISeqOutStream *outStream,
+SRes LzmaEnc_SetPresetDict(CLzmaEncHandle pp, const Byte *dict, SizeT dictSize)
+{
+  CLzmaEnc *p = (CLzmaEnc *)pp;
+  if (dictSize > ((UInt32)1 << 31))
+    return SZ_ERROR_PARAM;
+  p->presetDict = dict;
+  p->presetDictSize = (dict != 0) ? dictSize : 0;
+  return SZ_OK;
+}
+
+SRes LzmaEnc_Prepare(CLzmaEncHandle pp, ISeqInStream *inStream, ISeqOutStream *outStream,
     ISzAlloc *alloc, ISzAlloc *allocBig)
 {
   CLzmaEnc *p = (CLzmaEnc *)pp;
+  p->matchFinderBase.directInput = 0;
   p->inStream = inStream;
   p->rc.outStream = outStream;
   return LzmaEnc_AllocAndInit(p, 0, alloc, allocBig);
@@ -2064,15 +2499,25 @@ SRes LzmaEnc_PrepareForLzma2(CLzmaEncHandle pp,
     ISzAlloc *alloc, ISzAlloc *allocBig)
 {
   CLzmaEnc *p = (CLzmaEnc *)pp;
+  p->matchFinderBase.directInput = 0;
   p->inStream = inStream;
   return LzmaEnc_AllocAndInit(p, keepWindowSize, alloc, allocBig);
 }
 
+/* the match finder works straight from src, seqBufInStream only marks
+   the stream as pending initialization.  A preset dictionary has to
+   precede src in the window, so then src is read like a stream. */
 static void LzmaEnc_SetInputBuf(CLzmaEnc *p, const Byte *src, SizeT srcLen)
 {
   p->seqBufInStream.funcTable.Read = MyRead;
   p->seqBufInStream.data = src;
   p->seqBufInStream.rem = srcLen;
+  p->matchFinderBase.directInput = (p->presetDictSize == 0);
+  if (p->matchFinderBase.directInput)
+  {
+    p->matchFinderBase.bufferBase = (Byte *)src;
+    p->matchFinderBase.directInputRem = srcLen;
+  }
 }
 
 SRes LzmaEnc_MemPrepare(CLzmaEncHandle pp, const Byte *src, SizeT srcLen,
@@ -2130,6 +2575,42 @@ const Byte *LzmaEnc_GetCurBuf(CLzmaEncHandle pp)
   return p->matchFinder.GetPointerToCurrentPos(p->matchFinderObj) - p->additionalOffset;
 }
 
+/* makes size bytes past the current position readable through
+   LzmaEnc_GetCurBuf (fewer at the end of the input) and returns how many
+   are.  The threaded match finder reads on its own, so then it's 0 */
+UInt32 LzmaEnc_ReadAhead(CLzmaEncHandle pp, UInt32 size)
+{
+  CLzmaEnc *p = (CLzmaEnc *)pp;
+  #ifdef COMPRESS_MF_MT
+  if (p->mtMode)
+    return 0;
+  #endif
+  if (p->additionalOffset != 0 || MatchFinder_WindowLost(&p->matchFinderBase))
+    return 0;
+  LzmaEnc_InitInput(p);
+  return MatchFinder_ReadAhead(&p->matchFinderBase, size);
+}
+
+/* MatchFinder_CountRepeats over bytes made readable by LzmaEnc_ReadAhead */
+UInt32 LzmaEnc_CountRepeats(CLzmaEncHandle pp, UInt32 size, UInt32 step)
+{
+  CLzmaEnc *p = (CLzmaEnc *)pp;
+  return MatchFinder_CountRepeats(&p->matchFinderBase, size, step);
+}
+
+/* passes size readable bytes through the match finder without coding
+   them, for LZMA2 to store.  The state and probabilities are left as they
+   are, as a decoder leaves them over a stored chunk */
+SRes LzmaEnc_SkipUncoded(CLzmaEncHandle pp, UInt32 size)
+{
+  CLzmaEnc *p = (CLzmaEnc *)pp;
+  if (MatchFinder_WindowLost(&p->matchFinderBase))
+    return SZ_ERROR_MEM;
+  p->matchFinder.Skip(p->matchFinderObj, size);
+  p->nowPos64 += size;
+  return CheckErrors(p);
+}
+
 SRes LzmaEnc_CodeOneMemBlock(CLzmaEncHandle pp, Bool reInit,
     Byte *dest, size_t *destLen, UInt32 desiredPackSize, UInt32 *unpackSize)
 {
@@ -2148,8 +2629,12 @@ SRes LzmaEnc_CodeOneMemBlock(CLzmaEncHandle pp, Bool reInit,
   p->result = SZ_OK;
 
   if (reInit)
+  {
     LzmaEnc_Init(p);
-  LzmaEnc_InitPrices(p);
+    LzmaEnc_InitFreshPrices(p);
+  }
+  else
+    LzmaEnc_InitPrices(p);
   nowPos64 = p->nowPos64;
   RangeEnc_Init(&p->rc);
   p->rc.outStream = &outStream.funcTable;
@@ -2164,21 +2649,10 @@ SRes LzmaEnc_CodeOneMemBlock(CLzmaEncHandle pp, Bool reInit,
   return res;
 }
 
-SRes LzmaEnc_Encode(CLzmaEncHandle pp, ISeqOutStream *outStream, ISeqInStream *inStream, ICompressProgress *progress,
-    ISzAlloc *alloc, ISzAlloc *allocBig)
+static SRes LzmaEnc_Encode2(CLzmaEnc *p, ICompressProgress *progress)
 {
-  CLzmaEnc *p = (CLzmaEnc *)pp;
   SRes res = SZ_OK;
 
-  #ifdef COMPRESS_MF_MT
-  Byte allocaDummy[0x300];
-  int i = 0;
-  for (i = 0; i < 16; i++)
-    allocaDummy[i] = (Byte)i;
-  #endif
-
-  RINOK(LzmaEnc_Prepare(pp, inStream, outStream, alloc, allocBig));
-
   for (;;)
   {
     res = LzmaEnc_CodeOneBlock(p, False, 0, 0);
@@ -2186,7 +2660,7 @@ SRes LzmaEnc_Encode(CLzmaEncHandle pp, ISeqOutStream *outStream, ISeqInStream *i
       break;
     if (progress != 0)
     {
-      res = progress->Progress(progress, p->nowPos64, RangeEnc_GetProcessed(&p->rc));
+      res = progress->Progress(progress, p->nowPos64 - p->presetDictSize, RangeEnc_GetProcessed(&p->rc));
       if (res != SZ_OK)
       {
         res = SZ_ERROR_PROGRESS;
@@ -2194,10 +2668,141 @@ SRes LzmaEnc_Encode(CLzmaEncHandle pp, ISeqOutStream *outStream, ISeqInStream *i
       }
     }
   }
-  LzmaEnc_Finish(pp);
+  LzmaEnc_Finish(p);
   return res;
 }
 
+SRes LzmaEnc_CodeAvail(CLzmaEncHandle pp, UInt64 availSize, Bool finish,
+    UInt64 *unpackSize, Bool *finished)
+{
+  CLzmaEnc *p = (CLzmaEnc *)pp;
+  SRes res = SZ_OK;
+  availSize += p->presetDictSize;
+  if (!p->finished)
+  {
+    if (finish)
+      p->availSize = (UInt64)(Int64)-1;
+    else if (availSize < p->nowPos64 + kAvailLookahead)
+      availSize = 0; /* wait for more input */
+    else
+      p->availSize = availSize;
+    if (finish || availSize != 0)
+      res = LzmaEnc_CodeOneBlock(p, False, 0, 0);
+  }
+  *unpackSize = p->nowPos64 - p->presetDictSize;
+  *finished = p->finished;
+  return res;
+}
+
+SRes LzmaEnc_Fork(CLzmaEncHandle destHandle, CLzmaEncHandle pp,
+    ISeqInStream *inStream, ISeqOutStream *outStream, ISzAlloc *alloc, ISzAlloc *allocBig)
+{
+  CLzmaEnc *p = (CLzmaEnc *)pp;
+  CLzmaEnc *dest = (CLzmaEnc *)destHandle;
+  CMatchFinder *mf = &p->matchFinderBase;
+  CMatchFinder *destMf = &dest->matchFinderBase;
+  CMatchFinder destOwn = *destMf;
+  CLzmaProb *litProbs = dest->litProbs;
+  CLzmaProb *saveLitProbs = dest->saveState.litProbs;
+  unsigned lclpAlloc = dest->lclpAlloc;
+  CRangeEnc rcOwn = dest->rc;
+  const Byte *presetDict = dest->presetDict;
+  size_t litSize;
+
+  #ifdef COMPRESS_MF_MT
+  if (p->mtMode)
+    return SZ_ERROR_PARAM;
+  #endif
+  if (dest == p || mf->directInput || p->finished || p->result != SZ_OK ||
+      dest->presetDictSize != p->presetDictSize)
+    return SZ_ERROR_PARAM;
+  if (MatchFinder_WindowLost(mf))
+    return SZ_ERROR_MEM;
+
+  /* everything from the parser state on is plain data, except for the
+     buffers dest keeps */
+  memcpy(&dest->optimumEndIndex, &p->optimumEndIndex,
+      sizeof(CLzmaEnc) - ((Byte *)&p->optimumEndIndex - (Byte *)p));
+  dest->litProbs = litProbs;
+  dest->saveState.litProbs = saveLitProbs;
+  dest->lclpAlloc = lclpAlloc;
+  dest->rc.bufBase = rcOwn.bufBase;
+  dest->rc.bufLim = rcOwn.bufLim;
+  dest->presetDict = presetDict;
+  dest->multiThread = False;
+
+  *destMf = *mf;
+  destMf->bufferAlloc = destOwn.bufferAlloc;
+  destMf->bufferAllocSize = destOwn.bufferAllocSize;
+  destMf->ringSize = destOwn.ringSize;
+  destMf->ringGeneration = destOwn.ringGeneration;
+  destMf->hash = destOwn.hash;
+  destMf->refsAllocSize = destOwn.refsAllocSize;
+
+  /* the window and tables must come out laid out like p's, which were
+     sized for the fast bytes the stream started with */
+  dest->numFastBytes = mf->matchMaxLen;
+  RINOK(LzmaEnc_Alloc(dest, mf->keepSizeBefore - 1, alloc, allocBig));
+  dest->numFastBytes = p->numFastBytes;
+  if (destMf->keepSizeBefore != mf->keepSizeBefore || destMf->hashSizeSum != mf->hashSizeSum)
+    return SZ_ERROR_PARAM;
+  destMf->hashIsValid = mf->hashIsValid;
+
+  litSize = ((size_t)0x300 << p->lclp) * sizeof(CLzmaProb);
+  memcpy(dest->litProbs, p->litProbs, litSize);
+  memcpy(dest->saveState.litProbs, p->saveState.litProbs, litSize);
+
+  memcpy(dest->rc.bufBase, p->rc.bufBase, p->rc.buf - p->rc.bufBase);
+  dest->rc.buf = dest->rc.bufBase + (p->rc.buf - p->rc.bufBase);
+  dest->rc.outStream = outStream;
+
+  if (p->inStream != 0)
+  {
+    /* the match finder hasn't started yet */
+    dest->inStream = inStream;
+    return SZ_OK;
+  }
+  destMf->stream = inStream;
+  if (mf->stream == &p->presetDictInStream.funcTable)
+  {
+    dest->presetDictInStream.dict = presetDict + (p->presetDictInStream.dict - p->presetDict);
+    dest->presetDictInStream.stream = inStream;
+    destMf->stream = &dest->presetDictInStream.funcTable;
+  }
+
+  {
+    /* only the bytes MatchFinder_MoveBlock keeps are copied, to the start
+       of dest's window, which may be flat while p's is mapped twice or
+       the other way round */
+    size_t before = mf->buffer - mf->bufferBase;
+    if (before > mf->keepSizeBefore)
+      before = mf->keepSizeBefore;
+    if (before + (mf->streamPos - mf->pos) >
+        (destMf->ringSize != 0 ? destMf->ringSize : destMf->blockSize))
+      return SZ_ERROR_PARAM;
+    destMf->buffer = destMf->bufferBase + before;
+    memcpy(destMf->bufferBase, mf->buffer - before,
+        before + (mf->streamPos - mf->pos));
+  }
+  {
+    /* until the cyclic buffer wraps only its start has been written, and
+       nothing refers to the rest */
+    UInt32 numSons = mf->numSons;
+    if (p->nowPos64 + p->additionalOffset < mf->cyclicBufferSize)
+      numSons = mf->btMode ? mf->cyclicBufferPos * 2 : mf->cyclicBufferPos;
+    memcpy(destMf->hash, mf->hash, (size_t)mf->hashSizeSum * sizeof(CLzRef));
+    memcpy(destMf->son, mf->son, (size_t)numSons * sizeof(CLzRef));
+  }
+  return SZ_OK;
+}
+
+SRes LzmaEnc_Encode(CLzmaEncHandle pp, ISeqOutStream *outStream, ISeqInStream *inStream, ICompressProgress *progress,
+    ISzAlloc *alloc, ISzAlloc *allocBig)
+{
+  RINOK(LzmaEnc_Prepare(pp, inStream, outStream, alloc, allocBig));
+  return LzmaEnc_Encode2((CLzmaEnc *)pp, progress);
+}
+
 SRes LzmaEnc_WriteProperties(CLzmaEncHandle pp, Byte *props, SizeT *size)
 {
   CLzmaEnc *p = (CLzmaEnc *)pp;
@@ -2235,16 +2840,17 @@ SRes LzmaEnc_MemEncode(CLzmaEncHandle pp, Byte *dest, SizeT *destLen, const Byte
 
   CSeqOutStreamBuf outStream;
 
-  LzmaEnc_SetInputBuf(p, src, srcLen);
-
   outStream.funcTable.Write = MyWrite;
   outStream.data = dest;
   outStream.rem = *destLen;
   outStream.overflow = False;
 
   p->writeEndMark = writeEndMark;
-  res = LzmaEnc_Encode(pp, &outStream.funcTable, &p->seqBufInStream.funcTable,
-      progress, alloc, allocBig);
+  p->rc.outStream = &outStream.funcTable;
+
+  res = LzmaEnc_MemPrepare(pp, src, srcLen, 0, alloc, allocBig);
+  if (res == SZ_OK)
+    res = LzmaEnc_Encode2(p, progress);
 
   *destLen -= outStream.rem;
   if (outStream.overflow)
@@ -2252,6 +2858,20 @@ SRes LzmaEnc_MemEncode(CLzmaEncHandle pp, Byte *dest, SizeT *destLen, const Byte
   return res;
 }
 
+SRes LzmaEnc_MemEncodePart(CLzmaEncHandle pp, Byte *dest, SizeT *destLen, const Byte *src, SizeT *srcLen,
+    int writeEndMark, ICompressProgress *progress, ISzAlloc *alloc, ISzAlloc *allocBig)
+{
+  SRes res;
+  CLzmaEnc *p = (CLzmaEnc *)pp;
+  if (*destLen == 0)
+    return SZ_ERROR_OUTPUT_EOF;
+  p->packLimit = *destLen;
+  res = LzmaEnc_MemEncode(pp, dest, destLen, src, *srcLen, writeEndMark, progress, alloc, allocBig);
+  p->packLimit = 0;
+  *srcLen = (SizeT)(p->nowPos64 - p->presetDictSize);
+  return res;
+}
+
 SRes LzmaEncode(Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen,
     const CLzmaEncProps *props, Byte *propsEncoded, SizeT *propsSize, int writeEndMark,
     ICompressProgress *progress, ISzAlloc *alloc, ISzAlloc *allocBig)
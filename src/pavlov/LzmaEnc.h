@@ -17,10 +17,13 @@ typedef struct _CLzmaEncProps
   int lc;          /* 0 <= lc <= 8, default = 3 */
   int lp;          /* 0 <= lp <= 4, default = 0 */
   int pb;          /* 0 <= pb <= 4, default = 2 */
-  int algo;        /* 0 - fast, 1 - normal, default = 1 */
+  int algo;        /* 0 - fast, 1 - normal, 2 - lazy, default = 1 */
   int fb;          /* 5 <= fb <= 273, default = 32 */
   int btMode;      /* 0 - hashChain Mode, 1 - binTree mode - normal, default = 1 */
   int numHashBytes; /* 2, 3 or 4, default = 4 */
+  int mulHash;      /* 0 - hash through a CRC table, 1 - multiplicative hash, default = 0 */
+  int ringWindow;   /* 0 - window from allocBig, 1 - mapped twice in a row where the system can
+                       (RingAlloc in Alloc.h), so that it never moves, default = 0 */
   UInt32 mc;        /* 1 <= mc <= (1 << 30), default = 32 */
   unsigned writeEndMark;  /* 0 - do not write EOPM, 1 - write EOPM, default = 0 */
   int numThreads;  /* 1 or 2, default = 2 */
@@ -54,6 +57,70 @@ SRes LzmaEnc_Encode(CLzmaEncHandle p, ISeqOutStream *outStream, ISeqInStream *in
 SRes LzmaEnc_MemEncode(CLzmaEncHandle p, Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen,
     int writeEndMark, ICompressProgress *progress, ISzAlloc *alloc, ISzAlloc *allocBig);
 
+/* LzmaEnc_MemEncodePart codes as much of src as fits in *destLen bytes,
+   end mark included, rather than failing when all of it doesn't.  Coding
+   stops at the last symbol which fits, which leaves the stream within a few
+   bytes of the limit, and *srcLen receives the amount of src coded. */
+SRes LzmaEnc_MemEncodePart(CLzmaEncHandle p, Byte *dest, SizeT *destLen, const Byte *src, SizeT *srcLen,
+    int writeEndMark, ICompressProgress *progress, ISzAlloc *alloc, ISzAlloc *allocBig);
+
+/* LzmaEnc_SetPresetDict makes the following streams continue dict, which
+   is read into the window but not coded, so that matches can refer to it.
+   The decoder must be primed with the same data (LzmaDec_SetPresetDict).
+   dict must stay valid while encoding, a NULL dict removes it. */
+SRes LzmaEnc_SetPresetDict(CLzmaEncHandle p, const Byte *dict, SizeT dictSize);
+
+/* LzmaEnc_SetEffort changes the parser (algo as in CLzmaEncProps), the
+   number of fast bytes and the match finder cycles of a stream being
+   encoded, for the blocks which follow.  It may be called between blocks,
+   from the progress callback of LzmaEnc_Encode.  Fast bytes are capped at
+   what sized the match finder when the stream started, the number it
+   started with or LzmaEnc_SetMaxFastBytes if that's more, and the match
+   finder threads keep their cycles, so it fails with them. */
+SRes LzmaEnc_SetEffort(CLzmaEncHandle p, int algo, UInt32 fb, UInt32 mc);
+
+/* LzmaEnc_SetMaxFastBytes sizes the match finder of the following streams
+   for up to fb fast bytes, so that LzmaEnc_SetEffort can raise them that
+   far.  Zero (the default) sizes it for the fast bytes set by
+   LzmaEnc_SetProps. */
+SRes LzmaEnc_SetMaxFastBytes(CLzmaEncHandle p, UInt32 fb);
+
+/* LzmaEnc_GetLargePageBytes returns how much of the window and the match
+   finder tables the system has backed with large pages (LargePageBytes
+   in Alloc.h).  allocBig decides where they come from, BigAlloc tries to
+   get them in large pages */
+UInt64 LzmaEnc_GetLargePageBytes(CLzmaEncHandle p);
+
+/* ---------- Push Interface ----------
+
+LzmaEnc_Prepare starts encoding inStream to outStream.  LzmaEnc_CodeAvail
+then encodes about 32 KB per call from an inStream which so far holds only
+the first availSize bytes of the input, and which must not report its end
+until the call that sets finish.  The encoder stops short of availSize far
+enough that its match finder never reads past it.  *unpackSize receives
+the amount of input encoded, *finished is set once the end mark (if
+requested) has been written and the range coder flushed, after which
+LzmaEnc_Finish must be called.
+*/
+
+SRes LzmaEnc_Prepare(CLzmaEncHandle p, ISeqInStream *inStream, ISeqOutStream *outStream,
+    ISzAlloc *alloc, ISzAlloc *allocBig);
+SRes LzmaEnc_CodeAvail(CLzmaEncHandle p, UInt64 availSize, Bool finish,
+    UInt64 *unpackSize, Bool *finished);
+void LzmaEnc_Finish(CLzmaEncHandle p);
+
+/* LzmaEnc_Fork makes dest (any handle from LzmaEnc_Create) a copy of the
+stream p is encoding through the push interface, between LzmaEnc_CodeAvail
+calls: window, match finder tables, probabilities, reps and the range
+coder with its unwritten output.  dest then continues on its own, reading
+the input which follows what p has read from inStream and writing to
+outStream, with LzmaEnc_CodeAvail counting input as p does.  dest must
+have been given a preset dictionary of the same size holding the same
+data as p's.  p is left as it was, and neither may use match finder
+threads.  The copy is bounded by the dictionary size, not the input. */
+SRes LzmaEnc_Fork(CLzmaEncHandle dest, CLzmaEncHandle p,
+    ISeqInStream *inStream, ISeqOutStream *outStream, ISzAlloc *alloc, ISzAlloc *allocBig);
+
 /* ---------- One Call Interface ---------- */
 
 /* LzmaEncode
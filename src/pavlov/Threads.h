@@ -0,0 +1,140 @@
+/* Threads.h -- multithreading library
+2008-11-22 : Igor Pavlov : Public domain */
+
+#ifndef __7Z_THRESDS_H
+#define __7Z_THRESDS_H
+
+#include "Types.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+
+typedef struct _CThread
+{
+  HANDLE handle;
+} CThread;
+
+#define Thread_Construct(thread) (thread)->handle = NULL
+#define Thread_WasCreated(thread) ((thread)->handle != NULL)
+
+typedef unsigned THREAD_FUNC_RET_TYPE;
+#define THREAD_FUNC_CALL_TYPE MY_STD_CALL
+
+#else
+
+typedef struct _CThread
+{
+  pthread_t handle;
+  int created;
+} CThread;
+
+#define Thread_Construct(thread) (thread)->created = 0
+#define Thread_WasCreated(thread) ((thread)->created != 0)
+
+typedef void * THREAD_FUNC_RET_TYPE;
+#define THREAD_FUNC_CALL_TYPE
+
+#endif
+
+#define THREAD_FUNC_DECL THREAD_FUNC_RET_TYPE THREAD_FUNC_CALL_TYPE
+
+WRes Thread_Create(CThread *thread, THREAD_FUNC_RET_TYPE (THREAD_FUNC_CALL_TYPE *startAddress)(void *), void *parameter);
+WRes Thread_Wait(CThread *thread);
+WRes Thread_Close(CThread *thread);
+
+typedef struct _CEvent
+{
+  #ifdef _WIN32
+  HANDLE handle;
+  #else
+  int created;
+  int manualReset;
+  int state;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  #endif
+} CEvent;
+
+typedef CEvent CAutoResetEvent;
+typedef CEvent CManualResetEvent;
+
+#ifdef _WIN32
+#define Event_Construct(event) (event)->handle = NULL
+#define Event_IsCreated(event) ((event)->handle != NULL)
+#else
+#define Event_Construct(event) (event)->created = 0
+#define Event_IsCreated(event) ((event)->created != 0)
+#endif
+
+WRes ManualResetEvent_Create(CManualResetEvent *event, int initialSignaled);
+WRes ManualResetEvent_CreateNotSignaled(CManualResetEvent *event);
+WRes AutoResetEvent_Create(CAutoResetEvent *event, int initialSignaled);
+WRes AutoResetEvent_CreateNotSignaled(CAutoResetEvent *event);
+WRes Event_Set(CEvent *event);
+WRes Event_Reset(CEvent *event);
+WRes Event_Wait(CEvent *event);
+WRes Event_Close(CEvent *event);
+
+typedef struct _CSemaphore
+{
+  #ifdef _WIN32
+  HANDLE handle;
+  #else
+  int created;
+  UInt32 count;
+  UInt32 maxCount;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  #endif
+} CSemaphore;
+
+#ifdef _WIN32
+#define Semaphore_Construct(p) (p)->handle = NULL
+#else
+#define Semaphore_Construct(p) (p)->created = 0
+#endif
+
+WRes Semaphore_Create(CSemaphore *p, UInt32 initiallyCount, UInt32 maxCount);
+WRes Semaphore_ReleaseN(CSemaphore *p, UInt32 num);
+WRes Semaphore_Release1(CSemaphore *p);
+WRes Semaphore_Wait(CSemaphore *p);
+WRes Semaphore_Close(CSemaphore *p);
+
+#ifdef _WIN32
+
+typedef CRITICAL_SECTION CCriticalSection;
+
+WRes CriticalSection_Init(CCriticalSection *p);
+#define CriticalSection_Delete(p) DeleteCriticalSection(p)
+#define CriticalSection_Enter(p) EnterCriticalSection(p)
+#define CriticalSection_Leave(p) LeaveCriticalSection(p)
+
+#else
+
+typedef pthread_mutex_t CCriticalSection;
+
+WRes CriticalSection_Init(CCriticalSection *p);
+#define CriticalSection_Delete(p) pthread_mutex_destroy(p)
+#define CriticalSection_Enter(p) pthread_mutex_lock(p)
+#define CriticalSection_Leave(p) pthread_mutex_unlock(p)
+
+#endif
+
+/* Once_Run calls func the first time it's called with once, and returns
+   from any call only once that first one is done, so that tables shared
+   by all threads can be set up by whichever needs them first */
+
+#ifdef _WIN32
+typedef LONG volatile COnce;
+#define ONCE_INIT 0
+#else
+typedef pthread_once_t COnce;
+#define ONCE_INIT PTHREAD_ONCE_INIT
+#endif
+
+void Once_Run(COnce *once, void (*func)(void));
+
+#endif
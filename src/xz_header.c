@@ -0,0 +1,470 @@
+/*
+ * Written in 2009 by Lloyd Hilaiel
+ *
+ * License
+ * 
+ * All the cruft you find here is public domain.  You don't have to credit
+ * anyone to use this code, but my personal request is that you mention
+ * Igor Pavlov for his hard, high quality work.
+ */
+
+#include "xz_header.h"
+#include "lzma2_header.h"
+
+#include "pavlov/7zCrc.h"
+#include "pavlov/XzCrc64.h"
+
+#include <string.h>
+
+#define ELZMA_XZ_FILTER_LZMA2 0x21
+/* the long range filter has a custom ID: the 0x3F prefix, a random
+ * developer ID and filter number 1.  Other decoders refuse it instead of
+ * producing filtered data. */
+#define ELZMA_XZ_FILTER_LONG_RANGE                   \
+    (((unsigned long long) 0x3F << 56) |             \
+     ((unsigned long long) 0xCCFD39D2 << 24) |       \
+     ((unsigned long long) 0x15 << 16) | 1)
+/* block flags: the number of filters less one, and which sizes follow */
+#define ELZMA_XZ_BF_NUM_FILTERS_MASK 0x03
+#define ELZMA_XZ_BF_RESERVED 0x3C
+#define ELZMA_XZ_BF_COMPRESSED_SIZE 0x40
+#define ELZMA_XZ_BF_UNCOMPRESSED_SIZE 0x80
+
+static const unsigned char xzMagic[6] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+static const unsigned char xzFooterMagic[2] = { 'Y', 'Z' };
+
+static void
+writeLE32(unsigned char * buf, unsigned int v)
+{
+    unsigned int i;
+    for (i = 0; i < 4; i++) buf[i] = (unsigned char) (v >> (i * 8));
+}
+
+static unsigned int
+readLE32(const unsigned char * buf)
+{
+    unsigned int i, v = 0;
+    for (i = 0; i < 4; i++) v |= (unsigned int) buf[i] << (i * 8);
+    return v;
+}
+
+unsigned int
+elzmaXZDecodeVarint(const unsigned char * buf, size_t size,
+                    unsigned long long * num)
+{
+    unsigned int i;
+    *num = 0;
+    for (i = 0; i < size && i < ELZMA_XZ_VARINT_MAX_BYTES; i++) {
+        *num |= (unsigned long long) (buf[i] & 0x7F) << (i * 7);
+        if (!(buf[i] & 0x80)) {
+            /* the shortest encoding is required */
+            if (i > 0 && buf[i] == 0) return 0;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static unsigned int
+encodeVarint(unsigned char * buf, unsigned long long num)
+{
+    unsigned int i = 0;
+    while (num >= 0x80) {
+        buf[i++] = (unsigned char) (num | 0x80);
+        num >>= 7;
+    }
+    buf[i++] = (unsigned char) num;
+    return i;
+}
+
+unsigned int
+elzmaXZCheckSize(unsigned int checkType)
+{
+    /* types come in groups of three sharing a size: 0, 4, 8, 16, ... */
+    if (checkType == 0) return 0;
+    return 4 << ((checkType - 1) / 3);
+}
+
+unsigned int
+elzmaXZPadding(unsigned long long size)
+{
+    return (unsigned int) ((4 - (size & 3)) & 3);
+}
+
+/*****************************
+  Stream header and footer
+ *****************************/
+
+static void
+initXZHeader(struct elzma_file_header * hdr)
+{
+    memset((void *) hdr, 0, sizeof(struct elzma_file_header));
+    /* the end of each block's LZMA2 data is marked */
+    hdr->isStreamed = 1;
+    hdr->checkType = ELZMA_XZ_CHECK_CRC64;
+}
+
+/* the two stream flag bytes hold a check type, and must otherwise be
+ * zero */
+static int
+parseStreamFlags(const unsigned char * flags, unsigned char * checkType)
+{
+    if (flags[0] != 0 || (flags[1] & 0xF0) != 0) return 1;
+    *checkType = flags[1];
+    return 0;
+}
+
+static int
+parseXZHeader(const unsigned char * hdrBuf,
+              struct elzma_file_header * hdr)
+{
+    if (0 != memcmp(hdrBuf, xzMagic, sizeof(xzMagic))) return 1;
+    if (readLE32(hdrBuf + 8) != CrcCalc(hdrBuf + 6, 2)) return 1;
+    return parseStreamFlags(hdrBuf + 6, &(hdr->checkType));
+}
+
+static int
+serializeXZHeader(unsigned char * hdrBuf,
+                  const struct elzma_file_header * hdr)
+{
+    memcpy(hdrBuf, xzMagic, sizeof(xzMagic));
+    hdrBuf[6] = 0;
+    hdrBuf[7] = hdr->checkType;
+    writeLE32(hdrBuf + 8, CrcCalc(hdrBuf + 6, 2));
+    return 0;
+}
+
+static int
+serializeXZFooter(struct elzma_file_footer * ftr,
+                  unsigned char * ftrBuf)
+{
+    /* the index size is stored in units of four bytes, less one */
+    writeLE32(ftrBuf + 4, (unsigned int) (ftr->indexSize / 4 - 1));
+    ftrBuf[8] = 0;
+    ftrBuf[9] = ftr->checkType;
+    memcpy(ftrBuf + 10, xzFooterMagic, sizeof(xzFooterMagic));
+    writeLE32(ftrBuf, CrcCalc(ftrBuf + 4, 6));
+    return 0;
+}
+
+static int
+parseXZFooter(const unsigned char * ftrBuf,
+              struct elzma_file_footer * ftr)
+{
+    memset((void *) ftr, 0, sizeof(struct elzma_file_footer));
+    if (0 != memcmp(ftrBuf + 10, xzFooterMagic, sizeof(xzFooterMagic)) ||
+        readLE32(ftrBuf) != CrcCalc(ftrBuf + 4, 6))
+    {
+        return 1;
+    }
+    ftr->indexSize = ((unsigned long long) readLE32(ftrBuf + 4) + 1) * 4;
+    return parseStreamFlags(ftrBuf + 8, &(ftr->checkType));
+}
+
+void
+initializeXZFormatHandler(struct elzma_format_handler * hand)
+{
+    CrcGenerateTable();
+    Crc64GenerateTable();
+    hand->header_size = ELZMA_XZ_STREAM_HEADER_SIZE;
+    hand->init_header = initXZHeader;
+    hand->parse_header = parseXZHeader;    
+    hand->serialize_header = serializeXZHeader;    
+    hand->footer_size = ELZMA_XZ_STREAM_FOOTER_SIZE;    
+    hand->serialize_footer = serializeXZFooter;
+    hand->parse_footer = parseXZFooter;
+}
+
+/*****************
+  Block headers
+ *****************/
+
+int
+elzmaXZParseBlockHeader(const unsigned char * hdrBuf,
+                        struct elzma_xz_block_header * bh)
+{
+    unsigned int pos = 2, used, end;
+    unsigned long long filterId, propsSize;
+    unsigned char flags;
+
+    if (hdrBuf[0] == 0) return ELZMA_E_CORRUPT_HEADER;
+    bh->headerSize = ((unsigned int) hdrBuf[0] + 1) * 4;
+    end = bh->headerSize - 4;
+    if (readLE32(hdrBuf + end) != CrcCalc(hdrBuf, end)) {
+        return ELZMA_E_CORRUPT_HEADER;
+    }
+
+    flags = hdrBuf[1];
+    if (flags & ELZMA_XZ_BF_RESERVED) return ELZMA_E_CORRUPT_HEADER;
+
+    bh->compressedSize = ELZMA_XZ_SIZE_UNKNOWN;
+    bh->uncompressedSize = ELZMA_XZ_SIZE_UNKNOWN;
+    if (flags & ELZMA_XZ_BF_COMPRESSED_SIZE) {
+        used = elzmaXZDecodeVarint(hdrBuf + pos, end - pos,
+                                   &(bh->compressedSize));
+        if (used == 0 || bh->compressedSize == 0) {
+            return ELZMA_E_CORRUPT_HEADER;
+        }
+        pos += used;
+    }
+    if (flags & ELZMA_XZ_BF_UNCOMPRESSED_SIZE) {
+        used = elzmaXZDecodeVarint(hdrBuf + pos, end - pos,
+                                   &(bh->uncompressedSize));
+        if (used == 0) return ELZMA_E_CORRUPT_HEADER;
+        pos += used;
+    }
+
+    /* LZMA2 must be the last filter of a chain, the only one we allow
+     * before it is our own long range filter, which has no properties.
+     * We don't implement any of the others (BCJ, delta). */
+    bh->longRange = 0;
+    if ((flags & ELZMA_XZ_BF_NUM_FILTERS_MASK) > 1) {
+        return ELZMA_E_UNSUPPORTED_FORMAT;
+    }
+    if ((flags & ELZMA_XZ_BF_NUM_FILTERS_MASK) == 1) {
+        used = elzmaXZDecodeVarint(hdrBuf + pos, end - pos, &filterId);
+        if (used == 0) return ELZMA_E_CORRUPT_HEADER;
+        pos += used;
+        used = elzmaXZDecodeVarint(hdrBuf + pos, end - pos, &propsSize);
+        if (used == 0 || propsSize > end - pos - used) {
+            return ELZMA_E_CORRUPT_HEADER;
+        }
+        pos += used;
+        if (filterId != ELZMA_XZ_FILTER_LONG_RANGE) {
+            return ELZMA_E_UNSUPPORTED_FORMAT;
+        }
+        if (propsSize != 0) return ELZMA_E_CORRUPT_HEADER;
+        bh->longRange = 1;
+    }
+    used = elzmaXZDecodeVarint(hdrBuf + pos, end - pos, &filterId);
+    if (used == 0) return ELZMA_E_CORRUPT_HEADER;
+    pos += used;
+    used = elzmaXZDecodeVarint(hdrBuf + pos, end - pos, &propsSize);
+    if (used == 0 || propsSize > end - pos - used) {
+        return ELZMA_E_CORRUPT_HEADER;
+    }
+    pos += used;
+    if (filterId != ELZMA_XZ_FILTER_LZMA2) return ELZMA_E_UNSUPPORTED_FORMAT;
+    if (propsSize != 1) return ELZMA_E_CORRUPT_HEADER;
+    bh->dictProp = hdrBuf[pos++];
+
+    /* then zero padding up to the CRC */
+    for (; pos < end; pos++) {
+        if (hdrBuf[pos] != 0) return ELZMA_E_CORRUPT_HEADER;
+    }
+
+    {
+        /* the dictionary property must be a valid one */
+        struct elzma_format_handler lzma2;
+        struct elzma_file_header h;
+        initializeLZMA2FormatHandler(&lzma2);
+        lzma2.init_header(&h);
+        if (0 != lzma2.parse_header(&(bh->dictProp), &h)) {
+            return ELZMA_E_CORRUPT_HEADER;
+        }
+    }
+
+    return ELZMA_E_OK;
+}
+
+unsigned int
+elzmaXZSerializeBlockHeader(unsigned char * hdrBuf,
+                            struct elzma_xz_block_header * bh)
+{
+    unsigned int pos = 2;
+
+    hdrBuf[1] = 0;
+    if (bh->compressedSize != ELZMA_XZ_SIZE_UNKNOWN) {
+        hdrBuf[1] |= ELZMA_XZ_BF_COMPRESSED_SIZE;
+        pos += encodeVarint(hdrBuf + pos, bh->compressedSize);
+    }
+    if (bh->uncompressedSize != ELZMA_XZ_SIZE_UNKNOWN) {
+        hdrBuf[1] |= ELZMA_XZ_BF_UNCOMPRESSED_SIZE;
+        pos += encodeVarint(hdrBuf + pos, bh->uncompressedSize);
+    }
+    if (bh->longRange) {
+        hdrBuf[1] |= 1;
+        pos += encodeVarint(hdrBuf + pos, ELZMA_XZ_FILTER_LONG_RANGE);
+        hdrBuf[pos++] = 0;
+    }
+    hdrBuf[pos++] = ELZMA_XZ_FILTER_LZMA2;
+    hdrBuf[pos++] = 1;
+    hdrBuf[pos++] = bh->dictProp;
+    while (pos & 3) hdrBuf[pos++] = 0;
+
+    bh->headerSize = pos + 4;
+    hdrBuf[0] = (unsigned char) (bh->headerSize / 4 - 1);
+    writeLE32(hdrBuf + pos, CrcCalc(hdrBuf, pos));
+
+    return bh->headerSize;
+}
+
+/*******************
+  Integrity checks
+ *******************/
+
+void
+elzmaXZCheckInit(struct elzma_xz_check * c, unsigned int checkType)
+{
+    c->checkType = checkType;
+    c->crc32 = CRC_INIT_VAL;
+    c->crc64 = CRC64_INIT_VAL;
+}
+
+void
+elzmaXZCheckUpdate(struct elzma_xz_check * c, const void * buf,
+                   size_t size)
+{
+    if (c->checkType == ELZMA_XZ_CHECK_CRC32) {
+        c->crc32 = CrcUpdate(c->crc32, buf, size);
+    } else if (c->checkType == ELZMA_XZ_CHECK_CRC64) {
+        c->crc64 = Crc64Update(c->crc64, buf, size);
+    }
+}
+
+unsigned int
+elzmaXZCheckFinish(struct elzma_xz_check * c, unsigned char * buf)
+{
+    unsigned int i;
+    if (c->checkType == ELZMA_XZ_CHECK_CRC32) {
+        writeLE32(buf, CRC_GET_DIGEST(c->crc32));
+    } else if (c->checkType == ELZMA_XZ_CHECK_CRC64) {
+        UInt64 v = CRC64_GET_DIGEST(c->crc64);
+        for (i = 0; i < 8; i++) buf[i] = (unsigned char) (v >> (i * 8));
+    } else {
+        /* checks we can't compute never match a stored one, callers
+         * skip them */
+        memset(buf, 0, elzmaXZCheckSize(c->checkType));
+    }
+    return elzmaXZCheckSize(c->checkType);
+}
+
+/***********
+  Index
+ ***********/
+
+void
+elzmaXZIndexInit(struct elzma_xz_index * idx)
+{
+    memset((void *) idx, 0, sizeof(struct elzma_xz_index));
+}
+
+void
+elzmaXZIndexFree(struct elzma_xz_index * idx,
+                 struct elzma_alloc_struct * as)
+{
+    as->Free(as, idx->records);
+    elzmaXZIndexInit(idx);
+}
+
+int
+elzmaXZIndexAppend(struct elzma_xz_index * idx,
+                   struct elzma_alloc_struct * as,
+                   unsigned long long unpaddedSize,
+                   unsigned long long uncompressedSize)
+{
+    if (idx->numRecords == idx->allocated) {
+        unsigned int n = idx->allocated ? idx->allocated * 2 : 16;
+        struct elzma_xz_index_record * r =
+            as->Alloc(as, n * sizeof(struct elzma_xz_index_record));
+        if (r == NULL) return 1;
+        if (idx->numRecords > 0) {
+            memcpy(r, idx->records,
+                   idx->numRecords * sizeof(struct elzma_xz_index_record));
+        }
+        as->Free(as, idx->records);
+        idx->records = r;
+        idx->allocated = n;
+    }
+    idx->records[idx->numRecords].unpaddedSize = unpaddedSize;
+    idx->records[idx->numRecords].uncompressedSize = uncompressedSize;
+    idx->numRecords++;
+    return 0;
+}
+
+int
+elzmaXZParseIndex(const unsigned char * buf, size_t indexSize,
+                  struct elzma_xz_index * idx,
+                  struct elzma_alloc_struct * as)
+{
+    unsigned long long n, i;
+    size_t pos = 1, end = indexSize - 4;
+    unsigned int used;
+
+    if (indexSize < 8 || (indexSize & 3) || buf[0] != 0 ||
+        readLE32(buf + end) != CrcCalc(buf, end))
+    {
+        return ELZMA_E_CORRUPT_HEADER;
+    }
+
+    used = elzmaXZDecodeVarint(buf + pos, end - pos, &n);
+    if (used == 0) return ELZMA_E_CORRUPT_HEADER;
+    pos += used;
+
+    for (i = 0; i < n; i++) {
+        unsigned long long unpadded, uncompressed;
+        used = elzmaXZDecodeVarint(buf + pos, end - pos, &unpadded);
+        if (used == 0) return ELZMA_E_CORRUPT_HEADER;
+        pos += used;
+        used = elzmaXZDecodeVarint(buf + pos, end - pos, &uncompressed);
+        if (used == 0 || unpadded == 0) return ELZMA_E_CORRUPT_HEADER;
+        pos += used;
+        if (idx && elzmaXZIndexAppend(idx, as, unpadded, uncompressed)) {
+            return ELZMA_E_DECOMPRESS_ERROR;
+        }
+    }
+
+    /* what remains must be the padding */
+    if (end - pos != elzmaXZPadding(pos)) return ELZMA_E_CORRUPT_HEADER;
+    for (; pos < end; pos++) {
+        if (buf[pos] != 0) return ELZMA_E_CORRUPT_HEADER;
+    }
+
+    return ELZMA_E_OK;
+}
+
+int
+elzmaXZWriteIndexAndFooter(const struct elzma_xz_index * idx,
+                           unsigned int checkType,
+                           struct elzma_alloc_struct * as,
+                           elzma_write_callback outputStream,
+                           void * outputContext)
+{
+    struct elzma_format_handler xz;
+    struct elzma_file_footer ftr;
+    unsigned char * buf;
+    size_t pos = 0, size;
+    unsigned int i;
+    int rc = ELZMA_E_OK;
+
+    /* indicator, count and padding fit in 16 bytes, each record in
+     * two varints */
+    size = 16 + 2 * ELZMA_XZ_VARINT_MAX_BYTES * (size_t) idx->numRecords +
+        ELZMA_XZ_STREAM_FOOTER_SIZE;
+    buf = as->Alloc(as, size);
+    if (buf == NULL) return ELZMA_E_OUTPUT_ERROR;
+
+    buf[pos++] = 0;
+    pos += encodeVarint(buf + pos, idx->numRecords);
+    for (i = 0; i < idx->numRecords; i++) {
+        pos += encodeVarint(buf + pos, idx->records[i].unpaddedSize);
+        pos += encodeVarint(buf + pos, idx->records[i].uncompressedSize);
+    }
+    while (pos & 3) buf[pos++] = 0;
+    writeLE32(buf + pos, CrcCalc(buf, pos));
+    pos += 4;
+
+    initializeXZFormatHandler(&xz);
+    memset((void *) &ftr, 0, sizeof(ftr));
+    ftr.indexSize = pos;
+    ftr.checkType = (unsigned char) checkType;
+    xz.serialize_footer(&ftr, buf + pos);
+    pos += ELZMA_XZ_STREAM_FOOTER_SIZE;
+
+    if (outputStream(outputContext, buf, pos) != pos) {
+        rc = ELZMA_E_OUTPUT_ERROR;
+    }
+    as->Free(as, buf);
+
+    return rc;
+}
@@ -0,0 +1,132 @@
+#ifndef __EASYLZMA_XZ_HEADER__
+#define __EASYLZMA_XZ_HEADER__
+
+#include "common_internal.h"
+
+/* xz file format documented here:
+ * http://tukaani.org/xz/xz-file-format.txt
+ *
+ * An xz stream is a stream header, any number of blocks, an index which
+ * lists every block's size, and a stream footer.  A block is a block
+ * header, the filtered data (we support a single LZMA2 filter, optionally
+ * preceded by our long range filter), zero padding to a multiple of four
+ * bytes and an integrity check of the uncompressed data.  The format handler covers the stream header and
+ * footer, the rest is handled by the routines below. */
+
+#define ELZMA_XZ_STREAM_HEADER_SIZE 12
+#define ELZMA_XZ_STREAM_FOOTER_SIZE 12
+
+/* the largest block header the format allows, and the largest we
+ * write */
+#define ELZMA_XZ_BLOCK_HEADER_SIZE_MAX 1024
+#define ELZMA_XZ_BLOCK_HEADER_SIZE_BOUND 40
+
+/* integrity check types we verify, others are skipped */
+#define ELZMA_XZ_CHECK_NONE 0
+#define ELZMA_XZ_CHECK_CRC32 1
+#define ELZMA_XZ_CHECK_CRC64 4
+
+/* the largest check the format allows */
+#define ELZMA_XZ_CHECK_SIZE_MAX 64
+
+/* sizes and counts are at most 63 bits, encoded 7 bits per byte */
+#define ELZMA_XZ_VARINT_MAX_BYTES 9
+
+/* a size absent from a block header */
+#define ELZMA_XZ_SIZE_UNKNOWN ((unsigned long long) -1)
+
+void initializeXZFormatHandler(struct elzma_format_handler * hand);
+
+/* the number of bytes the check of the given type occupies */
+unsigned int elzmaXZCheckSize(unsigned int checkType);
+
+/* zero bytes following size bytes of data to reach a multiple of four */
+unsigned int elzmaXZPadding(unsigned long long size);
+
+struct elzma_xz_block_header
+{
+    unsigned int headerSize;
+    /* ELZMA_XZ_SIZE_UNKNOWN when not recorded in the header */
+    unsigned long long compressedSize;
+    unsigned long long uncompressedSize;
+    /* the LZMA2 filter's dictionary size property */
+    unsigned char dictProp;
+    /* nonzero when the long range filter (see dedup.h) precedes LZMA2.
+     * Its state spans the stream, so sizes and the check cover the data
+     * LZMA2 produces, which the filter's decoder then restores. */
+    int longRange;
+};
+
+/* parse a block header.  hdrBuf must hold (hdrBuf[0] + 1) * 4 bytes,
+ * returns ELZMA_E_CORRUPT_HEADER when it's malformed or
+ * ELZMA_E_UNSUPPORTED_FORMAT when the block uses filters other than
+ * LZMA2 and the long range filter */
+int elzmaXZParseBlockHeader(const unsigned char * hdrBuf,
+                            struct elzma_xz_block_header * bh);
+
+/* write a block header (hdrBuf must hold
+ * ELZMA_XZ_BLOCK_HEADER_SIZE_BOUND bytes), sets and returns
+ * bh->headerSize */
+unsigned int elzmaXZSerializeBlockHeader(unsigned char * hdrBuf,
+                                         struct elzma_xz_block_header * bh);
+
+/* the integrity check of a block's uncompressed data */
+struct elzma_xz_check
+{
+    unsigned int checkType;
+    unsigned int crc32;
+    unsigned long long crc64;
+};
+
+void elzmaXZCheckInit(struct elzma_xz_check * c, unsigned int checkType);
+void elzmaXZCheckUpdate(struct elzma_xz_check * c, const void * buf,
+                        size_t size);
+/* write the finished check into buf, returns its size */
+unsigned int elzmaXZCheckFinish(struct elzma_xz_check * c,
+                                unsigned char * buf);
+
+/* the list of blocks which becomes the index */
+struct elzma_xz_index_record
+{
+    /* block header, data and check, excluding the padding */
+    unsigned long long unpaddedSize;
+    unsigned long long uncompressedSize;
+};
+
+struct elzma_xz_index
+{
+    struct elzma_xz_index_record * records;
+    unsigned int numRecords;
+    unsigned int allocated;
+};
+
+void elzmaXZIndexInit(struct elzma_xz_index * idx);
+void elzmaXZIndexFree(struct elzma_xz_index * idx,
+                      struct elzma_alloc_struct * as);
+/* returns nonzero when out of memory */
+int elzmaXZIndexAppend(struct elzma_xz_index * idx,
+                       struct elzma_alloc_struct * as,
+                       unsigned long long unpaddedSize,
+                       unsigned long long uncompressedSize);
+
+/* parse an index of indexSize bytes (as given by the stream footer),
+ * checking its padding and CRC32.  Records are appended to idx, which
+ * may be NULL to only validate it. */
+int elzmaXZParseIndex(const unsigned char * buf, size_t indexSize,
+                      struct elzma_xz_index * idx,
+                      struct elzma_alloc_struct * as);
+
+/* write the index for idx followed by the stream footer, returns
+ * ELZMA_E_OK or ELZMA_E_OUTPUT_ERROR */
+int elzmaXZWriteIndexAndFooter(const struct elzma_xz_index * idx,
+                               unsigned int checkType,
+                               struct elzma_alloc_struct * as,
+                               elzma_write_callback outputStream,
+                               void * outputContext);
+
+/* decode a multibyte integer from at most size bytes, returns the number
+ * of bytes used or zero when it's malformed */
+unsigned int elzmaXZDecodeVarint(const unsigned char * buf, size_t size,
+                                 unsigned long long * num);
+
+#endif
@@ -12,11 +12,22 @@
  */
 
 
+#ifdef __linux__
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "simple.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 static const char * sampleData = 
 "Overview\n"
 "\n"
@@ -165,120 +176,2689 @@ static int roundTripTest(elzma_file_format format)
     return ELZMA_E_OK;
 }
 
-/* "correct" lzip generated from the lzip program */
-/*|LZIP...3.?..????|*/
-/*|....?e2~........|*/
-static unsigned char correctLzip[] = {
-    0x4c,0x5a,0x49,0x50,0x01,0x0c,0x00,0x33,0x1b,0xec,
-    0x15,0x07,0xff,0xff,0xff,0xff,0x80,0x00,0x00,0x00,
-    0xa8,0x65,0x32,0x7e,0x04,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x28,0x00,0x00,0x00,0x00,0x00,0x00,0x00 
-};
+/* a test that multi-threaded compression produces multi-member lzip (or
+ * multi-block xz) output which round trips, and which is identical
+ * regardless of thread count */
+static int threadedRoundTripTest(elzma_file_format format)
+{
+    int rc;
+    unsigned int i;
+    unsigned char * input;
+    unsigned char * compressed[3];
+    unsigned char * decompressed;
+    size_t inLen, sz[3];
+    const size_t copies = 4;
+    const unsigned int threads[3] = { 1, 2, 4 };
 
-/* "correct" lzip generated from lzma utils */
-static unsigned char correctLzma[] = {
-    0x5d,0x00,0x00,0x80,0x00,0x04,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x33,0x1b,0xec,0x14,0x00,0x00,
-    0x00
-};
+    /* a few copies of the sample data spread over several 4k blocks */
+    inLen = strlen(sampleData) * copies;
+    input = malloc(inLen);
+    for (i = 0; i < copies; i++) {
+        memcpy(input + i * strlen(sampleData), sampleData,
+               strlen(sampleData));
+    }
 
-/* lzip with a bad CRC */
-static unsigned char corruptCRC[] = {
-    0x4c,0x5a,0x49,0x50,0x01,0x0c,0x00,0x33,0x1b,0xec,
-    0x15,0x07,0xff,0xff,0xff,0xff,0x80,0x00,0x00,0x00,
-    0xa8,0x65,0x31,0x7e,0x04,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x28,0x00,0x00,0x00,0x00,0x00,0x00,0x00 
-};
+    for (i = 0; i < 3; i++) {
+        rc = simpleCompressThreaded(format, threads[i], 1 << 12,
+                                    input, inLen, compressed + i, sz + i);
+        if (rc != ELZMA_E_OK) {
+            while (i-- > 0) free(compressed[i]);
+            free(input);
+            return rc;
+        }
+    }
 
-/* lzip with a bad uncompressed size */
-static unsigned char corruptSize[] = {
-    0x4c,0x5a,0x49,0x50,0x01,0x0c,0x00,0x33,0x1b,0xec,
-    0x15,0x07,0xff,0xff,0xff,0xff,0x80,0x00,0x00,0x00,
-    0xa8,0x65,0x32,0x7e,0x04,0x01,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x28,0x00,0x00,0x00,0x00,0x00,0x00,0x00 
-};
+    /* output must not depend on how many threads did the work */
+    if (sz[0] != sz[1] || 0 != memcmp(compressed[0], compressed[1], sz[0]) ||
+        sz[0] != sz[2] || 0 != memcmp(compressed[0], compressed[2], sz[0]))
+    {
+        rc = 1;
+    } else {
+        rc = simpleDecompress(format, compressed[0], sz[0],
+                              &decompressed, sz);
+        if (rc == ELZMA_E_OK) {
+            if (sz[0] != inLen || 0 != memcmp(decompressed, input, inLen)) {
+                rc = 1;
+            }
+            free(decompressed);
+        }
+    }
 
-/* lzma with a bad uncompressed size */
-static unsigned char corruptSizeLzma[] = {
-    0x5d,0x00,0x00,0x80,0x00,0x04,0x01,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x33,0x1b,0xec,0x14,0x00,0x00,
-    0x00
-};
+    free(compressed[0]);
+    free(compressed[1]);
+    free(compressed[2]);
+    free(input);
 
-/* lzma with a bad uncompressed size */
-static unsigned char corruptSizeLzma2[] = {
-    0x5d,0x00,0x00,0x80,0x00,0x03,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x33,0x1b,0xec,0x14,0x00,0x00,
-    0x00
-};
+    return rc;
+}
 
+/* a test that the in-memory calls round trip, interoperate with the
+ * callback driven ones, and report output buffers which are too small */
+static int bufferRoundTripTest(elzma_file_format format)
+{
+    int rc;
+    size_t inLen = strlen(sampleData);
+    size_t bound, sz, dsz;
+    unsigned char * compressed;
+    unsigned char * decompressed = NULL;
+    elzma_compress_handle chand = elzma_compress_alloc();
+    elzma_decompress_handle dhand = elzma_decompress_alloc();
 
-/* tests */
-static struct 
+    elzma_compress_config(chand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 16, format, 0);
+    sz = bound = elzma_compress_bound(chand, inLen);
+    compressed = malloc(bound);
+
+    rc = elzma_compress_buffer(chand, (const unsigned char *) sampleData,
+                               inLen, compressed, &sz);
+    if (rc == ELZMA_E_OK && sz > inLen) rc = 1;
+
+    /* decompressing into a buffer one byte short must fail */
+    if (rc == ELZMA_E_OK) {
+        decompressed = malloc(inLen);
+        dsz = inLen - 1;
+        rc = elzma_decompress_buffer(dhand, compressed, sz, decompressed,
+                                     &dsz, format);
+        rc = (rc == ELZMA_E_OUTPUT_ERROR) ? ELZMA_E_OK : 1;
+    }
+
+    if (rc == ELZMA_E_OK) {
+        dsz = inLen;
+        rc = elzma_decompress_buffer(dhand, compressed, sz, decompressed,
+                                     &dsz, format);
+        if (rc == ELZMA_E_OK &&
+            (dsz != inLen || 0 != memcmp(decompressed, sampleData, inLen)))
+        {
+            rc = 1;
+        }
+    }
+    if (decompressed) free(decompressed);
+
+    /* the callback driven decompressor accepts it too */
+    if (rc == ELZMA_E_OK) {
+        rc = simpleDecompress(format, compressed, sz, &decompressed, &dsz);
+        if (rc == ELZMA_E_OK) {
+            if (dsz != inLen || 0 != memcmp(decompressed, sampleData, inLen)) {
+                rc = 1;
+            }
+            free(decompressed);
+        }
+    }
+
+    /* as must compressing into a buffer which is too small */
+    if (rc == ELZMA_E_OK) {
+        sz = 16;
+        rc = elzma_compress_buffer(chand, (const unsigned char *) sampleData,
+                                   inLen, compressed, &sz);
+        rc = (rc == ELZMA_E_OUTPUT_ERROR) ? ELZMA_E_OK : 1;
+    }
+
+    free(compressed);
+    elzma_compress_free(&chand);
+    elzma_decompress_free(&dhand);
+
+    return rc;
+}
+
+/* a test that input split into fixed size pages by
+ * elzma_compress_buffer_partial fills each page to within a few bytes,
+ * and that the pages decompress back to the input */
+static int partialTest(elzma_file_format format, size_t pageSize)
 {
-    const char * testName;  /* the name of the test */
-    int expectedCode;       /* the expected output of the test */
-    elzma_file_format format;
-    unsigned char * data;  /* input data */
-    unsigned int dataSize;
-} tests[] = {
-    {
-        "correct lzip", ELZMA_E_OK, ELZMA_lzip,
-        correctLzip, sizeof(correctLzip)
-    },
-    {
-        "lzip as lzma", ELZMA_E_DECOMPRESS_ERROR, ELZMA_lzma,
-        correctLzip, sizeof(correctLzip)
-    },
-    {
-        "correct lzma", ELZMA_E_OK, ELZMA_lzma,
-        correctLzma, sizeof(correctLzma)
-    },
-    {
-        "lzma as lzip", ELZMA_E_CORRUPT_HEADER, ELZMA_lzip,
-        correctLzma, sizeof(correctLzma)
-    },
-    {
-        "corrupt crc", ELZMA_E_CRC32_MISMATCH, ELZMA_lzip,
-        corruptCRC, sizeof(corruptCRC)
-    },
-    {
-        "bad lzip size", ELZMA_E_SIZE_MISMATCH, ELZMA_lzip,
-        corruptSize, sizeof(corruptSize)
-    },
-    {
-        "bad lzma size", ELZMA_E_INSUFFICIENT_INPUT, ELZMA_lzma,
-        corruptSizeLzma, sizeof(corruptSizeLzma)
-    },
+    int rc = ELZMA_E_OK;
+    unsigned int i, seed = 1;
+    const size_t copies = 16;
+    size_t sampleLen = strlen(sampleData);
+    size_t inLen = sampleLen * copies;
+    size_t pos = 0;
+    unsigned char * input = malloc(inLen);
+    unsigned char * page = malloc(pageSize);
+    elzma_compress_handle hand = elzma_compress_alloc();
+
+    /* scatter noise through the copies so they don't compress away */
+    for (i = 0; i < inLen; i++) {
+        seed = seed * 1103515245 + 12345;
+        input[i] = (seed >> 28) ? sampleData[i % sampleLen] :
+            (unsigned char) (seed >> 20);
+    }
+
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 16, format, 0);
+
+    while (rc == ELZMA_E_OK && pos < inLen) {
+        size_t coded = inLen - pos, sz = pageSize, dsz;
+        unsigned char * decompressed;
+
+        rc = elzma_compress_buffer_partial(hand, input + pos, &coded,
+                                           page, &sz);
+        if (rc == ELZMA_E_OK &&
+            (coded == 0 || sz > pageSize ||
+             (pos + coded < inLen && sz + 32 < pageSize)))
+        {
+            rc = 1;
+        }
+
+        if (rc == ELZMA_E_OK) {
+            rc = simpleDecompress(format, page, sz, &decompressed, &dsz);
+            if (rc == ELZMA_E_OK) {
+                if (dsz != coded || 0 != memcmp(decompressed, input + pos,
+                                                coded))
+                {
+                    rc = 1;
+                }
+                free(decompressed);
+            }
+        }
+        pos += coded;
+    }
+
+    /* a page with no room for an empty file fails */
+    if (rc == ELZMA_E_OK) {
+        size_t coded = inLen, sz = 16;
+        rc = elzma_compress_buffer_partial(hand, input, &coded, page, &sz);
+        rc = (rc == ELZMA_E_OUTPUT_ERROR) ? ELZMA_E_OK : 1;
+    }
+
+    free(page);
+    free(input);
+    elzma_compress_free(&hand);
+
+    return rc;
+}
+
+/* a test that a batch, on one thread or several, produces what
+ * elzma_compress_buffer does for each record, and that a record which
+ * doesn't fit fails the batch from that record on */
+static int batchTest(elzma_file_format format)
+{
+    enum { numRecords = 64 };
+    int rc = ELZMA_E_OK;
+    unsigned int i, pass;
+    size_t sampleLen = strlen(sampleData);
+    const unsigned char * in[numRecords];
+    size_t inLens[numRecords];
+    unsigned char * out[numRecords];
+    size_t outLens[numRecords];
+    unsigned char * expected = NULL;
+    size_t bound, sz;
+    elzma_compress_handle hand = elzma_compress_alloc();
+
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 16, format, 0);
+
+    /* records of assorted sizes, the first empty */
+    bound = elzma_compress_bound(hand, sampleLen);
+    for (i = 0; i < numRecords; i++) {
+        in[i] = (const unsigned char *) sampleData + (i * 37) % sampleLen;
+        inLens[i] = (i * 101) % (sampleLen - (i * 37) % sampleLen);
+        out[i] = malloc(bound);
+    }
+    expected = malloc(bound);
+
+    for (pass = 0; rc == ELZMA_E_OK && pass < 3; pass++) {
+        if (pass > 0) elzma_compress_set_threads(hand, pass * 3, 0);
+        for (i = 0; i < numRecords; i++) outLens[i] = bound;
+
+        rc = elzma_compress_batch(hand, numRecords, in, inLens, out,
+                                  outLens);
+
+        for (i = 0; rc == ELZMA_E_OK && i < numRecords; i++) {
+            sz = bound;
+            rc = elzma_compress_buffer(hand, in[i], inLens[i], expected,
+                                       &sz);
+            if (rc == ELZMA_E_OK &&
+                (sz != outLens[i] || 0 != memcmp(expected, out[i], sz)))
+            {
+                rc = 1;
+            }
+        }
+    }
+
+    /* and round trip */
+    for (i = 0; rc == ELZMA_E_OK && i < numRecords; i++) {
+        unsigned char * decompressed;
+        rc = simpleDecompress(format, out[i], outLens[i], &decompressed,
+                              &sz);
+        if (rc == ELZMA_E_OK) {
+            if (sz != inLens[i] ||
+                (sz > 0 && 0 != memcmp(decompressed, in[i], sz)))
+            {
+                rc = 1;
+            }
+            free(decompressed);
+        }
+    }
+
+    if (rc == ELZMA_E_OK) {
+        for (i = 0; i < numRecords; i++) outLens[i] = bound;
+        outLens[40] = 16;
+        rc = elzma_compress_batch(hand, numRecords, in, inLens, out,
+                                  outLens);
+        rc = (rc == ELZMA_E_OUTPUT_ERROR && outLens[39] > 0 &&
+              outLens[40] == 0 && outLens[numRecords - 1] == 0) ?
+            ELZMA_E_OK : 1;
+    }
+
+    for (i = 0; i < numRecords; i++) free(out[i]);
+    free(expected);
+    elzma_compress_free(&hand);
+
+    return rc;
+}
+
+/* round trip size bytes of input through a long range filtered xz
+ * stream, compressed in blocks of blockSize when it's nonzero, decoding
+ * the stream twice over to check that references in the second copy
+ * land in its own output */
+static int longRangeRoundTrip(const unsigned char * input, size_t size,
+                              unsigned int blockSize, size_t * sz)
+{
+    int rc;
+    unsigned char * compressed = NULL;
+    unsigned char * twice;
+    unsigned char * decompressed;
+    size_t dsz;
+    elzma_compress_handle hand;
+
+    hand = elzma_compress_alloc();
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 16, ELZMA_xz, 0);
+    elzma_compress_set_long_range(hand, 1 << 12);
+    if (blockSize) elzma_compress_set_threads(hand, 2, blockSize);
+    rc = simpleCompressWithHandle(hand, input, size, &compressed, sz);
+    elzma_compress_free(&hand);
+    if (rc != ELZMA_E_OK) return rc;
+
+    twice = malloc(2 * *sz);
+    memcpy(twice, compressed, *sz);
+    memcpy(twice + *sz, compressed, *sz);
+    rc = simpleDecompressLongRange(ELZMA_xz, twice, 2 * *sz, &decompressed,
+                                   &dsz);
+    if (rc == ELZMA_E_OK) {
+        if (dsz != 2 * size || 0 != memcmp(decompressed, input, size) ||
+            0 != memcmp(decompressed + size, input, size))
+        {
+            rc = 1;
+        }
+        free(decompressed);
+    }
+
+    /* without read back the stream is refused rather than written out
+     * as is, by buffer decoding too */
+    if (rc == ELZMA_E_OK) {
+        rc = simpleDecompress(ELZMA_xz, compressed, *sz, &decompressed,
+                              &dsz);
+        if (rc == ELZMA_E_OK) free(decompressed);
+        rc = (rc == ELZMA_E_LONG_RANGE) ? ELZMA_E_OK : 1;
+    }
+    if (rc == ELZMA_E_OK) {
+        elzma_decompress_handle dhand = elzma_decompress_alloc();
+        decompressed = malloc(size);
+        dsz = size;
+        rc = (elzma_decompress_buffer(dhand, compressed, *sz, decompressed,
+                                      &dsz, ELZMA_xz) == ELZMA_E_LONG_RANGE) ?
+            ELZMA_E_OK : 1;
+        free(decompressed);
+        elzma_decompress_free(&dhand);
+    }
+
+    free(twice);
+    free(compressed);
+
+    return rc;
+}
+
+/* a test that long range deduplication finds a repeat far beyond the
+ * dictionary, and round trips, but only when decompressed with it.  The
+ * filter is marked in xz block headers, other formats refuse it, and
+ * input which happens to begin with the filter's own header is
+ * ordinary data, with long range decoding or without */
+static int longRangeTest(elzma_file_format format)
+{
+    int rc = ELZMA_E_OK;
+    unsigned int i, seed = 7;
+    const size_t noiseLen = 1 << 18;
+    size_t inLen, plainLen = 0, sz = 0, dsz;
+    unsigned char * input;
+    unsigned char * compressed = NULL;
+    unsigned char * decompressed;
+    elzma_compress_handle hand;
+
+    /* noise A, noise B, then A again at an odd offset */
+    inLen = 3 * noiseLen + 1;
+    input = malloc(inLen);
+    for (i = 0; i < 2 * noiseLen + 1; i++) {
+        seed = seed * 1103515245 + 12345;
+        input[i] = (unsigned char) (seed >> 16);
+    }
+    memcpy(input + 2 * noiseLen + 1, input, noiseLen);
+
+    hand = elzma_compress_alloc();
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 16, format, 0);
+
+    /* out of range chunk sizes are refused */
+    if (elzma_compress_set_long_range(hand, 1000) != ELZMA_E_BAD_PARAMS ||
+        elzma_compress_set_long_range(hand, 1 << 11) != ELZMA_E_BAD_PARAMS)
     {
-        "bad lzma size 2", ELZMA_E_SIZE_MISMATCH, ELZMA_lzma,
-        corruptSizeLzma2, sizeof(corruptSizeLzma2)
+        rc = 1;
+    }
+
+    if (rc == ELZMA_E_OK) {
+        rc = simpleCompressWithHandle(hand, input, inLen, &compressed,
+                                      &plainLen);
+        free(compressed);
+    }
+    if (rc == ELZMA_E_OK && format != ELZMA_xz) {
+        elzma_compress_set_long_range(hand, 1 << 12);
+        rc = simpleCompressWithHandle(hand, input, inLen, &compressed, &sz);
+        if (rc == ELZMA_E_OK) free(compressed);
+        rc = (rc == ELZMA_E_UNSUPPORTED_FORMAT) ? ELZMA_E_OK : 1;
     }
+    elzma_compress_free(&hand);
+
+    if (rc == ELZMA_E_OK && format == ELZMA_xz) {
+        rc = longRangeRoundTrip(input, inLen, 0, &sz);
+        /* the repeat costs little more than references */
+        if (rc == ELZMA_E_OK && sz > plainLen - noiseLen + noiseLen / 16) {
+            rc = 1;
+        }
+        /* every block lists the filter */
+        if (rc == ELZMA_E_OK) rc = longRangeRoundTrip(input, inLen, 1 << 16,
+                                                      &sz);
+    }
+
+    /* input which begins with the filter's header, or consists of it */
+    memcpy(input, "ELDD\001", 5);
+    for (i = 0; rc == ELZMA_E_OK && i < 2; i++) {
+        size_t len = i ? 5 : inLen;
+        rc = simpleCompress(format, input, len, &compressed, &sz);
+        if (rc != ELZMA_E_OK) break;
+        rc = simpleDecompress(format, compressed, sz, &decompressed, &dsz);
+        if (rc == ELZMA_E_OK) {
+            if (dsz != len || 0 != memcmp(decompressed, input, len)) rc = 1;
+            free(decompressed);
+        }
+        if (rc == ELZMA_E_OK) {
+            rc = simpleDecompressLongRange(format, compressed, sz,
+                                           &decompressed, &dsz);
+            if (rc == ELZMA_E_OK) {
+                if (dsz != len || 0 != memcmp(decompressed, input, len)) {
+                    rc = 1;
+                }
+                free(decompressed);
+            }
+        }
+        free(compressed);
+    }
+
+    free(input);
+
+    return rc;
+}
+
+/* a clock for throughputTest which moves a fixed step each time it's
+ * read, so that the measured speed doesn't depend on the machine */
+struct fakeClock {
+    unsigned long long now;
+    unsigned long long step;
 };
 
-int
-main(void)
+static unsigned long long
+fakeClockRead(void *ctx)
 {
-    unsigned int i;
-    unsigned int testsPassed = 0;
-    unsigned int testsRun = 0;    
-    
-    int rc = 0;
+    struct fakeClock * c = (struct fakeClock *) ctx;
+    c->now += c->step;
+    return c->now;
+}
 
-    printf("round trip lzma test:    ");
-    fflush(stdout);
-    testsRun++;
-    if (ELZMA_E_OK != (rc = roundTripTest(ELZMA_lzma))) {
-        printf("fail! (%d)\n", rc);
-    } else {
-        testsPassed++;
-        printf("ok\n");
+/* a test that an unreachable throughput target or a spent time budget
+ * lowers the encoder's effort (costing ratio) while a slack target
+ * doesn't, that the choices repeat exactly under the same clock, that
+ * the output round trips, and that the target is refused where it can't
+ * apply */
+static int throughputTest(void)
+{
+    int rc = ELZMA_E_OK;
+    unsigned int i, seed = 3;
+    const size_t inLen = 1 << 19;
+    size_t sz[4] = { 0, 0, 0, 0 }, dsz, pos = 0;
+    unsigned char * input;
+    unsigned char * compressed[4] = { NULL, NULL, NULL, NULL };
+    unsigned char * decompressed;
+    struct fakeClock clock;
+    elzma_compress_handle hand;
+
+    /* words drawn at random from a few hundred made up ones */
+    input = malloc(inLen);
+    while (pos < inLen) {
+        unsigned int word, len;
+        seed = seed * 1103515245 + 12345;
+        word = (seed >> 16) % 300;
+        len = 2 + word % 7;
+        for (i = 0; i < len && pos < inLen; i++) {
+            input[pos++] = (unsigned char) ('a' + (word * 7 + i * 13) % 26);
+        }
+        if (pos < inLen) input[pos++] = ' ';
     }
 
-    printf("round trip lzip test:    ");
-    fflush(stdout);
-    testsRun++;
-    if (ELZMA_E_OK != (rc = roundTripTest(ELZMA_lzip))) {
+    /* every reading of the clock is a second later, so each window
+     * measures the input coded between two progress reports */
+    hand = elzma_compress_alloc();
+    elzma_compress_set_clock(hand, fakeClockRead, &clock);
+
+    /* no target, an unreachable one, a slack one, and a one millisecond
+     * budget (which needs the size) */
+    for (i = 0; rc == ELZMA_E_OK && i < 4; i++) {
+        elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                              ELZMA_PB_DEFAULT, 5, 1 << 20, ELZMA_lzip,
+                              (i == 3) ? inLen : 0);
+        elzma_compress_set_throughput(hand, (i == 1) ? 0xFFFFFFFF :
+                                      (i == 2) ? 2 : 0, (i == 3) ? 1 : 0);
+        clock.now = 0;
+        clock.step = 1000000;
+        rc = simpleCompressWithHandle(hand, input, inLen, compressed + i,
+                                      sz + i);
+    }
+    if (rc == ELZMA_E_OK &&
+        (sz[1] <= sz[0] || sz[2] >= sz[1] || sz[3] <= sz[0]))
+    {
+        rc = 1;
+    }
+
+    /* the same clock makes the same choices */
+    if (rc == ELZMA_E_OK) {
+        unsigned char * out;
+        elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                              ELZMA_PB_DEFAULT, 5, 1 << 20, ELZMA_lzip, 0);
+        elzma_compress_set_throughput(hand, 0xFFFFFFFF, 0);
+        clock.now = 0;
+        rc = simpleCompressWithHandle(hand, input, inLen, &out, &dsz);
+        if (rc == ELZMA_E_OK) {
+            if (dsz != sz[1] || 0 != memcmp(out, compressed[1], dsz)) {
+                rc = 1;
+            }
+            free(out);
+        }
+    }
+
+    for (i = 1; rc == ELZMA_E_OK && i < 4; i++) {
+        rc = simpleDecompress(ELZMA_lzip, compressed[i], sz[i],
+                              &decompressed, &dsz);
+        if (rc == ELZMA_E_OK) {
+            if (dsz != inLen || 0 != memcmp(decompressed, input, inLen)) {
+                rc = 1;
+            }
+            free(decompressed);
+        }
+    }
+
+    /* a time budget needs the size, and LZMA2 doesn't adapt */
+    if (rc == ELZMA_E_OK) {
+        unsigned char * out;
+        elzma_compress_set_throughput(hand, 0, 1000);
+        if (simpleCompressWithHandle(hand, input, 16, &out, &dsz) !=
+            ELZMA_E_BAD_PARAMS)
+        {
+            rc = 1;
+        }
+        elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                              ELZMA_PB_DEFAULT, 5, 1 << 20, ELZMA_xz, 16);
+        if (simpleCompressWithHandle(hand, input, 16, &out, &dsz) !=
+            ELZMA_E_UNSUPPORTED_FORMAT)
+        {
+            rc = 1;
+        }
+    }
+
+    /* nor do blocks coded in parallel */
+    if (rc == ELZMA_E_OK) {
+        unsigned char * out;
+        elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                              ELZMA_PB_DEFAULT, 5, 1 << 20, ELZMA_lzip, 0);
+        elzma_compress_set_throughput(hand, 2, 0);
+        elzma_compress_set_threads(hand, 1, 1 << 16);
+        if (simpleCompressWithHandle(hand, input, inLen, &out, &dsz) !=
+            ELZMA_E_BAD_PARAMS)
+        {
+            rc = 1;
+        }
+        elzma_compress_set_threads(hand, 1, 0);
+    }
+
+    /* the top level's fast bytes are reached from the default 32: once
+     * a run of zeros (coded the same whatever the fast bytes) is past,
+     * a slack target codes exactly as it does starting from 64 */
+    if (rc == ELZMA_E_OK) {
+        unsigned char * zeros = calloc(1, inLen + (1 << 18));
+        unsigned char * out[2] = { NULL, NULL };
+        size_t osz[2];
+        elzma_compress_options opts;
+
+        memcpy(zeros + (1 << 18), input, inLen);
+        for (i = 0; rc == ELZMA_E_OK && i < 2; i++) {
+            elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                                  ELZMA_PB_DEFAULT, 5, 1 << 20, ELZMA_lzip,
+                                  0);
+            opts.version = ELZMA_COMPRESS_OPTIONS_VERSION;
+            elzma_compress_get_options(hand, &opts);
+            if (i == 1) {
+                opts.fb = 64;
+                elzma_compress_set_options(hand, &opts);
+            }
+            elzma_compress_set_throughput(hand, 2, 0);
+            clock.now = 0;
+            clock.step = 1000000;
+            rc = simpleCompressWithHandle(hand, zeros, inLen + (1 << 18),
+                                          out + i, osz + i);
+        }
+        if (rc == ELZMA_E_OK &&
+            (osz[0] != osz[1] || 0 != memcmp(out[0], out[1], osz[0])))
+        {
+            rc = 1;
+        }
+        for (i = 0; i < 2; i++) {
+            if (out[i]) free(out[i]);
+        }
+        free(zeros);
+    }
+
+    for (i = 0; i < 4; i++) {
+        if (compressed[i]) free(compressed[i]);
+    }
+    elzma_compress_free(&hand);
+    free(input);
+
+    return rc;
+}
+
+/* a test that LZMA2 round trips data which mixes incompressible noise
+ * (stored in uncompressed chunks) with text spanning several chunks, and
+ * that the noise costs only a few bytes of chunk headers */
+static int lzma2RoundTripTest(void)
+{
+    int rc;
+    unsigned int i, seed = 1;
+    const size_t noiseLen = 1 << 18;
+    const size_t copies = 200;
+    size_t inLen, sz, dsz;
+    unsigned char * input;
+    unsigned char * compressed;
+    unsigned char * decompressed;
+    elzma_decompress_handle dhand;
+
+    inLen = noiseLen + strlen(sampleData) * copies;
+    input = malloc(inLen);
+    for (i = 0; i < noiseLen; i++) {
+        seed = seed * 1103515245 + 12345;
+        input[i] = (unsigned char) (seed >> 16);
+    }
+    for (i = 0; i < copies; i++) {
+        memcpy(input + noiseLen + i * strlen(sampleData), sampleData,
+               strlen(sampleData));
+    }
+
+    rc = simpleCompress(ELZMA_lzma2, input, inLen, &compressed, &sz);
+    if (rc != ELZMA_E_OK) {
+        free(input);
+        return rc;
+    }
+
+    /* 3 header bytes per 64k stored, and the text compresses well */
+    if (sz > noiseLen + noiseLen / 1024 + strlen(sampleData) * copies / 10) {
+        rc = 1;
+    }
+
+    if (rc == ELZMA_E_OK) {
+        rc = simpleDecompress(ELZMA_lzma2, compressed, sz,
+                              &decompressed, &dsz);
+        if (rc == ELZMA_E_OK) {
+            if (dsz != inLen || 0 != memcmp(decompressed, input, inLen)) {
+                rc = 1;
+            }
+            free(decompressed);
+        }
+    }
+
+    /* the in-memory decompressor handles it, and notices a short
+     * output buffer */
+    if (rc == ELZMA_E_OK) {
+        dhand = elzma_decompress_alloc();
+        decompressed = malloc(inLen);
+        dsz = inLen - 1;
+        rc = elzma_decompress_buffer(dhand, compressed, sz, decompressed,
+                                     &dsz, ELZMA_lzma2);
+        rc = (rc == ELZMA_E_OUTPUT_ERROR) ? ELZMA_E_OK : 1;
+        if (rc == ELZMA_E_OK) {
+            dsz = inLen;
+            rc = elzma_decompress_buffer(dhand, compressed, sz, decompressed,
+                                         &dsz, ELZMA_lzma2);
+            if (rc == ELZMA_E_OK &&
+                (dsz != inLen || 0 != memcmp(decompressed, input, inLen)))
+            {
+                rc = 1;
+            }
+        }
+        free(decompressed);
+        elzma_decompress_free(&dhand);
+    }
+
+    free(compressed);
+    free(input);
+
+    return rc;
+}
+
+/* a test that noise between two runs of text is stored, and that a
+ * repeat of the noise and the text after it are still matched against
+ * what came before, whatever the position bits (lp, pb) */
+static int storedWindowTest(elzma_file_format format)
+{
+    int rc = ELZMA_E_OK;
+    unsigned int i, seed = 7, pass;
+    const size_t noiseLen = 1 << 18;
+    const size_t textLen = strlen(sampleData) * 100;
+    size_t inLen, sz, dsz;
+    unsigned char * input;
+    unsigned char * compressed;
+    unsigned char * decompressed;
+
+    inLen = textLen * 2 + noiseLen * 2;
+    input = malloc(inLen);
+    for (i = 0; i < 100; i++) {
+        memcpy(input + i * strlen(sampleData), sampleData,
+               strlen(sampleData));
+    }
+    for (i = 0; i < noiseLen; i++) {
+        seed = seed * 1103515245 + 12345;
+        input[textLen + i] = (unsigned char) (seed >> 16);
+    }
+    memcpy(input + textLen + noiseLen, input + textLen, noiseLen);
+    memcpy(input + textLen + noiseLen * 2, input, textLen);
+
+    for (pass = 0; rc == ELZMA_E_OK && pass < 2; pass++) {
+        elzma_compress_handle hand = elzma_compress_alloc();
+        rc = elzma_compress_config(hand, pass ? 1 : ELZMA_LC_DEFAULT,
+                                   pass ? 3 : ELZMA_LP_DEFAULT,
+                                   pass ? 4 : ELZMA_PB_DEFAULT, 5, 1 << 20,
+                                   format, inLen);
+        if (rc == ELZMA_E_OK) {
+            rc = simpleCompressWithHandle(hand, input, inLen,
+                                          &compressed, &sz);
+        }
+        elzma_compress_free(&hand);
+        if (rc != ELZMA_E_OK) break;
+
+        /* the noise costs chunk headers, its repeat next to nothing and
+         * each run of text well under a tenth of itself */
+        if (sz > noiseLen + noiseLen / 1024 + textLen / 5 + 128) rc = 1;
+
+        if (rc == ELZMA_E_OK) {
+            rc = simpleDecompress(format, compressed, sz,
+                                  &decompressed, &dsz);
+            if (rc == ELZMA_E_OK) {
+                if (dsz != inLen || 0 != memcmp(decompressed, input, inLen)) {
+                    rc = 1;
+                }
+                free(decompressed);
+            }
+        }
+        free(compressed);
+    }
+
+    free(input);
+
+    return rc;
+}
+
+/* a test that random input is probed and stored without being parsed:
+ * every 64k window of it becomes a stored chunk of exactly 64k.  The
+ * encoder's own fallback can't produce those, a chunk it stores is what
+ * it parsed before the packed size came within 8k of the 64k limit, so
+ * less than 57k of random input.  The output must still round trip */
+static int storedBypassTest(void)
+{
+    int rc = ELZMA_E_OK;
+    unsigned int i, seed = 11, windows = 0, chunks = 0;
+    const size_t inLen = 1 << 20;
+    size_t sz, dsz, pos;
+    unsigned char * input = malloc(inLen);
+    unsigned char * compressed;
+    unsigned char * decompressed;
+    elzma_compress_handle hand = elzma_compress_alloc();
+
+    for (i = 0; i < inLen; i++) {
+        seed = seed * 1103515245 + 12345;
+        input[i] = (unsigned char) (seed >> 16);
+    }
+
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 20, ELZMA_lzma2, 0);
+    rc = simpleCompressWithHandle(hand, input, inLen, &compressed, &sz);
+    elzma_compress_free(&hand);
+    if (rc != ELZMA_E_OK) {
+        free(input);
+        return rc;
+    }
+
+    /* walk the chunks after the dictionary size byte */
+    for (pos = 1; rc == ELZMA_E_OK && pos < sz && compressed[pos] != 0;
+         chunks++)
+    {
+        unsigned int control = compressed[pos];
+        if (control == 1 || control == 2) {
+            size_t size = ((size_t) compressed[pos + 1] << 8) +
+                compressed[pos + 2] + 1;
+            if (size == 1 << 16) windows++;
+            pos += 3 + size;
+        } else if (control >= 0x80) {
+            pos += 5 + (control >= 0xC0 ? 1 : 0) +
+                ((size_t) compressed[pos + 3] << 8) + compressed[pos + 4] + 1;
+        } else {
+            rc = 1;
+        }
+    }
+    if (rc == ELZMA_E_OK &&
+        (windows != inLen >> 16 || chunks != windows || pos != sz - 1))
+    {
+        rc = 1;
+    }
+
+    if (rc == ELZMA_E_OK) {
+        rc = simpleDecompress(ELZMA_lzma2, compressed, sz,
+                              &decompressed, &dsz);
+        if (rc == ELZMA_E_OK) {
+            if (dsz != inLen || 0 != memcmp(decompressed, input, inLen)) {
+                rc = 1;
+            }
+            free(decompressed);
+        }
+    }
+
+    free(compressed);
+    free(input);
+
+    return rc;
+}
+
+/* a test that push mode compression, fed in small pieces with a small
+ * work limit, matches elzma_compress_run for a single member, and round
+ * trips when flushes split it into several lzip members */
+static int pushRoundTripTest(elzma_file_format format, unsigned int flushEvery)
+{
+    int rc;
+    unsigned int i;
+    const size_t copies = 64;
+    size_t sampleLen = strlen(sampleData);
+    size_t inLen = sampleLen * copies;
+    unsigned char * input = malloc(inLen);
+    unsigned char * compressed[2] = { NULL, NULL };
+    unsigned char * decompressed;
+    size_t sz[2];
+    elzma_compress_handle hand = elzma_compress_alloc();
+
+    /* vary the copies a little so there's something left to compress */
+    for (i = 0; i < copies; i++) {
+        memcpy(input + i * sampleLen, sampleData, sampleLen);
+        input[i * sampleLen + i % sampleLen] = (unsigned char) i;
+    }
+
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 16, format, 0);
+
+    rc = simpleCompressPush(hand, input, inLen, 1000, 4096, flushEvery,
+                            compressed, sz);
+    if (rc == ELZMA_E_OK && flushEvery == 0) {
+        rc = simpleCompressWithHandle(hand, input, inLen,
+                                      compressed + 1, sz + 1);
+        if (rc == ELZMA_E_OK &&
+            (sz[0] != sz[1] || 0 != memcmp(compressed[0], compressed[1],
+                                           sz[0])))
+        {
+            rc = 1;
+        }
+    }
+
+    if (rc == ELZMA_E_OK) {
+        rc = simpleDecompress(format, compressed[0], sz[0],
+                              &decompressed, sz);
+        if (rc == ELZMA_E_OK) {
+            if (sz[0] != inLen || 0 != memcmp(decompressed, input, inLen)) {
+                rc = 1;
+            }
+            free(decompressed);
+        }
+    }
+
+    if (compressed[0]) free(compressed[0]);
+    if (compressed[1]) free(compressed[1]);
+    free(input);
+    elzma_compress_free(&hand);
+
+    return rc;
+}
+
+/* a test that forks of a push mode stream produce exactly the files the
+ * whole input would have, for dictionaries smaller and larger than the
+ * prefix */
+static int forkTest(elzma_file_format format, unsigned int dictSize)
+{
+    int rc;
+    unsigned int i;
+    const size_t copies = 16;
+    size_t sampleLen = strlen(sampleData);
+    size_t prefixLen = sampleLen * copies;
+    unsigned char * input = malloc(prefixLen + sampleLen);
+    unsigned char * suffixes[3];
+    size_t suffixLens[3];
+    unsigned char * forked[3];
+    size_t forkedLens[3];
+    elzma_compress_handle hand = elzma_compress_alloc();
+
+    for (i = 0; i < copies; i++) {
+        memcpy(input + i * sampleLen, sampleData, sampleLen);
+        input[i * sampleLen + i % sampleLen] = (unsigned char) i;
+    }
+
+    /* an empty suffix, and two which differ only near the start */
+    for (i = 0; i < 3; i++) {
+        suffixLens[i] = (i == 0) ? 0 : sampleLen - 100 * i;
+        suffixes[i] = malloc(sampleLen);
+        memcpy(suffixes[i], sampleData + 10 * i, sampleLen - 10 * i);
+        suffixes[i][5] = (unsigned char) i;
+    }
+
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, dictSize, format, 0);
+
+    rc = simpleCompressForked(hand, input, prefixLen, 3,
+                              (const unsigned char * const *) suffixes,
+                              suffixLens, forked, forkedLens);
+
+    for (i = 0; i < 3 && rc == ELZMA_E_OK; i++) {
+        unsigned char * compressed = NULL;
+        unsigned char * decompressed;
+        size_t sz, dsz;
+
+        /* the same writes to a single stream */
+        memcpy(input + prefixLen, suffixes[i], suffixLens[i]);
+        rc = simpleCompressPush(hand, input, prefixLen + suffixLens[i],
+                                prefixLen, 0, 0, &compressed, &sz);
+        if (rc == ELZMA_E_OK &&
+            (sz != forkedLens[i] || 0 != memcmp(compressed, forked[i], sz)))
+        {
+            rc = 1;
+        }
+        if (compressed) free(compressed);
+
+        if (rc == ELZMA_E_OK) {
+            rc = simpleDecompress(format, forked[i], forkedLens[i],
+                                  &decompressed, &dsz);
+            if (rc == ELZMA_E_OK) {
+                if (dsz != prefixLen + suffixLens[i] ||
+                    0 != memcmp(decompressed, input, dsz))
+                {
+                    rc = 1;
+                }
+                free(decompressed);
+            }
+        }
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (forked[i]) free(forked[i]);
+        free(suffixes[i]);
+    }
+    free(input);
+    elzma_compress_free(&hand);
+
+    return rc;
+}
+
+/* an abort callback which gives up once it's been polled a given number
+ * of times */
+static int
+abortAfterCallback(void * ctx)
+{
+    unsigned int * polls = (unsigned int *) ctx;
+    if (*polls == 0) return 1;
+    (*polls)--;
+    return 0;
+}
+
+/* a test that an abort callback stops single and multi threaded
+ * compression with ELZMA_E_ABORTED, and that the handle is usable
+ * afterwards */
+static int abortTest(void)
+{
+    int rc;
+    unsigned int i, polls;
+    const size_t copies = 512;
+    size_t sampleLen = strlen(sampleData);
+    size_t inLen = sampleLen * copies;
+    unsigned char * input = malloc(inLen);
+    unsigned char * compressed = NULL;
+    unsigned char * decompressed;
+    size_t sz;
+    elzma_compress_handle hand = elzma_compress_alloc();
+
+    for (i = 0; i < copies; i++) {
+        memcpy(input + i * sampleLen, sampleData, sampleLen);
+        input[i * sampleLen + i % sampleLen] = (unsigned char) i;
+    }
+
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 20, ELZMA_lzip, inLen);
+
+    polls = 2;
+    elzma_compress_set_abort_callback(hand, abortAfterCallback,
+                                      (void *) &polls);
+    rc = simpleCompressWithHandle(hand, input, inLen, &compressed, &sz);
+    if (rc == ELZMA_E_ABORTED) {
+        polls = 2;
+        elzma_compress_set_threads(hand, 4, 1 << 12);
+        rc = simpleCompressWithHandle(hand, input, inLen, &compressed, &sz);
+    } else {
+        rc = (rc == ELZMA_E_OK) ? 1 : rc;
+    }
+
+    /* without the callback the same handle completes */
+    if (rc == ELZMA_E_ABORTED) {
+        elzma_compress_set_abort_callback(hand, NULL, NULL);
+        rc = simpleCompressWithHandle(hand, input, inLen, &compressed, &sz);
+        if (rc == ELZMA_E_OK) {
+            rc = simpleDecompress(ELZMA_lzip, compressed, sz,
+                                  &decompressed, &sz);
+            if (rc == ELZMA_E_OK) {
+                if (sz != inLen || 0 != memcmp(decompressed, input, inLen)) {
+                    rc = 1;
+                }
+                free(decompressed);
+            }
+            free(compressed);
+        }
+    } else {
+        rc = (rc == ELZMA_E_OK) ? 1 : rc;
+    }
+
+    free(input);
+    elzma_compress_free(&hand);
+
+    return rc;
+}
+
+/* a test that stepped compression takes several steps under a work or
+ * time limit, matches elzma_compress_run, and round trips */
+static int stepTest(elzma_file_format format)
+{
+    int rc;
+    unsigned int i, steps = 0;
+    const size_t copies = 256;
+    size_t sampleLen = strlen(sampleData);
+    size_t inLen = sampleLen * copies;
+    unsigned char * input = malloc(inLen);
+    unsigned char * compressed[3] = { NULL, NULL, NULL };
+    unsigned char * decompressed;
+    size_t sz[3];
+    elzma_compress_handle hand = elzma_compress_alloc();
+
+    for (i = 0; i < copies; i++) {
+        memcpy(input + i * sampleLen, sampleData, sampleLen);
+        input[i * sampleLen + i % sampleLen] = (unsigned char) i;
+    }
+
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 20, format, 0);
+
+    rc = simpleCompressStepped(hand, input, inLen, 1 << 16, 0,
+                               compressed, sz, &steps);
+    /* the input is several times the work limit */
+    if (rc == ELZMA_E_OK && steps < 4) rc = 1;
+    if (rc == ELZMA_E_OK) {
+        rc = simpleCompressWithHandle(hand, input, inLen,
+                                      compressed + 1, sz + 1);
+        if (rc == ELZMA_E_OK &&
+            (sz[0] != sz[1] || 0 != memcmp(compressed[0], compressed[1],
+                                           sz[0])))
+        {
+            rc = 1;
+        }
+    }
+    if (rc == ELZMA_E_OK) {
+        rc = simpleCompressStepped(hand, input, inLen, 0, 1000,
+                                   compressed + 2, sz + 2, &steps);
+        if (rc == ELZMA_E_OK &&
+            (sz[0] != sz[2] || 0 != memcmp(compressed[0], compressed[2],
+                                           sz[0])))
+        {
+            rc = 1;
+        }
+    }
+
+    if (rc == ELZMA_E_OK) {
+        rc = simpleDecompress(format, compressed[0], sz[0],
+                              &decompressed, sz);
+        if (rc == ELZMA_E_OK) {
+            if (sz[0] != inLen || 0 != memcmp(decompressed, input, inLen)) {
+                rc = 1;
+            }
+            free(decompressed);
+        }
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (compressed[i]) free(compressed[i]);
+    }
+    free(input);
+    elzma_compress_free(&hand);
+
+    return rc;
+}
+
+/* a test that input which is mostly long runs of one byte value (as in
+ * sparse disk images) compresses to almost nothing with each preset, to
+ * the same output stepped or threaded, and round trips */
+static int runTest(elzma_file_format format)
+{
+    int rc = ELZMA_E_OK;
+    unsigned int i, steps;
+    const size_t copies = 16, runLen = 1 << 16;
+    size_t sampleLen = strlen(sampleData);
+    size_t inLen = (sampleLen + runLen) * copies;
+    unsigned char * input = malloc(inLen);
+    unsigned char * compressed[2];
+    unsigned char * decompressed;
+    size_t sz[2];
+    static const elzma_compress_preset presets[3] = {
+        ELZMA_PRESET_DEFAULT, ELZMA_PRESET_FAST, ELZMA_PRESET_LAZY
+    };
+    elzma_compress_handle hand = elzma_compress_alloc();
+
+    /* the sample data between runs of zeros and of another value */
+    for (i = 0; i < copies; i++) {
+        unsigned char * p = input + i * (sampleLen + runLen);
+        memcpy(p, sampleData, sampleLen);
+        memset(p + sampleLen, (i & 1) ? 0x5a : 0, runLen);
+    }
+
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 20, format, 0);
+
+    for (i = 0; rc == ELZMA_E_OK && i < 3; i++) {
+        elzma_compress_options opts;
+        elzma_compress_options_init(&opts, presets[i]);
+        rc = elzma_compress_set_options(hand, &opts);
+        if (rc != ELZMA_E_OK) break;
+
+        rc = simpleCompressWithHandle(hand, input, inLen,
+                                      compressed, sz);
+        if (rc != ELZMA_E_OK) break;
+        rc = simpleCompressStepped(hand, input, inLen, 1 << 16, 0,
+                                   compressed + 1, sz + 1, &steps);
+        if (rc == ELZMA_E_OK) {
+            if (sz[0] != sz[1] ||
+                0 != memcmp(compressed[0], compressed[1], sz[0]) ||
+                sz[0] > sampleLen + inLen / 256)
+            {
+                rc = 1;
+            }
+            free(compressed[1]);
+        }
+
+        if (rc == ELZMA_E_OK) {
+            rc = simpleDecompress(format, compressed[0], sz[0],
+                                  &decompressed, sz + 1);
+            if (rc == ELZMA_E_OK) {
+                if (sz[1] != inLen ||
+                    0 != memcmp(decompressed, input, inLen))
+                {
+                    rc = 1;
+                }
+                free(decompressed);
+            }
+        }
+        free(compressed[0]);
+    }
+
+    free(input);
+    elzma_compress_free(&hand);
+
+    return rc;
+}
+
+/* a test that a single handle may be reused across runs with differing
+ * configurations, producing the same output as a fresh handle would */
+static int handleReuseTest(void)
+{
+    static const struct {
+        elzma_file_format format;
+        unsigned char lc;
+        unsigned char lp;
+        unsigned int dictSize;
+    } runs[] = {
+        { ELZMA_lzip, 3, 0, 1 << 20 },
+        { ELZMA_lzma, 0, 0, 1 << 16 },
+        { ELZMA_lzip, 4, 0, 1 << 22 },
+        { ELZMA_lzma, 3, 0, 1 << 20 }
+    };
+    int rc = ELZMA_E_OK;
+    unsigned int i;
+    size_t inLen = strlen(sampleData);
+    elzma_compress_handle reused = elzma_compress_alloc();
+
+    for (i = 0; rc == ELZMA_E_OK && i < sizeof(runs)/sizeof(runs[0]); i++)
+    {
+        elzma_compress_handle fresh = elzma_compress_alloc();
+        unsigned char * out[2] = { NULL, NULL };
+        size_t sz[2];
+
+        elzma_compress_config(reused, runs[i].lc, runs[i].lp,
+                              ELZMA_PB_DEFAULT, 5, runs[i].dictSize,
+                              runs[i].format, inLen);
+        elzma_compress_config(fresh, runs[i].lc, runs[i].lp,
+                              ELZMA_PB_DEFAULT, 5, runs[i].dictSize,
+                              runs[i].format, inLen);
+
+        rc = simpleCompressWithHandle(reused, (unsigned char *) sampleData,
+                                      inLen, out, sz);
+        if (rc == ELZMA_E_OK) {
+            rc = simpleCompressWithHandle(fresh, (unsigned char *) sampleData,
+                                          inLen, out + 1, sz + 1);
+        }
+        if (rc == ELZMA_E_OK &&
+            (sz[0] != sz[1] || 0 != memcmp(out[0], out[1], sz[0])))
+        {
+            rc = 1;
+        }
+
+        if (out[0]) free(out[0]);
+        if (out[1]) free(out[1]);
+        elzma_compress_free(&fresh);
+
+        /* reset restores defaults, and the handle stays usable */
+        if (i == 1) elzma_compress_reset(reused);
+    }
+
+    elzma_compress_free(&reused);
+
+    return rc;
+}
+
+/* a test that encoder options are validated, survive a round trip
+ * through the handle, are restored by reset, that structures of earlier
+ * versions are neither read nor written past their end, and that the
+ * fast preset produces output which decompresses */
+static int optionsTest(void)
+{
+    int rc;
+    unsigned int i;
+    static const elzma_compress_preset presets[3] = {
+        ELZMA_PRESET_DEFAULT, ELZMA_PRESET_FAST, ELZMA_PRESET_LAZY
+    };
+    unsigned char * compressed[3];
+    unsigned char * decompressed;
+    size_t sz[3];
+    elzma_compress_options opts, got;
+    elzma_compress_handle hand = elzma_compress_alloc();
+
+    rc = elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                               ELZMA_PB_DEFAULT, 5, 1 << 20, ELZMA_lzip,
+                               strlen(sampleData));
+
+    /* bad versions and out of range values are refused */
+    if (rc == ELZMA_E_OK) {
+        elzma_compress_options_init(&opts, ELZMA_PRESET_FAST);
+        opts.version = ELZMA_COMPRESS_OPTIONS_VERSION + 1;
+        if (elzma_compress_set_options(hand, &opts) != ELZMA_E_BAD_PARAMS) {
+            rc = 1;
+        }
+        opts.version = ELZMA_COMPRESS_OPTIONS_VERSION;
+        opts.fb = 4;
+        if (elzma_compress_set_options(hand, &opts) != ELZMA_E_BAD_PARAMS) {
+            rc = 1;
+        }
+        opts.fb = 16;
+        opts.algo = 3;
+        if (elzma_compress_set_options(hand, &opts) != ELZMA_E_BAD_PARAMS) {
+            rc = 1;
+        }
+        opts.algo = 0;
+        opts.mulHash = 2;
+        if (elzma_compress_set_options(hand, &opts) != ELZMA_E_BAD_PARAMS) {
+            rc = 1;
+        }
+        opts.mulHash = 0;
+        opts.ringWindow = 2;
+        if (elzma_compress_set_options(hand, &opts) != ELZMA_E_BAD_PARAMS) {
+            rc = 1;
+        }
+    }
+
+    for (i = 0; rc == ELZMA_E_OK && i < 3; i++) {
+        elzma_compress_options_init(&opts, presets[i]);
+        rc = elzma_compress_set_options(hand, &opts);
+        /* whatever the structure held before, all of it is filled */
+        memset((void *) &got, 0xFF, sizeof(got));
+        if (rc == ELZMA_E_OK) rc = elzma_compress_get_options(hand, &got);
+        if (rc == ELZMA_E_OK && 0 != memcmp(&opts, &got, sizeof(opts))) {
+            rc = 1;
+        }
+        if (rc == ELZMA_E_OK) {
+            rc = simpleCompressWithHandle(hand, (unsigned char *) sampleData,
+                                          strlen(sampleData),
+                                          compressed + i, sz + i);
+            if (rc != ELZMA_E_OK) {
+                while (i-- > 0) free(compressed[i]);
+            }
+        }
+    }
+    if (rc != ELZMA_E_OK) {
+        elzma_compress_free(&hand);
+        return rc;
+    }
+
+    /* greedy and lazy parsing over hash chains make streams of their own,
+     * which round trip */
+    for (i = 1; rc == ELZMA_E_OK && i < 3; i++) {
+        if (sz[0] == sz[i] &&
+            0 == memcmp(compressed[0], compressed[i], sz[0]))
+        {
+            rc = 1;
+            break;
+        }
+        rc = simpleDecompress(ELZMA_lzip, compressed[i], sz[i],
+                              &decompressed, sz + i);
+        if (rc == ELZMA_E_OK) {
+            if (sz[i] != strlen(sampleData) ||
+                0 != memcmp(decompressed, sampleData, sz[i]))
+            {
+                rc = 1;
+            }
+            free(decompressed);
+        }
+    }
+
+    /* reset brings back the default preset */
+    if (rc == ELZMA_E_OK) {
+        elzma_compress_reset(hand);
+        elzma_compress_options_init(&opts, ELZMA_PRESET_DEFAULT);
+        rc = elzma_compress_get_options(hand, &got);
+        if (rc == ELZMA_E_OK && 0 != memcmp(&opts, &got, sizeof(opts))) {
+            rc = 1;
+        }
+    }
+
+    /* a version 1 structure ends before mulHash, whose value in the
+     * handle it resets to the default.  Nothing past its end is touched,
+     * and the current version is refused beyond what it knows. */
+    if (rc == ELZMA_E_OK) {
+        const size_t v1Size = offsetof(elzma_compress_options, mulHash);
+        elzma_compress_options * v1 = malloc(sizeof(elzma_compress_options));
+        memset((void *) v1, 0xAB, sizeof(elzma_compress_options));
+
+        elzma_compress_options_init(&opts, ELZMA_PRESET_BEST);
+        opts.mulHash = 1;
+        elzma_compress_set_options(hand, &opts);
+
+        if (elzma_compress_options_init_version(v1, ELZMA_PRESET_BEST, 1) !=
+            ELZMA_E_OK ||
+            elzma_compress_set_options(hand, v1) != ELZMA_E_OK ||
+            elzma_compress_get_options_version(hand, v1, 1) != ELZMA_E_OK ||
+            v1->version != 1 || v1->fb != 64 ||
+            elzma_compress_get_options_version(
+                hand, &got, ELZMA_COMPRESS_OPTIONS_VERSION + 1) !=
+            ELZMA_E_BAD_PARAMS)
+        {
+            rc = 1;
+        }
+        if (rc == ELZMA_E_OK) {
+            const unsigned char * tail = (const unsigned char *) v1 + v1Size;
+            for (i = 0; i < sizeof(elzma_compress_options) - v1Size; i++) {
+                if (tail[i] != 0xAB) rc = 1;
+            }
+        }
+        if (rc == ELZMA_E_OK) {
+            opts.mulHash = 0;
+            rc = elzma_compress_get_options(hand, &got);
+            if (rc == ELZMA_E_OK &&
+                0 != memcmp(&opts, &got, sizeof(opts)))
+            {
+                rc = 1;
+            }
+        }
+        free(v1);
+    }
+
+    for (i = 0; i < 3; i++) free(compressed[i]);
+    elzma_compress_free(&hand);
+
+    return rc;
+}
+
+/* a test that with multiplicative hashing each preset makes output of its
+ * own, the same stepped as in one run, which round trips */
+static int mulHashTest(elzma_file_format format)
+{
+    int rc = ELZMA_E_OK;
+    unsigned int i, steps;
+    const size_t copies = 64;
+    size_t sampleLen = strlen(sampleData);
+    size_t inLen = sampleLen * copies;
+    unsigned char * input = malloc(inLen);
+    unsigned char * compressed[3];
+    unsigned char * decompressed;
+    size_t sz[3];
+    static const elzma_compress_preset presets[3] = {
+        ELZMA_PRESET_DEFAULT, ELZMA_PRESET_FAST, ELZMA_PRESET_LAZY
+    };
+    elzma_compress_handle hand = elzma_compress_alloc();
+
+    for (i = 0; i < copies; i++) {
+        memcpy(input + i * sampleLen, sampleData, sampleLen);
+        input[i * sampleLen + i % sampleLen] = (unsigned char) i;
+    }
+
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 20, format, 0);
+
+    for (i = 0; rc == ELZMA_E_OK && i < 3; i++) {
+        elzma_compress_options opts;
+        elzma_compress_options_init(&opts, presets[i]);
+        rc = elzma_compress_set_options(hand, &opts);
+        if (rc == ELZMA_E_OK) {
+            rc = simpleCompressWithHandle(hand, input, inLen,
+                                          compressed + 2, sz + 2);
+        }
+        if (rc != ELZMA_E_OK) break;
+
+        opts.mulHash = 1;
+        rc = elzma_compress_set_options(hand, &opts);
+        if (rc == ELZMA_E_OK) {
+            rc = simpleCompressWithHandle(hand, input, inLen,
+                                          compressed, sz);
+        }
+        if (rc != ELZMA_E_OK) {
+            free(compressed[2]);
+            break;
+        }
+        rc = simpleCompressStepped(hand, input, inLen, 1 << 14, 0,
+                                   compressed + 1, sz + 1, &steps);
+        if (rc == ELZMA_E_OK) {
+            if (sz[0] != sz[1] ||
+                0 != memcmp(compressed[0], compressed[1], sz[0]) ||
+                (sz[0] == sz[2] &&
+                 0 == memcmp(compressed[0], compressed[2], sz[0])))
+            {
+                rc = 1;
+            }
+            free(compressed[1]);
+        }
+        free(compressed[2]);
+
+        if (rc == ELZMA_E_OK) {
+            rc = simpleDecompress(format, compressed[0], sz[0],
+                                  &decompressed, sz + 1);
+            if (rc == ELZMA_E_OK) {
+                if (sz[1] != inLen ||
+                    0 != memcmp(decompressed, input, inLen))
+                {
+                    rc = 1;
+                }
+                free(decompressed);
+            }
+        }
+        free(compressed[0]);
+    }
+
+    free(input);
+    elzma_compress_free(&hand);
+
+    return rc;
+}
+
+/* allocation routines which note the largest block asked for */
+static void *
+largestMalloc(void * ctx, unsigned int sz)
+{
+    unsigned int * largest = (unsigned int *) ctx;
+    if (sz > *largest) *largest = sz;
+    return malloc(sz);
+}
+
+static void
+largestFree(void * ctx, void * ptr)
+{
+    (void) ctx;
+    free(ptr);
+}
+
+/* a test that the window and match finder tables, which go through the
+ * large page allocator, round trip with a dictionary several huge pages
+ * big, that no more than their size is reported in huge pages, that
+ * client allocation routines still get the large blocks, and that a
+ * small input of known size is decoded with a small dictionary */
+static int hugePageTest(void)
+{
+    int rc = ELZMA_E_OK;
+    unsigned int i, largest = 0;
+    const unsigned int dictSize = 1 << 23;
+    const size_t copies = 4096;
+    size_t sampleLen = strlen(sampleData);
+    size_t inLen = sampleLen * copies;
+    unsigned char * input = malloc(inLen);
+    unsigned char * compressed = NULL;
+    unsigned char * decompressed = NULL;
+    size_t compressedLen = 0, decompressedLen = 0;
+    elzma_compress_handle hand = elzma_compress_alloc();
+    elzma_decompress_handle dhand = elzma_decompress_alloc();
+
+    for (i = 0; i < copies; i++) {
+        memcpy(input + i * sampleLen, sampleData, sampleLen);
+        input[i * sampleLen + i % sampleLen] = (unsigned char) i;
+    }
+
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, dictSize, ELZMA_lzma, 0);
+    rc = simpleCompressWithHandle(hand, input, inLen,
+                                  &compressed, &compressedLen);
+    if (rc == ELZMA_E_OK &&
+        elzma_compress_huge_page_bytes(hand) / 32 > dictSize)
+    {
+        rc = 1;
+    }
+    if (rc == ELZMA_E_OK) {
+        rc = simpleDecompressWithHandle(dhand, ELZMA_lzma,
+                                        compressed, compressedLen,
+                                        &decompressed, &decompressedLen);
+    }
+    if (rc == ELZMA_E_OK) {
+        if (decompressedLen != inLen ||
+            0 != memcmp(decompressed, input, inLen) ||
+            elzma_decompress_huge_page_bytes(dhand) > dictSize)
+        {
+            rc = 1;
+        }
+        free(decompressed);
+    }
+    free(compressed);
+    elzma_compress_free(&hand);
+    elzma_decompress_free(&dhand);
+
+    /* the same through the client's routines */
+    if (rc == ELZMA_E_OK) {
+        hand = elzma_compress_alloc();
+        elzma_compress_set_allocation_callbacks(hand, largestMalloc, &largest,
+                                                largestFree, NULL);
+        elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                              ELZMA_PB_DEFAULT, 5, dictSize, ELZMA_lzma, 0);
+        rc = simpleCompressWithHandle(hand, input, inLen,
+                                      &compressed, &compressedLen);
+        if (rc == ELZMA_E_OK && largest < dictSize) rc = 1;
+        elzma_compress_free(&hand);
+
+        if (rc == ELZMA_E_OK) {
+            largest = 0;
+            dhand = elzma_decompress_alloc();
+            elzma_decompress_set_allocation_callbacks(dhand,
+                                                      largestMalloc, &largest,
+                                                      largestFree, NULL);
+            rc = simpleDecompressWithHandle(dhand, ELZMA_lzma,
+                                            compressed, compressedLen,
+                                            &decompressed, &decompressedLen);
+            if (rc == ELZMA_E_OK) {
+                if (decompressedLen != inLen ||
+                    0 != memcmp(decompressed, input, inLen) ||
+                    largest < dictSize)
+                {
+                    rc = 1;
+                }
+                free(decompressed);
+            }
+            elzma_decompress_free(&dhand);
+        }
+        free(compressed);
+    }
+
+    if (rc == ELZMA_E_OK) {
+        hand = elzma_compress_alloc();
+        elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                              ELZMA_PB_DEFAULT, 5, dictSize, ELZMA_lzma,
+                              sampleLen);
+        rc = simpleCompressWithHandle(hand, input, sampleLen,
+                                      &compressed, &compressedLen);
+        elzma_compress_free(&hand);
+
+        if (rc == ELZMA_E_OK) {
+            largest = 0;
+            dhand = elzma_decompress_alloc();
+            elzma_decompress_set_allocation_callbacks(dhand,
+                                                      largestMalloc, &largest,
+                                                      largestFree, NULL);
+            rc = simpleDecompressWithHandle(dhand, ELZMA_lzma,
+                                            compressed, compressedLen,
+                                            &decompressed, &decompressedLen);
+            if (rc == ELZMA_E_OK) {
+                if (decompressedLen != sampleLen ||
+                    0 != memcmp(decompressed, input, sampleLen) ||
+                    largest > (1 << 16))
+                {
+                    rc = 1;
+                }
+                free(decompressed);
+            }
+            elzma_decompress_free(&dhand);
+        }
+        free(compressed);
+    }
+
+    free(input);
+
+    return rc;
+}
+
+/* a test that moving binary tree match finding into threads of its own
+ * leaves the output byte for byte the same, over text, noise and runs,
+ * with a dictionary smaller and larger than the input and the default
+ * and best presets */
+static int matchFinderThreadsTest(void)
+{
+    int rc = ELZMA_E_OK;
+    unsigned int i, seed = 5, dict, preset;
+    const size_t copies = 1024;
+    size_t sampleLen = strlen(sampleData);
+    size_t textLen = sampleLen * copies;
+    size_t inLen = textLen * 2 + (1 << 18) + (1 << 16);
+    size_t pos;
+    unsigned char * input = malloc(inLen);
+
+    /* mutated text, noise, a run of zeros and the text again */
+    for (i = 0; i < copies; i++) {
+        memcpy(input + i * sampleLen, sampleData, sampleLen);
+        input[i * sampleLen + (i * 7) % sampleLen] = (unsigned char) i;
+    }
+    pos = textLen;
+    for (i = 0; i < (1 << 18); i++) {
+        seed = seed * 1103515245 + 12345;
+        input[pos++] = (unsigned char) (seed >> 16);
+    }
+    memset(input + pos, 0, 1 << 16);
+    pos += 1 << 16;
+    memcpy(input + pos, input, textLen);
+
+    for (dict = 1 << 16; rc == ELZMA_E_OK && dict <= (1 << 22);
+         dict <<= 6)
+    {
+        for (preset = 0; rc == ELZMA_E_OK && preset < 2; preset++) {
+            unsigned char * compressed[2] = { NULL, NULL };
+            size_t sz[2] = { 0, 0 };
+
+            for (i = 0; rc == ELZMA_E_OK && i < 2; i++) {
+                elzma_compress_options opts;
+                elzma_compress_handle hand = elzma_compress_alloc();
+                elzma_compress_config(hand, ELZMA_LC_DEFAULT,
+                                      ELZMA_LP_DEFAULT, ELZMA_PB_DEFAULT,
+                                      5, dict, ELZMA_lzma, 0);
+                elzma_compress_options_init(&opts, preset ?
+                                            ELZMA_PRESET_BEST :
+                                            ELZMA_PRESET_DEFAULT);
+                opts.matchFinderThreads = i + 1;
+                rc = elzma_compress_set_options(hand, &opts);
+                if (rc == ELZMA_E_OK) {
+                    rc = simpleCompressWithHandle(hand, input, inLen,
+                                                  compressed + i, sz + i);
+                }
+                elzma_compress_free(&hand);
+            }
+            if (rc == ELZMA_E_OK &&
+                (sz[0] != sz[1] ||
+                 0 != memcmp(compressed[0], compressed[1], sz[0])))
+            {
+                rc = 1;
+            }
+            if (compressed[0]) free(compressed[0]);
+            if (compressed[1]) free(compressed[1]);
+        }
+    }
+
+    free(input);
+
+    return rc;
+}
+
+/* a test that a window which wraps around many times, mapped twice
+ * where the system can when asked for, codes exactly as the flat one the
+ * client's allocation routines give even then, with and without match
+ * finder threads */
+static int ringWindowTest(void)
+{
+    int rc = ELZMA_E_OK;
+    unsigned int i, threads, largest = 0;
+    const size_t copies = 2048;
+    size_t sampleLen = strlen(sampleData);
+    size_t inLen = sampleLen * copies;
+    unsigned char * input = malloc(inLen);
+    unsigned char * compressed[2];
+    unsigned char * decompressed;
+    size_t sz[2];
+
+    for (i = 0; i < copies; i++) {
+        memcpy(input + i * sampleLen, sampleData, sampleLen);
+        input[i * sampleLen + (i * 7) % sampleLen] = (unsigned char) i;
+        input[i * sampleLen + (i * 13) % sampleLen] = (unsigned char) (i >> 3);
+    }
+
+    for (threads = 1; rc == ELZMA_E_OK && threads <= 2; threads++) {
+        for (i = 0; rc == ELZMA_E_OK && i < 2; i++) {
+            elzma_compress_options opts;
+            elzma_compress_handle hand = elzma_compress_alloc();
+            if (i == 1) {
+                elzma_compress_set_allocation_callbacks(
+                    hand, largestMalloc, &largest, largestFree, NULL);
+            }
+            elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                                  ELZMA_PB_DEFAULT, 5, 1 << 16,
+                                  ELZMA_lzma, 0);
+            elzma_compress_options_init(&opts, ELZMA_PRESET_DEFAULT);
+            opts.matchFinderThreads = threads;
+            opts.ringWindow = 1;
+            rc = elzma_compress_set_options(hand, &opts);
+            if (rc == ELZMA_E_OK) {
+                rc = simpleCompressWithHandle(hand, input, inLen,
+                                              compressed + i, sz + i);
+            }
+            elzma_compress_free(&hand);
+            if (rc != ELZMA_E_OK && i == 1) free(compressed[0]);
+        }
+        if (rc != ELZMA_E_OK) break;
+
+        if (sz[0] != sz[1] || 0 != memcmp(compressed[0], compressed[1], sz[0]))
+        {
+            rc = 1;
+        }
+        if (rc == ELZMA_E_OK) {
+            rc = simpleDecompress(ELZMA_lzma, compressed[0], sz[0],
+                                  &decompressed, sz + 1);
+            if (rc == ELZMA_E_OK) {
+                if (sz[1] != inLen ||
+                    0 != memcmp(decompressed, input, inLen))
+                {
+                    rc = 1;
+                }
+                free(decompressed);
+            }
+        }
+        free(compressed[0]);
+        free(compressed[1]);
+    }
+
+    free(input);
+
+    return rc;
+}
+
+#ifdef __linux__
+struct memOutput {
+    unsigned char * data;
+    size_t len;
+};
+
+static size_t
+memOutputCallback(void * ctx, const void * buf, size_t size)
+{
+    struct memOutput * out = (struct memOutput *) ctx;
+    if (size > 0) {
+        out->data = realloc(out->data, out->len + size);
+        memcpy(out->data + out->len, buf, size);
+        out->len += size;
+    }
+    return size;
+}
+
+/* whether a stream round trips to input */
+static int
+ringForkCheck(const unsigned char * compressed, size_t compressedLen,
+              const unsigned char * input, size_t inLen)
+{
+    unsigned char * decompressed = NULL;
+    size_t decompressedLen = 0;
+    int rc = simpleDecompress(ELZMA_lzma, compressed, compressedLen,
+                              &decompressed, &decompressedLen);
+    if (rc == ELZMA_E_OK) {
+        if (decompressedLen != inLen ||
+            0 != memcmp(decompressed, input, inLen))
+        {
+            rc = 1;
+        }
+        free(decompressed);
+    }
+    return rc;
+}
+
+/* a test that a child process after fork() gets an error rather than a
+ * fault going on with a push mode stream whose window was mapped twice
+ * before, and still codes a new stream with the handle, while the
+ * parent's stream is unaffected.  Where the window couldn't be mapped
+ * twice it's flat, copied to the child, and the stream just goes on */
+static int ringWindowForkTest(void)
+{
+    int rc = ELZMA_E_OK, status = 0;
+    unsigned int i;
+    const size_t copies = 2048;
+    size_t sampleLen = strlen(sampleData);
+    size_t inLen = sampleLen * copies, half = inLen / 2;
+    unsigned char * input = malloc(inLen);
+    struct memOutput out;
+    elzma_compress_options opts;
+    elzma_compress_handle hand = elzma_compress_alloc();
+    pid_t pid;
+
+    for (i = 0; i < copies; i++) {
+        memcpy(input + i * sampleLen, sampleData, sampleLen);
+        input[i * sampleLen + (i * 7) % sampleLen] = (unsigned char) i;
+    }
+    out.data = NULL;
+    out.len = 0;
+
+    elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                          ELZMA_PB_DEFAULT, 5, 1 << 16, ELZMA_lzma, 0);
+    elzma_compress_options_init(&opts, ELZMA_PRESET_DEFAULT);
+    opts.ringWindow = 1;
+    rc = elzma_compress_set_options(hand, &opts);
+    if (rc == ELZMA_E_OK) {
+        rc = elzma_compress_stream_begin(hand, memOutputCallback,
+                                         (void *) &out, 0);
+    }
+    if (rc == ELZMA_E_OK) {
+        rc = elzma_compress_stream_write(hand, input, half);
+    }
+
+    fflush(stdout);
+    pid = (rc == ELZMA_E_OK) ? fork() : -1;
+    if (pid == 0) {
+        unsigned char * compressed = NULL;
+        size_t compressedLen = 0;
+
+        rc = elzma_compress_stream_write(hand, input + half, inLen - half);
+        if (rc == ELZMA_E_OK) rc = elzma_compress_stream_finish(hand);
+        if (rc == ELZMA_E_OK) {
+            rc = ringForkCheck(out.data, out.len, input, inLen);
+        } else if (rc == ELZMA_E_COMPRESS_ERROR) {
+            rc = ELZMA_E_OK;
+        }
+        if (rc == ELZMA_E_OK) {
+            rc = simpleCompressWithHandle(hand, input, inLen,
+                                          &compressed, &compressedLen);
+        }
+        if (rc == ELZMA_E_OK) {
+            rc = ringForkCheck(compressed, compressedLen, input, inLen);
+            free(compressed);
+        }
+        elzma_compress_free(&hand);
+        _exit(rc == ELZMA_E_OK ? 0 : 1);
+    }
+    if (pid < 0 ||
+        waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        rc = 1;
+    }
+
+    if (rc == ELZMA_E_OK) {
+        rc = elzma_compress_stream_write(hand, input + half, inLen - half);
+    }
+    if (rc == ELZMA_E_OK) rc = elzma_compress_stream_finish(hand);
+    if (rc == ELZMA_E_OK) rc = ringForkCheck(out.data, out.len, input, inLen);
+
+    free(out.data);
+    elzma_compress_free(&hand);
+    free(input);
+
+    return rc;
+}
+#endif
+
+/* a small json document of the kind preset dictionaries are made for */
+static size_t
+sampleMessage(char * buf, unsigned int id)
+{
+    sprintf(buf, "{\"id\": %u, \"user\": \"user%u@example.com\", "
+            "\"event\": \"page_view\", \"path\": \"/products/%u\", "
+            "\"agent\": \"Mozilla/5.0 (X11; Linux x86_64)\", "
+            "\"tags\": [\"web\", \"organic\"], \"ok\": true}",
+            id, id * 7, id % 97);
+    return strlen(buf);
+}
+
+/* a test that a preset dictionary shrinks a small message, that the
+ * message only decompresses with the same dictionary, through both the
+ * streaming and the in-memory calls, and (with lzip) that every member
+ * of a flushed push mode stream continues the dictionary */
+static int presetDictTest(elzma_file_format format)
+{
+    int rc;
+    unsigned int i;
+    char dict[8 * 256];
+    char msg[256];
+    size_t dictLen = 0, msgLen, sz[2], dsz;
+    unsigned char * compressed[2];
+    unsigned char * decompressed;
+    elzma_compress_handle chand = elzma_compress_alloc();
+    elzma_decompress_handle dhand = elzma_decompress_alloc();
+
+    for (i = 0; i < 8; i++) dictLen += sampleMessage(dict + dictLen, i);
+    msgLen = sampleMessage(msg, 1234);
+
+    rc = elzma_compress_config(chand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                               ELZMA_PB_DEFAULT, 5, 1 << 16, format,
+                               msgLen);
+
+    /* without, then with the dictionary */
+    for (i = 0; rc == ELZMA_E_OK && i < 2; i++) {
+        if (i == 1) {
+            rc = elzma_compress_set_dictionary(chand, dict, dictLen);
+            if (rc != ELZMA_E_OK) break;
+        }
+        rc = simpleCompressWithHandle(chand, (unsigned char *) msg, msgLen,
+                                      compressed + i, sz + i);
+        if (rc != ELZMA_E_OK && i > 0) free(compressed[0]);
+    }
+    if (rc != ELZMA_E_OK) {
+        elzma_compress_free(&chand);
+        elzma_decompress_free(&dhand);
+        return rc;
+    }
+
+    /* the message is mostly made of what's in the dictionary */
+    if (sz[1] * 2 > sz[0]) rc = 1;
+
+    /* a decoder without the dictionary can't reproduce the message */
+    if (rc == ELZMA_E_OK) {
+        rc = simpleDecompressWithHandle(dhand, format, compressed[1], sz[1],
+                                        &decompressed, &dsz);
+        if (rc == ELZMA_E_OK) {
+            if (dsz == msgLen && 0 == memcmp(decompressed, msg, msgLen)) {
+                rc = 1;
+            }
+            free(decompressed);
+        }
+        rc = (rc == 1) ? 1 : ELZMA_E_OK;
+    }
+
+    /* with it, streaming and in memory */
+    if (rc == ELZMA_E_OK) {
+        rc = elzma_decompress_set_dictionary(dhand, dict, dictLen);
+    }
+    if (rc == ELZMA_E_OK) {
+        rc = simpleDecompressWithHandle(dhand, format, compressed[1], sz[1],
+                                        &decompressed, &dsz);
+        if (rc == ELZMA_E_OK) {
+            if (dsz != msgLen || 0 != memcmp(decompressed, msg, msgLen)) {
+                rc = 1;
+            }
+            free(decompressed);
+        }
+    }
+    if (rc == ELZMA_E_OK) {
+        unsigned char out[256];
+        dsz = sizeof(out);
+        rc = elzma_decompress_buffer(dhand, compressed[1], sz[1], out, &dsz,
+                                     format);
+        if (rc == ELZMA_E_OK &&
+            (dsz != msgLen || 0 != memcmp(out, msg, msgLen)))
+        {
+            rc = 1;
+        }
+    }
+    free(compressed[0]);
+    free(compressed[1]);
+
+    /* the in-memory compressor primes its window too */
+    if (rc == ELZMA_E_OK) {
+        unsigned char out[512];
+        unsigned char back[256];
+        sz[0] = sizeof(out);
+        rc = elzma_compress_buffer(chand, (unsigned char *) msg, msgLen,
+                                   out, sz);
+        if (rc == ELZMA_E_OK) {
+            dsz = sizeof(back);
+            rc = elzma_decompress_buffer(dhand, out, sz[0], back, &dsz,
+                                         format);
+        }
+        if (rc == ELZMA_E_OK &&
+            (dsz != msgLen || 0 != memcmp(back, msg, msgLen)))
+        {
+            rc = 1;
+        }
+    }
+
+    /* members after a flush start from the dictionary again */
+    if (rc == ELZMA_E_OK && format == ELZMA_lzip) {
+        rc = simpleCompressPush(chand, (unsigned char *) msg, msgLen, 64, 0,
+                                1, compressed, sz);
+        if (rc == ELZMA_E_OK) {
+            rc = simpleDecompressWithHandle(dhand, format, compressed[0],
+                                            sz[0], &decompressed, &dsz);
+            if (rc == ELZMA_E_OK) {
+                if (dsz != msgLen || 0 != memcmp(decompressed, msg, msgLen)) {
+                    rc = 1;
+                }
+                free(decompressed);
+            }
+            free(compressed[0]);
+        }
+    }
+
+    elzma_compress_free(&chand);
+    elzma_decompress_free(&dhand);
+
+    return rc;
+}
+
+/* a test that a dictionary trained on sample messages stays within its
+ * size limit and shrinks messages it wasn't trained on */
+static int dictTrainTest(void)
+{
+    int rc;
+    unsigned int i;
+    char * samples = malloc(200 * 256);
+    char heldOut[20 * 256];
+    size_t sizes[200], heldOutSizes[20];
+    size_t samplesLen = 0, heldOutLen = 0;
+    unsigned char dict[1024];
+    size_t dictSize = sizeof(dict);
+    unsigned long long sizeWithout = 0, sizeWith = 0;
+    elzma_compress_handle hand;
+
+    if (samples == NULL) return 1;
+    for (i = 0; i < 200; i++) {
+        sizes[i] = sampleMessage(samples + samplesLen, i);
+        samplesLen += sizes[i];
+    }
+    for (i = 0; i < 20; i++) {
+        heldOutSizes[i] = sampleMessage(heldOut + heldOutLen, 5000 + i * 13);
+        heldOutLen += heldOutSizes[i];
+    }
+
+    rc = elzma_train_dictionary((unsigned char *) samples, sizes, 200,
+                                dict, &dictSize);
+    free(samples);
+    if (rc != ELZMA_E_OK) return rc;
+    if (dictSize == 0 || dictSize > sizeof(dict)) return 1;
+
+    hand = elzma_compress_alloc();
+    rc = elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT,
+                               ELZMA_PB_DEFAULT, 5, 1 << 16, ELZMA_lzip, 0);
+    if (rc == ELZMA_E_OK) {
+        rc = elzma_compress_evaluate_dictionary(
+            hand, dict, dictSize, (unsigned char *) heldOut, heldOutSizes, 20,
+            &sizeWithout, &sizeWith);
+    }
+    elzma_compress_free(&hand);
+
+    /* the held out messages share everything but their numbers with the
+     * training set */
+    if (rc == ELZMA_E_OK && sizeWith * 2 > sizeWithout) rc = 1;
+
+    return rc;
+}
+
+/* an xz stream without blocks whose index lists four of 2^62 bytes,
+ * which add up to 0 in 64 bits */
+static const unsigned char wrappingIndex[] = {
+    0xfd, 0x37, 0x7a, 0x58, 0x5a, 0x00, 0x00, 0x01, 0x69, 0x22, 0xde, 0x36,
+    0x00, 0x04, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40, 0x01,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40, 0x01, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40, 0x01, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x40, 0x01, 0x00, 0x00, 0xd7, 0xa6, 0xaa, 0x75,
+    0xf6, 0x61, 0x02, 0xac, 0x0b, 0x00, 0x00, 0x00, 0x00, 0x01, 0x59, 0x5a
+};
+
+/* a test that xz files split into blocks can be read through their
+ * index, one block at a time, and in a single call */
+static int xzIndexTest(void)
+{
+    int rc;
+    unsigned int i, numBlocks = 0;
+    const size_t copies = 4;
+    const size_t blockSize = 1 << 12;
+    size_t inLen, sz, dsz;
+    unsigned char * input;
+    unsigned char * compressed;
+    unsigned char * decompressed;
+    elzma_xz_block * blocks = NULL;
+    elzma_decompress_handle dhand;
+
+    inLen = strlen(sampleData) * copies;
+    input = malloc(inLen);
+    for (i = 0; i < copies; i++) {
+        memcpy(input + i * strlen(sampleData), sampleData,
+               strlen(sampleData));
+    }
+
+    /* a single thread still splits the stream into blocks */
+    rc = simpleCompressThreaded(ELZMA_xz, 1, blockSize, input, inLen,
+                                &compressed, &sz);
+    if (rc != ELZMA_E_OK) {
+        free(input);
+        return rc;
+    }
+
+    dhand = elzma_decompress_alloc();
+    decompressed = malloc(inLen);
+
+    rc = elzma_xz_read_index(dhand, compressed, sz, &blocks, &numBlocks);
+    if (rc == ELZMA_E_OK &&
+        numBlocks != (inLen + blockSize - 1) / blockSize)
+    {
+        rc = 1;
+    }
+
+    /* decode the blocks back to front, each on its own */
+    for (i = numBlocks; rc == ELZMA_E_OK && i > 0; i--) {
+        const elzma_xz_block * b = blocks + i - 1;
+        dsz = inLen;
+        if (b->uncompressedOffset != (i - 1) * blockSize) {
+            rc = 1;
+            break;
+        }
+        rc = elzma_xz_decompress_block(dhand, b,
+                                       compressed + b->compressedOffset,
+                                       (size_t) b->compressedSize,
+                                       decompressed, &dsz);
+        if (rc == ELZMA_E_OK &&
+            (dsz != b->uncompressedSize ||
+             0 != memcmp(decompressed, input + b->uncompressedOffset, dsz)))
+        {
+            rc = 1;
+        }
+    }
+
+    /* the in-memory decompressor finds its way through the index */
+    if (rc == ELZMA_E_OK) {
+        dsz = inLen;
+        memset(decompressed, 0, inLen);
+        rc = elzma_decompress_buffer(dhand, compressed, sz, decompressed,
+                                     &dsz, ELZMA_xz);
+        if (rc == ELZMA_E_OK &&
+            (dsz != inLen || 0 != memcmp(decompressed, input, inLen)))
+        {
+            rc = 1;
+        }
+    }
+
+    /* a damaged check is noticed when streaming */
+    if (rc == ELZMA_E_OK) {
+        unsigned char * out;
+        compressed[blocks[0].compressedOffset + blocks[0].compressedSize - 1]
+            ^= 1;
+        rc = simpleDecompress(ELZMA_xz, compressed, sz, &out, &dsz);
+        if (rc == ELZMA_E_OK) free(out);
+        rc = (rc == ELZMA_E_CRC32_MISMATCH) ? ELZMA_E_OK : 1;
+    }
+
+    /* block sizes which wrap around to fit before the index are refused */
+    if (rc == ELZMA_E_OK) {
+        elzma_xz_block * wrapBlocks = NULL;
+        unsigned int numWrapBlocks = 0;
+        rc = elzma_xz_read_index(dhand, wrappingIndex, sizeof(wrappingIndex),
+                                 &wrapBlocks, &numWrapBlocks);
+        if (rc == ELZMA_E_OK) elzma_xz_free_index(dhand, wrapBlocks);
+        rc = (rc == ELZMA_E_CORRUPT_HEADER) ? ELZMA_E_OK : 1;
+    }
+
+    elzma_xz_free_index(dhand, blocks);
+    elzma_decompress_free(&dhand);
+    free(decompressed);
+    free(compressed);
+    free(input);
+
+    return rc;
+}
+
+/* "correct" lzip generated from the lzip program */
+/*|LZIP...3.?..????|*/
+/*|....?e2~........|*/
+static unsigned char correctLzip[] = {
+    0x4c,0x5a,0x49,0x50,0x01,0x0c,0x00,0x33,0x1b,0xec,
+    0x15,0x07,0xff,0xff,0xff,0xff,0x80,0x00,0x00,0x00,
+    0xa8,0x65,0x32,0x7e,0x04,0x00,0x00,0x00,0x00,0x00,
+    0x00,0x00,0x28,0x00,0x00,0x00,0x00,0x00,0x00,0x00 
+};
+
+/* "correct" lzip generated from lzma utils */
+static unsigned char correctLzma[] = {
+    0x5d,0x00,0x00,0x80,0x00,0x04,0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,0x33,0x1b,0xec,0x14,0x00,0x00,
+    0x00
+};
+
+/* lzip with a bad CRC */
+static unsigned char corruptCRC[] = {
+    0x4c,0x5a,0x49,0x50,0x01,0x0c,0x00,0x33,0x1b,0xec,
+    0x15,0x07,0xff,0xff,0xff,0xff,0x80,0x00,0x00,0x00,
+    0xa8,0x65,0x31,0x7e,0x04,0x00,0x00,0x00,0x00,0x00,
+    0x00,0x00,0x28,0x00,0x00,0x00,0x00,0x00,0x00,0x00 
+};
+
+/* lzip with a bad uncompressed size */
+static unsigned char corruptSize[] = {
+    0x4c,0x5a,0x49,0x50,0x01,0x0c,0x00,0x33,0x1b,0xec,
+    0x15,0x07,0xff,0xff,0xff,0xff,0x80,0x00,0x00,0x00,
+    0xa8,0x65,0x32,0x7e,0x04,0x01,0x00,0x00,0x00,0x00,
+    0x00,0x00,0x28,0x00,0x00,0x00,0x00,0x00,0x00,0x00 
+};
+
+/* lzma with a bad uncompressed size */
+static unsigned char corruptSizeLzma[] = {
+    0x5d,0x00,0x00,0x80,0x00,0x04,0x01,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,0x33,0x1b,0xec,0x14,0x00,0x00,
+    0x00
+};
+
+/* lzma with a bad uncompressed size */
+static unsigned char corruptSizeLzma2[] = {
+    0x5d,0x00,0x00,0x80,0x00,0x03,0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,0x33,0x1b,0xec,0x14,0x00,0x00,
+    0x00
+};
+
+
+/* two concatenated xz streams generated by the xz program, with CRC32
+ * and CRC64 checks, holding "easylzma reads xz\n" and "and more than
+ * one stream\n" */
+static unsigned char correctXz[] = {
+    0xfd,0x37,0x7a,0x58,0x5a,0x00,0x00,0x01,0x69,0x22,
+    0xde,0x36,0x04,0xc0,0x16,0x12,0x21,0x01,0x16,0x00,
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xa7,0x51,
+    0x77,0x9e,0x01,0x00,0x11,0x65,0x61,0x73,0x79,0x6c,
+    0x7a,0x6d,0x61,0x20,0x72,0x65,0x61,0x64,0x73,0x20,
+    0x78,0x7a,0x0a,0x00,0x00,0x00,0xcd,0x28,0xcd,0xd1,
+    0x00,0x01,0x2e,0x12,0x4f,0xcd,0x38,0xd8,0x90,0x42,
+    0x99,0x0d,0x01,0x00,0x00,0x00,0x00,0x01,0x59,0x5a,
+    0xfd,0x37,0x7a,0x58,0x5a,0x00,0x00,0x04,0xe6,0xd6,
+    0xb4,0x46,0x04,0xc0,0x1d,0x19,0x21,0x01,0x16,0x00,
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xe9,0xd5,
+    0x86,0x36,0x01,0x00,0x18,0x61,0x6e,0x64,0x20,0x6d,
+    0x6f,0x72,0x65,0x20,0x74,0x68,0x61,0x6e,0x20,0x6f,
+    0x6e,0x65,0x20,0x73,0x74,0x72,0x65,0x61,0x6d,0x0a,
+    0x00,0x00,0x00,0x00,0x2f,0x4b,0xe3,0x7a,0x95,0x00,
+    0xf9,0xb2,0x00,0x01,0x39,0x19,0x51,0x90,0x69,0x4a,
+    0x1f,0xb6,0xf3,0x7d,0x01,0x00,0x00,0x00,0x00,0x04,
+    0x59,0x5a
+};
+
+/* the same with a bad CRC32 in the first block */
+static unsigned char corruptXz[] = {
+    0xfd,0x37,0x7a,0x58,0x5a,0x00,0x00,0x01,0x69,0x22,
+    0xde,0x36,0x04,0xc0,0x16,0x12,0x21,0x01,0x16,0x00,
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xa7,0x51,
+    0x77,0x9e,0x01,0x00,0x11,0x65,0x61,0x73,0x79,0x6c,
+    0x7a,0x6d,0x61,0x20,0x72,0x65,0x61,0x64,0x73,0x20,
+    0x78,0x7a,0x0a,0x00,0x00,0x00,0xcd,0x28,0xcd,0xd2,
+    0x00,0x01,0x2e,0x12,0x4f,0xcd,0x38,0xd8,0x90,0x42,
+    0x99,0x0d,0x01,0x00,0x00,0x00,0x00,0x01,0x59,0x5a
+};
+
+/* tests */
+static struct 
+{
+    const char * testName;  /* the name of the test */
+    int expectedCode;       /* the expected output of the test */
+    elzma_file_format format;
+    unsigned char * data;  /* input data */
+    unsigned int dataSize;
+} tests[] = {
+    {
+        "correct lzip", ELZMA_E_OK, ELZMA_lzip,
+        correctLzip, sizeof(correctLzip)
+    },
+    {
+        "lzip as lzma", ELZMA_E_DECOMPRESS_ERROR, ELZMA_lzma,
+        correctLzip, sizeof(correctLzip)
+    },
+    {
+        "correct lzma", ELZMA_E_OK, ELZMA_lzma,
+        correctLzma, sizeof(correctLzma)
+    },
+    {
+        "lzma as lzip", ELZMA_E_CORRUPT_HEADER, ELZMA_lzip,
+        correctLzma, sizeof(correctLzma)
+    },
+    {
+        "corrupt crc", ELZMA_E_CRC32_MISMATCH, ELZMA_lzip,
+        corruptCRC, sizeof(corruptCRC)
+    },
+    {
+        "bad lzip size", ELZMA_E_SIZE_MISMATCH, ELZMA_lzip,
+        corruptSize, sizeof(corruptSize)
+    },
+    {
+        "bad lzma size", ELZMA_E_INSUFFICIENT_INPUT, ELZMA_lzma,
+        corruptSizeLzma, sizeof(corruptSizeLzma)
+    },
+    {
+        "bad lzma size 2", ELZMA_E_SIZE_MISMATCH, ELZMA_lzma,
+        corruptSizeLzma2, sizeof(corruptSizeLzma2)
+    },
+    {
+        "correct xz", ELZMA_E_OK, ELZMA_xz,
+        correctXz, sizeof(correctXz)
+    },
+    {
+        "xz as lzip", ELZMA_E_CORRUPT_HEADER, ELZMA_lzip,
+        correctXz, sizeof(correctXz)
+    },
+    {
+        "corrupt xz check", ELZMA_E_CRC32_MISMATCH, ELZMA_xz,
+        corruptXz, sizeof(corruptXz)
+    }
+};
+
+int
+main(void)
+{
+    unsigned int i;
+    unsigned int testsPassed = 0;
+    unsigned int testsRun = 0;    
+    
+    int rc = 0;
+
+    printf("round trip lzma test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = roundTripTest(ELZMA_lzma))) {
+        printf("fail! (%d)\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("round trip lzip test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = roundTripTest(ELZMA_lzip))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("round trip lzma2 test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = roundTripTest(ELZMA_lzma2))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("lzma2 stored chunk test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = lzma2RoundTripTest())) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("lzma2 stored window test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = storedWindowTest(ELZMA_lzma2))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("lzma2 stored bypass test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = storedBypassTest())) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("xz stored window test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = storedWindowTest(ELZMA_xz))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("threaded lzip test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = threadedRoundTripTest(ELZMA_lzip))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("round trip xz test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = roundTripTest(ELZMA_xz))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("threaded xz test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = threadedRoundTripTest(ELZMA_xz))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("xz index test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = xzIndexTest())) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("buffer round trip lzma test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = bufferRoundTripTest(ELZMA_lzma))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("buffer round trip lzip test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = bufferRoundTripTest(ELZMA_lzip))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("partial lzma test:              ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = partialTest(ELZMA_lzma, 1000))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("partial lzip test:              ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = partialTest(ELZMA_lzip, 4096))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("batch lzma test:                ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = batchTest(ELZMA_lzma))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("batch lzip test:                ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = batchTest(ELZMA_lzip))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("long range lzma test:           ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = longRangeTest(ELZMA_lzma))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("long range lzip test:           ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = longRangeTest(ELZMA_lzip))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("long range xz test:             ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = longRangeTest(ELZMA_xz))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("throughput target test:         ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = throughputTest())) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("push lzma test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = pushRoundTripTest(ELZMA_lzma, 0))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("push lzip flush test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = pushRoundTripTest(ELZMA_lzip, 20))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("handle reuse test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = handleReuseTest())) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("encoder options test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = optionsTest())) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("multiplicative hash lzma test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = mulHashTest(ELZMA_lzma))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("huge page test:                 ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = hugePageTest())) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("match finder threads test:      ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = matchFinderThreadsTest())) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("ring window test:               ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = ringWindowTest())) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+#ifdef __linux__
+    printf("ring window fork test:          ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = ringWindowForkTest())) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+#endif
+
+    printf("preset dictionary lzma test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = presetDictTest(ELZMA_lzma))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("preset dictionary lzip test:    ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = presetDictTest(ELZMA_lzip))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("fork lzma test:                 ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = forkTest(ELZMA_lzma, 1 << 16))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("fork lzip test:                 ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = forkTest(ELZMA_lzip, 1 << 20))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("abort test:                     ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = abortTest())) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("lzma stepped test:              ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = stepTest(ELZMA_lzma))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("lzip stepped test:              ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = stepTest(ELZMA_lzip))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("lzma run test:                  ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = runTest(ELZMA_lzma))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("lzip run test:                  ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = runTest(ELZMA_lzip))) {
+        printf("fail (%d)!\n", rc);
+    } else {
+        testsPassed++;
+        printf("ok\n");
+    }
+
+    printf("dictionary training test:       ");
+    fflush(stdout);
+    testsRun++;
+    if (ELZMA_E_OK != (rc = dictTrainTest())) {
         printf("fail (%d)!\n", rc);
     } else {
         testsPassed++;
@@ -0,0 +1,177 @@
+/*
+ * Written in 2009 by Lloyd Hilaiel
+ *
+ * License
+ *
+ * All the cruft you find here is public domain.  You don't have to credit
+ * anyone to use this code, but my personal request is that you mention
+ * Igor Pavlov for his hard, high quality work.
+ *
+ * A microbenchmark of the binary tree (bt4) match finder alone, which
+ * drives GetMatches over every position of a file the way the optimal
+ * parser does, without the encoder around it.  It's meant for changes to
+ * LzFind.c, such as the prefetching of tree nodes and hash heads, whose
+ * effect depends on the dictionary size:
+ *
+ *   mfbench <file> <dictionary MB> [cycles (32)] [runs (5)]
+ *
+ * It reports the best time of the runs, and a sum of the match counts
+ * which must not change with the match finder's speed.  Prefetching only
+ * starts above a 16MB dictionary, and shows on an input larger than the
+ * dictionary, so that the tree is full and spread over all of it: say
+ * 96MB of a tar of /usr with a 64MB dictionary, comparing builds with and
+ * without MF_PREFETCH in alternating runs.
+ */
+
+#include "pavlov/LzFind.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* the most input read, as the whole file is held in memory */
+#define MFBENCH_MAX_INPUT (1 << 27)
+
+/* the encoder's window margins for the default fast bytes */
+#define MFBENCH_KEEP_BEFORE (1 << 12)
+#define MFBENCH_FAST_BYTES 32
+#define MFBENCH_KEEP_AFTER (273 + 32)
+
+static void *
+benchAlloc(void *p, size_t size)
+{
+    (void) p;
+    return malloc(size);
+}
+
+static void
+benchFree(void *p, void *address)
+{
+    (void) p;
+    free(address);
+}
+
+static ISzAlloc benchAllocator = { benchAlloc, benchFree };
+
+struct memStream {
+    ISeqInStream funcTable;
+    const Byte * data;
+    size_t size;
+    size_t pos;
+};
+
+static SRes
+memStreamRead(void *p, void *buf, size_t *size)
+{
+    struct memStream * s = (struct memStream *) p;
+    size_t n = *size;
+    if (n > s->size - s->pos) n = s->size - s->pos;
+    memcpy(buf, s->data + s->pos, n);
+    s->pos += n;
+    *size = n;
+    return SZ_OK;
+}
+
+/* one pass of the match finder over the input, returning the seconds it
+ * took, or a negative number when out of memory */
+static double
+runOnce(const Byte * input, size_t inLen, UInt32 dictSize, UInt32 cycles,
+        unsigned long long * matchSum)
+{
+    CMatchFinder mf;
+    IMatchFinder vt;
+    struct memStream s;
+    UInt32 distances[2 * 273 + 2];
+    size_t i;
+    clock_t start;
+    double secs;
+
+    s.funcTable.Read = memStreamRead;
+    s.data = input;
+    s.size = inLen;
+    s.pos = 0;
+
+    MatchFinder_Construct(&mf);
+    mf.btMode = 1;
+    mf.numHashBytes = 4;
+    mf.cutValue = cycles;
+    if (!MatchFinder_Create(&mf, dictSize, MFBENCH_KEEP_BEFORE,
+                            MFBENCH_FAST_BYTES, MFBENCH_KEEP_AFTER,
+                            &benchAllocator))
+    {
+        return -1.0;
+    }
+    mf.stream = &s.funcTable;
+    MatchFinder_CreateVTable(&mf, &vt);
+
+    *matchSum = 0;
+    start = clock();
+    vt.Init(&mf);
+    for (i = 0; i < inLen; i++) {
+        *matchSum += vt.GetMatches(&mf, distances);
+    }
+    secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    MatchFinder_Free(&mf, &benchAllocator);
+
+    return secs;
+}
+
+int
+main(int argc, char ** argv)
+{
+    FILE * f;
+    Byte * input;
+    size_t inLen;
+    UInt32 dictMB, cycles = 32;
+    unsigned int runs = 5, i;
+    double best = -1.0;
+    unsigned long long matchSum = 0;
+
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr,
+                "usage: mfbench <file> <dictionary MB> [cycles] [runs]\n");
+        return 1;
+    }
+    dictMB = (UInt32) strtoul(argv[2], NULL, 10);
+    if (argc > 3) cycles = (UInt32) strtoul(argv[3], NULL, 10);
+    if (argc > 4) runs = (unsigned int) strtoul(argv[4], NULL, 10);
+    if (dictMB < 1 || dictMB > 1536 || cycles < 1 || runs < 1) {
+        fprintf(stderr, "bad dictionary size, cycles or runs\n");
+        return 1;
+    }
+
+    f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        fprintf(stderr, "couldn't open '%s' for reading\n", argv[1]);
+        return 1;
+    }
+    input = malloc(MFBENCH_MAX_INPUT);
+    if (input == NULL) {
+        fclose(f);
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    inLen = fread(input, 1, MFBENCH_MAX_INPUT, f);
+    fclose(f);
+
+    for (i = 0; i < runs; i++) {
+        double secs = runOnce(input, inLen, dictMB << 20, cycles, &matchSum);
+        if (secs < 0) {
+            fprintf(stderr, "out of memory\n");
+            free(input);
+            return 1;
+        }
+        if (best < 0 || secs < best) best = secs;
+    }
+
+    printf("dict %4uMB mc %u: %.3fs %.2f MB/s (matches %lu)\n",
+           (unsigned int) dictMB, (unsigned int) cycles, best,
+           best > 0 ? (double) inLen / best / 1e6 : 0.0,
+           (unsigned long) matchSum);
+
+    free(input);
+
+    return 0;
+}
@@ -63,6 +63,16 @@ int
 simpleCompress(elzma_file_format format, const unsigned char * inData,
                size_t inLen, unsigned char ** outData,
                size_t * outLen)
+{
+    return simpleCompressThreaded(format, 1, 0, inData, inLen,
+                                  outData, outLen);
+}
+
+int
+simpleCompressThreaded(elzma_file_format format,
+                       unsigned int numThreads, unsigned int blockSize,
+                       const unsigned char * inData, size_t inLen,
+                       unsigned char ** outData, size_t * outLen)
 {
     int rc;
     elzma_compress_handle hand;
@@ -81,28 +91,236 @@ simpleCompress(elzma_file_format format, const unsigned char * inData,
         return rc;
     }    
 
-    /* now run the compression */
-    {
-        struct dataStream ds;
-        ds.inData = inData;
-        ds.inLen = inLen;
-        ds.outData = NULL;
-        ds.outLen = 0;
-
-        rc = elzma_compress_run(hand, inputCallback, (void *) &ds,
-                                outputCallback, (void *) &ds,
-                                NULL, NULL);
-        
+    if (numThreads > 1 || blockSize > 0) {
+        rc = elzma_compress_set_threads(hand, numThreads, blockSize);
         if (rc != ELZMA_E_OK) {
-            if (ds.outData != NULL) free(ds.outData);
             elzma_compress_free(&hand);
             return rc;
         }
+    }
+
+    rc = simpleCompressWithHandle(hand, inData, inLen, outData, outLen);
+    elzma_compress_free(&hand);
+
+    return rc;
+}
+
+int
+simpleCompressWithHandle(elzma_compress_handle hand,
+                         const unsigned char * inData, size_t inLen,
+                         unsigned char ** outData, size_t * outLen)
+{
+    int rc;
+    struct dataStream ds;
+    ds.inData = inData;
+    ds.inLen = inLen;
+    ds.outData = NULL;
+    ds.outLen = 0;
+
+    rc = elzma_compress_run(hand, inputCallback, (void *) &ds,
+                            outputCallback, (void *) &ds,
+                            NULL, NULL);
+
+    if (rc != ELZMA_E_OK) {
+        if (ds.outData != NULL) free(ds.outData);
+        return rc;
+    }
+
+    *outData = ds.outData;
+    *outLen = ds.outLen;
+
+    return rc;
+}
+
+int
+simpleCompressPush(elzma_compress_handle hand,
+                   const unsigned char * inData, size_t inLen,
+                   size_t chunkSize, size_t workLimit,
+                   unsigned int flushEvery,
+                   unsigned char ** outData, size_t * outLen)
+{
+    int rc;
+    unsigned int chunks = 0;
+    struct dataStream ds;
+    ds.outData = NULL;
+    ds.outLen = 0;
+
+    rc = elzma_compress_stream_begin(hand, outputCallback, (void *) &ds,
+                                     workLimit);
+
+    while (rc == ELZMA_E_OK || rc == ELZMA_E_AGAIN) {
+        size_t sz = (inLen < chunkSize) ? inLen : chunkSize;
+
+        /* like an event loop, give other work a turn before resuming */
+        while (rc == ELZMA_E_AGAIN) rc = elzma_compress_stream_continue(hand);
+        if (rc != ELZMA_E_OK) break;
+
+        if (sz == 0) {
+            rc = elzma_compress_stream_finish(hand);
+            while (rc == ELZMA_E_AGAIN) {
+                rc = elzma_compress_stream_continue(hand);
+            }
+            break;
+        }
+
+        rc = elzma_compress_stream_write(hand, inData, sz);
+        inData += sz;
+        inLen -= sz;
+
+        if (flushEvery > 0 && ++chunks % flushEvery == 0 &&
+            (rc == ELZMA_E_OK || rc == ELZMA_E_AGAIN))
+        {
+            rc = elzma_compress_stream_flush(hand);
+        }
+    }
+
+    if (rc != ELZMA_E_OK) {
+        if (ds.outData != NULL) free(ds.outData);
+        return rc;
+    }
+
+    *outData = ds.outData;
+    *outLen = ds.outLen;
+
+    return rc;
+}
+
+int
+simpleCompressForked(elzma_compress_handle hand,
+                     const unsigned char * prefix, size_t prefixLen,
+                     unsigned int count,
+                     const unsigned char * const * suffixes,
+                     const size_t * suffixLens,
+                     unsigned char ** outData, size_t * outLens)
+{
+    int rc;
+    unsigned int i;
+    struct dataStream ds;
+    elzma_compress_handle fork = elzma_compress_alloc();
+    ds.outData = NULL;
+    ds.outLen = 0;
+
+    for (i = 0; i < count; i++) outData[i] = NULL;
+
+    rc = elzma_compress_stream_begin(hand, outputCallback, (void *) &ds, 0);
+    if (rc == ELZMA_E_OK) {
+        rc = elzma_compress_stream_write(hand, prefix, prefixLen);
+    }
+
+    /* one handle takes each fork in turn */
+    for (i = 0; i < count && rc == ELZMA_E_OK; i++) {
+        struct dataStream fds;
+        fds.outData = malloc(ds.outLen + 1);
+        fds.outLen = ds.outLen;
+        memcpy((void *) fds.outData, (void *) ds.outData, ds.outLen);
+
+        rc = elzma_compress_stream_fork(fork, hand, outputCallback,
+                                        (void *) &fds);
+        if (rc == ELZMA_E_OK) {
+            rc = elzma_compress_stream_write(fork, suffixes[i],
+                                             suffixLens[i]);
+        }
+        if (rc == ELZMA_E_OK) rc = elzma_compress_stream_finish(fork);
+
+        outData[i] = fds.outData;
+        outLens[i] = fds.outLen;
+    }
+
+    if (rc != ELZMA_E_OK) {
+        for (i = 0; i < count; i++) {
+            if (outData[i] != NULL) free(outData[i]);
+            outData[i] = NULL;
+        }
+    }
+    if (ds.outData != NULL) free(ds.outData);
+    elzma_compress_free(&fork);
 
-        *outData = ds.outData;
-        *outLen = ds.outLen;
+    return rc;
+}
+
+int
+simpleCompressStepped(elzma_compress_handle hand,
+                      const unsigned char * inData, size_t inLen,
+                      size_t workLimit, unsigned long timeLimit,
+                      unsigned char ** outData, size_t * outLen,
+                      unsigned int * steps)
+{
+    int rc;
+    struct dataStream ds;
+    ds.inData = inData;
+    ds.inLen = inLen;
+    ds.outData = NULL;
+    ds.outLen = 0;
+    *steps = 0;
+
+    rc = elzma_compress_step_begin(hand, inputCallback, (void *) &ds,
+                                   outputCallback, (void *) &ds);
+
+    if (rc == ELZMA_E_OK) {
+        do {
+            rc = elzma_compress_step(hand, workLimit, timeLimit);
+            (*steps)++;
+        } while (rc == ELZMA_E_AGAIN);
     }
 
+    if (rc != ELZMA_E_OK) {
+        if (ds.outData != NULL) free(ds.outData);
+        return rc;
+    }
+
+    *outData = ds.outData;
+    *outLen = ds.outLen;
+
+    return rc;
+}
+
+/* read back from the output accumulated so far */
+static int
+readBackCallback(void *ctx, unsigned long long offset, void *buf,
+                 size_t size)
+{
+    struct dataStream * ds = (struct dataStream *) ctx;
+    assert(ds != NULL);
+
+    if (offset > ds->outLen || size > ds->outLen - offset) return 1;
+    memcpy(buf, (void *) (ds->outData + offset), size);
+
+    return 0;
+}
+
+int
+simpleDecompressLongRange(elzma_file_format format,
+                          const unsigned char * inData, size_t inLen,
+                          unsigned char ** outData, size_t * outLen)
+{
+    int rc;
+    struct dataStream ds;
+    elzma_decompress_handle hand;
+
+    hand = elzma_decompress_alloc();
+    if (hand == NULL) return ELZMA_E_BAD_PARAMS;
+
+    ds.inData = inData;
+    ds.inLen = inLen;
+    ds.outData = NULL;
+    ds.outLen = 0;
+
+    rc = elzma_decompress_set_long_range(hand, readBackCallback,
+                                         (void *) &ds);
+    if (rc == ELZMA_E_OK) {
+        rc = elzma_decompress_run(hand, inputCallback, (void *) &ds,
+                                  outputCallback, (void *) &ds, format);
+    }
+    elzma_decompress_free(&hand);
+
+    if (rc != ELZMA_E_OK) {
+        if (ds.outData != NULL) free(ds.outData);
+        return rc;
+    }
+
+    *outData = ds.outData;
+    *outLen = ds.outLen;
+
     return rc;
 }
 
@@ -115,27 +333,36 @@ simpleDecompress(elzma_file_format format, const unsigned char * inData,
     elzma_decompress_handle hand;
     
     hand = elzma_decompress_alloc();
-    
-    /* now run the compression */
-    {
-        struct dataStream ds;
-        ds.inData = inData;
-        ds.inLen = inLen;
-        ds.outData = NULL;
-        ds.outLen = 0;
+    rc = simpleDecompressWithHandle(hand, format, inData, inLen,
+                                    outData, outLen);
+    elzma_decompress_free(&hand);
 
-        rc = elzma_decompress_run(hand, inputCallback, (void *) &ds,
-                                  outputCallback, (void *) &ds, format);
-        
-        if (rc != ELZMA_E_OK) {
-            if (ds.outData != NULL) free(ds.outData);
-            elzma_decompress_free(&hand);
-            return rc;
-        }
-        
-        *outData = ds.outData;
-        *outLen = ds.outLen;
+    return rc;
+}
+
+int
+simpleDecompressWithHandle(elzma_decompress_handle hand,
+                           elzma_file_format format,
+                           const unsigned char * inData, size_t inLen,
+                           unsigned char ** outData, size_t * outLen)
+{
+    int rc;
+    struct dataStream ds;
+    ds.inData = inData;
+    ds.inLen = inLen;
+    ds.outData = NULL;
+    ds.outLen = 0;
+
+    rc = elzma_decompress_run(hand, inputCallback, (void *) &ds,
+                              outputCallback, (void *) &ds, format);
+
+    if (rc != ELZMA_E_OK) {
+        if (ds.outData != NULL) free(ds.outData);
+        return rc;
     }
 
+    *outData = ds.outData;
+    *outLen = ds.outLen;
+
     return rc;
 }
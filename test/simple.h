@@ -24,6 +24,61 @@ int simpleCompress(elzma_file_format format,
                    unsigned char ** outData,
                    size_t * outLen);
 
+/* like simpleCompress, but split the input into blocks of blockSize
+ * bytes which are compressed on numThreads threads */
+int simpleCompressThreaded(elzma_file_format format,
+                           unsigned int numThreads,
+                           unsigned int blockSize,
+                           const unsigned char * inData,
+                           size_t inLen,
+                           unsigned char ** outData,
+                           size_t * outLen);
+
+/* compress a chunk of memory using an already configured handle, which
+ * is left allocated */
+int simpleCompressWithHandle(elzma_compress_handle hand,
+                             const unsigned char * inData,
+                             size_t inLen,
+                             unsigned char ** outData,
+                             size_t * outLen);
+
+/* compress a chunk of memory with the push interface of an already
+ * configured handle, writing chunkSize bytes at a time and flushing after
+ * every flushEvery chunks (if nonzero) */
+int simpleCompressPush(elzma_compress_handle hand,
+                       const unsigned char * inData,
+                       size_t inLen,
+                       size_t chunkSize,
+                       size_t workLimit,
+                       unsigned int flushEvery,
+                       unsigned char ** outData,
+                       size_t * outLen);
+
+/* compress prefix followed by each of count suffixes with the push
+ * interface of an already configured handle, compressing the prefix once
+ * and forking the stream for each suffix.  outData[i] receives the whole
+ * compressed file for suffix i */
+int simpleCompressForked(elzma_compress_handle hand,
+                         const unsigned char * prefix,
+                         size_t prefixLen,
+                         unsigned int count,
+                         const unsigned char * const * suffixes,
+                         const size_t * suffixLens,
+                         unsigned char ** outData,
+                         size_t * outLens);
+
+/* compress a chunk of memory in steps with an already configured handle,
+ * passing workLimit and timeLimit to each elzma_compress_step call.  the
+ * number of calls made is returned in steps */
+int simpleCompressStepped(elzma_compress_handle hand,
+                          const unsigned char * inData,
+                          size_t inLen,
+                          size_t workLimit,
+                          unsigned long timeLimit,
+                          unsigned char ** outData,
+                          size_t * outLen,
+                          unsigned int * steps);
+
 /* decompress a chunk of memory and return a dynamically allocated buffer
  * if successful.  return value is an easylzma error code */
 int simpleDecompress(elzma_file_format format,
@@ -32,4 +87,21 @@ int simpleDecompress(elzma_file_format format,
                      unsigned char ** outData,
                      size_t * outLen);
 
+/* decompress long range filtered data, reading back from the output
+ * buffer as it grows */
+int simpleDecompressLongRange(elzma_file_format format,
+                              const unsigned char * inData,
+                              size_t inLen,
+                              unsigned char ** outData,
+                              size_t * outLen);
+
+/* decompress a chunk of memory using an already configured handle, which
+ * is left allocated */
+int simpleDecompressWithHandle(elzma_decompress_handle hand,
+                               elzma_file_format format,
+                               const unsigned char * inData,
+                               size_t inLen,
+                               unsigned char ** outData,
+                               size_t * outLen);
+
 #endif